@@ -0,0 +1,60 @@
+/* libFuzzer / AFL entry point: full document parse.
+ * The first byte picks the build options (threads, pipeline, filters) so
+ * the alternative builder paths are fuzzed too, and its high bit adds text
+ * extraction from the tree and from the token stream and runs the builds
+ * in a parser_ctx kept from input to input; the rest is the input. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree_builder.h"
+#include "tokenizer.h"
+
+static const char *const pruned[] = { "script", "style", "svg", "table", NULL };
+static const char *const dropped[] = { "class", "id", NULL };
+
+static parser_ctx *reused;
+
+static void discard_text(const char *s, size_t len, void *ctx) {
+    (void)s;
+    (void)len;
+    (void)ctx;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) return 0;
+    unsigned mode = data[0];
+    char *input = tokenizer_replace_nulls((const char *)data + 1, size - 1);
+    if (!input) return 0;
+
+    tree_build_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = (mode & 1) ? 3 : 0;
+    opts.pipelined = (mode & 2) ? 1 : 0;
+    opts.build_index = (mode & 4) ? 1 : 0;
+    if (mode & 8) opts.prune_elements = pruned;
+    if (mode & 16) opts.drop_attributes = dropped;
+    opts.drop_comments = (mode & 32) ? 1 : 0;
+    opts.stop_after_head = (mode & 64) ? 1 : 0;
+
+    parser_ctx *prev = NULL;
+    if (mode & 128) {
+        if (!reused) reused = parser_ctx_create();
+        prev = parser_ctx_attach(reused);
+    }
+    const char *change_enc = NULL;
+    node *doc = build_tree_from_input_opts(input, "windows-1252",
+                                           ENC_CONFIDENCE_TENTATIVE,
+                                           &change_enc, &opts);
+    if (!doc && change_enc)
+        doc = build_tree_from_input_opts(input, change_enc,
+                                         ENC_CONFIDENCE_CERTAIN, NULL, &opts);
+    if (mode & 128) {
+        free(tree_extract_text(doc, NULL));
+        extract_text_from_input(input, discard_text, NULL);
+        parser_ctx_attach(prev);
+    }
+    node_free(doc);
+    free(input);
+    return 0;
+}
@@ -0,0 +1,183 @@
+/* Standalone driver for the fuzz entry points, for compilers without
+ * libFuzzer and for AFL (pass the input file as "@@").
+ *
+ *   fuzz_x [--min-mbps M] FILE|DIR...  run each input once, report
+ *                                      throughput; exit 1 below M MB/s
+ *   fuzz_x --perf [--max-exp E] FILE|DIR...
+ *                                      superlinear check: time each input
+ *                                      repeated to ~16 KB and 16x that,
+ *                                      and flag growth exponents above E
+ *                                      (default 1.5)
+ *
+ * The first byte is kept in front when an input is repeated, because
+ * the entry points use it to choose options. */
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#define PERF_BASE_BYTES 16384
+#define PERF_SCALE      16
+#define PERF_REPEATS    3
+
+typedef struct {
+    size_t inputs;
+    size_t bytes;
+    double seconds;
+    size_t flagged;
+    double max_exp;
+    double min_mbps;
+    int perf;
+} driver_state;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (n < 0) { fclose(fp); return NULL; }
+    uint8_t *buf = (uint8_t *)malloc((size_t)n + 1);
+    if (!buf) { fclose(fp); return NULL; }
+    *len = fread(buf, 1, (size_t)n, fp);
+    fclose(fp);
+    return buf;
+}
+
+/* data[0] followed by `times` copies of the rest. */
+static uint8_t *repeat_input(const uint8_t *data, size_t len, size_t times,
+                             size_t *out_len) {
+    size_t body = len - 1;
+    uint8_t *buf = (uint8_t *)malloc(1 + body * times);
+    if (!buf) return NULL;
+    buf[0] = data[0];
+    for (size_t i = 0; i < times; i++)
+        memcpy(buf + 1 + i * body, data + 1, body);
+    *out_len = 1 + body * times;
+    return buf;
+}
+
+/* Best-of-PERF_REPEATS time for one run of the entry point. */
+static double time_input(const uint8_t *data, size_t len) {
+    double best = -1;
+    for (int r = 0; r < PERF_REPEATS; r++) {
+        double start = now_seconds();
+        LLVMFuzzerTestOneInput(data, len);
+        double t = now_seconds() - start;
+        if (best < 0 || t < best) best = t;
+    }
+    return best;
+}
+
+static void perf_check(driver_state *st, const char *path, const uint8_t *data,
+                       size_t len) {
+    if (len < 2) return;
+    size_t small_times = PERF_BASE_BYTES / (len - 1) + 1;
+    size_t small_len = 0, large_len = 0;
+    uint8_t *small = repeat_input(data, len, small_times, &small_len);
+    uint8_t *large = repeat_input(data, len, small_times * PERF_SCALE,
+                                  &large_len);
+    if (small && large) {
+        double t_small = time_input(small, small_len);
+        double t_large = time_input(large, large_len);
+        double ratio = t_large / (t_small > 1e-6 ? t_small : 1e-6);
+        double exponent = log(ratio) / log((double)large_len / small_len);
+        int flag = exponent > st->max_exp;
+        printf("%s %-40s %8zu B %9.3f ms  %9zu B %9.3f ms  exp %.2f\n",
+               flag ? "SUPERLINEAR" : "ok         ", path, small_len,
+               t_small * 1e3, large_len, t_large * 1e3, exponent);
+        if (flag) st->flagged++;
+    }
+    free(small);
+    free(large);
+}
+
+static void run_file(driver_state *st, const char *path) {
+    size_t len = 0;
+    uint8_t *data = read_file(path, &len);
+    if (!data) {
+        fprintf(stderr, "failed to read %s\n", path);
+        return;
+    }
+    if (st->perf) {
+        perf_check(st, path, data, len);
+    } else {
+        double start = now_seconds();
+        LLVMFuzzerTestOneInput(data, len);
+        st->seconds += now_seconds() - start;
+    }
+    st->inputs++;
+    st->bytes += len;
+    free(data);
+}
+
+static void run_path(driver_state *st, const char *path) {
+    struct stat sb;
+    if (stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+        run_file(st, path);
+        return;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        char full[4096];
+        snprintf(full, sizeof(full), "%s/%s", path, ent->d_name);
+        run_path(st, full);
+    }
+    closedir(dir);
+}
+
+int main(int argc, char **argv) {
+    driver_state st = { 0, 0, 0, 0, 1.5, 0, 0 };
+    int arg_idx = 1;
+    while (arg_idx < argc) {
+        if (strcmp(argv[arg_idx], "--perf") == 0) {
+            st.perf = 1;
+            arg_idx++;
+        } else if (arg_idx + 1 < argc && strcmp(argv[arg_idx], "--max-exp") == 0) {
+            st.max_exp = atof(argv[arg_idx + 1]);
+            arg_idx += 2;
+        } else if (arg_idx + 1 < argc && strcmp(argv[arg_idx], "--min-mbps") == 0) {
+            st.min_mbps = atof(argv[arg_idx + 1]);
+            arg_idx += 2;
+        } else {
+            break;
+        }
+    }
+    if (arg_idx >= argc) {
+        fprintf(stderr, "usage: %s [--perf [--max-exp E] | --min-mbps M] FILE|DIR...\n", argv[0]);
+        return 2;
+    }
+    for (int i = arg_idx; i < argc; i++)
+        run_path(&st, argv[i]);
+
+    if (st.perf) {
+        printf("%zu inputs, %zu superlinear (exponent > %.2f)\n", st.inputs,
+               st.flagged, st.max_exp);
+        return st.flagged ? 1 : 0;
+    }
+    double mbps = st.seconds > 0 ? st.bytes / st.seconds / 1e6 : 0.0;
+    printf("%zu inputs, %zu bytes, %.1f ms (%.1f inputs/s, %.2f MB/s)\n",
+           st.inputs, st.bytes, st.seconds * 1e3,
+           st.seconds > 0 ? st.inputs / st.seconds : 0.0, mbps);
+    if (st.min_mbps > 0 && mbps < st.min_mbps) {
+        printf("throughput below %.2f MB/s\n", st.min_mbps);
+        return 1;
+    }
+    return 0;
+}
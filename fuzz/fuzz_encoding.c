@@ -0,0 +1,37 @@
+/* libFuzzer / AFL entry point: encoding sniffing and conversion.
+ * The first byte picks the sniff flags and a charset hint; the rest is
+ * the raw input. Both the one-shot and the reusable decoder are run; the
+ * one-shot source map is also carried over newline normalization. */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "encoding.h"
+
+static const char *const hints[] = {
+    NULL, "UTF-8", "windows-1252", "Shift_JIS", "EUC-JP", "ISO-2022-JP",
+    "GBK", "gb18030", "Big5", "EUC-KR", "UTF-16LE", "UTF-16BE",
+    "windows-1251", "KOI8-R", "ISO-8859-2", "x-user-defined",
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) return 0;
+    const char *hint = hints[data[0] & 15];
+    int flags = ENC_SNIFF_DEFAULT;
+    if (data[0] & 16) flags |= ENC_SNIFF_DETECT;
+    if (data[0] & 32) flags |= ENC_SNIFF_SOURCE_MAP;
+    data++;
+    size--;
+
+    encoding_result r = encoding_sniff_and_convert_ex(data, size, hint, flags);
+    if (r.data)
+        encoding_source_map_normalize(r.source_map, r.data, r.len);
+    free(r.data);
+    encoding_source_map_free(r.source_map);
+
+    encoding_decoder *dec = encoding_decoder_create();
+    if (!dec) return 0;
+    r = encoding_decoder_convert(dec, data, size, hint, flags);
+    encoding_source_map_free(r.source_map);
+    encoding_decoder_free(dec);
+    return 0;
+}
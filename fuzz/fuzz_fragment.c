@@ -0,0 +1,60 @@
+/* libFuzzer / AFL entry point: fragment parse (innerHTML).
+ * The low seven bits of the first byte pick the context element; the rest
+ * is the input. With the high bit set the input also goes through a
+ * fragment_parser into a node arena, twice (the second time into the
+ * reset arena, in a parser_ctx kept from input to input), and both trees
+ * must serialize like the plain parse. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree_builder.h"
+#include "tokenizer.h"
+
+static const char *const contexts[] = {
+    "body", "div", "table", "tbody", "tr", "td", "select", "template",
+    "title", "textarea", "script", "style", "plaintext", "html", "head",
+    "svg", "math", "frameset", "noscript", "colgroup", "caption", "p",
+};
+
+static parser_ctx *reused;
+
+static void check_arena(const char *input, const char *context,
+                        const node *doc) {
+    fragment_parser *fp = fragment_parser_create(context, "UTF-8",
+                                                 ENC_CONFIDENCE_IRRELEVANT);
+    node_arena *arena = node_arena_create(1024);
+    char *expected = tree_serialize_html(doc);
+    for (int pass = 0; fp && arena && expected && pass < 2; pass++) {
+        node_arena_reset(arena);
+        if (pass == 1 && !reused) reused = parser_ctx_create();
+        parser_ctx *prev = parser_ctx_attach(pass == 1 ? reused : NULL);
+        node *frag = fragment_parser_parse(fp, input, arena);
+        parser_ctx_attach(prev);
+        char *got = frag ? tree_serialize_html(frag) : NULL;
+        if (got && strcmp(got, expected) != 0) {
+            fprintf(stderr, "arena fragment differs:\n--- expected\n%s\n--- got\n%s\n",
+                    expected, got);
+            abort();
+        }
+        free(got);
+    }
+    free(expected);
+    node_arena_free(arena);
+    fragment_parser_free(fp);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) return 0;
+    const char *context = contexts[(data[0] & 0x7f) % (sizeof(contexts) / sizeof(contexts[0]))];
+    char *input = tokenizer_replace_nulls((const char *)data + 1, size - 1);
+    if (!input) return 0;
+    node *doc = build_fragment_from_input(input, context, "UTF-8",
+                                          ENC_CONFIDENCE_IRRELEVANT, NULL);
+    if (doc && (data[0] & 0x80))
+        check_arena(input, context, doc);
+    node_free(doc);
+    free(input);
+    return 0;
+}
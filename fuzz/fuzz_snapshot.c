@@ -0,0 +1,95 @@
+/* libFuzzer / AFL entry point for packed tree snapshots. The first byte
+ * picks the mode:
+ *   bit 0 clear  parse the rest as a document, snapshot it, view and thaw
+ *                the image; the thawed tree must serialize like the
+ *                original. With bit 1 set, one byte of the image (chosen
+ *                by the next two input bytes) is flipped first, and the
+ *                view must reject it or stay in bounds.
+ *   bit 0 set    the rest is a snapshot image as-is. */
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packed_tree.h"
+#include "tree_builder.h"
+#include "tokenizer.h"
+
+/* Thaw and look up a name: reaches every index the view validated. */
+static void exercise(const packed_tree *t) {
+    node *doc = packed_tree_thaw(t);
+    char *html = doc ? tree_serialize_html(doc) : NULL;
+    free(html);
+    node_free(doc);
+    (void)packed_tree_atom(t, "div");
+}
+
+static void fuzz_image(const uint8_t *data, size_t size) {
+    /* malloc() gives the alignment a view needs */
+    void *image = malloc(size ? size : 1);
+    if (!image) return;
+    memcpy(image, data, size);
+    packed_tree *t = packed_tree_view(image, size);
+    if (t) exercise(t);
+    packed_tree_free(t);
+    free(image);
+}
+
+static void fuzz_document(const uint8_t *data, size_t size, int flip) {
+    size_t pos = 0;
+    if (flip && size >= 2) {
+        pos = (size_t)data[0] << 8 | data[1];
+        data += 2;
+        size -= 2;
+    }
+    char *input = tokenizer_replace_nulls((const char *)data, size);
+    if (!input) return;
+    node *doc = build_tree_from_input(input, "UTF-8",
+                                      ENC_CONFIDENCE_IRRELEVANT, NULL);
+    free(input);
+    if (!doc) return;
+
+    char *image = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&image, &len);
+    packed_tree *packed = packed_tree_build(doc);
+    int ok = out && packed && packed_tree_write(packed, out);
+    packed_tree_free(packed);
+    if (out) fclose(out);
+    if (ok && flip) {
+        image[pos % len] ^= (char)(1u << (pos >> 13));
+        packed_tree *t = packed_tree_view(image, len);
+        if (t) exercise(t);
+        packed_tree_free(t);
+    } else if (ok) {
+        packed_tree *t = packed_tree_view(image, len);
+        if (!t) {
+            fprintf(stderr, "snapshot rejected its own image\n");
+            abort();
+        }
+        node *thawed = packed_tree_thaw(t);
+        char *a = tree_serialize_html(doc);
+        char *b = thawed ? tree_serialize_html(thawed) : NULL;
+        if (a && b && strcmp(a, b) != 0) {
+            fprintf(stderr, "thawed tree differs:\n--- original\n%s\n--- thawed\n%s\n",
+                    a, b);
+            abort();
+        }
+        free(a);
+        free(b);
+        node_free(thawed);
+        packed_tree_free(t);
+    }
+    free(image);
+    node_free(doc);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) return 0;
+    if (data[0] & 1)
+        fuzz_image(data + 1, size - 1);
+    else
+        fuzz_document(data + 1, size - 1, data[0] & 2);
+    return 0;
+}
@@ -9,13 +9,38 @@ typedef enum {
     ENC_CONFIDENCE_IRRELEVANT  /* already UTF-8 */
 } encoding_confidence;
 
+/* Run-length source map from UTF-8 output offsets to input byte offsets. */
+typedef struct {
+    size_t out_off;           /* first UTF-8 byte of the run */
+    size_t in_off;            /* first input byte of the run */
+    unsigned char out_w;      /* UTF-8 bytes per character (> 0) */
+    unsigned char in_w;       /* input bytes per character (0 for inserted U+FFFD) */
+} encoding_source_run;
+
+typedef struct {
+    encoding_source_run *runs; /* sorted by out_off */
+    size_t count;
+    size_t cap;
+    size_t out_len;           /* total UTF-8 bytes mapped */
+    size_t in_len;            /* total input bytes consumed (BOM included) */
+} encoding_source_map;
+
 typedef struct {
     char *data;                /* UTF-8 output (heap-allocated, caller must free) */
     size_t len;                /* byte length of data (excluding NUL terminator) */
     const char *encoding;      /* canonical encoding name (static string, do NOT free) */
     encoding_confidence confidence;
+    int detect_score;          /* 0-100 when chosen by encoding_detect(), else 0 */
+    encoding_source_map *source_map; /* ENC_SNIFF_SOURCE_MAP only; caller frees */
 } encoding_result;
 
+/* Optional sniffing behaviour for encoding_sniff_and_convert_ex(). */
+typedef enum {
+    ENC_SNIFF_DEFAULT = 0,
+    ENC_SNIFF_DETECT     = 1 << 0, /* statistical fallback before default UTF-8 */
+    ENC_SNIFF_SOURCE_MAP = 1 << 1  /* record a source map during conversion */
+} encoding_sniff_flags;
+
 /* Sniff the encoding of raw bytes and convert to UTF-8.
  * raw: input buffer (may contain any encoding).
  * raw_len: exact byte length.
@@ -25,7 +50,45 @@ encoding_result encoding_sniff_and_convert(const unsigned char *raw,
                                            size_t raw_len,
                                            const char *hint);
 
+/* Same as encoding_sniff_and_convert(), with optional encoding_sniff_flags. */
+encoding_result encoding_sniff_and_convert_ex(const unsigned char *raw,
+                                              size_t raw_len,
+                                              const char *hint,
+                                              int flags);
+
+/* Guess the encoding of a bounded prefix by byte statistics.
+ * Returns canonical name (static string) or NULL; *score (optional) gets 0-100. */
+const char *encoding_detect(const unsigned char *raw, size_t raw_len,
+                            int *score);
+
+/* Map a byte offset in the UTF-8 output back to the original input.
+ * UTF-8 input maps byte for byte; past the end returns map->in_len. */
+size_t encoding_source_map_lookup(const encoding_source_map *map,
+                                  size_t out_off);
+
+/* Carry a map over tokenizer_replace_nulls() of utf8/len.
+ * Returns 0 on allocation failure, leaving the map unchanged. */
+int encoding_source_map_normalize(encoding_source_map *map, const char *utf8,
+                                  size_t len);
+
+void encoding_source_map_free(encoding_source_map *map);
+
+/* Reusable decoder context for batch workloads. Not thread-safe. */
+typedef struct encoding_decoder encoding_decoder;
+
+encoding_decoder *encoding_decoder_create(void);
+void encoding_decoder_free(encoding_decoder *dec);
+
+/* Same as encoding_sniff_and_convert_ex(), but result.data is owned by dec
+ * (do NOT free) and stays valid only until the next call on dec. */
+encoding_result encoding_decoder_convert(encoding_decoder *dec,
+                                         const unsigned char *raw,
+                                         size_t raw_len,
+                                         const char *hint,
+                                         int flags);
+
 /* Resolve a charset label to its canonical WHATWG encoding name.
+ * Does not allocate.
  * Returns canonical name (static string) or NULL if not recognized. */
 const char *encoding_resolve_label(const char *label);
 
@@ -0,0 +1,43 @@
+#ifndef HTML_PARSER_NODE_INDEX_H
+#define HTML_PARSER_NODE_INDEX_H
+
+#include <stddef.h>
+#include "tree.h"
+
+/* id / class / tag lookup tables of a NODE_DOCUMENT (doc->index), kept in
+ * step by the tree mutators. Lookups may build it: not thread-safe. */
+typedef struct node_index node_index;
+
+/* Build the index for doc now. Returns 0 on allocation failure. */
+int node_index_build(node *doc);
+
+/* First element in tree order whose id attribute equals id, or NULL. */
+node *node_get_element_by_id(node *doc, const char *id);
+
+/* Every element carrying that id, in tree order. Same ownership as below. */
+node *const *node_get_elements_with_id(node *doc, const char *id,
+                                       size_t *count);
+
+/* Elements whose class attribute contains class_name, in tree order.
+ * The array belongs to the index and stays valid until the tree changes;
+ * *count is 0 (and NULL returned) when nothing matches. */
+node *const *node_get_elements_by_class(node *doc, const char *class_name,
+                                        size_t *count);
+
+/* Elements with that tag name (exact, as stored on the node), in tree
+ * order. Same ownership rules as above. */
+node *const *node_get_elements_by_tag_name(node *doc, const char *name,
+                                           size_t *count);
+
+/* Drop the index so the next lookup rebuilds it. */
+void node_index_invalidate(node *doc);
+
+void node_index_free(node_index *idx);
+
+/* Maintenance hooks, no-ops outside an indexed document. Call
+ * element_changed after editing n's id/class attributes in place. */
+void node_index_subtree_added(node *child, int at_end);
+void node_index_subtree_removed(node *parent, node *child);
+void node_index_element_changed(const node *n);
+
+#endif
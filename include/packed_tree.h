@@ -0,0 +1,107 @@
+#ifndef HTML_PARSER_PACKED_TREE_H
+#define HTML_PARSER_PACKED_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "tree.h"
+
+/* Read-only, struct-of-arrays copy of a DOM tree. Nodes are numbered in
+ * pre-order from the root (id 0); a subtree is [id, subtree_end[id]). */
+
+#define PACKED_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t off;               /* offset into text, PACKED_NONE for NULL */
+    uint32_t len;
+} packed_span;
+
+typedef struct {
+    uint32_t name;              /* atom id, PACKED_NONE for NULL */
+    packed_span value;
+} packed_attr;
+
+typedef struct {
+    uint32_t count;             /* number of nodes */
+    uint8_t *type;              /* node_type */
+    uint8_t *ns;                /* node_namespace */
+    uint32_t *parent;           /* PACKED_NONE for the root */
+    uint32_t *next_sibling;
+    uint32_t *subtree_end;      /* one past the last descendant */
+    uint32_t *name;             /* atom id */
+    packed_span *data;
+    uint32_t *attr_first;       /* count + 1 entries: attrs of i are
+                                 * attrs[attr_first[i] .. attr_first[i+1]) */
+    uint32_t *form_owner;       /* node id */
+
+    packed_attr *attrs;
+    uint32_t attr_count;
+
+    char *text;                 /* shared string storage */
+    size_t text_len;
+
+    uint32_t atom_count;
+    uint32_t *atom_off;         /* offset of each atom in atom_buf */
+    char *atom_buf;
+    size_t atom_buf_len;
+    uint32_t *atom_hash;        /* open-addressing table of atom ids */
+    uint32_t atom_hash_cap;
+
+    char *encoding;             /* from the source document node */
+    encoding_confidence enc_confidence;
+
+    const void *snapshot;       /* set when the arrays point into a
+                                 * snapshot image (read-only) */
+    size_t snapshot_len;
+    int mapped;                 /* snapshot was mmap()ed by
+                                 * packed_tree_load() */
+} packed_tree;
+
+/* Pack the tree rooted at root. Returns NULL on allocation failure or if
+ * the tree does not fit 32-bit ids/offsets. Free with packed_tree_free(). */
+packed_tree *packed_tree_build(const node *root);
+void packed_tree_free(packed_tree *t);
+
+/* Atom id for name, or PACKED_NONE if no node uses it. */
+uint32_t packed_tree_atom(const packed_tree *t, const char *name);
+
+/* Bytes owned by the packed tree. */
+size_t packed_tree_memory(const packed_tree *t);
+
+/* Same output as tree_dump_ascii() on the source tree. */
+void packed_tree_dump_ascii(const packed_tree *t, const char *title);
+
+/* Copy back into a regular node tree (free with node_free()). */
+node *packed_tree_thaw(const packed_tree *t);
+
+/* ---- Snapshots ----
+ * A packed tree as one host-byte-order image, loaded in place after a
+ * bounds check. Trees viewing a snapshot are read-only. */
+
+/* Write t to out. Returns 1 on success. */
+int packed_tree_write(const packed_tree *t, FILE *out);
+
+/* Pack the tree rooted at root and write it to path. Returns 1 on
+ * success. */
+int packed_tree_save(const node *root, const char *path);
+
+/* View over a snapshot image already in memory, which must stay valid
+ * (and 8-byte aligned) while the view is used. NULL if it is malformed. */
+packed_tree *packed_tree_view(const void *image, size_t len);
+
+/* mmap() a snapshot file and view it; packed_tree_free() unmaps it. */
+packed_tree *packed_tree_load(const char *path);
+
+static inline uint32_t packed_first_child(const packed_tree *t, uint32_t id) {
+    return (id + 1 < t->subtree_end[id]) ? id + 1 : PACKED_NONE;
+}
+
+static inline const char *packed_atom_name(const packed_tree *t, uint32_t atom) {
+    return atom == PACKED_NONE ? NULL : t->atom_buf + t->atom_off[atom];
+}
+
+static inline const char *packed_span_str(const packed_tree *t, packed_span s) {
+    return s.off == PACKED_NONE ? NULL : t->text + s.off;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef HTML_PARSER_PARSE_CACHE_H
+#define HTML_PARSER_PARSE_CACHE_H
+
+#include <stddef.h>
+#include "tree_builder.h"
+
+/* LRU cache of parsed trees, stored packed and keyed by a hash of the input.
+ * A hit returns a fresh tree the caller owns. Thread-safe. */
+typedef struct parse_cache parse_cache;
+
+typedef struct {
+    size_t hits;
+    size_t misses;          /* parsed (and stored if it fit the budget) */
+    size_t bypassed;        /* options the cache does not key on */
+    size_t evictions;
+    size_t entries;         /* currently stored */
+    size_t bytes;
+} parse_cache_stats;
+
+/* Zero for either budget means no limit. NULL when out of memory. */
+parse_cache *parse_cache_create(size_t max_entries, size_t max_bytes);
+void parse_cache_free(parse_cache *c);
+
+/* Decode raw (dec may be NULL) and build it with
+ * build_tree_from_input_opts(), through the cache. */
+node *parse_cache_build(parse_cache *c, encoding_decoder *dec,
+                        const unsigned char *raw, size_t raw_len,
+                        const char *hint, int sniff_flags,
+                        const tree_build_options *opts);
+
+/* build_fragment_from_input() through the cache. */
+node *parse_cache_build_fragment(parse_cache *c, const char *input,
+                                 const char *context_tag,
+                                 const char *encoding,
+                                 encoding_confidence confidence,
+                                 const char **change_encoding);
+
+void parse_cache_get_stats(parse_cache *c, parse_cache_stats *out);
+
+/* Drop every entry not in use; the counters are kept. */
+void parse_cache_clear(parse_cache *c);
+
+#endif
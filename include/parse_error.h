@@ -0,0 +1,114 @@
+#ifndef HTML_PARSER_PARSE_ERROR_H
+#define HTML_PARSER_PARSE_ERROR_H
+
+#include <stddef.h>
+#include "token.h"
+
+/* Parse errors as records, delivered to the sink attached to the calling
+ * thread (callback, ring of the latest ring_cap records, or both). */
+typedef enum {
+    PARSE_ERR_NONE = 0,
+    /* tokenizer */
+    PARSE_ERR_UNEXPECTED_NULL_CHARACTER,
+    PARSE_ERR_ABRUPT_CLOSING_OF_EMPTY_COMMENT,
+    PARSE_ERR_EOF_IN_COMMENT,
+    PARSE_ERR_NESTED_COMMENT,
+    PARSE_ERR_INCORRECTLY_CLOSED_COMMENT,
+    PARSE_ERR_BOGUS_MARKUP_DECLARATION,
+    PARSE_ERR_DOCTYPE_NAME_MISSING,
+    PARSE_ERR_DOCTYPE_PUBLIC_ID_MISSING,
+    PARSE_ERR_DOCTYPE_PUBLIC_ID_UNTERMINATED,
+    PARSE_ERR_DOCTYPE_SYSTEM_ID_MISSING,
+    PARSE_ERR_DOCTYPE_SYSTEM_ID_UNTERMINATED,
+    PARSE_ERR_TAG_NAME_MISSING,
+    PARSE_ERR_INVALID_END_TAG,
+    PARSE_ERR_END_TAG_WITH_ATTRIBUTES,
+    PARSE_ERR_UNEXPECTED_SOLIDUS_IN_TAG,
+    PARSE_ERR_ATTRIBUTE_NAME_MISSING,
+    PARSE_ERR_UNEXPECTED_CHARACTER_IN_ATTRIBUTE_NAME,
+    PARSE_ERR_ATTRIBUTE_VALUE_MISSING,
+    /* character references */
+    PARSE_ERR_NULL_CHARACTER_REFERENCE,
+    PARSE_ERR_CHARACTER_REFERENCE_OUTSIDE_UNICODE_RANGE,
+    PARSE_ERR_SURROGATE_CHARACTER_REFERENCE,
+    PARSE_ERR_NONCHARACTER_CHARACTER_REFERENCE,
+    PARSE_ERR_CONTROL_CHARACTER_REFERENCE,
+    /* tree construction */
+    PARSE_ERR_MISSING_DOCTYPE,
+    PARSE_ERR_STRAY_DOCTYPE,
+    PARSE_ERR_EOF_BEFORE_DOCTYPE,
+    PARSE_ERR_STRAY_DOCTYPE_IN_HEAD_NOSCRIPT,
+    PARSE_ERR_CHAR_IN_HEAD_NOSCRIPT,
+    PARSE_ERR_UNEXPECTED_START_TAG_IN_HEAD_NOSCRIPT,
+    PARSE_ERR_UNEXPECTED_END_TAG_IN_HEAD_NOSCRIPT,
+    PARSE_ERR_END_TAG_BR_IN_HEAD_NOSCRIPT,
+    PARSE_ERR_EOF_IN_HEAD_NOSCRIPT,
+    PARSE_ERR_UNEXPECTED_START_TAG,
+    PARSE_ERR_UNEXPECTED_END_TAG,
+    PARSE_ERR_END_TAG_WITH_UNCLOSED_ELEMENTS,
+    PARSE_ERR_UNEXPECTED_START_TAG_IN_TABLE,
+    PARSE_ERR_UNEXPECTED_START_TAG_IN_SELECT,
+    PARSE_ERR_UNEXPECTED_ELEMENT_BEFORE_TEMPLATE,
+    PARSE_ERR_UNEXPECTED_TOKEN_AFTER_BODY,
+    PARSE_ERR_FOSTER_PARENTING,
+    PARSE_ERR_ADOPTION_AGENCY_1_1,
+    PARSE_ERR_AAA_IMPLIED_MISMATCH,
+    PARSE_ERR_EOF_IN_TEXT,
+    PARSE_ERR_EOF_IN_TABLE,
+    PARSE_ERR_EOF_IN_TEMPLATE,
+    PARSE_ERR_EOF_WITH_OPEN_ELEMENTS,
+    PARSE_ERR_COUNT
+} parse_error_code;
+
+#define PARSE_ERROR_NO_OFFSET ((size_t)-1)
+
+typedef struct {
+    parse_error_code code;
+    size_t offset;          /* into the tokenizer input, or PARSE_ERROR_NO_OFFSET */
+    size_t line;            /* 1-based; 0 when unknown */
+    size_t col;
+    token_type token;       /* token being processed (tree construction only) */
+    char context[32];       /* its tag or doctype name, truncated */
+} parse_error;
+
+typedef void (*parse_error_fn)(const parse_error *err, void *user);
+
+typedef struct {
+    parse_error_fn callback;    /* optional */
+    void *user;
+    parse_error *ring;          /* optional, caller-owned, ring_cap long */
+    size_t ring_cap;
+    size_t count;               /* errors reported so far */
+} parse_error_sink;
+
+/* Make sink the calling thread's error sink (NULL detaches). Returns the
+ * previous sink so calls can nest. */
+parse_error_sink *parse_errors_attach(parse_error_sink *sink);
+
+/* Records kept in the ring (min(count, ring_cap)) and the i-th oldest. */
+size_t parse_error_sink_size(const parse_error_sink *sink);
+const parse_error *parse_error_sink_at(const parse_error_sink *sink,
+                                       size_t i);
+
+/* Stable text name of a code, e.g. "unexpected-end-tag". */
+const char *parse_error_code_name(parse_error_code code);
+
+/* "line=L col=C: name <context>" into buf, snprintf-style. */
+int parse_error_format(const parse_error *err, char *buf, size_t size);
+
+/* ---- for the parser sources ---- */
+extern _Thread_local parse_error_sink *parse_errors_current;
+
+/* Whether anyone is listening (a sink, or HTMLPARSER_PARSE_ERRORS=1). */
+int parse_errors_enabled(void);
+
+/* Report an error at a known input position. */
+void parse_error_emit_at(parse_error_code code, size_t offset, size_t line,
+                         size_t col);
+/* Report an error against the token last passed to
+ * parse_errors_note_token(). */
+void parse_error_emit(parse_error_code code);
+void parse_errors_note_token(const token *t, size_t offset, size_t line,
+                             size_t col);
+
+#endif
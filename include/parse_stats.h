@@ -0,0 +1,59 @@
+#ifndef HTML_PARSER_PARSE_STATS_H
+#define HTML_PARSER_PARSE_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "token.h"
+
+/* Per-stage counters, added to by every parse step on the thread they are
+ * attached to. -DHTMLPARSER_NO_STATS compiles them out. */
+typedef struct {
+    size_t bytes_decoded;       /* raw input bytes through the decoder */
+    uint64_t decode_ns;
+    uint64_t build_ns;          /* tokenize + tree construction */
+    size_t re_encodes;          /* builds abandoned for a <meta> charset */
+    size_t cache_hits;          /* trees thawed from a parse_cache */
+    size_t tokens[TOKEN_EOF + 1];   /* by token_type */
+    size_t entity_lookups;      /* named character references */
+    size_t entity_misses;
+    size_t nodes_created;
+    size_t attrs_created;
+    size_t aaa_outer;           /* adoption agency loop iterations */
+    size_t aaa_inner;
+    size_t reconstructs;        /* reconstruct_active_formatting() calls */
+    size_t foster_inserts;
+    size_t peak_stack_depth;    /* open elements */
+    size_t allocs;              /* tree allocations: nodes, names, text, */
+    size_t alloc_bytes;         /* attribute arrays and strings */
+} parse_stats;
+
+/* Make s the calling thread's stats sink (NULL detaches). Returns the
+ * previous sink so calls can nest. */
+parse_stats *parse_stats_attach(parse_stats *s);
+
+/* Add every counter of src into dst (peak depth takes the maximum). */
+void parse_stats_merge(parse_stats *dst, const parse_stats *src);
+
+/* One JSON object, no trailing newline. */
+void parse_stats_print_json(const parse_stats *s, FILE *out);
+
+/* ---- for the parser sources ---- */
+uint64_t parse_stats_now_ns(void);
+
+extern _Thread_local parse_stats *parse_stats_current;
+
+#ifdef HTMLPARSER_NO_STATS
+#define PARSE_STATS_ON 0
+#define PARSE_STAT_ADD(field, n) ((void)sizeof(n))
+#define PARSE_STAT_MAX(field, v) ((void)sizeof(v))
+#else
+#define PARSE_STATS_ON (parse_stats_current != NULL)
+#define PARSE_STAT_ADD(field, n) \
+    do { if (parse_stats_current) parse_stats_current->field += (n); } while (0)
+#define PARSE_STAT_MAX(field, v) \
+    do { if (parse_stats_current && parse_stats_current->field < (v)) \
+             parse_stats_current->field = (v); } while (0)
+#endif
+
+#endif
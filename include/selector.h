@@ -0,0 +1,25 @@
+#ifndef HTML_PARSER_SELECTOR_H
+#define HTML_PARSER_SELECTOR_H
+
+#include <stddef.h>
+#include "tree.h"
+
+/* Compiled CSS selector list (supported syntax: see README). */
+typedef struct selector selector;
+
+/* Parse text once into a matcher program. Returns NULL on a syntax error
+ * or unsupported feature (the reason is stored in *error if non-NULL). */
+selector *selector_compile(const char *text, const char **error);
+void selector_free(selector *sel);
+
+/* Whether element n matches any selector of the list. */
+int selector_matches(const selector *sel, const node *n);
+
+/* First descendant of root (in tree order) that matches, or NULL. */
+node *selector_query_first(node *root, const selector *sel);
+
+/* All matching descendants of root in tree order. Returns a heap array
+ * (free() it) with the length in *count, or NULL on allocation failure. */
+node **selector_query_all(node *root, const selector *sel, size_t *count);
+
+#endif
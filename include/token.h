@@ -27,9 +27,26 @@ typedef struct {
     size_t attr_count;
     int self_closing;
     int force_quirks;
+    int attrs_moved;  /* attribute strings now belong to a node; attrs only
+                       * aliases them and token_free() frees just the array */
 } token;
 
 void token_init(token *t);
 void token_free(token *t);
 
+/* Open-addressing set of attribute names, for duplicate checks on long
+ * attribute lists. Names are borrowed, not copied; zero-initialize.
+ * Below ATTR_NAME_SET_MIN names a linear scan is cheaper. */
+#define ATTR_NAME_SET_MIN 8
+
+typedef struct {
+    const char **slots;
+    size_t cap;
+    size_t count;
+} attr_name_set;
+
+/* 1 if name was added, 0 if already present, -1 when out of memory */
+int attr_name_set_add(attr_name_set *s, const char *name);
+void attr_name_set_free(attr_name_set *s);
+
 #endif
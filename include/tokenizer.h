@@ -25,10 +25,49 @@ typedef struct {
     int allow_cdata;        /* set by tree builder when in foreign content */
 } tokenizer;
 
+/* Tag, attribute and comment buffers for tokenizer_next(), kept across
+ * tokens and inputs while attached. Zero-initialise; one thread at a time. */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} tokenizer_buf;
+
+typedef struct {
+    tokenizer_buf tag_name;
+    tokenizer_buf attr_name;
+    tokenizer_buf attr_value;
+    tokenizer_buf comment;
+} tokenizer_scratch;
+
+/* Make s the calling thread's scratch (NULL detaches). Returns the
+ * previous one so calls can nest. */
+tokenizer_scratch *tokenizer_scratch_attach(tokenizer_scratch *s);
+/* Free the buffers; s is empty and reusable afterwards. */
+void tokenizer_scratch_free(tokenizer_scratch *s);
+
 void tokenizer_init(tokenizer *tz, const char *input);
 void tokenizer_init_with_context(tokenizer *tz, const char *input, const char *context_tag);
 void tokenizer_next(tokenizer *tz, token *out);
 
+/* Load the named-entity table and cache environment flags up front.
+ * Call once before running tokenizers on several threads; otherwise both
+ * are initialized lazily on first use. */
+void tokenizer_global_init(void);
+
+/* Tokenize the whole input on up to `threads` threads, ending with TOKEN_EOF.
+ * Returns a heap array of *count tokens (caller frees), or NULL. */
+token *tokenizer_tokenize_parallel(const char *input, int threads,
+                                   size_t *count);
+
+/* A copy of *tz tokenizing ahead on its own thread; tokenizer_pipeline_next()
+ * behaves like tokenizer_next(). start returns NULL if no thread starts. */
+typedef struct tokenizer_pipeline tokenizer_pipeline;
+
+tokenizer_pipeline *tokenizer_pipeline_start(const tokenizer *tz);
+void tokenizer_pipeline_next(tokenizer_pipeline *pl, tokenizer *tz, token *out);
+void tokenizer_pipeline_free(tokenizer_pipeline *pl);
+
 /* Pre-process raw input bytes: replace U+0000 NULL with U+FFFD REPLACEMENT CHARACTER.
  * raw: input buffer (may contain embedded NULLs).
  * raw_len: exact byte length (from fread, not strlen).
@@ -23,6 +23,12 @@ typedef struct {
     char *value;
 } node_attr;
 
+/* Attribute storage shared between an element and its shallow clones
+ * (see node_attrs_share). */
+typedef struct node_attr_block node_attr_block;
+
+typedef struct node_arena node_arena;
+
 typedef struct node {
     node_type type;
     node_namespace ns;       /* element namespace (NS_HTML for most elements) */
@@ -30,17 +36,33 @@ typedef struct node {
     char *data;              /* text/comment data */
     node_attr *attrs;        /* element attributes (NULL if none) */
     size_t attr_count;
+    node_attr_block *attr_block; /* non-NULL while attrs is shared */
     struct node *parent;
     struct node *first_child;
     struct node *last_child;
     struct node *next_sibling;
+    struct node *prev_sibling;
     struct node *form_owner; /* form element pointer association (non-owning) */
     char *encoding;              /* document encoding (only meaningful on NODE_DOCUMENT) */
     encoding_confidence enc_confidence; /* encoding confidence level */
+    encoding_source_map *source_map;    /* optional tokenizer input → raw
+                                         * input offset map, see
+                                         * encoding_source_map_normalize()
+                                         * (NODE_DOCUMENT only, owned) */
+    struct node_index *index;           /* lookup tables (owned by the NODE_DOCUMENT) */
+    node_arena *arena;                  /* arena the node came from, or NULL */
 } node;
 
 node *node_create(node_type type, const char *name, const char *data);
 node *node_create_ns(node_type type, const char *name, const char *data, node_namespace ns);
+/* Like node_create, but the node takes ownership of the malloc'd name and
+ * data instead of copying them. */
+node *node_create_take(node_type type, char *name, char *data);
+/* Share src's attributes with dst, which must have none of its own. */
+void node_attrs_share(node *dst, node *src);
+/* Give n a private copy of its attributes if they are shared. Returns 0
+ * when out of memory (n keeps the shared ones). */
+int node_attrs_unshare(node *n);
 void node_append_child(node *parent, node *child);
 void node_insert_before(node *parent, node *child, node *ref);
 void node_remove_child(node *parent, node *child);
@@ -48,9 +70,79 @@ void node_reparent_children(node *src, node *dst);
 void node_free_shallow(node *n);
 void node_free(node *n);
 
+/* Iterative traversal of root's subtree; NULL once it is exhausted.
+ * A post-order successor does not depend on n, so n may then be freed. */
+node *node_preorder_next(const node *n, const node *root);
+node *node_postorder_first(const node *root);
+node *node_postorder_next(const node *n, const node *root);
+
+/* Walk visiting every node of root's subtree on entering and on leaving it:
+ *   while (node_walk_next(&w)) ... w.node, w.leaving ... */
+typedef struct {
+    const node *root;
+    const node *node;
+    int leaving;
+    int skip;
+} node_walk;
+
+void node_walk_init(node_walk *w, const node *root);
+int node_walk_next(node_walk *w);
+/* On an entering step: go to the node's leaving step without its children */
+void node_walk_skip_children(node_walk *w);
+
+/* ---- Arenas ----
+ * Bump allocation for whole trees built while an arena is attached;
+ * node_arena_reset() reclaims them all at once. */
+node_arena *node_arena_create(size_t chunk_size);  /* 0: 64 KB chunks */
+void node_arena_reset(node_arena *a);
+void node_arena_free(node_arena *a);
+/* Bytes handed out since the last reset. */
+size_t node_arena_used(const node_arena *a);
+/* Make a the calling thread's arena (NULL detaches). Returns the previous
+ * one so calls can nest. */
+node_arena *node_arena_attach(node_arena *a);
+void *node_arena_alloc(node_arena *a, size_t size);
+
+/* Memory owned by n, from n's arena when it has one, else the heap. */
+void *node_mem_alloc(const node *n, size_t size);
+void *node_mem_realloc(const node *n, void *p, size_t old_size, size_t size);
+char *node_mem_strdup(const node *n, const char *s);
+void node_mem_free(const node *n, void *p);
+
+extern _Thread_local node_arena *node_arena_current;
+
 void tree_dump_ascii(const node *root, const char *title);
 
 /* Serialize tree to HTML string (caller must free) */
 char *tree_serialize_html(const node *root);
 
+/* ---- Text extraction ----
+ * The visible text of a tree, roughly as innerText renders it, judged by
+ * element names alone (no CSS). The extractor only sees open/close/text. */
+typedef void (*text_sink)(const char *s, size_t len, void *ctx);
+
+typedef struct {
+    text_sink sink;
+    void *ctx;
+    size_t emitted;             /* bytes passed to the sink */
+    size_t skip_depth;          /* open script/style/template/noscript */
+    size_t pre_depth;
+    size_t pending_breaks;      /* separators held back until the next text */
+    size_t pending_tabs;
+    int pending_space;
+    size_t trailing_newlines;   /* at the end of what was emitted */
+    size_t row_cells;
+} text_extractor;
+
+void text_extractor_init(text_extractor *te, text_sink sink, void *ctx);
+void text_extractor_open(text_extractor *te, const char *name);
+void text_extractor_close(text_extractor *te, const char *name);
+void text_extractor_text(text_extractor *te, const char *s, size_t len);
+
+/* Extract root's text into sink; returns the bytes written. */
+size_t tree_extract_text_to(const node *root, text_sink sink, void *ctx);
+/* Extract root's text into a string (caller must free), its length in
+ * *len when len is not NULL. NULL when out of memory. */
+char *tree_extract_text(const node *root, size_t *len);
+
 #endif
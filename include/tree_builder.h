@@ -3,14 +3,102 @@
 
 #include "token.h"
 #include "tree.h"
+#include "parse_stats.h"
+#include "parse_error.h"
+
+/* Knobs for build_tree_from_input_opts(); zero-initialise. */
+typedef struct {
+    int threads;        /* > 1: build_tree_from_input_parallel */
+    int pipelined;      /* build_tree_from_input_pipelined */
+    int build_index;    /* fill doc->index during construction */
+
+    /* Filtering; name lists are NULL-terminated, lowercase. */
+    const char *const *prune_elements;  /* keep the element, drop its content */
+    const char *const *drop_attributes; /* never copied onto elements */
+    int drop_comments;
+    int stop_after_head;    /* stop once the parser moves past <head> */
+
+    /* Early termination: nonzero from stop_when (run after each token)
+     * ends parsing as EOF would. Either stop makes the build single-threaded. */
+    int (*stop_when)(const token *t, const node *doc, void *ctx);
+    void *stop_ctx;
+    size_t *consumed;       /* out, optional: tokenizer input bytes parsed */
+
+    parse_stats *stats;     /* counters for this build, or NULL */
+    parse_error_sink *errors;   /* sink for this build; single-threaded */
+} tree_build_options;
 
 node *build_tree_from_tokens(const token *tokens, size_t count);
 node *build_tree_from_input(const char *input, const char *encoding,
                             encoding_confidence confidence,
                             const char **change_encoding);
+/* Same as build_tree_from_input(), with the tokenizer running ahead on a
+ * second thread (see tokenizer_pipeline_start). */
+node *build_tree_from_input_pipelined(const char *input, const char *encoding,
+                                      encoding_confidence confidence,
+                                      const char **change_encoding);
+/* Same as build_tree_from_input(), tokenizing on up to `threads` threads
+ * first (see tokenizer_tokenize_parallel). For multi-megabyte inputs. */
+node *build_tree_from_input_parallel(const char *input, const char *encoding,
+                                     encoding_confidence confidence,
+                                     const char **change_encoding,
+                                     int threads);
+/* build_tree_from_input() with options; opts may be NULL. */
+node *build_tree_from_input_opts(const char *input, const char *encoding,
+                                 encoding_confidence confidence,
+                                 const char **change_encoding,
+                                 const tree_build_options *opts);
 node *build_fragment_from_input(const char *input, const char *context_tag,
                                 const char *encoding,
                                 encoding_confidence confidence,
                                 const char **change_encoding);
 
+/* Parser buffers kept from build to build on one thread, so the parser core
+ * stops allocating once they fit the inputs. One context per thread. */
+typedef struct parser_ctx parser_ctx;
+
+parser_ctx *parser_ctx_create(void);
+void parser_ctx_free(parser_ctx *ctx);
+/* Make ctx the calling thread's context (NULL detaches). Returns the
+ * previous one so calls can nest. */
+parser_ctx *parser_ctx_attach(parser_ctx *ctx);
+
+/* A fragment parser prepared once for one context element. With an arena
+ * the result lives until the arena's next reset. One parser per thread. */
+typedef struct fragment_parser fragment_parser;
+
+fragment_parser *fragment_parser_create(const char *context_tag,
+                                        const char *encoding,
+                                        encoding_confidence confidence);
+node *fragment_parser_parse(fragment_parser *fp, const char *input,
+                            node_arena *arena);
+void fragment_parser_free(fragment_parser *fp);
+
+/* Batch fragment parsing into one arena, one batch at a time per arena.
+ * Call tokenizer_global_init() before running batches on several threads. */
+typedef struct {
+    const char *input;          /* NUL-terminated UTF-8; NULL is "" */
+    const char *context_tag;
+} fragment_batch_item;
+
+typedef struct {
+    size_t fragments;
+    size_t failed;              /* NULL roots (out of memory) */
+    size_t bytes;               /* input bytes parsed */
+    size_t contexts;            /* distinct contexts, one parser each */
+    size_t arena_bytes;         /* node_arena_used() after the batch */
+    uint64_t elapsed_ns;        /* excludes the entity table load */
+} fragment_batch_stats;
+
+/* Parse items[0..count) into arena. Returns count roots in item order,
+ * allocated in the arena; NULL when out of memory. stats may be NULL. */
+node **build_fragment_batch(const fragment_batch_item *items, size_t count,
+                            const char *encoding,
+                            encoding_confidence confidence,
+                            node_arena *arena, fragment_batch_stats *stats);
+
+/* tree_extract_text() straight from the token stream, without the tree
+ * builder's repairs. Returns the bytes passed to sink. */
+size_t extract_text_from_input(const char *input, text_sink sink, void *ctx);
+
 #endif
@@ -1,7 +1,9 @@
 #include "encoding.h"
+#include "parse_stats.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -256,7 +258,12 @@ static int entry_cmp(const void *key, const void *entry) {
     return strcmp((const char *)key, ((const encoding_entry *)entry)->label);
 }
 
-static char *normalize_label(const char *label) {
+/* Longest table label is 19 bytes; anything longer cannot match. */
+#define ENCODING_LABEL_MAX 32
+
+/* Trim and lowercase label into buf (no allocation).
+ * Returns buf, or NULL if the label is empty or too long to match. */
+static const char *normalize_label(const char *label, char *buf, size_t cap) {
     if (!label) return NULL;
     /* skip leading ASCII whitespace */
     while (*label == ' ' || *label == '\t' || *label == '\n' ||
@@ -271,33 +278,25 @@ static char *normalize_label(const char *label) {
         else
             break;
     }
-    if (len == 0) return NULL;
-    char *norm = (char *)malloc(len + 1);
-    if (!norm) return NULL;
+    if (len == 0 || len >= cap) return NULL;
     for (size_t i = 0; i < len; i++)
-        norm[i] = (char)tolower((unsigned char)label[i]);
-    norm[len] = '\0';
-    return norm;
+        buf[i] = (char)tolower((unsigned char)label[i]);
+    buf[len] = '\0';
+    return buf;
 }
 
-const char *encoding_resolve_label(const char *label) {
-    char *norm = normalize_label(label);
+static const encoding_entry *lookup_entry(const char *label) {
+    char buf[ENCODING_LABEL_MAX];
+    const char *norm = normalize_label(label, buf, sizeof(buf));
     if (!norm) return NULL;
-    encoding_entry *found = (encoding_entry *)bsearch(
+    return (const encoding_entry *)bsearch(
         norm, encoding_table, encoding_table_size,
         sizeof(encoding_entry), entry_cmp);
-    free(norm);
-    return found ? found->canonical : NULL;
 }
 
-static const encoding_entry *lookup_entry(const char *label) {
-    char *norm = normalize_label(label);
-    if (!norm) return NULL;
-    encoding_entry *found = (encoding_entry *)bsearch(
-        norm, encoding_table, encoding_table_size,
-        sizeof(encoding_entry), entry_cmp);
-    free(norm);
-    return found;
+const char *encoding_resolve_label(const char *label) {
+    const encoding_entry *found = lookup_entry(label);
+    return found ? found->canonical : NULL;
 }
 
 /* ========================================================================
@@ -579,44 +578,222 @@ static const char *meta_prescan(const unsigned char *raw, size_t raw_len) {
     return NULL;
 }
 
+/* ========================================================================
+ * Source map (UTF-8 output offset → input byte offset)
+ * ======================================================================== */
+
+static encoding_source_map *source_map_create(size_t in_skip) {
+    encoding_source_map *map =
+        (encoding_source_map *)calloc(1, sizeof(encoding_source_map));
+    if (map) map->in_len = in_skip;
+    return map;
+}
+
+void encoding_source_map_free(encoding_source_map *map) {
+    if (!map) return;
+    free(map->runs);
+    free(map);
+}
+
+/* Record count characters of out_w UTF-8 bytes, each from in_w input
+ * bytes. out_w == 0 records input consumed without output (escape
+ * sequences). Extends the last run when the widths line up. Returns 0 on
+ * allocation failure. */
+static int source_map_add(encoding_source_map *map, size_t out_w,
+                          size_t in_w, size_t count) {
+    if (count == 0) return 1;
+    if (out_w == 0) {
+        map->in_len += in_w * count;
+        return 1;
+    }
+    if (map->count > 0) {
+        encoding_source_run *last = &map->runs[map->count - 1];
+        size_t chars = (map->out_len - last->out_off) / last->out_w;
+        if (last->out_w == out_w && last->in_w == in_w &&
+            last->in_off + chars * last->in_w == map->in_len) {
+            map->out_len += out_w * count;
+            map->in_len += in_w * count;
+            return 1;
+        }
+    }
+    if (map->count == map->cap) {
+        size_t ncap = map->cap ? map->cap * 2 : 16;
+        encoding_source_run *tmp = (encoding_source_run *)realloc(
+            map->runs, ncap * sizeof(encoding_source_run));
+        if (!tmp) return 0;
+        map->runs = tmp;
+        map->cap = ncap;
+    }
+    encoding_source_run *run = &map->runs[map->count++];
+    run->out_off = map->out_len;
+    run->in_off = map->in_len;
+    run->out_w = (unsigned char)out_w;
+    run->in_w = (unsigned char)in_w;
+    map->out_len += out_w * count;
+    map->in_len += in_w * count;
+    return 1;
+}
+
+/* Identity mapping for bytes passed through unchanged (UTF-8 input or
+ * conversion fallback). Drops anything recorded before. */
+static void source_map_identity(encoding_source_map *map, size_t in_skip,
+                                size_t len) {
+    map->count = 0;
+    map->out_len = 0;
+    map->in_len = in_skip;
+    source_map_add(map, 1, 1, len);
+}
+
+size_t encoding_source_map_lookup(const encoding_source_map *map,
+                                  size_t out_off) {
+    if (!map) return out_off;
+    if (out_off >= map->out_len || map->count == 0) return map->in_len;
+    /* last run with run.out_off <= out_off */
+    size_t lo = 0, hi = map->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->runs[mid].out_off <= out_off) lo = mid;
+        else hi = mid;
+    }
+    const encoding_source_run *run = &map->runs[lo];
+    return run->in_off + ((out_off - run->out_off) / run->out_w) * run->in_w;
+}
+
+int encoding_source_map_normalize(encoding_source_map *map, const char *utf8,
+                                  size_t len) {
+    if (!map || !utf8) return 1;
+    encoding_source_map out = {0};
+    int pending_lf = 0;   /* last byte was CR: a following LF is dropped */
+    for (size_t r = 0; r < map->count; r++) {
+        const encoding_source_run *run = &map->runs[r];
+        size_t end = (r + 1 < map->count) ? map->runs[r + 1].out_off
+                                          : map->out_len;
+        if (end > len) end = len;
+        size_t ow = run->out_w, iw = run->in_w;
+        /* input skipped between runs (BOM, escape sequences) */
+        if (out.in_len < run->in_off)
+            source_map_add(&out, 0, run->in_off - out.in_len, 1);
+        size_t pos = run->out_off;
+        while (pos < end) {
+            size_t stop = pos;
+            if (!pending_lf) {
+                while (stop < end && utf8[stop] != '\r' && utf8[stop] != '\0')
+                    stop++;
+                stop = pos + ((stop - pos) / ow) * ow;
+            }
+            if (stop > pos) {
+                if (!source_map_add(&out, ow, iw, (stop - pos) / ow))
+                    goto fail;
+                pos = stop;
+                continue;
+            }
+            /* One character holding a CR, a NUL or the LF of a CRLF */
+            size_t nw = 0;
+            for (size_t k = pos; k < pos + ow && k < end; k++) {
+                if (pending_lf && utf8[k] == '\n') {
+                    pending_lf = 0;
+                    continue;
+                }
+                pending_lf = utf8[k] == '\r';
+                nw += utf8[k] == '\0' ? 3 : 1;
+            }
+            if (!source_map_add(&out, nw, iw, 1)) goto fail;
+            pos += ow;
+        }
+    }
+    if (out.in_len < map->in_len)
+        source_map_add(&out, 0, map->in_len - out.in_len, 1);
+    free(map->runs);
+    *map = out;
+    return 1;
+
+fail:
+    free(out.runs);
+    return 0;
+}
+
 /* ========================================================================
  * Encoding conversion
  * ======================================================================== */
 
-/* Built-in UTF-16 to UTF-8 converter (no iconv needed) */
-static char *convert_utf16_to_utf8(const unsigned char *raw, size_t raw_len,
-                                    int big_endian, size_t *out_len) {
-    size_t cap = raw_len * 2 + 4;
-    char *out = (char *)malloc(cap);
-    if (!out) return NULL;
+/* Write cp as UTF-8 into dst (at least 4 bytes free). Returns length. */
+static size_t utf8_encode_cp(char *dst, unsigned int cp) {
+    if (cp < 0x80) {
+        dst[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        dst[0] = (char)(0xC0 | (cp >> 6));
+        dst[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        dst[0] = (char)(0xE0 | (cp >> 12));
+        dst[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        dst[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    dst[0] = (char)(0xF0 | (cp >> 18));
+    dst[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    dst[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    dst[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/* Make *buf (kept by the caller for reuse) hold at least need bytes.
+ * Returns 0 on allocation failure. */
+static int out_reserve(char **buf, size_t *cap, size_t need) {
+    if (*buf && *cap >= need) return 1;
+    char *tmp = (char *)realloc(*buf, need);
+    if (!tmp) return 0;
+    *buf = tmp;
+    *cap = need;
+    return 1;
+}
+
+/* Built-in UTF-16 to UTF-8 converter (no iconv needed), into *buf.
+ * Output bound: a BMP unit (or lone surrogate → U+FFFD) needs at most 3
+ * bytes, a surrogate pair needs 4 bytes for 2 units, a trailing odd byte
+ * needs 3. So units * 3 + 3 + NUL always fits; reserve once. */
+static int convert_utf16_into(const unsigned char *raw, size_t raw_len,
+                              int big_endian, char **buf, size_t *cap,
+                              size_t *out_len, encoding_source_map *map) {
+    if (!out_reserve(buf, cap, (raw_len / 2) * 3 + 4)) return 0;
+    char *out = *buf;
     size_t olen = 0;
     size_t i = 0;
+    /* offset of the high (zero for ASCII) byte within each unit */
+    size_t hi = big_endian ? 0 : 1;
+    size_t lo = 1 - hi;
 
     while (i + 1 < raw_len) {
-        /* ensure space for max UTF-8 char (4 bytes) + NUL */
-        if (olen + 5 > cap) {
-            cap *= 2;
-            char *tmp = (char *)realloc(out, cap);
-            if (!tmp) { free(out); return NULL; }
-            out = tmp;
+        /* ASCII fast path: four units per step. The byte ORs are
+         * branch-free and auto-vectorize. */
+        while (i + 8 <= raw_len) {
+            unsigned char high = raw[i + hi] | raw[i + 2 + hi] |
+                                 raw[i + 4 + hi] | raw[i + 6 + hi];
+            unsigned char low = raw[i + lo] | raw[i + 2 + lo] |
+                                raw[i + 4 + lo] | raw[i + 6 + lo];
+            if (high | (low & 0x80)) break;
+            out[olen]     = (char)raw[i + lo];
+            out[olen + 1] = (char)raw[i + 2 + lo];
+            out[olen + 2] = (char)raw[i + 4 + lo];
+            out[olen + 3] = (char)raw[i + 6 + lo];
+            olen += 4;
+            i += 8;
+            if (map && !source_map_add(map, 1, 2, 4)) return 0;
         }
+        if (i + 1 >= raw_len) break;
 
-        unsigned int w1;
-        if (big_endian)
-            w1 = ((unsigned int)raw[i] << 8) | raw[i+1];
-        else
-            w1 = raw[i] | ((unsigned int)raw[i+1] << 8);
+        size_t start = i;
+        unsigned int w1 = ((unsigned int)raw[i + hi] << 8) | raw[i + lo];
         i += 2;
 
         unsigned int cp;
         if (w1 >= 0xD800 && w1 <= 0xDBFF) {
             /* high surrogate — need low surrogate */
             if (i + 1 < raw_len) {
-                unsigned int w2;
-                if (big_endian)
-                    w2 = ((unsigned int)raw[i] << 8) | raw[i+1];
-                else
-                    w2 = raw[i] | ((unsigned int)raw[i+1] << 8);
+                unsigned int w2 = ((unsigned int)raw[i + hi] << 8) | raw[i + lo];
                 if (w2 >= 0xDC00 && w2 <= 0xDFFF) {
                     cp = 0x10000 + ((w1 - 0xD800) << 10) + (w2 - 0xDC00);
                     i += 2;
@@ -632,65 +809,52 @@ static char *convert_utf16_to_utf8(const unsigned char *raw, size_t raw_len,
             cp = w1;
         }
 
-        /* encode as UTF-8 */
-        if (cp < 0x80) {
-            out[olen++] = (char)cp;
-        } else if (cp < 0x800) {
-            out[olen++] = (char)(0xC0 | (cp >> 6));
-            out[olen++] = (char)(0x80 | (cp & 0x3F));
-        } else if (cp < 0x10000) {
-            out[olen++] = (char)(0xE0 | (cp >> 12));
-            out[olen++] = (char)(0x80 | ((cp >> 6) & 0x3F));
-            out[olen++] = (char)(0x80 | (cp & 0x3F));
-        } else {
-            out[olen++] = (char)(0xF0 | (cp >> 18));
-            out[olen++] = (char)(0x80 | ((cp >> 12) & 0x3F));
-            out[olen++] = (char)(0x80 | ((cp >> 6) & 0x3F));
-            out[olen++] = (char)(0x80 | (cp & 0x3F));
-        }
+        size_t w = utf8_encode_cp(out + olen, cp);
+        olen += w;
+        if (map && !source_map_add(map, w, i - start, 1)) return 0;
     }
 
     /* handle trailing byte for odd-length input */
     if (i < raw_len) {
-        if (olen + 4 > cap) {
-            cap += 4;
-            char *tmp = (char *)realloc(out, cap);
-            if (!tmp) { free(out); return NULL; }
-            out = tmp;
-        }
-        /* U+FFFD */
-        out[olen++] = (char)0xEF;
-        out[olen++] = (char)0xBF;
-        out[olen++] = (char)0xBD;
+        olen += utf8_encode_cp(out + olen, 0xFFFD);
+        if (map && !source_map_add(map, 3, 1, 1)) return 0;
     }
 
     out[olen] = '\0';
     *out_len = olen;
-    return out;
+    return 1;
 }
 
-/* x-user-defined: 0x00-0x7F unchanged, 0x80-0xFF -> U+F780-U+F7FF */
-static char *convert_x_user_defined(const unsigned char *raw, size_t raw_len,
-                                     size_t *out_len) {
-    /* worst case: each byte -> 3 UTF-8 bytes */
-    size_t cap = raw_len * 3 + 1;
-    char *out = (char *)malloc(cap);
-    if (!out) return NULL;
-    size_t olen = 0;
+/* x-user-defined: 0x00-0x7F unchanged, 0x80-0xFF -> U+F780-U+F7FF, into
+ * *buf. Counting pre-pass gives the exact output size. */
+static int convert_x_user_defined_into(const unsigned char *raw,
+                                       size_t raw_len, char **buf,
+                                       size_t *cap, size_t *out_len,
+                                       encoding_source_map *map) {
+    size_t high = 0;
+    for (size_t i = 0; i < raw_len; i++)
+        high += raw[i] >> 7;
+
+    size_t olen = raw_len + high * 2;
+    if (!out_reserve(buf, cap, olen + 1)) return 0;
+    char *p = *buf;
 
     for (size_t i = 0; i < raw_len; i++) {
         if (raw[i] < 0x80) {
-            out[olen++] = (char)raw[i];
+            *p++ = (char)raw[i];
         } else {
+            /* U+F780 + (b - 0x80) = EF 9E/9F xx */
             unsigned int cp = 0xF780 + (raw[i] - 0x80);
-            out[olen++] = (char)(0xE0 | (cp >> 12));
-            out[olen++] = (char)(0x80 | ((cp >> 6) & 0x3F));
-            out[olen++] = (char)(0x80 | (cp & 0x3F));
+            *p++ = (char)0xEF;
+            *p++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *p++ = (char)(0x80 | (cp & 0x3F));
         }
+        if (map && !source_map_add(map, raw[i] < 0x80 ? 1 : 3, 1, 1))
+            return 0;
     }
-    out[olen] = '\0';
+    *p = '\0';
     *out_len = olen;
-    return out;
+    return 1;
 }
 
 /* ========================================================================
@@ -698,37 +862,15 @@ static char *convert_x_user_defined(const unsigned char *raw, size_t raw_len,
  * State machine: ASCII, Roman, Katakana, Lead byte, Trail byte, Escape
  * ======================================================================== */
 
-/* Helper: append a Unicode codepoint as UTF-8 to output buffer.
- * Grows buffer if needed. Returns 0 on success, -1 on alloc failure. */
-static int iso2022jp_emit_cp(char **out, size_t *olen, size_t *cap,
-                              unsigned int cp) {
-    /* ensure space for max 4 UTF-8 bytes */
-    if (*olen + 4 > *cap) {
-        *cap *= 2;
-        char *tmp = (char *)realloc(*out, *cap);
-        if (!tmp) return -1;
-        *out = tmp;
-    }
-    if (cp < 0x80) {
-        (*out)[(*olen)++] = (char)cp;
-    } else if (cp < 0x800) {
-        (*out)[(*olen)++] = (char)(0xC0 | (cp >> 6));
-        (*out)[(*olen)++] = (char)(0x80 | (cp & 0x3F));
-    } else if (cp < 0x10000) {
-        (*out)[(*olen)++] = (char)(0xE0 | (cp >> 12));
-        (*out)[(*olen)++] = (char)(0x80 | ((cp >> 6) & 0x3F));
-        (*out)[(*olen)++] = (char)(0x80 | (cp & 0x3F));
-    } else {
-        (*out)[(*olen)++] = (char)(0xF0 | (cp >> 18));
-        (*out)[(*olen)++] = (char)(0x80 | ((cp >> 12) & 0x3F));
-        (*out)[(*olen)++] = (char)(0x80 | ((cp >> 6) & 0x3F));
-        (*out)[(*olen)++] = (char)(0x80 | (cp & 0x3F));
-    }
-    return 0;
+/* Helper: append a Unicode codepoint as UTF-8 to the output buffer.
+ * No capacity check: see the bound in convert_iso2022jp_into(). */
+static void iso2022jp_emit_cp(char *out, size_t *olen, unsigned int cp) {
+    *olen += utf8_encode_cp(out + *olen, cp);
 }
 
-static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
-                                        size_t *out_len) {
+static int convert_iso2022jp_into(const unsigned char *raw, size_t raw_len,
+                                  char **buf, size_t *cap, size_t *out_len,
+                                  encoding_source_map *map) {
     enum {
         ISO2022_ASCII,
         ISO2022_ROMAN,
@@ -739,16 +881,37 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
         ISO2022_ESCAPE
     } state = ISO2022_ASCII, output_state = ISO2022_ASCII;
 
-    size_t cap = raw_len * 3 + 4;
-    char *out = (char *)malloc(cap);
-    if (!out) return NULL;
+    /* Output bound: every byte is consumed as data at most once (≤ 3 UTF-8
+     * bytes, the largest being U+FF61..U+FF9F and JIS X 0208 BMP code
+     * points), and every U+FFFD from an escape or interrupted trail is
+     * charged to a byte that produced no data itself (the ESC, or the lead
+     * byte). So raw_len * 3 + NUL always fits; reserve once. */
+    if (!out_reserve(buf, cap, raw_len * 3 + 1)) return 0;
+    char *out = *buf;
     size_t olen = 0;
 
     int output_flag = 0;
     unsigned char lead = 0;
     size_t i = 0;
+    size_t in_mark = 0;     /* input already charged to the source map */
 
     while (i <= raw_len) {
+        /* Each iteration emits at most one code point. With a source map,
+         * charge the input consumed since in_mark to it; a recognized
+         * escape sequence is recorded as input without output. */
+        if (map && i > in_mark) {
+            size_t prev_olen = map->out_len;
+            if (olen > prev_olen) {
+                if (!source_map_add(map, olen - prev_olen, i - in_mark, 1))
+                    return 0;
+                in_mark = i;
+            } else if (state != ISO2022_ESCAPE_START &&
+                       state != ISO2022_ESCAPE && state != ISO2022_TRAIL) {
+                source_map_add(map, 0, i - in_mark, 1);
+                in_mark = i;
+            }
+        }
+
         /* At i == raw_len, we process EOF (byte = -1 sentinel) */
         int is_eof = (i == raw_len);
         unsigned char byte = is_eof ? 0 : raw[i];
@@ -763,13 +926,11 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
             }
             if (byte <= 0x7F && byte != 0x0E && byte != 0x0F) {
                 output_flag = 1;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, byte) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, byte);
                 i++;
             } else {
                 output_flag = 0;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 i++;
             }
             break;
@@ -783,23 +944,19 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
             }
             if (byte == 0x5C) {
                 output_flag = 1;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0x00A5) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0x00A5);
                 i++;
             } else if (byte == 0x7E) {
                 output_flag = 1;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0x203E) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0x203E);
                 i++;
             } else if (byte <= 0x7F && byte != 0x0E && byte != 0x0F) {
                 output_flag = 1;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, byte) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, byte);
                 i++;
             } else {
                 output_flag = 0;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 i++;
             }
             break;
@@ -813,13 +970,11 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
             }
             if (byte >= 0x21 && byte <= 0x5F) {
                 output_flag = 1;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFF61 - 0x21 + byte) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFF61 - 0x21 + byte);
                 i++;
             } else {
                 output_flag = 0;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 i++;
             }
             break;
@@ -838,8 +993,7 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
                 i++;
             } else {
                 output_flag = 0;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 i++;
             }
             break;
@@ -847,14 +1001,12 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
         case ISO2022_TRAIL:
             if (is_eof) {
                 /* Incomplete two-byte sequence at EOF */
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 goto done;
             }
             if (byte == 0x1B) {
                 /* ESC interrupts trail byte — emit error for lead */
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 state = ISO2022_ESCAPE_START;
                 i++;
                 break;
@@ -865,14 +1017,12 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
                 if (pointer < JIS0208_TABLE_SIZE && jis0208_table[pointer] != 0) {
                     cp = jis0208_table[pointer];
                 }
-                if (iso2022jp_emit_cp(&out, &olen, &cap, cp) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, cp);
                 state = ISO2022_LEAD;
                 output_flag = (cp != 0xFFFD) ? 1 : 0;
                 i++;
             } else {
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 state = ISO2022_LEAD;
                 output_flag = 0;
                 i++;
@@ -883,8 +1033,7 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
             if (is_eof) {
                 /* ESC at EOF: emit error, done */
                 output_flag = 0;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 goto done;
             }
             if (byte == 0x24 || byte == 0x28) {
@@ -896,8 +1045,7 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
                  * in output_state */
                 output_flag = 0;
                 state = output_state;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 /* Don't advance i — re-process this byte */
             }
             break;
@@ -907,8 +1055,7 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
             if (is_eof) {
                 /* Incomplete escape at EOF */
                 output_flag = 0;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 goto done;
             }
             int recognized = 0;
@@ -940,8 +1087,7 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
                 /* If output_flag is set, emit U+FFFD per spec
                  * (security measure for state transitions) */
                 if (output_flag) {
-                    if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                        goto fail;
+                    iso2022jp_emit_cp(out, &olen, 0xFFFD);
                     output_flag = 0;
                 }
                 i++;
@@ -954,8 +1100,7 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
                  * lead and byte in output_state. */
                 output_flag = 0;
                 state = output_state;
-                if (iso2022jp_emit_cp(&out, &olen, &cap, 0xFFFD) < 0)
-                    goto fail;
+                iso2022jp_emit_cp(out, &olen, 0xFFFD);
                 /* Back up: re-process 'lead' byte and current byte.
                  * We need to re-process two bytes. Since we consumed the
                  * ESC and the lead already, we back i by 1 to re-process
@@ -971,51 +1116,58 @@ static char *convert_iso2022jp_to_utf8(const unsigned char *raw, size_t raw_len,
     } /* while */
 
 done:
+    if (map && olen > map->out_len &&
+        !source_map_add(map, olen - map->out_len, raw_len - in_mark, 1))
+        return 0;
     out[olen] = '\0';
     *out_len = olen;
-    return out;
-
-fail:
-    free(out);
-    return NULL;
+    return 1;
 }
 
 #ifdef HAVE_ICONV
-static char *convert_with_iconv(const unsigned char *raw, size_t raw_len,
-                                 const char *iconv_name, size_t *out_len) {
-    iconv_t cd = iconv_open("UTF-8", iconv_name);
-    if (cd == (iconv_t)-1) return NULL;
-
-    size_t cap = raw_len * 4 + 4;
-    char *out = (char *)malloc(cap);
-    if (!out) { iconv_close(cd); return NULL; }
+/* Run an open converter over raw into *buf (grown as needed, kept by the
+ * caller for reuse). Returns 1 on success, 0 on allocation failure. */
+static int iconv_convert_into(iconv_t cd, const unsigned char *raw,
+                              size_t raw_len, char **buf, size_t *cap,
+                              size_t *out_len) {
+    size_t need = raw_len * 4 + 4;
+    if (!*buf || *cap < need) {
+        char *tmp = (char *)realloc(*buf, need);
+        if (!tmp) return 0;
+        *buf = tmp;
+        *cap = need;
+    }
+    char *out = *buf;
 
     char *in_ptr = (char *)raw;
     size_t in_left = raw_len;
     char *out_ptr = out;
-    size_t out_left = cap;
+    size_t out_left = *cap;
+
+    /* start from the initial shift state */
+    iconv(cd, NULL, NULL, NULL, NULL);
 
     while (in_left > 0) {
         size_t rc = iconv(cd, &in_ptr, &in_left, &out_ptr, &out_left);
         if (rc == (size_t)-1) {
             if (errno == E2BIG) {
                 size_t used = (size_t)(out_ptr - out);
-                cap *= 2;
-                char *tmp = (char *)realloc(out, cap);
-                if (!tmp) { free(out); iconv_close(cd); return NULL; }
+                char *tmp = (char *)realloc(out, *cap * 2);
+                if (!tmp) { *buf = out; return 0; }
+                *cap *= 2;
                 out = tmp;
                 out_ptr = out + used;
-                out_left = cap - used;
+                out_left = *cap - used;
             } else {
                 /* EILSEQ or EINVAL: insert U+FFFD, skip 1 byte */
                 size_t used = (size_t)(out_ptr - out);
-                if (out_left < 3) {
-                    cap *= 2;
-                    char *tmp = (char *)realloc(out, cap);
-                    if (!tmp) { free(out); iconv_close(cd); return NULL; }
+                if (out_left < 4) {
+                    char *tmp = (char *)realloc(out, *cap * 2);
+                    if (!tmp) { *buf = out; return 0; }
+                    *cap *= 2;
                     out = tmp;
                     out_ptr = out + used;
-                    out_left = cap - used;
+                    out_left = *cap - used;
                 }
                 *out_ptr++ = (char)0xEF;
                 *out_ptr++ = (char)0xBF;
@@ -1029,40 +1181,146 @@ static char *convert_with_iconv(const unsigned char *raw, size_t raw_len,
         }
     }
 
+    if (out_left < 1) {
+        size_t used = (size_t)(out_ptr - out);
+        char *tmp = (char *)realloc(out, *cap + 1);
+        if (!tmp) { *buf = out; return 0; }
+        *cap += 1;
+        out = tmp;
+        out_ptr = out + used;
+    }
     *out_ptr = '\0';
     *out_len = (size_t)(out_ptr - out);
+    *buf = out;
+    return 1;
+}
+
+static char *convert_with_iconv(const unsigned char *raw, size_t raw_len,
+                                 const char *iconv_name, size_t *out_len) {
+    iconv_t cd = iconv_open("UTF-8", iconv_name);
+    if (cd == (iconv_t)-1) return NULL;
+
+    char *out = NULL;
+    size_t cap = 0;
+    if (!iconv_convert_into(cd, raw, raw_len, &out, &cap, out_len)) {
+        free(out);
+        out = NULL;
+    }
     iconv_close(cd);
     return out;
 }
 #endif
 
-static char *convert_to_utf8(const unsigned char *raw, size_t raw_len,
-                              const char *canonical, size_t *out_len) {
-    /* replacement encoding: return a single U+FFFD */
+#ifdef HAVE_ICONV
+/* Source-map variant of iconv_convert_into(): feeds iconv one character at
+ * a time (widening the input window until a character completes) so each
+ * output character is charged to its own input bytes. Slower; only used
+ * when a source map is requested. */
+static int iconv_convert_mapped(iconv_t cd, const unsigned char *raw,
+                                size_t raw_len, char **buf, size_t *cap,
+                                size_t *out_len, encoding_source_map *map) {
+    size_t olen = 0;
+    size_t pos = 0;
+
+    iconv(cd, NULL, NULL, NULL, NULL);
+
+    while (pos < raw_len) {
+        /* room for the widest character (plus NUL) */
+        if (!*buf || *cap - olen < 16) {
+            size_t ncap = *cap ? *cap * 2 : raw_len * 2 + 16;
+            char *tmp = (char *)realloc(*buf, ncap);
+            if (!tmp) return 0;
+            *buf = tmp;
+            *cap = ncap;
+        }
+
+        int done = 0;
+        for (size_t k = 1; k <= 4 && pos + k <= raw_len; k++) {
+            char *in_ptr = (char *)raw + pos;
+            size_t in_left = k;
+            char *out_ptr = *buf + olen;
+            size_t out_left = *cap - olen - 1;
+            size_t rc = iconv(cd, &in_ptr, &in_left, &out_ptr, &out_left);
+            size_t consumed = k - in_left;
+            if (consumed > 0) {
+                size_t produced = (size_t)(out_ptr - (*buf + olen));
+                if (!source_map_add(map, produced, consumed, 1)) return 0;
+                olen += produced;
+                pos += consumed;
+                done = 1;
+                break;
+            }
+            if (rc != (size_t)-1 || errno != EINVAL) break;
+        }
+        if (!done) {
+            /* EILSEQ or truncated: insert U+FFFD, skip 1 byte */
+            olen += utf8_encode_cp(*buf + olen, 0xFFFD);
+            if (!source_map_add(map, 3, 1, 1)) return 0;
+            pos++;
+            iconv(cd, NULL, NULL, NULL, NULL);
+        }
+    }
+
+    if (!*buf) {
+        *buf = (char *)malloc(1);
+        if (!*buf) return 0;
+        *cap = 1;
+    }
+    (*buf)[olen] = '\0';
+    *out_len = olen;
+    return 1;
+}
+#endif
+
+/* The converters that need no iconv, into *buf (kept by the caller for
+ * reuse). Returns 1 on success, 0 on failure, -1 when canonical is not
+ * one of them. */
+static int convert_builtin_into(const unsigned char *raw, size_t raw_len,
+                                const char *canonical, char **buf,
+                                size_t *cap, size_t *out_len,
+                                encoding_source_map *map) {
+    /* replacement encoding: a single U+FFFD */
     if (strcmp(canonical, "replacement") == 0) {
-        char *out = (char *)malloc(4);
-        if (!out) return NULL;
-        out[0] = (char)0xEF;
-        out[1] = (char)0xBF;
-        out[2] = (char)0xBD;
-        out[3] = '\0';
-        *out_len = 3;
-        return out;
+        if (!out_reserve(buf, cap, 4)) return 0;
+        *out_len = utf8_encode_cp(*buf, 0xFFFD);
+        (*buf)[*out_len] = '\0';
+        if (map) {
+            /* the whole input collapses into one U+FFFD */
+            if (!source_map_add(map, 3, 0, 1)) return 0;
+            source_map_add(map, 0, raw_len, 1);
+        }
+        return 1;
     }
 
-    /* x-user-defined: built-in converter */
     if (strcmp(canonical, "x-user-defined") == 0)
-        return convert_x_user_defined(raw, raw_len, out_len);
+        return convert_x_user_defined_into(raw, raw_len, buf, cap, out_len,
+                                           map);
 
-    /* UTF-16: built-in converter (works without iconv) */
+    /* UTF-16 works without iconv */
     if (strcmp(canonical, "UTF-16BE") == 0)
-        return convert_utf16_to_utf8(raw, raw_len, 1, out_len);
+        return convert_utf16_into(raw, raw_len, 1, buf, cap, out_len, map);
     if (strcmp(canonical, "UTF-16LE") == 0)
-        return convert_utf16_to_utf8(raw, raw_len, 0, out_len);
+        return convert_utf16_into(raw, raw_len, 0, buf, cap, out_len, map);
 
     /* ISO-2022-JP: built-in state machine decoder */
     if (strcmp(canonical, "ISO-2022-JP") == 0)
-        return convert_iso2022jp_to_utf8(raw, raw_len, out_len);
+        return convert_iso2022jp_into(raw, raw_len, buf, cap, out_len, map);
+
+    return -1;
+}
+
+static char *convert_to_utf8(const unsigned char *raw, size_t raw_len,
+                              const char *canonical, size_t *out_len,
+                              encoding_source_map *map) {
+    char *out = NULL;
+    size_t cap = 0;
+    int rc = convert_builtin_into(raw, raw_len, canonical, &out, &cap,
+                                  out_len, map);
+    if (rc >= 0) {
+        if (rc) return out;
+        free(out);
+        return NULL;
+    }
 
 #ifdef HAVE_ICONV
     {
@@ -1070,69 +1328,377 @@ static char *convert_to_utf8(const unsigned char *raw, size_t raw_len,
         const encoding_entry *ent = lookup_entry(canonical);
         const char *iconv_name = ent ? ent->iconv_name : canonical;
         if (!iconv_name) return NULL;
-        return convert_with_iconv(raw, raw_len, iconv_name, out_len);
+        if (!map)
+            return convert_with_iconv(raw, raw_len, iconv_name, out_len);
+
+        iconv_t cd = iconv_open("UTF-8", iconv_name);
+        if (cd == (iconv_t)-1) return NULL;
+        if (!iconv_convert_mapped(cd, raw, raw_len, &out, &cap, out_len, map)) {
+            free(out);
+            out = NULL;
+        }
+        iconv_close(cd);
+        return out;
     }
 #else
-    (void)raw; (void)raw_len; (void)canonical; (void)out_len;
     return NULL;
 #endif
 }
 
 /* ========================================================================
- * Main entry: encoding_sniff_and_convert()
+ * Statistical detection (WHATWG §13.2.3.2 step 8: frequency analysis)
+ * One pass over a bounded prefix. Each multibyte candidate runs its own
+ * validator; well-formed characters that fall in the encoding's most
+ * frequent code points count as hits. ASCII runs are skipped a word at a
+ * time while no candidate is inside a multibyte sequence.
  * ======================================================================== */
 
-encoding_result encoding_sniff_and_convert(const unsigned char *raw,
-                                           size_t raw_len,
-                                           const char *hint) {
-    encoding_result result = {NULL, 0, NULL, ENC_CONFIDENCE_TENTATIVE};
+#define DETECT_PREFIX_MAX      4096
+#define DETECT_MIN_HIT_PERCENT 10
+
+/* Most frequent ideographs / syllables, sorted for bsearch().
+ * High octet = lead byte, low octet = trail byte. */
+static const unsigned short detect_gbk_common[] = {
+    0xB2BB, 0xB2BF, 0xB3C9, 0xB3F6, 0xB4F3, 0xB5B1, 0xB5BD, 0xB5C0, 0xB5C3,
+    0xB5C4, 0xB5D8, 0xB6A8, 0xB6AF, 0xB6BC, 0xB6D4, 0xB6E0, 0xB6F8, 0xB7A2,
+    0xB7A8, 0xB7BD, 0xB7D6, 0xB8F6, 0xB9FA, 0xB9FD, 0xBAC3, 0xBACD, 0xBAF3,
+    0xBBB9, 0xBBE1, 0xBCD2, 0xBDF8, 0xBEAD, 0xBECD, 0xBFB4, 0xBFC9, 0xC0B4,
+    0xC0ED, 0xC0EF, 0xC1CB, 0xC3B4, 0xC3BB, 0xC3C7, 0xC3E6, 0xC4C7, 0xC4DC,
+    0xC4E3, 0xC4EA, 0xC6E4, 0xC6F0, 0xC8A5, 0xC8BB, 0xC8CB, 0xC8E7, 0xC9CF,
+    0xC9FA, 0xCAB1, 0xCAC2, 0xCAC7, 0xCBB5, 0xCBF9, 0xCBFB, 0xCCEC, 0xCDAC,
+    0xCEAA, 0xCED2, 0xCFC2, 0xCFD6, 0xD0A1, 0xD0A9, 0xD0C4, 0xD0D0, 0xD1A7,
+    0xD1F9, 0xD2AA, 0xD2B2, 0xD2BB, 0xD2D4, 0xD3C3, 0xD3D0, 0xD3DA, 0xD4DA,
+    0xD5E2, 0xD6AE, 0xD6D0, 0xD6D6, 0xD6F7, 0xD7C5, 0xD7D3, 0xD7D4, 0xD7F7,
+};
 
-    if (!raw || raw_len == 0) {
-        result.data = (char *)calloc(1, 1);
-        result.len = 0;
-        result.encoding = "UTF-8";
-        result.confidence = ENC_CONFIDENCE_IRRELEVANT;
-        return result;
+static const unsigned short detect_big5_common[] = {
+    0xA440, 0xA446, 0xA448, 0xA455, 0xA457, 0xA45D, 0xA46A, 0xA46C, 0xA470,
+    0xA4A3, 0xA4A4, 0xA4A7, 0xA4C0, 0xA4D1, 0xA4DF, 0xA4E8, 0xA544, 0xA548,
+    0xA54C, 0xA558, 0xA568, 0xA569, 0xA5CD, 0xA5CE, 0xA650, 0xA661, 0xA662,
+    0xA668, 0xA66E, 0xA670, 0xA67E, 0xA6A8, 0xA6B3, 0xA6D3, 0xA6DB, 0xA6E6,
+    0xA740, 0xA741, 0xA7DA, 0xA853, 0xA8BA, 0xA8C6, 0xA8C7, 0xA8D3, 0xA8E4,
+    0xA8EC, 0xA94D, 0xA977, 0xA9D2, 0xA9F3, 0xAA6B, 0xAABA, 0xABE1, 0xAC4F,
+    0xACB0, 0xACDD, 0xAD6E, 0xADB1, 0xADCC, 0xADD3, 0xAE61, 0xAEC9, 0xAFE0,
+    0xB05F, 0xB0CA, 0xB0EA, 0xB16F, 0xB27A, 0xB27B, 0xB36F, 0xB3A1, 0xB3A3,
+    0xB44E, 0xB54D, 0xB56F, 0xB5DB, 0xB669, 0xB77C, 0xB7ED, 0xB867, 0xB8CC,
+    0xB944, 0xB94C, 0xB9EF, 0xBAD8, 0xBBA1, 0xBBF2, 0xBCCB, 0xBEC7, 0xC1D9,
+};
+
+static const unsigned short detect_euckr_common[] = {
+    0xB0A1, 0xB0CD, 0xB0D4, 0xB0ED, 0xB0FA, 0xB1B8, 0xB1D7, 0xB1E2, 0xB3AA,
+    0xB3BB, 0xB4C2, 0xB4D9, 0xB4EB, 0xB5B5, 0xB5E9, 0xB6F3, 0xB7CE, 0xB8A6,
+    0xB8AE, 0xB8B6, 0xB8B8, 0xB8E9, 0xB9AE, 0xB9D7, 0xBAB8, 0xBACE, 0xBBE7,
+    0xBBF3, 0xBCAD, 0xBCD2, 0xBCF6, 0xBDBA, 0xBDC3, 0xBDC5, 0xBEC6, 0xBEEE,
+    0xBEF8, 0xBFA1, 0xBFA9, 0xBFE4, 0xBFEC, 0xBFF8, 0xC0BB, 0xC0C7, 0xC0CC,
+    0xC0CE, 0xC0CF, 0xC0D6, 0xC0DA, 0xC0E5, 0xC0FB, 0xC0FC, 0xC1A4, 0xC1A6,
+    0xC1D6, 0xC1F6, 0xC7CF, 0xC7D0, 0xC7D1, 0xC7D8,
+};
+
+typedef enum {
+    DETECT_UTF8,
+    DETECT_SJIS,
+    DETECT_EUCJP,
+    DETECT_GBK,
+    DETECT_BIG5,
+    DETECT_EUCKR,
+    DETECT_MB_COUNT
+} detect_mb_kind;
+
+static const char *const detect_mb_names[DETECT_MB_COUNT] = {
+    "UTF-8", "Shift_JIS", "EUC-JP", "GBK", "Big5", "EUC-KR"
+};
+
+typedef struct {
+    unsigned lead;   /* pending lead byte (UTF-8: bytes still expected) */
+    size_t chars;    /* well-formed multibyte characters */
+    size_t hits;     /* characters in the encoding's frequent set */
+    size_t errors;   /* ill-formed sequences */
+} detect_mb_state;
+
+static int detect_in(unsigned c, unsigned lo, unsigned hi) {
+    return c >= lo && c <= hi;
+}
+
+static int u16_cmp(const void *key, const void *entry) {
+    unsigned short a = *(const unsigned short *)key;
+    unsigned short b = *(const unsigned short *)entry;
+    return (a > b) - (a < b);
+}
+
+static int detect_is_common(const unsigned short *table, size_t count,
+                            unsigned lead, unsigned trail) {
+    unsigned short key = (unsigned short)((lead << 8) | trail);
+    return bsearch(&key, table, count, sizeof(table[0]), u16_cmp) != NULL;
+}
+
+#define DETECT_COMMON(tbl, lead, trail) \
+    detect_is_common(tbl, sizeof(tbl) / sizeof(tbl[0]), lead, trail)
+
+/* Feed one byte to a candidate's validator. */
+static void detect_step(detect_mb_kind kind, detect_mb_state *s, unsigned c) {
+    unsigned lead = s->lead;
+
+    if (lead) {
+        s->lead = 0;
+        switch (kind) {
+            case DETECT_UTF8:
+                if (detect_in(c, 0x80, 0xBF)) {
+                    s->lead = lead - 1;
+                    if (s->lead == 0) { s->chars++; s->hits++; }
+                    return;
+                }
+                break;
+            case DETECT_SJIS:
+                if (detect_in(c, 0x40, 0x7E) || detect_in(c, 0x80, 0xFC)) {
+                    s->chars++;
+                    /* hiragana / katakana rows */
+                    if ((lead == 0x82 && detect_in(c, 0x9F, 0xF1)) ||
+                        (lead == 0x83 && detect_in(c, 0x40, 0x96)))
+                        s->hits++;
+                    return;
+                }
+                break;
+            case DETECT_EUCJP:
+                if (lead == 0x100) {  /* JIS X 0212 third byte */
+                    if (detect_in(c, 0xA1, 0xFE)) { s->chars++; return; }
+                    break;
+                }
+                if (lead == 0x8E) {
+                    if (detect_in(c, 0xA1, 0xDF)) { s->chars++; return; }
+                    break;
+                }
+                if (lead == 0x8F) {
+                    if (detect_in(c, 0xA1, 0xFE)) { s->lead = 0x100; return; }
+                    break;
+                }
+                if (detect_in(c, 0xA1, 0xFE)) {
+                    s->chars++;
+                    if (lead == 0xA4 || lead == 0xA5) s->hits++;
+                    return;
+                }
+                break;
+            case DETECT_GBK:
+                if (detect_in(c, 0x40, 0x7E) || detect_in(c, 0x80, 0xFE)) {
+                    s->chars++;
+                    if (DETECT_COMMON(detect_gbk_common, lead, c)) s->hits++;
+                    return;
+                }
+                break;
+            case DETECT_BIG5:
+                if (detect_in(c, 0x40, 0x7E) || detect_in(c, 0xA1, 0xFE)) {
+                    s->chars++;
+                    if (DETECT_COMMON(detect_big5_common, lead, c)) s->hits++;
+                    return;
+                }
+                break;
+            case DETECT_EUCKR:
+                if (detect_in(c, 0x41, 0xFE)) {
+                    s->chars++;
+                    if (DETECT_COMMON(detect_euckr_common, lead, c)) s->hits++;
+                    return;
+                }
+                break;
+            default:
+                break;
+        }
+        /* Ill-formed: the offending byte may still start a new character */
+        s->errors++;
     }
 
-    const unsigned char *data = raw;
-    size_t data_len = raw_len;
-    const char *encoding = NULL;
-    encoding_confidence confidence = ENC_CONFIDENCE_TENTATIVE;
+    if (c < 0x80) return;
+    switch (kind) {
+        case DETECT_UTF8:
+            if (detect_in(c, 0xC2, 0xDF)) s->lead = 1;
+            else if (detect_in(c, 0xE0, 0xEF)) s->lead = 2;
+            else if (detect_in(c, 0xF0, 0xF4)) s->lead = 3;
+            else s->errors++;
+            break;
+        case DETECT_SJIS:
+            if (detect_in(c, 0x81, 0x9F) || detect_in(c, 0xE0, 0xFC)) s->lead = c;
+            else if (detect_in(c, 0xA1, 0xDF)) s->chars++;  /* half-width katakana */
+            else s->errors++;
+            break;
+        case DETECT_EUCJP:
+            if (c == 0x8E || c == 0x8F || detect_in(c, 0xA1, 0xFE)) s->lead = c;
+            else s->errors++;
+            break;
+        case DETECT_GBK:
+            if (c == 0x80) s->chars++;  /* euro sign */
+            else if (c <= 0xFE) s->lead = c;
+            else s->errors++;
+            break;
+        default:
+            if (detect_in(c, 0x81, 0xFE)) s->lead = c;
+            else s->errors++;
+            break;
+    }
+}
+
+const char *encoding_detect(const unsigned char *raw, size_t raw_len,
+                            int *score) {
+    detect_mb_state mb[DETECT_MB_COUNT];
+    size_t high = 0, high_runs = 0;
+    size_t upper_c0 = 0, upper_e0 = 0;  /* 0xC0-0xDF / 0xE0-0xFF */
+    int prev_high = 0;
+    int pending = 0;
+    size_t n = raw_len < DETECT_PREFIX_MAX ? raw_len : DETECT_PREFIX_MAX;
+    size_t i = 0;
+
+    if (score) *score = 0;
+    if (!raw) return NULL;
+    memset(mb, 0, sizeof(mb));
+
+    while (i < n) {
+        if (!pending && i + 8 <= n) {
+            uint64_t word;
+            memcpy(&word, raw + i, sizeof(word));
+            if ((word & UINT64_C(0x8080808080808080)) == 0) {
+                i += 8;
+                prev_high = 0;
+                continue;
+            }
+        }
+
+        unsigned c = raw[i++];
+        if (c >= 0x80) {
+            high++;
+            if (prev_high) high_runs++;
+            if (c >= 0xE0) upper_e0++;
+            else if (c >= 0xC0) upper_c0++;
+        }
+        prev_high = c >= 0x80;
+
+        pending = 0;
+        for (int k = 0; k < DETECT_MB_COUNT; k++) {
+            detect_step((detect_mb_kind)k, &mb[k], c);
+            pending |= mb[k].lead != 0;
+        }
+    }
+
+    if (high == 0) return NULL;  /* plain ASCII: nothing to decide */
+
+    /* Well-formed UTF-8 is almost never accidental */
+    if (mb[DETECT_UTF8].errors == 0 && mb[DETECT_UTF8].chars > 0) {
+        if (score) *score = 100;
+        return "UTF-8";
+    }
+
+    /* Multibyte legacy encodings: best share of frequent characters */
+    int best = -1;
+    size_t best_pct = 0;
+    for (int k = DETECT_SJIS; k < DETECT_MB_COUNT; k++) {
+        const detect_mb_state *s = &mb[k];
+        if (s->chars == 0 || s->errors * 16 > s->chars) continue;
+        size_t pct = s->hits * 100 / s->chars;
+        if (pct >= DETECT_MIN_HIT_PERCENT && pct > best_pct) {
+            best = k;
+            best_pct = pct;
+        }
+    }
+    if (best >= 0) {
+        if (score) *score = (int)(50 + best_pct / 2);
+        return detect_mb_names[best];
+    }
+
+    /* Single-byte: Cyrillic letters come in runs, Latin accents are
+     * isolated. windows-1251 puts lowercase at 0xE0-0xFF, KOI8-R at
+     * 0xC0-0xDF. */
+    if (high_runs * 2 >= high && upper_c0 + upper_e0 > 0) {
+        size_t total = upper_c0 + upper_e0;
+        if (upper_e0 >= upper_c0) {
+            if (score) *score = (int)(upper_e0 * 100 / total);
+            return "windows-1251";
+        }
+        if (score) *score = (int)(upper_c0 * 100 / total);
+        return "KOI8-R";
+    }
+
+    if (score) *score = 50;
+    return "windows-1252";
+}
+
+/* ========================================================================
+ * Sniffing (shared by encoding_sniff_and_convert_ex and the decoder)
+ * ======================================================================== */
+
+/* Run BOM → hint → meta prescan → optional detection → default UTF-8.
+ * Returns canonical name; *skip receives the BOM length. */
+static const char *sniff_encoding(const unsigned char *raw, size_t raw_len,
+                                  const char *hint, int flags, size_t *skip,
+                                  encoding_confidence *confidence,
+                                  int *detect_score) {
+    *skip = 0;
+    *detect_score = 0;
 
     /* Step 1: BOM detection */
     bom_result bom = detect_bom(raw, raw_len);
     if (bom.encoding) {
-        encoding = bom.encoding;
-        confidence = ENC_CONFIDENCE_CERTAIN;
-        data = raw + bom.skip;
-        data_len = raw_len - bom.skip;
+        *skip = bom.skip;
+        *confidence = ENC_CONFIDENCE_CERTAIN;
+        return bom.encoding;
     }
 
     /* Step 2: Transport-layer hint */
-    if (!encoding && hint) {
+    if (hint) {
         const char *resolved = encoding_resolve_label(hint);
         if (resolved) {
-            encoding = resolved;
-            confidence = ENC_CONFIDENCE_CERTAIN;
+            *confidence = ENC_CONFIDENCE_CERTAIN;
+            return resolved;
         }
     }
 
     /* Step 3: Meta prescan */
-    if (!encoding) {
-        const char *meta_enc = meta_prescan(raw, raw_len);
-        if (meta_enc) {
-            encoding = meta_enc;
-            confidence = ENC_CONFIDENCE_TENTATIVE;
-        }
+    *confidence = ENC_CONFIDENCE_TENTATIVE;
+    const char *meta_enc = meta_prescan(raw, raw_len);
+    if (meta_enc) return meta_enc;
+
+    /* Step 4: Optional statistical detection */
+    if (flags & ENC_SNIFF_DETECT) {
+        const char *detected = encoding_detect(raw, raw_len, detect_score);
+        if (detected) return detected;
+        *detect_score = 0;
     }
 
-    /* Step 4: Default to UTF-8 */
-    if (!encoding) {
-        encoding = "UTF-8";
-        confidence = ENC_CONFIDENCE_TENTATIVE;
+    /* Step 5: Default to UTF-8 */
+    return "UTF-8";
+}
+
+/* ========================================================================
+ * Main entry: encoding_sniff_and_convert()
+ * ======================================================================== */
+
+encoding_result encoding_sniff_and_convert(const unsigned char *raw,
+                                           size_t raw_len,
+                                           const char *hint) {
+    return encoding_sniff_and_convert_ex(raw, raw_len, hint, ENC_SNIFF_DEFAULT);
+}
+
+static encoding_result sniff_and_convert(const unsigned char *raw,
+                                         size_t raw_len, const char *hint,
+                                         int flags) {
+    encoding_result result = {NULL, 0, NULL, ENC_CONFIDENCE_TENTATIVE, 0, NULL};
+
+    if (!raw || raw_len == 0) {
+        result.data = (char *)calloc(1, 1);
+        result.len = 0;
+        result.encoding = "UTF-8";
+        result.confidence = ENC_CONFIDENCE_IRRELEVANT;
+        if (flags & ENC_SNIFF_SOURCE_MAP)
+            result.source_map = source_map_create(0);
+        return result;
     }
 
+    size_t skip = 0;
+    encoding_confidence confidence = ENC_CONFIDENCE_TENTATIVE;
+    int detect_score = 0;
+    const char *encoding = sniff_encoding(raw, raw_len, hint, flags, &skip,
+                                          &confidence, &detect_score);
+    const unsigned char *data = raw + skip;
+    size_t data_len = raw_len - skip;
+    encoding_source_map *map = NULL;
+    if (flags & ENC_SNIFF_SOURCE_MAP)
+        map = source_map_create(skip);
+
     /* WHATWG: certain encodings get overridden */
     /* UTF-16LE/BE from non-BOM sources get mapped to UTF-8 per spec
      * (only BOM should trigger UTF-16 decoding). */
@@ -1140,27 +1706,33 @@ encoding_result encoding_sniff_and_convert(const unsigned char *raw,
     /* UTF-8 fast path: memcpy, no conversion */
     if (strcmp(encoding, "UTF-8") == 0) {
         result.data = (char *)malloc(data_len + 1);
-        if (!result.data) return result;
+        if (!result.data) { encoding_source_map_free(map); return result; }
         memcpy(result.data, data, data_len);
         result.data[data_len] = '\0';
         result.len = data_len;
         result.encoding = "UTF-8";
         result.confidence = confidence;
+        result.detect_score = detect_score;
+        if (map) source_map_identity(map, skip, data_len);
+        result.source_map = map;
         return result;
     }
 
     /* Convert to UTF-8 */
     size_t out_len = 0;
-    char *converted = convert_to_utf8(data, data_len, encoding, &out_len);
+    char *converted = convert_to_utf8(data, data_len, encoding, &out_len, map);
     if (!converted) {
         /* Conversion failed — fallback: treat as UTF-8 */
         result.data = (char *)malloc(data_len + 1);
-        if (!result.data) return result;
+        if (!result.data) { encoding_source_map_free(map); return result; }
         memcpy(result.data, data, data_len);
         result.data[data_len] = '\0';
         result.len = data_len;
         result.encoding = "UTF-8";
         result.confidence = ENC_CONFIDENCE_TENTATIVE;
+        result.detect_score = 0;
+        if (map) source_map_identity(map, skip, data_len);
+        result.source_map = map;
         return result;
     }
 
@@ -1168,5 +1740,194 @@ encoding_result encoding_sniff_and_convert(const unsigned char *raw,
     result.len = out_len;
     result.encoding = encoding;
     result.confidence = confidence;
+    result.detect_score = detect_score;
+    result.source_map = map;
+    return result;
+}
+
+/* ========================================================================
+ * Reusable decoder context
+ * Caches open iconv converters by canonical name and keeps one UTF-8
+ * output buffer across documents. Not thread-safe: one per thread.
+ * ======================================================================== */
+
+#define DECODER_CACHE_SIZE 8
+
+struct encoding_decoder {
+#ifdef HAVE_ICONV
+    struct {
+        const char *canonical;  /* static table string */
+        iconv_t cd;
+    } cache[DECODER_CACHE_SIZE];
+    size_t cache_count;
+    size_t cache_next;          /* round-robin eviction slot */
+#endif
+    char *buf;                  /* reused UTF-8 output */
+    size_t cap;
+};
+
+encoding_decoder *encoding_decoder_create(void) {
+    return (encoding_decoder *)calloc(1, sizeof(encoding_decoder));
+}
+
+void encoding_decoder_free(encoding_decoder *dec) {
+    if (!dec) return;
+#ifdef HAVE_ICONV
+    for (size_t i = 0; i < dec->cache_count; i++)
+        iconv_close(dec->cache[i].cd);
+#endif
+    free(dec->buf);
+    free(dec);
+}
+
+static int decoder_reserve(encoding_decoder *dec, size_t need) {
+    if (dec->buf && dec->cap >= need) return 1;
+    char *tmp = (char *)realloc(dec->buf, need);
+    if (!tmp) return 0;
+    dec->buf = tmp;
+    dec->cap = need;
+    return 1;
+}
+
+/* Copy bytes as-is (UTF-8 fast path and conversion fallback). */
+static int decoder_copy(encoding_decoder *dec, const unsigned char *data,
+                        size_t data_len) {
+    if (!decoder_reserve(dec, data_len + 1)) return 0;
+    memcpy(dec->buf, data, data_len);
+    dec->buf[data_len] = '\0';
+    return 1;
+}
+
+#ifdef HAVE_ICONV
+static iconv_t decoder_iconv(encoding_decoder *dec, const char *canonical,
+                             const char *iconv_name) {
+    for (size_t i = 0; i < dec->cache_count; i++) {
+        if (strcmp(dec->cache[i].canonical, canonical) == 0)
+            return dec->cache[i].cd;
+    }
+    iconv_t cd = iconv_open("UTF-8", iconv_name);
+    if (cd == (iconv_t)-1) return cd;
+    size_t slot;
+    if (dec->cache_count < DECODER_CACHE_SIZE) {
+        slot = dec->cache_count++;
+    } else {
+        slot = dec->cache_next;
+        dec->cache_next = (dec->cache_next + 1) % DECODER_CACHE_SIZE;
+        iconv_close(dec->cache[slot].cd);
+    }
+    dec->cache[slot].canonical = canonical;
+    dec->cache[slot].cd = cd;
+    return cd;
+}
+#endif
+
+/* Convert into dec->buf. Returns 1 on success. */
+static int decoder_convert(encoding_decoder *dec, const unsigned char *raw,
+                           size_t raw_len, const char *canonical,
+                           size_t *out_len, encoding_source_map *map) {
+    int rc = convert_builtin_into(raw, raw_len, canonical, &dec->buf,
+                                  &dec->cap, out_len, map);
+    if (rc >= 0) return rc;
+#ifdef HAVE_ICONV
+    const encoding_entry *ent = lookup_entry(canonical);
+    if (ent && ent->iconv_name) {
+        iconv_t cd = decoder_iconv(dec, ent->canonical, ent->iconv_name);
+        if (cd == (iconv_t)-1) return 0;
+        if (map)
+            return iconv_convert_mapped(cd, raw, raw_len, &dec->buf,
+                                        &dec->cap, out_len, map);
+        return iconv_convert_into(cd, raw, raw_len, &dec->buf, &dec->cap,
+                                  out_len);
+    }
+#endif
+    return 0;
+}
+
+static encoding_result decoder_convert_input(encoding_decoder *dec,
+                                             const unsigned char *raw,
+                                             size_t raw_len, const char *hint,
+                                             int flags) {
+    encoding_result result = {NULL, 0, NULL, ENC_CONFIDENCE_TENTATIVE, 0, NULL};
+    if (!dec) return result;
+
+    if (!raw || raw_len == 0) {
+        if (!decoder_copy(dec, (const unsigned char *)"", 0)) return result;
+        result.data = dec->buf;
+        result.encoding = "UTF-8";
+        result.confidence = ENC_CONFIDENCE_IRRELEVANT;
+        if (flags & ENC_SNIFF_SOURCE_MAP)
+            result.source_map = source_map_create(0);
+        return result;
+    }
+
+    size_t skip = 0;
+    encoding_confidence confidence = ENC_CONFIDENCE_TENTATIVE;
+    int detect_score = 0;
+    const char *encoding = sniff_encoding(raw, raw_len, hint, flags, &skip,
+                                          &confidence, &detect_score);
+    const unsigned char *data = raw + skip;
+    size_t data_len = raw_len - skip;
+    size_t out_len = data_len;
+    encoding_source_map *map = NULL;
+    if (flags & ENC_SNIFF_SOURCE_MAP)
+        map = source_map_create(skip);
+
+    if (strcmp(encoding, "UTF-8") != 0 &&
+        !decoder_convert(dec, data, data_len, encoding, &out_len, map)) {
+        /* Conversion failed — fallback: treat as UTF-8 */
+        encoding = "UTF-8";
+        confidence = ENC_CONFIDENCE_TENTATIVE;
+        detect_score = 0;
+        out_len = data_len;
+    }
+    if (strcmp(encoding, "UTF-8") == 0) {
+        if (!decoder_copy(dec, data, data_len)) {
+            encoding_source_map_free(map);
+            return result;
+        }
+        if (map) source_map_identity(map, skip, data_len);
+    }
+
+    result.data = dec->buf;
+    result.len = out_len;
+    result.encoding = encoding;
+    result.confidence = confidence;
+    result.detect_score = detect_score;
+    result.source_map = map;
+    return result;
+}
+
+/* ========================================================================
+ * Public conversion entry points (timed when parse stats are attached)
+ * ======================================================================== */
+
+static void stat_decode(size_t raw_len, uint64_t start_ns) {
+    PARSE_STAT_ADD(bytes_decoded, raw_len);
+    PARSE_STAT_ADD(decode_ns, parse_stats_now_ns() - start_ns);
+}
+
+encoding_result encoding_sniff_and_convert_ex(const unsigned char *raw,
+                                              size_t raw_len,
+                                              const char *hint,
+                                              int flags) {
+    if (!PARSE_STATS_ON)
+        return sniff_and_convert(raw, raw_len, hint, flags);
+    uint64_t start_ns = parse_stats_now_ns();
+    encoding_result result = sniff_and_convert(raw, raw_len, hint, flags);
+    stat_decode(raw_len, start_ns);
+    return result;
+}
+
+encoding_result encoding_decoder_convert(encoding_decoder *dec,
+                                         const unsigned char *raw,
+                                         size_t raw_len,
+                                         const char *hint,
+                                         int flags) {
+    if (!PARSE_STATS_ON)
+        return decoder_convert_input(dec, raw, raw_len, hint, flags);
+    uint64_t start_ns = parse_stats_now_ns();
+    encoding_result result = decoder_convert_input(dec, raw, raw_len, hint,
+                                                   flags);
+    stat_decode(raw_len, start_ns);
     return result;
 }
@@ -0,0 +1,389 @@
+#include "node_index.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================================
+ * String → node list hash map (open addressing, linear probing)
+ * ============================================================================ */
+
+typedef struct {
+    char *key;                  /* NULL = empty slot */
+    uint32_t hash;
+    node **items;
+    size_t count;
+    size_t cap;
+    unsigned stamp;             /* compacted in this subtree removal */
+} index_bucket;
+
+typedef struct {
+    index_bucket *slots;
+    size_t cap;                 /* power of two */
+    size_t used;
+} index_map;
+
+struct node_index {
+    index_map ids;
+    index_map classes;
+    index_map tags;
+    int dirty;                  /* out of order: rebuild on next lookup */
+    unsigned stamp;             /* current subtree removal */
+    node **tail;                /* the document, its last child, that
+                                 * one's last child, ...: appending under
+                                 * any of them appends at the end */
+    size_t tail_depth;
+    size_t tail_cap;
+};
+
+static uint32_t index_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;                   /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static index_bucket *map_find(const index_map *m, const char *key, size_t len,
+                              uint32_t hash) {
+    if (m->cap == 0) return NULL;
+    size_t mask = m->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        index_bucket *b = &m->slots[i];
+        if (!b->key) return b;
+        if (b->hash == hash && strncmp(b->key, key, len) == 0 && b->key[len] == '\0')
+            return b;
+    }
+}
+
+static int map_grow(index_map *m) {
+    size_t ncap = m->cap ? m->cap * 2 : 64;
+    index_bucket *slots = (index_bucket *)calloc(ncap, sizeof(index_bucket));
+    if (!slots) return 0;
+    for (size_t i = 0; i < m->cap; i++) {
+        index_bucket *b = &m->slots[i];
+        if (!b->key) continue;
+        size_t j = b->hash & (ncap - 1);
+        while (slots[j].key) j = (j + 1) & (ncap - 1);
+        slots[j] = *b;
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->cap = ncap;
+    return 1;
+}
+
+/* Append n to the list for key[0..len). Returns 0 on allocation failure. */
+static int map_add(index_map *m, const char *key, size_t len, node *n) {
+    if ((m->used + 1) * 2 > m->cap && !map_grow(m)) return 0;
+    uint32_t hash = index_hash(key, len);
+    index_bucket *b = map_find(m, key, len, hash);
+    if (!b->key) {
+        b->key = (char *)malloc(len + 1);
+        if (!b->key) return 0;
+        memcpy(b->key, key, len);
+        b->key[len] = '\0';
+        b->hash = hash;
+        m->used++;
+    }
+    if (b->count > 0 && b->items[b->count - 1] == n) return 1;  /* class="a a" */
+    if (b->count == b->cap) {
+        size_t ncap = b->cap ? b->cap * 2 : 4;
+        node **items = (node **)realloc(b->items, ncap * sizeof(node *));
+        if (!items) return 0;
+        b->items = items;
+        b->cap = ncap;
+    }
+    b->items[b->count++] = n;
+    return 1;
+}
+
+/* Remove n from the list for key[0..len), keeping tree order. Searches
+ * from the back: the builder mostly detaches recently inserted nodes. */
+static void map_remove(index_map *m, const char *key, size_t len, const node *n) {
+    index_bucket *b = map_find(m, key, len, index_hash(key, len));
+    if (!b || !b->key) return;
+    for (size_t i = b->count; i-- > 0;) {
+        if (b->items[i] == n) {
+            memmove(&b->items[i], &b->items[i + 1], (b->count - i - 1) * sizeof(node *));
+            b->count--;
+            return;
+        }
+    }
+}
+
+/* Drop every node that left idx's document from the list for key[0..len),
+ * once per subtree removal (see index_subtree_remove()). */
+static void map_compact(index_map *m, const char *key, size_t len,
+                        const node_index *idx) {
+    index_bucket *b = map_find(m, key, len, index_hash(key, len));
+    if (!b || !b->key || b->stamp == idx->stamp) return;
+    b->stamp = idx->stamp;
+    size_t kept = 0;
+    for (size_t i = 0; i < b->count; i++)
+        if (b->items[i]->index == idx) b->items[kept++] = b->items[i];
+    b->count = kept;
+}
+
+static void map_clear_stamps(index_map *m) {
+    for (size_t i = 0; i < m->cap; i++)
+        m->slots[i].stamp = 0;
+}
+
+static const index_bucket *map_get(const index_map *m, const char *key) {
+    size_t len = strlen(key);
+    const index_bucket *b = map_find(m, key, len, index_hash(key, len));
+    return (b && b->key && b->count > 0) ? b : NULL;
+}
+
+static void map_free(index_map *m) {
+    for (size_t i = 0; i < m->cap; i++) {
+        free(m->slots[i].key);
+        free(m->slots[i].items);
+    }
+    free(m->slots);
+    m->slots = NULL;
+    m->cap = m->used = 0;
+}
+
+/* ============================================================================
+ * Building
+ * ============================================================================ */
+
+static const char *find_attr(const node *n, const char *name) {
+    for (size_t i = 0; i < n->attr_count; i++)
+        if (n->attrs[i].name && strcmp(n->attrs[i].name, name) == 0)
+            return n->attrs[i].value ? n->attrs[i].value : "";
+    return NULL;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+typedef enum { KEY_ADD, KEY_REMOVE, KEY_COMPACT } key_op;
+
+static int index_key(node_index *idx, index_map *m, const char *key,
+                     size_t len, node *n, key_op op) {
+    if (op == KEY_ADD) return map_add(m, key, len, n);
+    if (op == KEY_REMOVE) map_remove(m, key, len, n);
+    else map_compact(m, key, len, idx);
+    return 1;
+}
+
+/* Apply op to one element's id/class/tag entries. Returns 0 on
+ * allocation failure. */
+static int index_element(node_index *idx, node *n, key_op op) {
+    if (n->name && !index_key(idx, &idx->tags, n->name, strlen(n->name), n, op))
+        return 0;
+    const char *id = find_attr(n, "id");
+    if (id && id[0] && !index_key(idx, &idx->ids, id, strlen(id), n, op))
+        return 0;
+    const char *cls = find_attr(n, "class");
+    while (cls && *cls) {
+        while (is_space(*cls)) cls++;
+        const char *start = cls;
+        while (*cls && !is_space(*cls)) cls++;
+        if (cls == start) continue;
+        if (!index_key(idx, &idx->classes, start, (size_t)(cls - start), n, op))
+            return 0;
+    }
+    return 1;
+}
+
+/* Point every node of root's subtree at idx and, unless idx is dirty,
+ * index its elements in tree order. Returns 0 on allocation failure. */
+static int index_subtree_add(node_index *idx, node *root) {
+    int ok = 1;
+    for (node *n = root; n; n = node_preorder_next(n, root)) {
+        n->index = idx;
+        if (ok && !idx->dirty && n->type == NODE_ELEMENT)
+            ok = index_element(idx, n, KEY_ADD);
+    }
+    return ok;
+}
+
+/* Detach root's subtree from idx. A lone element is looked up from the
+ * back of its lists; a larger subtree is first unmarked, then each list
+ * it appears in is compacted once, so the cost is linear in the subtree
+ * plus those lists. */
+static void index_subtree_remove(node_index *idx, node *root) {
+    size_t elements = 0;
+    for (node *n = root; n; n = node_preorder_next(n, root)) {
+        n->index = NULL;
+        elements += n->type == NODE_ELEMENT;
+    }
+    if (idx->dirty || elements == 0) return;
+    if (elements == 1 && root->type == NODE_ELEMENT) {
+        index_element(idx, root, KEY_REMOVE);
+        return;
+    }
+    if (++idx->stamp == 0) {
+        map_clear_stamps(&idx->ids);
+        map_clear_stamps(&idx->classes);
+        map_clear_stamps(&idx->tags);
+        idx->stamp = 1;
+    }
+    for (node *n = root; n; n = node_preorder_next(n, root))
+        if (n->type == NODE_ELEMENT)
+            index_element(idx, n, KEY_COMPACT);
+}
+
+/* Unmark every node of doc (doc keeps its own pointer) */
+static void index_disown(node *doc) {
+    for (node *n = doc->first_child; n; n = node_preorder_next(n, doc))
+        n->index = NULL;
+}
+
+static void index_clear(node_index *idx) {
+    map_free(&idx->ids);
+    map_free(&idx->classes);
+    map_free(&idx->tags);
+}
+
+/* The up-to-date index of doc, building or rebuilding it as needed. */
+static node_index *index_get(node *doc) {
+    if (!doc || doc->type != NODE_DOCUMENT) return NULL;
+    node_index *idx = doc->index;
+    if (idx && !idx->dirty) return idx;
+
+    if (!idx) {
+        idx = (node_index *)calloc(1, sizeof(node_index));
+        if (!idx) return NULL;
+        doc->index = idx;
+    }
+    index_clear(idx);
+    idx->dirty = 0;
+    if (!index_subtree_add(idx, doc)) {
+        node_index_invalidate(doc);
+        return NULL;
+    }
+    return idx;
+}
+
+static void index_mark_dirty(node_index *idx) {
+    idx->dirty = 1;
+    idx->tail_depth = 0;
+}
+
+/* Position of n on idx's tail path. When n is at the end of the document
+ * but not on the path, the path is rebuilt from n upwards. Returns 0 when
+ * n is not at the end (or on allocation failure). */
+static int tail_find(node_index *idx, node *n, size_t *pos) {
+    for (size_t i = idx->tail_depth; i-- > 0;) {
+        if (idx->tail[i] == n) {
+            *pos = i;
+            return 1;
+        }
+    }
+    size_t depth = 0;
+    for (const node *p = n; p; p = p->parent, depth++)
+        if (p->next_sibling) return 0;
+    if (depth + 1 > idx->tail_cap) {
+        size_t ncap = idx->tail_cap ? idx->tail_cap : 16;
+        while (ncap < depth + 1) ncap *= 2;
+        node **tail = (node **)realloc(idx->tail, ncap * sizeof(node *));
+        if (!tail) return 0;
+        idx->tail = tail;
+        idx->tail_cap = ncap;
+    }
+    idx->tail_depth = depth;
+    for (node *p = n; p; p = p->parent)
+        idx->tail[--depth] = p;
+    *pos = idx->tail_depth - 1;
+    return 1;
+}
+
+/* ============================================================================
+ * Mutation hooks
+ * ============================================================================ */
+
+void node_index_subtree_added(node *child, int at_end) {
+    if (!child || !child->parent || !child->parent->index) return;
+    node_index *idx = child->parent->index;
+    size_t pos;
+    /* Only appends at the very end of the document keep every list in
+     * tree order; anything else is resolved by one rebuild on lookup. */
+    if (!idx->dirty && at_end && tail_find(idx, child->parent, &pos) &&
+        index_subtree_add(idx, child)) {
+        idx->tail_depth = pos + 1;
+        if (idx->tail_depth < idx->tail_cap)
+            idx->tail[idx->tail_depth++] = child;
+        return;
+    }
+    index_mark_dirty(idx);
+    index_subtree_add(idx, child);
+}
+
+void node_index_subtree_removed(node *parent, node *child) {
+    if (!parent || !child || !parent->index) return;
+    node_index *idx = parent->index;
+    for (size_t i = idx->tail_depth; i-- > 1;) {
+        if (idx->tail[i] == child) {
+            idx->tail_depth = i;
+            break;
+        }
+    }
+    index_subtree_remove(idx, child);
+}
+
+void node_index_element_changed(const node *n) {
+    if (n && n->index) index_mark_dirty(n->index);
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================ */
+
+node *node_get_element_by_id(node *doc, const char *id) {
+    if (!id) return NULL;
+    node_index *idx = index_get(doc);
+    if (!idx) return NULL;
+    const index_bucket *b = map_get(&idx->ids, id);
+    return b ? b->items[0] : NULL;
+}
+
+int node_index_build(node *doc) {
+    return index_get(doc) != NULL;
+}
+
+static node *const *lookup_list(node *doc, char kind, const char *key,
+                               size_t *count) {
+    if (count) *count = 0;
+    if (!key || !count) return NULL;
+    node_index *idx = index_get(doc);
+    if (!idx) return NULL;
+    const index_bucket *b = map_get(kind == 'c' ? &idx->classes : kind == 't' ? &idx->tags : &idx->ids, key);
+    if (!b) return NULL;
+    *count = b->count;
+    return b->items;
+}
+
+node *const *node_get_elements_with_id(node *doc, const char *id, size_t *count) {
+    return lookup_list(doc, 'i', id, count);
+}
+
+node *const *node_get_elements_by_class(node *doc, const char *class_name,
+                                        size_t *count) {
+    return lookup_list(doc, 'c', class_name, count);
+}
+
+node *const *node_get_elements_by_tag_name(node *doc, const char *name,
+                                           size_t *count) {
+    return lookup_list(doc, 't', name, count);
+}
+
+void node_index_invalidate(node *doc) {
+    if (!doc || doc->type != NODE_DOCUMENT || !doc->index) return;
+    index_disown(doc);
+    node_index_free(doc->index);
+    doc->index = NULL;
+}
+
+void node_index_free(node_index *idx) {
+    if (!idx) return;
+    index_clear(idx);
+    free(idx->tail);
+    free(idx);
+}
@@ -0,0 +1,670 @@
+#define _POSIX_C_SOURCE 200809L
+#include "packed_tree.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ============================================================================
+ * Atom table
+ * ============================================================================ */
+
+static uint32_t atom_hash_str(const char *s) {
+    uint32_t h = 2166136261u;                   /* FNV-1a */
+    for (const unsigned char *p = (const unsigned char *)s; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t *atom_slot(const packed_tree *t, const char *name) {
+    uint32_t mask = t->atom_hash_cap - 1;
+    uint32_t i = atom_hash_str(name) & mask;
+    while (t->atom_hash[i] != PACKED_NONE &&
+           strcmp(t->atom_buf + t->atom_off[t->atom_hash[i]], name) != 0)
+        i = (i + 1) & mask;
+    return &t->atom_hash[i];
+}
+
+static int atom_table_grow(packed_tree *t) {
+    uint32_t ncap = t->atom_hash_cap ? t->atom_hash_cap * 2 : 64;
+    uint32_t *table = (uint32_t *)malloc(ncap * sizeof(uint32_t));
+    if (!table) return 0;
+    memset(table, 0xff, ncap * sizeof(uint32_t));  /* PACKED_NONE */
+    uint32_t *atom_off = (uint32_t *)realloc(t->atom_off, (ncap / 2) * sizeof(uint32_t));
+    if (!atom_off) { free(table); return 0; }
+    t->atom_off = atom_off;
+    free(t->atom_hash);
+    t->atom_hash = table;
+    t->atom_hash_cap = ncap;
+    for (uint32_t a = 0; a < t->atom_count; a++)
+        *atom_slot(t, t->atom_buf + t->atom_off[a]) = a;
+    return 1;
+}
+
+/* Atom id for name, adding it if new. Returns PACKED_NONE for NULL names;
+ * sets *ok = 0 on allocation failure. */
+static uint32_t atom_intern(packed_tree *t, const char *name, size_t *buf_cap, int *ok) {
+    if (!name) return PACKED_NONE;
+    if (t->atom_count + 1 > t->atom_hash_cap / 2 && !atom_table_grow(t)) {
+        *ok = 0;
+        return PACKED_NONE;
+    }
+    uint32_t *slot = atom_slot(t, name);
+    if (*slot != PACKED_NONE) return *slot;
+
+    size_t len = strlen(name) + 1;
+    if (t->atom_buf_len + len > *buf_cap) {
+        size_t ncap = *buf_cap ? *buf_cap * 2 : 256;
+        while (ncap < t->atom_buf_len + len) ncap *= 2;
+        char *buf = (char *)realloc(t->atom_buf, ncap);
+        if (!buf) { *ok = 0; return PACKED_NONE; }
+        t->atom_buf = buf;
+        *buf_cap = ncap;
+    }
+    memcpy(t->atom_buf + t->atom_buf_len, name, len);
+    t->atom_off[t->atom_count] = (uint32_t)t->atom_buf_len;
+    t->atom_buf_len += len;
+    *slot = t->atom_count;
+    return t->atom_count++;
+}
+
+uint32_t packed_tree_atom(const packed_tree *t, const char *name) {
+    if (!t || !name || t->atom_hash_cap == 0) return PACKED_NONE;
+    return *atom_slot(t, name);
+}
+
+/* ============================================================================
+ * Build
+ * ============================================================================ */
+
+static packed_span text_put(packed_tree *t, const char *s) {
+    packed_span span = { PACKED_NONE, 0 };
+    if (!s) return span;
+    size_t len = strlen(s);
+    memcpy(t->text + t->text_len, s, len + 1);
+    span.off = (uint32_t)t->text_len;
+    span.len = (uint32_t)len;
+    t->text_len += len + 1;
+    return span;
+}
+
+static int ptr_cmp(const void *a, const void *b) {
+    const node *x = *(const node *const *)a;
+    const node *y = *(const node *const *)b;
+    return (x > y) - (x < y);
+}
+
+packed_tree *packed_tree_build(const node *root) {
+    if (!root) return NULL;
+    packed_tree *t = (packed_tree *)calloc(1, sizeof(packed_tree));
+    if (!t) return NULL;
+
+    /* Pass 1: sizes, atoms, and the set of form owners to resolve */
+    size_t nodes = 0, attrs = 0, text = 0, owners = 0, atom_cap = 0;
+    int ok = 1;
+    for (const node *n = root; n && ok; n = node_preorder_next(n, root)) {
+        nodes++;
+        atom_intern(t, n->name, &atom_cap, &ok);
+        if (n->data) text += strlen(n->data) + 1;
+        for (size_t i = 0; i < n->attr_count; i++) {
+            atom_intern(t, n->attrs[i].name, &atom_cap, &ok);
+            if (n->attrs[i].value) text += strlen(n->attrs[i].value) + 1;
+        }
+        attrs += n->attr_count;
+        if (n->form_owner) owners++;
+    }
+    if (!ok || nodes >= PACKED_NONE || attrs >= PACKED_NONE || text >= PACKED_NONE) {
+        packed_tree_free(t);
+        return NULL;
+    }
+
+    t->count = (uint32_t)nodes;
+    t->type = (uint8_t *)malloc(nodes);
+    t->ns = (uint8_t *)malloc(nodes);
+    t->parent = (uint32_t *)malloc(nodes * sizeof(uint32_t));
+    t->next_sibling = (uint32_t *)malloc(nodes * sizeof(uint32_t));
+    t->subtree_end = (uint32_t *)malloc(nodes * sizeof(uint32_t));
+    t->name = (uint32_t *)malloc(nodes * sizeof(uint32_t));
+    t->data = (packed_span *)malloc(nodes * sizeof(packed_span));
+    t->attr_first = (uint32_t *)malloc((nodes + 1) * sizeof(uint32_t));
+    t->form_owner = (uint32_t *)malloc(nodes * sizeof(uint32_t));
+    t->attrs = (packed_attr *)malloc((attrs ? attrs : 1) * sizeof(packed_attr));
+    t->text = (char *)malloc(text ? text : 1);
+    const node **targets = (const node **)malloc((owners ? owners : 1) * sizeof(*targets));
+    uint32_t *target_ids = (uint32_t *)malloc((owners ? owners : 1) * sizeof(uint32_t));
+    if (!t->type || !t->ns || !t->parent || !t->next_sibling || !t->subtree_end ||
+        !t->name || !t->data || !t->attr_first || !t->form_owner || !t->attrs ||
+        !t->text || !targets || !target_ids) {
+        free(targets);
+        free(target_ids);
+        packed_tree_free(t);
+        return NULL;
+    }
+
+    size_t nowners = 0;
+    for (const node *n = root; n; n = node_preorder_next(n, root))
+        if (n->form_owner) targets[nowners++] = n->form_owner;
+    qsort(targets, nowners, sizeof(*targets), ptr_cmp);
+    for (size_t i = 0; i < nowners; i++) target_ids[i] = PACKED_NONE;
+
+    if (root->encoding) t->encoding = strdup(root->encoding);
+    t->enc_confidence = root->enc_confidence;
+
+    /* Pass 2: fill the arrays in document order */
+    const node *n = root;
+    uint32_t id = 0, next = 0, attr_pos = 0, parent = PACKED_NONE;
+    for (;;) {
+        id = next++;
+        t->type[id] = (uint8_t)n->type;
+        t->ns[id] = (uint8_t)n->ns;
+        t->parent[id] = parent;
+        t->next_sibling[id] = PACKED_NONE;
+        t->name[id] = packed_tree_atom(t, n->name);
+        t->data[id] = text_put(t, n->data);
+        t->attr_first[id] = attr_pos;
+        for (size_t i = 0; i < n->attr_count; i++, attr_pos++) {
+            t->attrs[attr_pos].name = packed_tree_atom(t, n->attrs[i].name);
+            t->attrs[attr_pos].value = text_put(t, n->attrs[i].value);
+        }
+        t->form_owner[id] = PACKED_NONE;
+        if (owners) {
+            const node **hit = (const node **)bsearch(&n, targets, owners,
+                                                      sizeof(*targets), ptr_cmp);
+            /* duplicates are adjacent; mark them all */
+            while (hit && hit > targets && hit[-1] == n) hit--;
+            while (hit && hit < targets + owners && *hit == n)
+                target_ids[hit++ - targets] = id;
+        }
+
+        if (n->first_child) {
+            n = n->first_child;
+            parent = id;
+            continue;
+        }
+        /* Leaf: close finished subtrees until a sibling is found */
+        for (;;) {
+            t->subtree_end[id] = next;
+            if (n == root) goto done;
+            if (n->next_sibling) {
+                t->next_sibling[id] = next;
+                n = n->next_sibling;
+                parent = t->parent[id];
+                break;
+            }
+            n = n->parent;
+            id = t->parent[id];
+        }
+    }
+done:
+    t->attr_first[t->count] = attr_pos;
+    t->attr_count = attr_pos;
+
+    /* form_owner: ids follow document order, so walk once more */
+    id = 0;
+    for (const node *m = root; m; m = node_preorder_next(m, root), id++) {
+        if (!m->form_owner) continue;
+        const node **hit = (const node **)bsearch(&m->form_owner, targets, owners,
+                                                  sizeof(*targets), ptr_cmp);
+        if (hit) t->form_owner[id] = target_ids[hit - targets];
+    }
+    free(targets);
+    free(target_ids);
+    return t;
+}
+
+void packed_tree_free(packed_tree *t) {
+    if (!t) return;
+    if (t->snapshot) {
+        /* The arrays live in the image */
+        if (t->mapped)
+            munmap((void *)t->snapshot, t->snapshot_len);
+        free(t);
+        return;
+    }
+    free(t->type);
+    free(t->ns);
+    free(t->parent);
+    free(t->next_sibling);
+    free(t->subtree_end);
+    free(t->name);
+    free(t->data);
+    free(t->attr_first);
+    free(t->form_owner);
+    free(t->attrs);
+    free(t->text);
+    free(t->atom_off);
+    free(t->atom_buf);
+    free(t->atom_hash);
+    free(t->encoding);
+    free(t);
+}
+
+size_t packed_tree_memory(const packed_tree *t) {
+    if (!t) return 0;
+    if (t->snapshot) return sizeof(packed_tree) + t->snapshot_len;
+    size_t per_node = 2 * sizeof(uint8_t) + 6 * sizeof(uint32_t) + sizeof(packed_span);
+    return sizeof(packed_tree) +
+           (size_t)t->count * per_node + sizeof(uint32_t) +
+           (size_t)t->attr_count * sizeof(packed_attr) +
+           t->text_len +
+           (size_t)t->atom_count * sizeof(uint32_t) + t->atom_buf_len +
+           (size_t)t->atom_hash_cap * sizeof(uint32_t) +
+           (t->encoding ? strlen(t->encoding) + 1 : 0);
+}
+
+/* ============================================================================
+ * ASCII dump
+ * ============================================================================ */
+
+static const char *packed_type_name(uint8_t type) {
+    switch ((node_type)type) {
+        case NODE_DOCUMENT: return "DOCUMENT";
+        case NODE_DOCTYPE: return "DOCTYPE";
+        case NODE_ELEMENT: return "ELEMENT";
+        case NODE_TEXT: return "TEXT";
+        case NODE_COMMENT: return "COMMENT";
+        default: return "UNKNOWN";
+    }
+}
+
+static void print_escaped(const char *s) {
+    if (!s) return;
+    for (const unsigned char *p = (const unsigned char *)s; *p; ++p) {
+        if (*p == '\n') { printf("\\n"); continue; }
+        if (*p == '\r') { printf("\\r"); continue; }
+        printf("%c", *p);
+    }
+}
+
+static void dump_packed_node(const packed_tree *t, uint32_t id,
+                             const char *prefix) {
+    const char *branch = t->next_sibling[id] == PACKED_NONE ? "\\-- " : "|-- ";
+
+    printf("%s%s%s", prefix, branch, packed_type_name(t->type[id]));
+    if (t->ns[id] == NS_SVG) printf("(svg)");
+    else if (t->ns[id] == NS_MATHML) printf("(math)");
+    if (t->name[id] != PACKED_NONE) printf(" name=\"%s\"", packed_atom_name(t, t->name[id]));
+    if (t->data[id].off != PACKED_NONE) {
+        printf(" data=\"");
+        print_escaped(packed_span_str(t, t->data[id]));
+        printf("\"");
+    }
+    uint32_t a0 = t->attr_first[id], a1 = t->attr_first[id + 1];
+    if (a1 > a0) {
+        printf(" [");
+        for (uint32_t a = a0; a < a1; ++a) {
+            const char *name = packed_atom_name(t, t->attrs[a].name);
+            const char *value = packed_span_str(t, t->attrs[a].value);
+            if (a > a0) printf(" ");
+            printf("%s=\"%s\"", name ? name : "", value ? value : "");
+        }
+        printf("]");
+    }
+    uint32_t form = t->form_owner[id];
+    if (form != PACKED_NONE) {
+        uint32_t id_atom = packed_tree_atom(t, "id");
+        for (uint32_t a = t->attr_first[form]; a < t->attr_first[form + 1]; ++a) {
+            if (id_atom != PACKED_NONE && t->attrs[a].name == id_atom) {
+                const char *value = packed_span_str(t, t->attrs[a].value);
+                printf(" form=\"%s\"", value ? value : "");
+                break;
+            }
+        }
+    }
+    printf("\n");
+}
+
+/* Ids are in document order, so the dump is one scan; open[] holds the
+ * ancestors with children, each adding a 4-character prefix column. */
+void packed_tree_dump_ascii(const packed_tree *t, const char *title) {
+    if (!t || t->count == 0) return;
+    if (title && title[0]) {
+        printf("%s\n", title);
+    }
+    printf("%s", packed_type_name(t->type[0]));
+    if (t->encoding)
+        printf(" encoding=\"%s\"", t->encoding);
+    printf("\n");
+
+    size_t depth = 0, cap = 16;
+    uint32_t *open = (uint32_t *)malloc(cap * sizeof(uint32_t));
+    char *prefix = (char *)malloc(cap * 4 + 1);
+    if (!open || !prefix) {
+        free(open);
+        free(prefix);
+        return;
+    }
+    prefix[0] = '\0';
+    for (uint32_t id = 1; id < t->count; id++) {
+        while (depth > 0 && t->subtree_end[open[depth - 1]] <= id)
+            prefix[--depth * 4] = '\0';
+        dump_packed_node(t, id, prefix);
+        if (packed_first_child(t, id) == PACKED_NONE) continue;
+        if (depth == cap) {
+            uint32_t *o = (uint32_t *)realloc(open, cap * 2 * sizeof(uint32_t));
+            char *p = o ? (char *)realloc(prefix, cap * 8 + 1) : NULL;
+            if (o) open = o;
+            if (!p) break;
+            prefix = p;
+            cap *= 2;
+        }
+        memcpy(prefix + depth * 4,
+               t->next_sibling[id] != PACKED_NONE ? "|   " : "    ", 5);
+        open[depth++] = id;
+    }
+    free(open);
+    free(prefix);
+}
+
+/* ============================================================================
+ * Thaw
+ * ============================================================================ */
+
+static int thaw_attrs(node *n, const packed_tree *t, uint32_t id) {
+    uint32_t a0 = t->attr_first[id], a1 = t->attr_first[id + 1];
+    if (a1 == a0) return 1;
+    n->attrs = (node_attr *)node_mem_alloc(n, (a1 - a0) * sizeof(node_attr));
+    if (!n->attrs) return 0;
+    for (uint32_t a = a0; a < a1; a++) {
+        const char *name = packed_atom_name(t, t->attrs[a].name);
+        const char *value = packed_span_str(t, t->attrs[a].value);
+        node_attr *dst = &n->attrs[n->attr_count++];
+        dst->name = node_mem_strdup(n, name);
+        dst->value = node_mem_strdup(n, value);
+        if ((name && !dst->name) || (value && !dst->value)) return 0;
+    }
+    return 1;
+}
+
+node *packed_tree_thaw(const packed_tree *t) {
+    if (!t || t->count == 0) return NULL;
+    node **nodes = (node **)malloc((size_t)t->count * sizeof(node *));
+    if (!nodes) return NULL;
+
+    /* Ids are in document order: appending each node to its parent
+     * rebuilds the child lists in order. */
+    node *root = NULL;
+    int ok = 1;
+    for (uint32_t id = 0; id < t->count && ok; id++) {
+        node *n = node_create_ns((node_type)t->type[id],
+                                 packed_atom_name(t, t->name[id]),
+                                 packed_span_str(t, t->data[id]),
+                                 (node_namespace)t->ns[id]);
+        if (!n) { ok = 0; break; }
+        nodes[id] = n;
+        if (id == 0) root = n;
+        else node_append_child(nodes[t->parent[id]], n);
+        ok = thaw_attrs(n, t, id);
+    }
+    if (ok) {
+        for (uint32_t id = 0; id < t->count; id++)
+            if (t->form_owner[id] != PACKED_NONE)
+                nodes[id]->form_owner = nodes[t->form_owner[id]];
+        root->enc_confidence = t->enc_confidence;
+        if (t->encoding && !(root->encoding = node_mem_strdup(root, t->encoding)))
+            ok = 0;
+    }
+    free(nodes);
+    if (!ok) {
+        node_free(root);
+        return NULL;
+    }
+    return root;
+}
+
+/* ============================================================================
+ * Snapshots
+ * ============================================================================ */
+
+#define SNAPSHOT_MAGIC      "HTMLPKT"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+enum {
+    SEC_TYPE, SEC_NS, SEC_PARENT, SEC_NEXT_SIBLING, SEC_SUBTREE_END,
+    SEC_NAME, SEC_DATA, SEC_ATTR_FIRST, SEC_FORM_OWNER, SEC_ATTRS,
+    SEC_TEXT, SEC_ATOM_OFF, SEC_ATOM_BUF, SEC_ATOM_HASH, SEC_ENCODING,
+    SEC_COUNT
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        /* SNAPSHOT_BYTE_ORDER as written */
+    uint32_t count;
+    uint32_t attr_count;
+    uint32_t atom_count;
+    uint32_t atom_hash_cap;
+    uint32_t enc_confidence;
+    uint32_t has_encoding;
+    uint64_t text_len;
+    uint64_t atom_buf_len;
+    uint64_t section[SEC_COUNT][2];     /* offset, length in bytes */
+} snapshot_header;
+
+static uint64_t align8(uint64_t n) {
+    return (n + 7) & ~(uint64_t)7;
+}
+
+/* Byte length of every section implied by the header's counts. */
+static void snapshot_lengths(const snapshot_header *h, uint64_t len[SEC_COUNT],
+                             uint64_t encoding_len) {
+    uint64_t count = h->count;
+    len[SEC_TYPE] = count;
+    len[SEC_NS] = count;
+    len[SEC_PARENT] = count * sizeof(uint32_t);
+    len[SEC_NEXT_SIBLING] = count * sizeof(uint32_t);
+    len[SEC_SUBTREE_END] = count * sizeof(uint32_t);
+    len[SEC_NAME] = count * sizeof(uint32_t);
+    len[SEC_DATA] = count * sizeof(packed_span);
+    len[SEC_ATTR_FIRST] = (count + 1) * sizeof(uint32_t);
+    len[SEC_FORM_OWNER] = count * sizeof(uint32_t);
+    len[SEC_ATTRS] = (uint64_t)h->attr_count * sizeof(packed_attr);
+    len[SEC_TEXT] = h->text_len;
+    len[SEC_ATOM_OFF] = (uint64_t)h->atom_count * sizeof(uint32_t);
+    len[SEC_ATOM_BUF] = h->atom_buf_len;
+    len[SEC_ATOM_HASH] = (uint64_t)h->atom_hash_cap * sizeof(uint32_t);
+    len[SEC_ENCODING] = encoding_len;
+}
+
+int packed_tree_write(const packed_tree *t, FILE *out) {
+    if (!t || !out || t->count == 0) return 0;
+    snapshot_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.version = SNAPSHOT_VERSION;
+    h.byte_order = SNAPSHOT_BYTE_ORDER;
+    h.count = t->count;
+    h.attr_count = t->attr_count;
+    h.atom_count = t->atom_count;
+    h.atom_hash_cap = t->atom_hash_cap;
+    h.enc_confidence = (uint32_t)t->enc_confidence;
+    h.has_encoding = t->encoding != NULL;
+    h.text_len = t->text_len;
+    h.atom_buf_len = t->atom_buf_len;
+
+    const void *data[SEC_COUNT] = {
+        t->type, t->ns, t->parent, t->next_sibling, t->subtree_end,
+        t->name, t->data, t->attr_first, t->form_owner, t->attrs,
+        t->text, t->atom_off, t->atom_buf, t->atom_hash, t->encoding
+    };
+    uint64_t len[SEC_COUNT];
+    snapshot_lengths(&h, len, t->encoding ? strlen(t->encoding) + 1 : 0);
+    uint64_t off = sizeof(h);
+    for (int s = 0; s < SEC_COUNT; s++) {
+        h.section[s][0] = off;
+        h.section[s][1] = len[s];
+        off = align8(off + len[s]);
+    }
+
+    static const char pad[8];
+    if (fwrite(&h, sizeof(h), 1, out) != 1) return 0;
+    uint64_t pos = sizeof(h);
+    for (int s = 0; s < SEC_COUNT; s++) {
+        if (len[s] && fwrite(data[s], 1, (size_t)len[s], out) != len[s])
+            return 0;
+        pos += len[s];
+        if (align8(pos) > pos && fwrite(pad, 1, align8(pos) - pos, out) != align8(pos) - pos)
+            return 0;
+        pos = align8(pos);
+    }
+    return 1;
+}
+
+int packed_tree_save(const node *root, const char *path) {
+    packed_tree *t = packed_tree_build(root);
+    if (!t) return 0;
+    FILE *out = fopen(path, "wb");
+    int ok = out && packed_tree_write(t, out);
+    if (out && fclose(out) != 0) ok = 0;
+    packed_tree_free(t);
+    return ok;
+}
+
+static int span_ok(const packed_tree *t, packed_span s) {
+    if (s.off == PACKED_NONE) return 1;
+    uint64_t end = (uint64_t)s.off + s.len;
+    return end < t->text_len && t->text[end] == '\0';
+}
+
+static int atom_ok(const packed_tree *t, uint32_t atom) {
+    return atom == PACKED_NONE || atom < t->atom_count;
+}
+
+/* Everything the accessors, dump and thaw index with must be in range. */
+static int snapshot_check(const packed_tree *t) {
+    uint32_t count = t->count;
+    if (t->parent[0] != PACKED_NONE || t->subtree_end[0] != count ||
+        t->next_sibling[0] != PACKED_NONE || t->attr_first[0] != 0 ||
+        t->attr_first[count] != t->attr_count)
+        return 0;
+    if (t->text_len && t->text[t->text_len - 1] != '\0') return 0;
+    if (t->atom_buf_len && t->atom_buf[t->atom_buf_len - 1] != '\0') return 0;
+
+    for (uint32_t id = 0; id < count; id++) {
+        uint32_t end = t->subtree_end[id];
+        if (t->type[id] < NODE_DOCUMENT || t->type[id] > NODE_COMMENT ||
+            t->ns[id] > NS_MATHML)
+            return 0;
+        if (end <= id || end > count) return 0;
+        if (id > 0) {
+            uint32_t p = t->parent[id];
+            if (p >= id || end > t->subtree_end[p]) return 0;
+            /* the last child closes its parent's range */
+            if (t->next_sibling[id] == PACKED_NONE && end != t->subtree_end[p])
+                return 0;
+        }
+        if (end > id + 1 && t->parent[id + 1] != id) return 0;
+        uint32_t sib = t->next_sibling[id];
+        if (sib != PACKED_NONE && (sib != end || sib >= count ||
+                                   t->parent[sib] != t->parent[id]))
+            return 0;
+        if (t->attr_first[id] > t->attr_first[id + 1]) return 0;
+        if (!atom_ok(t, t->name[id]) || !span_ok(t, t->data[id])) return 0;
+        if (t->form_owner[id] != PACKED_NONE && t->form_owner[id] >= count)
+            return 0;
+    }
+    for (uint32_t a = 0; a < t->attr_count; a++)
+        if (!atom_ok(t, t->attrs[a].name) || !span_ok(t, t->attrs[a].value))
+            return 0;
+    for (uint32_t a = 0; a < t->atom_count; a++)
+        if (t->atom_off[a] >= t->atom_buf_len) return 0;
+
+    /* Lookups probe until an empty slot, so one must exist */
+    uint32_t cap = t->atom_hash_cap, used = 0;
+    if (cap & (cap - 1)) return 0;
+    for (uint32_t i = 0; i < cap; i++) {
+        if (t->atom_hash[i] == PACKED_NONE) continue;
+        if (t->atom_hash[i] >= t->atom_count) return 0;
+        used++;
+    }
+    return cap == 0 || (used == t->atom_count && used < cap);
+}
+
+packed_tree *packed_tree_view(const void *image, size_t len) {
+    const snapshot_header *h = (const snapshot_header *)image;
+    if (!image || len < sizeof(*h) || ((uintptr_t)image & 7) != 0) return NULL;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        h->version != SNAPSHOT_VERSION || h->byte_order != SNAPSHOT_BYTE_ORDER)
+        return NULL;
+    if (h->count == 0 || h->count == PACKED_NONE ||
+        h->enc_confidence > ENC_CONFIDENCE_IRRELEVANT ||
+        h->text_len >= PACKED_NONE || h->atom_buf_len >= PACKED_NONE)
+        return NULL;
+
+    uint64_t want[SEC_COUNT];
+    snapshot_lengths(h, want, h->section[SEC_ENCODING][1]);
+    if (h->has_encoding ? want[SEC_ENCODING] == 0 : want[SEC_ENCODING] != 0)
+        return NULL;
+    const char *base = (const char *)image;
+    for (int s = 0; s < SEC_COUNT; s++) {
+        uint64_t off = h->section[s][0];
+        if (h->section[s][1] != want[s] || (off & 7) != 0 ||
+            off < sizeof(*h) || off > len || want[s] > len - off)
+            return NULL;
+    }
+    const char *encoding = base + h->section[SEC_ENCODING][0];
+    if (h->has_encoding && encoding[want[SEC_ENCODING] - 1] != '\0')
+        return NULL;
+
+    packed_tree *t = (packed_tree *)calloc(1, sizeof(packed_tree));
+    if (!t) return NULL;
+#define SECTION(s, type) ((type)(base + h->section[s][0]))
+    t->count = h->count;
+    t->type = SECTION(SEC_TYPE, uint8_t *);
+    t->ns = SECTION(SEC_NS, uint8_t *);
+    t->parent = SECTION(SEC_PARENT, uint32_t *);
+    t->next_sibling = SECTION(SEC_NEXT_SIBLING, uint32_t *);
+    t->subtree_end = SECTION(SEC_SUBTREE_END, uint32_t *);
+    t->name = SECTION(SEC_NAME, uint32_t *);
+    t->data = SECTION(SEC_DATA, packed_span *);
+    t->attr_first = SECTION(SEC_ATTR_FIRST, uint32_t *);
+    t->form_owner = SECTION(SEC_FORM_OWNER, uint32_t *);
+    t->attrs = SECTION(SEC_ATTRS, packed_attr *);
+    t->attr_count = h->attr_count;
+    t->text = SECTION(SEC_TEXT, char *);
+    t->text_len = (size_t)h->text_len;
+    t->atom_count = h->atom_count;
+    t->atom_off = SECTION(SEC_ATOM_OFF, uint32_t *);
+    t->atom_buf = SECTION(SEC_ATOM_BUF, char *);
+    t->atom_buf_len = (size_t)h->atom_buf_len;
+    t->atom_hash = SECTION(SEC_ATOM_HASH, uint32_t *);
+    t->atom_hash_cap = h->atom_hash_cap;
+    t->encoding = h->has_encoding ? SECTION(SEC_ENCODING, char *) : NULL;
+    t->enc_confidence = (encoding_confidence)h->enc_confidence;
+#undef SECTION
+    t->snapshot = image;
+    t->snapshot_len = len;
+    if (!snapshot_check(t)) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+packed_tree *packed_tree_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || sb.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t len = (size_t)sb.st_size;
+    void *image = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return NULL;
+    packed_tree *t = packed_tree_view(image, len);
+    if (!t) {
+        munmap(image, len);
+        return NULL;
+    }
+    t->mapped = 1;
+    return t;
+}
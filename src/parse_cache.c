@@ -0,0 +1,423 @@
+#define _POSIX_C_SOURCE 200809L
+#include "parse_cache.h"
+#include "packed_tree.h"
+#include "node_index.h"
+#include "tokenizer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================================
+ * Key hashing
+ * ============================================================================ */
+
+#define HASH_P1 0x9e3779b185ebca87ULL
+#define HASH_P2 0xc2b2ae3d27d4eb4fULL
+#define HASH_P3 0x165667b19e3779f9ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Eight bytes per step (xxh64-style rounds); the input is the bulk of
+ * the key, so this is the part that has to be fast. */
+static uint64_t hash_bytes(const char *p, size_t len, uint64_t seed) {
+    uint64_t h = seed ^ (len * HASH_P1);
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h ^= rotl64(w * HASH_P2, 31) * HASH_P1;
+        h = rotl64(h, 27) * HASH_P1 + HASH_P3;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, len);
+    h ^= rotl64(w * HASH_P2, 31) * HASH_P1;
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Input plus everything else the result depends on: for a document the
+ * raw bytes, the charset hint and the sniff flags; for a fragment its
+ * input, encoding label, confidence and context ("" when none, to keep it
+ * apart from a document). */
+static uint64_t key_hash(const char *input, size_t len, const char *encoding,
+                         encoding_confidence confidence, int sniff_flags,
+                         const char *context) {
+    uint64_t h = hash_bytes(input, len,
+                            (uint64_t)confidence ^ ((uint64_t)sniff_flags << 8));
+    if (encoding) h = hash_bytes(encoding, strlen(encoding), h + 1);
+    if (context) h = hash_bytes(context, strlen(context), h + 2);
+    return h;
+}
+
+/* ============================================================================
+ * Entries: hash chains plus an LRU list (head = most recently used)
+ * ============================================================================ */
+
+typedef struct cache_entry {
+    uint64_t hash;
+    char *input;                /* raw bytes for documents */
+    size_t input_len;
+    char *encoding;             /* charset hint or fragment encoding; NULL
+                                 * when built without one */
+    char *context;              /* NULL for documents */
+    encoding_confidence confidence;
+    int sniff_flags;
+    size_t decoded_len;         /* tokenizer input length, for consumed */
+    packed_tree *tree;
+    size_t bytes;               /* charged against the budget */
+    int refs;                   /* thaws in progress */
+    int evicted;                /* unlinked; freed by the last thaw */
+    struct cache_entry *chain;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry;
+
+struct parse_cache {
+    pthread_mutex_t lock;
+    cache_entry **buckets;
+    size_t bucket_cap;          /* power of two */
+    cache_entry *lru_head;
+    cache_entry *lru_tail;
+    size_t max_entries;
+    size_t max_bytes;
+    parse_cache_stats stats;
+};
+
+static void entry_free(cache_entry *e) {
+    packed_tree_free(e->tree);
+    free(e->input);
+    free(e->encoding);
+    free(e->context);
+    free(e);
+}
+
+static int str_eq(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/* What an entry is looked up by; see key_hash(). */
+typedef struct {
+    uint64_t hash;
+    const char *input;
+    size_t len;
+    const char *encoding;
+    encoding_confidence confidence;
+    int sniff_flags;
+    const char *context;
+} cache_key;
+
+static cache_entry *entry_find(const parse_cache *c, const cache_key *k) {
+    for (cache_entry *e = c->buckets[k->hash & (c->bucket_cap - 1)]; e; e = e->chain) {
+        if (e->hash == k->hash && e->input_len == k->len &&
+            e->confidence == k->confidence &&
+            e->sniff_flags == k->sniff_flags &&
+            str_eq(e->encoding, k->encoding) && str_eq(e->context, k->context) &&
+            memcmp(e->input, k->input, k->len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void lru_unlink(parse_cache *c, cache_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else c->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(parse_cache *c, cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head) c->lru_head->lru_prev = e;
+    c->lru_head = e;
+    if (!c->lru_tail) c->lru_tail = e;
+}
+
+/* Take e out of the table; it is freed now or when its last thaw ends. */
+static void entry_remove(parse_cache *c, cache_entry *e) {
+    cache_entry **pp = &c->buckets[e->hash & (c->bucket_cap - 1)];
+    while (*pp != e) pp = &(*pp)->chain;
+    *pp = e->chain;
+    lru_unlink(c, e);
+    c->stats.entries--;
+    c->stats.bytes -= e->bytes;
+    if (e->refs) e->evicted = 1;
+    else entry_free(e);
+}
+
+static int over_budget(const parse_cache *c) {
+    return (c->max_entries && c->stats.entries > c->max_entries) ||
+           (c->max_bytes && c->stats.bytes > c->max_bytes);
+}
+
+static void buckets_grow(parse_cache *c) {
+    size_t ncap = c->bucket_cap * 2;
+    cache_entry **nb = (cache_entry **)calloc(ncap, sizeof(cache_entry *));
+    if (!nb) return;            /* longer chains, still correct */
+    for (size_t i = 0; i < c->bucket_cap; i++) {
+        cache_entry *e = c->buckets[i];
+        while (e) {
+            cache_entry *next = e->chain;
+            e->chain = nb[e->hash & (ncap - 1)];
+            nb[e->hash & (ncap - 1)] = e;
+            e = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = nb;
+    c->bucket_cap = ncap;
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================ */
+
+parse_cache *parse_cache_create(size_t max_entries, size_t max_bytes) {
+    parse_cache *c = (parse_cache *)calloc(1, sizeof(parse_cache));
+    if (!c) return NULL;
+    c->bucket_cap = 64;
+    c->buckets = (cache_entry **)calloc(c->bucket_cap, sizeof(cache_entry *));
+    if (!c->buckets || pthread_mutex_init(&c->lock, NULL) != 0) {
+        free(c->buckets);
+        free(c);
+        return NULL;
+    }
+    c->max_entries = max_entries;
+    c->max_bytes = max_bytes;
+    return c;
+}
+
+void parse_cache_clear(parse_cache *c) {
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    while (c->lru_head)
+        entry_remove(c, c->lru_head);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void parse_cache_free(parse_cache *c) {
+    if (!c) return;
+    parse_cache_clear(c);
+    pthread_mutex_destroy(&c->lock);
+    free(c->buckets);
+    free(c);
+}
+
+void parse_cache_get_stats(parse_cache *c, parse_cache_stats *out) {
+    if (!c || !out) return;
+    pthread_mutex_lock(&c->lock);
+    *out = c->stats;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* On a hit, pin the entry and thaw a copy outside the lock; the thaw is
+ * counted in the thread's parse_stats. NULL on a miss, or if the thaw runs
+ * out of memory (the caller then parses). */
+static node *cache_lookup(parse_cache *c, const cache_key *k,
+                          size_t *decoded_len) {
+    pthread_mutex_lock(&c->lock);
+    cache_entry *e = entry_find(c, k);
+    if (!e) {
+        c->stats.misses++;
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    c->stats.hits++;
+    lru_unlink(c, e);
+    lru_push_front(c, e);
+    e->refs++;
+    if (decoded_len) *decoded_len = e->decoded_len;
+    pthread_mutex_unlock(&c->lock);
+
+    uint64_t start_ns = PARSE_STATS_ON ? parse_stats_now_ns() : 0;
+    node *doc = packed_tree_thaw(e->tree);
+    if (PARSE_STATS_ON) {
+        PARSE_STAT_ADD(cache_hits, 1);
+        PARSE_STAT_ADD(build_ns, parse_stats_now_ns() - start_ns);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (--e->refs == 0 && e->evicted)
+        entry_free(e);
+    pthread_mutex_unlock(&c->lock);
+    return doc;
+}
+
+/* Store a packed copy of doc unless it is over budget on its own or a
+ * concurrent miss stored the same key first. */
+static void cache_insert(parse_cache *c, const cache_key *k,
+                         size_t decoded_len, const node *doc) {
+    cache_entry *e = (cache_entry *)calloc(1, sizeof(cache_entry));
+    if (!e) return;
+    e->hash = k->hash;
+    e->input_len = k->len;
+    e->confidence = k->confidence;
+    e->sniff_flags = k->sniff_flags;
+    e->decoded_len = decoded_len;
+    e->input = (char *)malloc(k->len + 1);
+    e->encoding = k->encoding ? strdup(k->encoding) : NULL;
+    e->context = k->context ? strdup(k->context) : NULL;
+    e->tree = packed_tree_build(doc);
+    if (!e->input || (k->encoding && !e->encoding) ||
+        (k->context && !e->context) || !e->tree) {
+        entry_free(e);
+        return;
+    }
+    memcpy(e->input, k->input, k->len);
+    e->input[k->len] = '\0';
+    e->bytes = sizeof(cache_entry) + k->len + 1 + packed_tree_memory(e->tree) +
+               (k->encoding ? strlen(k->encoding) + 1 : 0) +
+               (k->context ? strlen(k->context) + 1 : 0);
+    if (c->max_bytes && e->bytes > c->max_bytes) {
+        entry_free(e);
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (entry_find(c, k)) {
+        pthread_mutex_unlock(&c->lock);
+        entry_free(e);
+        return;
+    }
+    if (c->stats.entries >= c->bucket_cap)
+        buckets_grow(c);
+    cache_entry **bucket = &c->buckets[k->hash & (c->bucket_cap - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    lru_push_front(c, e);
+    c->stats.entries++;
+    c->stats.bytes += e->bytes;
+    while (over_budget(c)) {
+        entry_remove(c, c->lru_tail);
+        c->stats.evictions++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Options that change the tree (or what a build reports) beyond what the
+ * key covers. Parse errors go out while parsing, so any listener,
+ * HTMLPARSER_PARSE_ERRORS included, needs a real parse. */
+static int cache_bypass(const tree_build_options *opts, int sniff_flags) {
+    if (parse_errors_enabled()) return 1;
+    if (sniff_flags & ENC_SNIFF_SOURCE_MAP) return 1;
+    return opts && (opts->prune_elements || opts->drop_attributes ||
+                    opts->drop_comments || opts->stop_after_head ||
+                    opts->stop_when || opts->errors);
+}
+
+static void count_bypass(parse_cache *c) {
+    pthread_mutex_lock(&c->lock);
+    c->stats.bypassed++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static encoding_result decode(encoding_decoder *dec, const unsigned char *raw,
+                              size_t raw_len, const char *hint, int flags) {
+    return dec ? encoding_decoder_convert(dec, raw, raw_len, hint, flags)
+               : encoding_sniff_and_convert_ex(raw, raw_len, hint, flags);
+}
+
+/* Decode, normalize and build, decoding again with the label of a
+ * <meta> charset that abandons the first build (WHATWG §13.2.3.5). The
+ * source map, if requested, ends up on the document. */
+static node *decode_and_build(encoding_decoder *dec, const unsigned char *raw,
+                              size_t raw_len, const char *hint, int flags,
+                              const tree_build_options *opts,
+                              size_t *decoded_len) {
+    encoding_confidence confidence = ENC_CONFIDENCE_CERTAIN;
+    const char *change = NULL;
+    node *doc = NULL;
+    for (int pass = 0; pass < 2 && !doc; pass++) {
+        encoding_result enc = decode(dec, raw, raw_len, hint, flags);
+        if (!enc.data) return NULL;
+        char *input = tokenizer_replace_nulls(enc.data, enc.len);
+        encoding_source_map_normalize(enc.source_map, enc.data, enc.len);
+        if (!dec) free(enc.data);
+        if (!input) {
+            encoding_source_map_free(enc.source_map);
+            return NULL;
+        }
+        if (pass == 0) confidence = enc.confidence;
+        doc = build_tree_from_input_opts(input, enc.encoding, confidence,
+                                         pass == 0 ? &change : NULL, opts);
+        *decoded_len = strlen(input);
+        free(input);
+        if (doc) {
+            doc->source_map = enc.source_map;
+        } else {
+            encoding_source_map_free(enc.source_map);
+            if (!change) return NULL;
+            hint = change;
+            flags &= ENC_SNIFF_SOURCE_MAP;
+            confidence = ENC_CONFIDENCE_CERTAIN;
+        }
+    }
+    return doc;
+}
+
+node *parse_cache_build(parse_cache *c, encoding_decoder *dec,
+                        const unsigned char *raw, size_t raw_len,
+                        const char *hint, int sniff_flags,
+                        const tree_build_options *opts) {
+    size_t decoded_len = 0;
+    if (!raw) return NULL;
+    parse_stats *prev_stats = opts && opts->stats ? parse_stats_attach(opts->stats)
+                                                  : NULL;
+    node *doc = NULL;
+    if (!c || cache_bypass(opts, sniff_flags)) {
+        if (c) count_bypass(c);
+        doc = decode_and_build(dec, raw, raw_len, hint, sniff_flags, opts,
+                               &decoded_len);
+    } else {
+        cache_key k = { 0, (const char *)raw, raw_len, hint,
+                        ENC_CONFIDENCE_CERTAIN, sniff_flags, NULL };
+        k.hash = key_hash(k.input, k.len, hint, k.confidence, sniff_flags, NULL);
+        doc = cache_lookup(c, &k, &decoded_len);
+        if (doc) {
+            if (opts && opts->build_index) node_index_build(doc);
+            if (opts && opts->consumed) *opts->consumed = decoded_len;
+        } else {
+            doc = decode_and_build(dec, raw, raw_len, hint, sniff_flags, opts,
+                                   &decoded_len);
+            if (doc) cache_insert(c, &k, decoded_len, doc);
+        }
+    }
+    if (opts && opts->stats)
+        parse_stats_attach(prev_stats);
+    return doc;
+}
+
+node *parse_cache_build_fragment(parse_cache *c, const char *input,
+                                 const char *context_tag,
+                                 const char *encoding,
+                                 encoding_confidence confidence,
+                                 const char **change_encoding) {
+    if (change_encoding) *change_encoding = NULL;
+    if (!c || !input || parse_errors_enabled()) {
+        if (c && input) count_bypass(c);
+        return build_fragment_from_input(input, context_tag, encoding,
+                                         confidence, change_encoding);
+    }
+
+    cache_key k = { 0, input, strlen(input), encoding, confidence, 0,
+                    context_tag ? context_tag : "" };
+    k.hash = key_hash(k.input, k.len, encoding, confidence, 0, k.context);
+    node *doc = cache_lookup(c, &k, NULL);
+    if (doc) return doc;
+
+    const char *change = NULL;
+    doc = build_fragment_from_input(input, context_tag, encoding, confidence,
+                                    &change);
+    if (change_encoding) *change_encoding = change;
+    if (doc && !change)
+        cache_insert(c, &k, k.len, doc);
+    return doc;
+}
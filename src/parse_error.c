@@ -0,0 +1,172 @@
+#include "parse_error.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Thread_local parse_error_sink *parse_errors_current;
+
+/* Token the builder is processing, for parse_error_emit() */
+static _Thread_local parse_error noted;
+
+/* HTMLPARSER_PARSE_ERRORS, read once per process */
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+static int env_enabled;
+
+static void read_env(void) {
+    const char *e = getenv("HTMLPARSER_PARSE_ERRORS");
+    env_enabled = (e && e[0] == '1') ? 1 : 0;
+}
+
+static const char *const code_names[PARSE_ERR_COUNT] = {
+    [PARSE_ERR_NONE] = "none",
+    [PARSE_ERR_UNEXPECTED_NULL_CHARACTER] = "unexpected null character",
+    [PARSE_ERR_ABRUPT_CLOSING_OF_EMPTY_COMMENT] = "abrupt-closing-of-empty-comment",
+    [PARSE_ERR_EOF_IN_COMMENT] = "eof-in-comment",
+    [PARSE_ERR_NESTED_COMMENT] = "nested-comment",
+    [PARSE_ERR_INCORRECTLY_CLOSED_COMMENT] = "incorrectly-closed-comment",
+    [PARSE_ERR_BOGUS_MARKUP_DECLARATION] = "bogus markup declaration",
+    [PARSE_ERR_DOCTYPE_NAME_MISSING] = "doctype name missing",
+    [PARSE_ERR_DOCTYPE_PUBLIC_ID_MISSING] = "doctype public id missing",
+    [PARSE_ERR_DOCTYPE_PUBLIC_ID_UNTERMINATED] = "doctype public id missing closing quote",
+    [PARSE_ERR_DOCTYPE_SYSTEM_ID_MISSING] = "doctype system id missing",
+    [PARSE_ERR_DOCTYPE_SYSTEM_ID_UNTERMINATED] = "doctype system id missing closing quote",
+    [PARSE_ERR_TAG_NAME_MISSING] = "tag name missing",
+    [PARSE_ERR_INVALID_END_TAG] = "invalid end tag",
+    [PARSE_ERR_END_TAG_WITH_ATTRIBUTES] = "end tag has trailing garbage/attributes",
+    [PARSE_ERR_UNEXPECTED_SOLIDUS_IN_TAG] = "unexpected '/' in start tag",
+    [PARSE_ERR_ATTRIBUTE_NAME_MISSING] = "attribute name missing before '='",
+    [PARSE_ERR_UNEXPECTED_CHARACTER_IN_ATTRIBUTE_NAME] = "unexpected character in attribute name",
+    [PARSE_ERR_ATTRIBUTE_VALUE_MISSING] = "attribute value missing",
+    [PARSE_ERR_NULL_CHARACTER_REFERENCE] = "null-character-reference",
+    [PARSE_ERR_CHARACTER_REFERENCE_OUTSIDE_UNICODE_RANGE] = "character-reference-outside-unicode-range",
+    [PARSE_ERR_SURROGATE_CHARACTER_REFERENCE] = "surrogate-character-reference",
+    [PARSE_ERR_NONCHARACTER_CHARACTER_REFERENCE] = "noncharacter-character-reference",
+    [PARSE_ERR_CONTROL_CHARACTER_REFERENCE] = "control-character-reference",
+    [PARSE_ERR_MISSING_DOCTYPE] = "missing-doctype",
+    [PARSE_ERR_STRAY_DOCTYPE] = "stray-doctype",
+    [PARSE_ERR_EOF_BEFORE_DOCTYPE] = "eof-before-doctype",
+    [PARSE_ERR_STRAY_DOCTYPE_IN_HEAD_NOSCRIPT] = "stray-doctype-in-head-noscript",
+    [PARSE_ERR_CHAR_IN_HEAD_NOSCRIPT] = "char-in-head-noscript",
+    [PARSE_ERR_UNEXPECTED_START_TAG_IN_HEAD_NOSCRIPT] = "unexpected-start-tag-in-head-noscript",
+    [PARSE_ERR_UNEXPECTED_END_TAG_IN_HEAD_NOSCRIPT] = "unexpected-end-tag-in-head-noscript",
+    [PARSE_ERR_END_TAG_BR_IN_HEAD_NOSCRIPT] = "end-tag-br-in-head-noscript",
+    [PARSE_ERR_EOF_IN_HEAD_NOSCRIPT] = "eof-in-head-noscript",
+    [PARSE_ERR_UNEXPECTED_START_TAG] = "unexpected-start-tag",
+    [PARSE_ERR_UNEXPECTED_END_TAG] = "unexpected-end-tag",
+    [PARSE_ERR_END_TAG_WITH_UNCLOSED_ELEMENTS] = "end-tag-with-unclosed-elements",
+    [PARSE_ERR_UNEXPECTED_START_TAG_IN_TABLE] = "unexpected-start-tag-in-table",
+    [PARSE_ERR_UNEXPECTED_START_TAG_IN_SELECT] = "unexpected-start-tag-in-select",
+    [PARSE_ERR_UNEXPECTED_ELEMENT_BEFORE_TEMPLATE] = "unexpected-element-before-template",
+    [PARSE_ERR_UNEXPECTED_TOKEN_AFTER_BODY] = "unexpected-token-after-body",
+    [PARSE_ERR_FOSTER_PARENTING] = "foster-parenting",
+    [PARSE_ERR_ADOPTION_AGENCY_1_1] = "adoption-agency-1.1",
+    [PARSE_ERR_AAA_IMPLIED_MISMATCH] = "aaa-implied-mismatch",
+    [PARSE_ERR_EOF_IN_TEXT] = "eof-in-text",
+    [PARSE_ERR_EOF_IN_TABLE] = "eof-in-table",
+    [PARSE_ERR_EOF_IN_TEMPLATE] = "eof-in-template",
+    [PARSE_ERR_EOF_WITH_OPEN_ELEMENTS] = "eof-with-open-elements",
+};
+
+parse_error_sink *parse_errors_attach(parse_error_sink *sink) {
+    parse_error_sink *prev = parse_errors_current;
+    parse_errors_current = sink;
+    return prev;
+}
+
+size_t parse_error_sink_size(const parse_error_sink *sink) {
+    if (!sink || !sink->ring) return 0;
+    return sink->count < sink->ring_cap ? sink->count : sink->ring_cap;
+}
+
+const parse_error *parse_error_sink_at(const parse_error_sink *sink,
+                                       size_t i) {
+    size_t size = parse_error_sink_size(sink);
+    if (i >= size) return NULL;
+    return &sink->ring[(sink->count - size + i) % sink->ring_cap];
+}
+
+const char *parse_error_code_name(parse_error_code code) {
+    if ((unsigned)code >= PARSE_ERR_COUNT || !code_names[code])
+        return "unknown";
+    return code_names[code];
+}
+
+int parse_error_format(const parse_error *err, char *buf, size_t size) {
+    if (!err) return -1;
+    const char *name = parse_error_code_name(err->code);
+    if (err->line == 0 && !err->context[0])
+        return snprintf(buf, size, "%s", name);
+    if (!err->context[0])
+        return snprintf(buf, size, "line=%zu col=%zu: %s", err->line,
+                        err->col, name);
+    return snprintf(buf, size, "line=%zu col=%zu: %s <%s%s>", err->line,
+                    err->col, name, err->token == TOKEN_END_TAG ? "/" : "",
+                    err->context);
+}
+
+int parse_errors_enabled(void) {
+    if (parse_errors_current) return 1;
+    pthread_once(&env_once, read_env);
+    return env_enabled;
+}
+
+/* Deliver a filled record, or print it when only the environment
+ * variable asked for errors. */
+static void deliver(parse_error *e) {
+    parse_error_sink *sink = parse_errors_current;
+    if (!sink) {
+        if (!parse_errors_enabled()) return;
+        if (e->line)
+            fprintf(stderr, "[parse error] line=%zu col=%zu: %s\n", e->line,
+                    e->col, parse_error_code_name(e->code));
+        else
+            fprintf(stderr, "[parse error] %s\n",
+                    parse_error_code_name(e->code));
+        return;
+    }
+    sink->count++;
+    if (sink->ring && sink->ring_cap)
+        sink->ring[(sink->count - 1) % sink->ring_cap] = *e;
+    if (sink->callback)
+        sink->callback(e, sink->user);
+}
+
+void parse_error_emit_at(parse_error_code code, size_t offset, size_t line,
+                         size_t col) {
+    parse_error e;
+    e.code = code;
+    e.offset = offset;
+    e.line = line;
+    e.col = col;
+    e.token = (token_type)0;
+    e.context[0] = '\0';
+    deliver(&e);
+}
+
+void parse_error_emit(parse_error_code code) {
+    if (!parse_errors_current) {
+        /* Tree construction errors have always printed bare */
+        parse_error_emit_at(code, PARSE_ERROR_NO_OFFSET, 0, 0);
+        return;
+    }
+    parse_error e = noted;
+    e.code = code;
+    deliver(&e);
+}
+
+void parse_errors_note_token(const token *t, size_t offset, size_t line,
+                             size_t col) {
+    noted.offset = offset;
+    noted.line = line;
+    noted.col = col;
+    noted.token = t ? t->type : (token_type)0;
+    noted.context[0] = '\0';
+    if (t && t->name) {
+        size_t n = strlen(t->name);
+        if (n >= sizeof(noted.context)) n = sizeof(noted.context) - 1;
+        memcpy(noted.context, t->name, n);
+        noted.context[n] = '\0';
+    }
+}
@@ -5,6 +5,11 @@
 #include "tree_builder.h"
 #include "tokenizer.h"
 #include "encoding.h"
+#include "packed_tree.h"
+#include "selector.h"
+#include "parse_stats.h"
+#include "parse_error.h"
+#include "parse_cache.h"
 
 /* Read raw file bytes. Caller must free *out_buf. */
 static size_t read_file_raw(const char *path, char **out_buf) {
@@ -23,16 +28,211 @@ static size_t read_file_raw(const char *path, char **out_buf) {
     return read_len;
 }
 
-int main(int argc, char **argv) {
-    const char *charset_hint = NULL;
-    int arg_idx = 1;
-    /* Parse --charset option */
-    if (argc > 2 && strcmp(argv[1], "--charset") == 0) {
-        charset_hint = argv[2];
-        arg_idx = 3;
+/* Print the run table of a source map: UTF-8 range <- input range. */
+static void dump_source_map(const encoding_source_map *map) {
+    printf("SOURCE MAP out=%zu in=%zu runs=%zu\n",
+           map->out_len, map->in_len, map->count);
+    for (size_t i = 0; i < map->count; i++) {
+        const encoding_source_run *r = &map->runs[i];
+        size_t out_end = (i + 1 < map->count) ? map->runs[i + 1].out_off
+                                              : map->out_len;
+        size_t in_end = r->in_off + ((out_end - r->out_off) / r->out_w) * r->in_w;
+        printf("  [%zu,%zu) <- [%zu,%zu) %u:%u\n", r->out_off, out_end,
+               r->in_off, in_end, (unsigned)r->out_w, (unsigned)r->in_w);
+    }
+}
+
+/* Command-line options shared by every file */
+typedef struct {
+    const char *charset_hint;
+    int sniff_flags;
+    tree_build_options build;   /* threads, pipeline, index, filters */
+    int packed;
+    const selector *select;     /* print matches instead of the tree */
+    int stats;                  /* print parse_stats as JSON per file */
+    int errors;                 /* list parse errors per file */
+    const char *save_snapshot;  /* write the packed tree here */
+    parse_cache *cache;         /* shared by every file of the run */
+    int text;                   /* print the visible text: 1 from the
+                                 * tree, 2 from the token stream */
+} parse_options;
+
+#define ERROR_RING_SIZE 64
+
+/* Parse errors collected for one file: the last ERROR_RING_SIZE of
+ * them, with their offsets. */
+static void dump_errors(const parse_error_sink *sink) {
+    size_t kept = parse_error_sink_size(sink);
+    printf("ERRORS %zu", sink->count);
+    if (kept < sink->count)
+        printf(" (first %zu dropped)", sink->count - kept);
+    printf("\n");
+    for (size_t i = 0; i < kept; i++) {
+        const parse_error *e = parse_error_sink_at(sink, i);
+        char text[128];
+        parse_error_format(e, text, sizeof(text));
+        if (e->offset == PARSE_ERROR_NO_OFFSET)
+            printf("  %s\n", text);
+        else
+            printf("  @%zu %s\n", e->offset, text);
+    }
+}
+
+/* Build the tree with the requested threading mode and filters. */
+static node *build_doc(const parse_options *opts, const char *input,
+                       const char *encoding, encoding_confidence confidence,
+                       const char **change_encoding, size_t *consumed) {
+    tree_build_options build = opts->build;
+    build.consumed = consumed;
+    return build_tree_from_input_opts(input, encoding, confidence,
+                                      change_encoding, &build);
+}
+
+/* --stop-at predicate: the first start tag with the given name, or the
+ * first character token for "#text". */
+static int stop_at_tag(const token *t, const node *doc, void *ctx) {
+    (void)doc;
+    if (strcmp((const char *)ctx, "#text") == 0)
+        return t->type == TOKEN_CHARACTER;
+    return t->type == TOKEN_START_TAG && t->name &&
+           strcmp(t->name, (const char *)ctx) == 0;
+}
+
+/* Split a comma-separated argument in place into a NULL-terminated list.
+ * Returns a heap array (free() it), or NULL on allocation failure. */
+static const char **split_names(char *arg) {
+    size_t n = 1;
+    for (const char *p = arg; *p; p++)
+        if (*p == ',') n++;
+    const char **list = (const char **)malloc((n + 1) * sizeof(*list));
+    if (!list) return NULL;
+    size_t i = 0;
+    for (char *tok = arg; tok; ) {
+        char *comma = strchr(tok, ',');
+        if (comma) *comma = '\0';
+        if (*tok) list[i++] = tok;
+        tok = comma ? comma + 1 : NULL;
+    }
+    list[i] = NULL;
+    return list;
+}
+
+/* Dump through the packed representation, plus its size. */
+static void dump_packed(const node *doc, const char *title) {
+    packed_tree *pt = packed_tree_build(doc);
+    if (!pt) {
+        fprintf(stderr, "failed to pack tree\n");
+        return;
+    }
+    packed_tree_dump_ascii(pt, title);
+    printf("PACKED nodes=%u attrs=%u atoms=%u text=%zu\n",
+           pt->count, pt->attr_count, pt->atom_count, pt->text_len);
+    packed_tree_free(pt);
+}
+
+/* Dump a snapshot file through an mmap()ed view, or through a node tree
+ * thawed from it. */
+static int load_snapshot(const char *path, int thaw) {
+    packed_tree *pt = packed_tree_load(path);
+    if (!pt) {
+        fprintf(stderr, "failed to load snapshot %s\n", path);
+        return 1;
+    }
+    char title[512];
+    snprintf(title, sizeof(title), "--- %s ---", path);
+    if (thaw) {
+        node *doc = packed_tree_thaw(pt);
+        if (!doc) {
+            fprintf(stderr, "failed to thaw %s\n", path);
+            packed_tree_free(pt);
+            return 1;
+        }
+        tree_dump_ascii(doc, title);
+        node_free(doc);
+    } else {
+        packed_tree_dump_ascii(pt, title);
+    }
+    printf("\n");
+    packed_tree_free(pt);
+    return 0;
+}
+
+static void text_to_stdout(const char *s, size_t len, void *ctx) {
+    (void)ctx;
+    fwrite(s, 1, len, stdout);
+}
+
+/* --text / --text-stream: the visible text, then its length. */
+static void dump_text(const node *doc, const char *input, const char *title) {
+    printf("%s\n", title);
+    size_t len = doc ? tree_extract_text_to(doc, text_to_stdout, NULL)
+                     : extract_text_from_input(input, text_to_stdout, NULL);
+    printf("\nTEXT %zu bytes\n", len);
+}
+
+/* One line per element matched by the --select query. */
+static void dump_matches(node *doc, const selector *sel, const char *title) {
+    size_t count = 0;
+    node **matches = selector_query_all(doc, sel, &count);
+    printf("%s\n", title);
+    if (!matches) {
+        fprintf(stderr, "out of memory\n");
+        return;
+    }
+    printf("MATCHES %zu\n", count);
+    for (size_t i = 0; i < count; i++) {
+        const node *n = matches[i];
+        printf("  <%s", n->name ? n->name : "");
+        for (size_t a = 0; a < n->attr_count; a++)
+            printf(" %s=\"%s\"", n->attrs[a].name ? n->attrs[a].name : "",
+                   n->attrs[a].value ? n->attrs[a].value : "");
+        printf(">\n");
+    }
+    free(matches);
+}
+
+/* Print what was asked for about one parsed file, then free doc and
+ * input. input may be NULL when doc is set; input_len is its length. */
+static int report_doc(node *doc, char *input, size_t input_len,
+                      size_t consumed, size_t raw_len, const char *path,
+                      const parse_options *opts, const parse_stats *stats,
+                      const parse_error_sink *errors) {
+    char title[512];
+    snprintf(title, sizeof(title), "--- %s ---", path);
+    if (opts->text)
+        dump_text(doc, input, title);
+    else if (opts->select)
+        dump_matches(doc, opts->select, title);
+    else if (opts->packed)
+        dump_packed(doc, title);
+    else
+        tree_dump_ascii(doc, title);
+    if (doc->source_map && (opts->sniff_flags & ENC_SNIFF_SOURCE_MAP))
+        dump_source_map(doc->source_map);
+    if (consumed < input_len)
+        printf("STOPPED at byte %zu of %zu\n",
+               encoding_source_map_lookup(doc->source_map, consumed), raw_len);
+    if (opts->errors)
+        dump_errors(errors);
+    if (opts->stats) {
+        printf("STATS ");
+        parse_stats_print_json(stats, stdout);
+        printf("\n");
+    }
+    printf("\n");
+    int status = 0;
+    if (opts->save_snapshot && !packed_tree_save(doc, opts->save_snapshot)) {
+        fprintf(stderr, "failed to write snapshot %s\n", opts->save_snapshot);
+        status = 1;
     }
-    const char *path = (argc > arg_idx) ? argv[arg_idx] : "tests/sample.html";
+    node_free(doc);
+    free(input);
+    return status;
+}
 
+/* Parse one file and dump its tree. The decoder is shared across files. */
+static int parse_one(encoding_decoder *dec, const char *path,
+                     const parse_options *opts) {
     /* Read raw bytes */
     char *raw = NULL;
     size_t raw_len = read_file_raw(path, &raw);
@@ -40,56 +240,274 @@ int main(int argc, char **argv) {
         fprintf(stderr, "failed to read %s\n", path);
         return 1;
     }
+    parse_stats stats = {0};
+    parse_stats *prev_stats = opts->stats ? parse_stats_attach(&stats) : NULL;
+    parse_error ring[ERROR_RING_SIZE];
+    parse_error_sink errors = { NULL, NULL, ring, ERROR_RING_SIZE, 0 };
+    parse_error_sink *prev_errors = opts->errors ? parse_errors_attach(&errors)
+                                                 : NULL;
 
-    /* Encoding sniff and convert */
-    encoding_result enc = encoding_sniff_and_convert(
-        (const unsigned char *)raw, raw_len, charset_hint);
+    /* Encoding sniff and convert. An early stop is reported in input
+     * bytes, which needs the source map even when it is not printed. */
+    int sniff_flags = opts->sniff_flags;
+    if (opts->build.stop_when || opts->build.stop_after_head)
+        sniff_flags |= ENC_SNIFF_SOURCE_MAP;
+    if (opts->cache && opts->text != 2) {
+        /* The cache is keyed on the raw bytes, so it decodes (and
+         * re-decodes for a <meta> charset) itself */
+        size_t consumed = 0;
+        tree_build_options build = opts->build;
+        build.consumed = &consumed;
+        node *doc = parse_cache_build(opts->cache, dec,
+                                      (const unsigned char *)raw, raw_len,
+                                      opts->charset_hint, sniff_flags, &build);
+        free(raw);
+        if (opts->stats)
+            parse_stats_attach(prev_stats);
+        if (opts->errors)
+            parse_errors_attach(prev_errors);
+        if (!doc) {
+            fprintf(stderr, "failed to build tree for %s\n", path);
+            return 1;
+        }
+        size_t input_len = doc->source_map ? doc->source_map->out_len
+                                            : consumed;
+        return report_doc(doc, NULL, input_len, consumed, raw_len, path, opts,
+                          &stats, &errors);
+    }
+    encoding_result enc = encoding_decoder_convert(
+        dec, (const unsigned char *)raw, raw_len, opts->charset_hint,
+        sniff_flags);
     if (!enc.data) {
         fprintf(stderr, "encoding conversion failed for %s\n", path);
         free(raw);
+        if (opts->stats)
+            parse_stats_attach(prev_stats);
+        if (opts->errors)
+            parse_errors_attach(prev_errors);
         return 1;
     }
 
     char *input = tokenizer_replace_nulls(enc.data, enc.len);
-    free(enc.data);
+    encoding_source_map_normalize(enc.source_map, enc.data, enc.len);
     const char *encoding = enc.encoding;
     encoding_confidence confidence = enc.confidence;
 
+    if (opts->text == 2) {
+        /* No tree: the sniffed encoding stands, a late <meta> charset is
+         * not acted on */
+        char title[512];
+        snprintf(title, sizeof(title), "--- %s ---", path);
+        dump_text(NULL, input, title);
+        printf("\n");
+        free(raw);
+        encoding_source_map_free(enc.source_map);
+        free(input);
+        if (opts->stats)
+            parse_stats_attach(prev_stats);
+        if (opts->errors)
+            parse_errors_attach(prev_errors);
+        return 0;
+    }
+
     /* Build tree — may request re-encoding */
     const char *change_enc = NULL;
-    node *doc = build_tree_from_input(input, encoding, confidence, &change_enc);
+    size_t consumed = 0;
+    node *doc = build_doc(opts, input, encoding, confidence, &change_enc,
+                          &consumed);
 
     if (!doc && change_enc) {
         /* WHATWG §13.2.3.5: re-encode and re-parse with new encoding */
         free(input);
-        encoding_result enc2 = encoding_sniff_and_convert(
-            (const unsigned char *)raw, raw_len, change_enc);
+        encoding_result enc2 = encoding_decoder_convert(
+            dec, (const unsigned char *)raw, raw_len, change_enc,
+            sniff_flags & ENC_SNIFF_SOURCE_MAP);
         free(raw);
         raw = NULL;
         if (!enc2.data) {
             fprintf(stderr, "re-encoding failed for %s\n", path);
+            if (opts->stats)
+                parse_stats_attach(prev_stats);
+            if (opts->errors)
+                parse_errors_attach(prev_errors);
             return 1;
         }
         input = tokenizer_replace_nulls(enc2.data, enc2.len);
-        free(enc2.data);
+        encoding_source_map_normalize(enc2.source_map, enc2.data, enc2.len);
         encoding = enc2.encoding;
-        doc = build_tree_from_input(input, encoding, ENC_CONFIDENCE_CERTAIN, NULL);
+        encoding_source_map_free(enc.source_map);
+        enc.source_map = enc2.source_map;
+        doc = build_doc(opts, input, encoding, ENC_CONFIDENCE_CERTAIN, NULL,
+                        &consumed);
     } else {
         free(raw);
         raw = NULL;
     }
 
+    if (opts->stats)
+        parse_stats_attach(prev_stats);
+    if (opts->errors)
+        parse_errors_attach(prev_errors);
     if (!doc) {
         fprintf(stderr, "failed to build tree\n");
+        encoding_source_map_free(enc.source_map);
         free(input);
         return 1;
     }
+    doc->source_map = enc.source_map;
 
-    char title[512];
-    snprintf(title, sizeof(title), "--- %s ---", path);
-    tree_dump_ascii(doc, title);
-    printf("\n");
-    node_free(doc);
-    free(input);
-    return 0;
+    return report_doc(doc, input, strlen(input), consumed, raw_len, path,
+                      opts, &stats, &errors);
+}
+
+int main(int argc, char **argv) {
+    parse_options opts = { NULL, ENC_SNIFF_DEFAULT, {0}, 0, NULL, 0, 0, NULL, NULL,
+                           0 };
+    int load = 0, thaw = 0;
+    selector *sel = NULL;
+    const char **prune = NULL;
+    const char **drop_attrs = NULL;
+    int arg_idx = 1;
+    /* Parse --charset / --detect / --source-map / --threads / --pipeline /
+     * --packed / --index / --select / --prune / --drop-attrs /
+     * --drop-comments / --head-only / --stop-at / --stats / --errors /
+     * --save-snapshot / --cache / --text / --text-stream options.
+     * --load-snapshot [--thaw] dumps the remaining arguments as snapshot
+     * files instead of parsing them. */
+    while (argc > arg_idx) {
+        if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--charset") == 0) {
+            opts.charset_hint = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--threads") == 0) {
+            opts.build.threads = atoi(argv[arg_idx + 1]);
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--detect") == 0) {
+            opts.sniff_flags |= ENC_SNIFF_DETECT;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--source-map") == 0) {
+            opts.sniff_flags |= ENC_SNIFF_SOURCE_MAP;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--pipeline") == 0) {
+            opts.build.pipelined = 1;
+            arg_idx++;
+        } else if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--select") == 0) {
+            const char *err = NULL;
+            selector_free(sel);
+            sel = selector_compile(argv[arg_idx + 1], &err);
+            if (!sel) {
+                fprintf(stderr, "bad selector \"%s\": %s\n", argv[arg_idx + 1], err);
+                free(prune);
+                free(drop_attrs);
+                return 1;
+            }
+            opts.select = sel;
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--packed") == 0) {
+            opts.packed = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--index") == 0) {
+            opts.build.build_index = 1;
+            arg_idx++;
+        } else if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--prune") == 0) {
+            free(prune);
+            prune = split_names(argv[arg_idx + 1]);
+            opts.build.prune_elements = prune;
+            arg_idx += 2;
+        } else if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--drop-attrs") == 0) {
+            free(drop_attrs);
+            drop_attrs = split_names(argv[arg_idx + 1]);
+            opts.build.drop_attributes = drop_attrs;
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--drop-comments") == 0) {
+            opts.build.drop_comments = 1;
+            arg_idx++;
+        } else if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--stop-at") == 0) {
+            opts.build.stop_when = stop_at_tag;
+            opts.build.stop_ctx = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--errors") == 0) {
+            opts.errors = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--stats") == 0) {
+            opts.stats = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--head-only") == 0) {
+            opts.build.stop_after_head = 1;
+            arg_idx++;
+        } else if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--save-snapshot") == 0) {
+            opts.save_snapshot = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--cache") == 0) {
+            if (!opts.cache)
+                opts.cache = parse_cache_create(256, 64u << 20);
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--text") == 0) {
+            opts.text = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--text-stream") == 0) {
+            opts.text = 2;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--load-snapshot") == 0) {
+            load = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--thaw") == 0) {
+            thaw = 1;
+            arg_idx++;
+        } else {
+            break;
+        }
+    }
+
+    if (load) {
+        int status = 0;
+        for (int i = arg_idx; i < argc; i++)
+            if (load_snapshot(argv[i], thaw) != 0)
+                status = 1;
+        parse_cache_free(opts.cache);
+        selector_free(sel);
+        free(prune);
+        free(drop_attrs);
+        return status;
+    }
+
+    encoding_decoder *dec = encoding_decoder_create();
+    if (!dec) {
+        fprintf(stderr, "out of memory\n");
+        parse_cache_free(opts.cache);
+        selector_free(sel);
+        free(prune);
+        free(drop_attrs);
+        return 1;
+    }
+
+    /* Files parsed one after another reuse the builder's buffers */
+    parser_ctx *ctx = parser_ctx_create();
+    parser_ctx_attach(ctx);
+
+    int status = 0;
+    if (argc <= arg_idx) {
+        status = parse_one(dec, "tests/sample.html", &opts);
+    } else {
+        /* Remaining arguments are files, parsed in order */
+        for (int i = arg_idx; i < argc; i++) {
+            if (parse_one(dec, argv[i], &opts) != 0)
+                status = 1;
+        }
+    }
+
+    if (opts.cache) {
+        parse_cache_stats cs;
+        parse_cache_get_stats(opts.cache, &cs);
+        printf("CACHE hits=%zu misses=%zu bypassed=%zu evictions=%zu "
+               "entries=%zu bytes=%zu\n", cs.hits, cs.misses, cs.bypassed,
+               cs.evictions, cs.entries, cs.bytes);
+        parse_cache_free(opts.cache);
+    }
+    parser_ctx_attach(NULL);
+    parser_ctx_free(ctx);
+    encoding_decoder_free(dec);
+    selector_free(sel);
+    free(prune);
+    free(drop_attrs);
+    return status;
 }
@@ -1,10 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "tree_builder.h"
 #include "tokenizer.h"
 #include "encoding.h"
+#include "parse_stats.h"
 
 /* Read raw file bytes. Caller must free *out_buf. */
 static size_t read_file_raw(const char *path, char **out_buf) {
@@ -23,55 +26,186 @@ static size_t read_file_raw(const char *path, char **out_buf) {
     return read_len;
 }
 
-int main(int argc, char **argv) {
-    const char *charset_hint = NULL;
-    int arg_idx = 1;
-    /* Parse --charset option */
-    if (argc > 2 && strcmp(argv[1], "--charset") == 0) {
-        charset_hint = argv[2];
-        arg_idx = 3;
-    }
-    if (argc - arg_idx < 2) {
-        fprintf(stderr, "usage: %s [--charset ENC] <context-tag> <file>\n", argv[0]);
-        return 1;
-    }
-    const char *context_tag = argv[arg_idx];
-    const char *path = argv[arg_idx + 1];
-
-    /* Read raw bytes */
+/* Read, sniff and convert one input. Returns NUL-free UTF-8 the caller
+ * frees, or NULL after printing why. */
+static char *load_input(const char *path, const char *charset_hint,
+                        const char **encoding,
+                        encoding_confidence *confidence) {
     char *raw = NULL;
     size_t raw_len = read_file_raw(path, &raw);
     if (!raw) {
         fprintf(stderr, "failed to read %s\n", path);
-        return 1;
+        return NULL;
     }
-
-    /* Encoding sniff and convert */
     encoding_result enc = encoding_sniff_and_convert(
         (const unsigned char *)raw, raw_len, charset_hint);
     free(raw);
     if (!enc.data) {
         fprintf(stderr, "encoding conversion failed for %s\n", path);
-        return 1;
+        return NULL;
     }
-
     char *input = tokenizer_replace_nulls(enc.data, enc.len);
     free(enc.data);
-    const char *encoding = enc.encoding;
-    encoding_confidence confidence = enc.confidence;
+    *encoding = enc.encoding;
+    *confidence = enc.confidence;
+    return input;
+}
+
+/* --batch: parse <context-tag> <file> pairs as one batch into one arena,
+ * `repeat` times, dump every fragment of the last run in order and report
+ * the batch throughput on stderr. The batch takes the first file's
+ * encoding. */
+static int run_batch(int npairs, char **pairs, const char *charset_hint,
+                     long repeat) {
+    fragment_batch_item *items = (fragment_batch_item *)calloc(
+        (size_t)npairs, sizeof(fragment_batch_item));
+    if (!items) return 1;
+    const char *encoding = NULL;
+    encoding_confidence confidence = ENC_CONFIDENCE_TENTATIVE;
+    int rc = 0;
+    for (int i = 0; i < npairs; i++) {
+        const char *enc = NULL;
+        encoding_confidence conf = ENC_CONFIDENCE_TENTATIVE;
+        items[i].context_tag = pairs[2 * i];
+        items[i].input = load_input(pairs[2 * i + 1], charset_hint, &enc,
+                                    &conf);
+        if (!items[i].input) { rc = 1; break; }
+        if (i == 0) { encoding = enc; confidence = conf; }
+    }
+
+    node_arena *arena = rc == 0 ? node_arena_create(0) : NULL;
+    node **roots = NULL;
+    fragment_batch_stats bs = {0};
+    uint64_t total_ns = 0;
+    size_t total_bytes = 0;
+    for (long r = 0; arena && r < repeat; r++) {
+        node_arena_reset(arena);
+        roots = build_fragment_batch(items, (size_t)npairs, encoding,
+                                     confidence, arena, &bs);
+        if (!roots) break;
+        total_ns += bs.elapsed_ns;
+        total_bytes += bs.bytes;
+    }
+    if (!roots || bs.failed) {
+        if (rc == 0) fprintf(stderr, "failed to build fragment batch\n");
+        rc = 1;
+    } else {
+        for (int i = 0; i < npairs; i++)
+            tree_dump_ascii(roots[i], "ASCII Tree (Fragment)");
+        double ms = total_ns / 1e6;
+        fprintf(stderr, "BATCH %zu fragments, %zu contexts, %zu bytes, "
+                        "%.3f ms/batch, %.2f MB/s, arena %zu bytes\n",
+                bs.fragments, bs.contexts, bs.bytes, ms / repeat,
+                total_ns ? total_bytes * 1e3 / total_ns : 0.0,
+                bs.arena_bytes);
+    }
+    node_arena_free(arena);
+    for (int i = 0; i < npairs; i++)
+        free((char *)items[i].input);
+    free(items);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    const char *charset_hint = NULL;
+    int print_stats = 0;
+    int use_arena = 0;
+    int batch = 0;
+    long repeat = 1;
+    int arg_idx = 1;
+    /* Parse --charset / --stats / --arena / --repeat / --batch options.
+     * --arena parses through a fragment_parser into a node arena;
+     * --repeat N (implies --arena) parses N times, resetting the arena in
+     * between, and reports the time per fragment. --batch takes any
+     * number of <context-tag> <file> pairs and parses them with
+     * build_fragment_batch(). */
+    while (argc > arg_idx) {
+        if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--charset") == 0) {
+            charset_hint = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--stats") == 0) {
+            print_stats = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--arena") == 0) {
+            use_arena = 1;
+            arg_idx++;
+        } else if (argc > arg_idx + 1 && strcmp(argv[arg_idx], "--repeat") == 0) {
+            repeat = atol(argv[arg_idx + 1]);
+            if (repeat < 1) repeat = 1;
+            use_arena = 1;
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--batch") == 0) {
+            batch = 1;
+            arg_idx++;
+        } else {
+            break;
+        }
+    }
+    if (argc - arg_idx < 2 || (batch && (argc - arg_idx) % 2 != 0)) {
+        fprintf(stderr, "usage: %s [--charset ENC] [--stats] [--arena] [--repeat N] <context-tag> <file>\n"
+                        "       %s [--charset ENC] [--repeat N] --batch <context-tag> <file>...\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+    if (batch)
+        return run_batch((argc - arg_idx) / 2, argv + arg_idx, charset_hint,
+                         repeat);
+    const char *context_tag = argv[arg_idx];
+    const char *path = argv[arg_idx + 1];
+
+    parse_stats stats = {0};
+    if (print_stats)
+        parse_stats_attach(&stats);
+
+    const char *encoding = NULL;
+    encoding_confidence confidence = ENC_CONFIDENCE_TENTATIVE;
+    char *input = load_input(path, charset_hint, &encoding, &confidence);
+    if (!input) return 1;
 
     /* Fragment parsing inherits encoding from context document.
      * Re-encoding is not applicable for fragments (encoding comes
      * from context element's document), so pass NULL for change_encoding. */
-    node *doc = build_fragment_from_input(input, context_tag, encoding,
-                                          confidence, NULL);
+    node *doc = NULL;
+    fragment_parser *fp = NULL;
+    node_arena *arena = NULL;
+    double seconds = 0;
+    if (use_arena) {
+        fp = fragment_parser_create(context_tag, encoding, confidence);
+        arena = node_arena_create(0);
+        if (fp && arena) {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (long i = 0; i < repeat; i++) {
+                node_arena_reset(arena);
+                doc = fragment_parser_parse(fp, input, arena);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            seconds = (double)(t1.tv_sec - t0.tv_sec) +
+                      (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+        }
+    } else {
+        doc = build_fragment_from_input(input, context_tag, encoding,
+                                        confidence, NULL);
+    }
     if (!doc) {
         fprintf(stderr, "failed to build fragment\n");
+        fragment_parser_free(fp);
+        node_arena_free(arena);
         free(input);
         return 1;
     }
     tree_dump_ascii(doc, "ASCII Tree (Fragment)");
+    if (print_stats) {
+        printf("STATS ");
+        parse_stats_print_json(&stats, stdout);
+        printf("\n");
+    }
+    if (repeat > 1)
+        printf("REPEAT %ld: %.3f us/fragment, arena %zu bytes\n", repeat,
+               seconds / repeat * 1e6, node_arena_used(arena));
     node_free(doc);
+    fragment_parser_free(fp);
+    node_arena_free(arena);
     free(input);
     return 0;
 }
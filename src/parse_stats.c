@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+#include "parse_stats.h"
+
+#include <time.h>
+
+_Thread_local parse_stats *parse_stats_current;
+
+parse_stats *parse_stats_attach(parse_stats *s) {
+    parse_stats *prev = parse_stats_current;
+    parse_stats_current = s;
+    return prev;
+}
+
+void parse_stats_merge(parse_stats *dst, const parse_stats *src) {
+    if (!dst || !src) return;
+    dst->bytes_decoded += src->bytes_decoded;
+    dst->decode_ns += src->decode_ns;
+    dst->build_ns += src->build_ns;
+    dst->re_encodes += src->re_encodes;
+    dst->cache_hits += src->cache_hits;
+    for (size_t i = 0; i <= TOKEN_EOF; i++)
+        dst->tokens[i] += src->tokens[i];
+    dst->entity_lookups += src->entity_lookups;
+    dst->entity_misses += src->entity_misses;
+    dst->nodes_created += src->nodes_created;
+    dst->attrs_created += src->attrs_created;
+    dst->aaa_outer += src->aaa_outer;
+    dst->aaa_inner += src->aaa_inner;
+    dst->reconstructs += src->reconstructs;
+    dst->foster_inserts += src->foster_inserts;
+    if (dst->peak_stack_depth < src->peak_stack_depth)
+        dst->peak_stack_depth = src->peak_stack_depth;
+    dst->allocs += src->allocs;
+    dst->alloc_bytes += src->alloc_bytes;
+}
+
+void parse_stats_print_json(const parse_stats *s, FILE *out) {
+    if (!s || !out) return;
+    fprintf(out, "{\"bytes_decoded\":%zu,\"decode_ms\":%.3f,\"build_ms\":%.3f,"
+            "\"re_encodes\":%zu,\"cache_hits\":%zu,", s->bytes_decoded,
+            s->decode_ns / 1e6, s->build_ns / 1e6, s->re_encodes,
+            s->cache_hits);
+    fprintf(out, "\"tokens\":{\"doctype\":%zu,\"start_tag\":%zu,\"end_tag\":%zu,"
+            "\"comment\":%zu,\"character\":%zu,\"eof\":%zu},",
+            s->tokens[TOKEN_DOCTYPE], s->tokens[TOKEN_START_TAG],
+            s->tokens[TOKEN_END_TAG], s->tokens[TOKEN_COMMENT],
+            s->tokens[TOKEN_CHARACTER], s->tokens[TOKEN_EOF]);
+    fprintf(out, "\"entity_lookups\":%zu,\"entity_misses\":%zu,"
+            "\"nodes_created\":%zu,\"attrs_created\":%zu,",
+            s->entity_lookups, s->entity_misses, s->nodes_created,
+            s->attrs_created);
+    fprintf(out, "\"aaa_outer\":%zu,\"aaa_inner\":%zu,\"reconstructs\":%zu,"
+            "\"foster_inserts\":%zu,\"peak_stack_depth\":%zu,",
+            s->aaa_outer, s->aaa_inner, s->reconstructs, s->foster_inserts,
+            s->peak_stack_depth);
+    fprintf(out, "\"allocs\":%zu,\"alloc_bytes\":%zu}", s->allocs,
+            s->alloc_bytes);
+}
+
+uint64_t parse_stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,838 @@
+#include "selector.h"
+#include "node_index.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* ============================================================================
+ * Compiled form
+ *
+ * A selector list is a set of complex selectors. Each complex selector is
+ * stored right to left: compounds[0] is the subject, and each compound's
+ * combinator says how it relates to the compound on its left. A compound
+ * is a flat program of simple-selector ops that must all pass.
+ * ============================================================================ */
+
+typedef enum {
+    SEL_TYPE,
+    SEL_ID,
+    SEL_CLASS,
+    SEL_ATTR,
+    SEL_NTH,
+    SEL_ROOT,
+    SEL_EMPTY,
+    SEL_NOT
+} sel_op_kind;
+
+typedef enum {
+    ATTR_EXISTS,
+    ATTR_EQUALS,        /* [a=v] */
+    ATTR_INCLUDES,      /* [a~=v] */
+    ATTR_DASH,          /* [a|=v] */
+    ATTR_PREFIX,        /* [a^=v] */
+    ATTR_SUFFIX,        /* [a$=v] */
+    ATTR_SUBSTRING      /* [a*=v] */
+} attr_match;
+
+typedef struct {
+    sel_op_kind kind;
+    attr_match match;
+    char *name;         /* type/attribute name, id, or class */
+    char *value;        /* attribute value */
+    int a, b;           /* :nth-*(an+b) */
+    int from_end;       /* :nth-last-child */
+    selector *inner;    /* :not() argument */
+} sel_op;
+
+typedef struct {
+    sel_op *ops;
+    size_t count;
+    size_t cap;
+    char combinator;    /* ' ', '>', '+', '~' to the left; 0 if leftmost */
+} sel_compound;
+
+#define SEL_MAX_ANCESTOR_HASHES 8
+
+typedef struct {
+    sel_compound *compounds;
+    size_t count;
+    size_t cap;
+    /* features some ancestor must have (for the bloom filter) */
+    uint32_t ancestor_hashes[SEL_MAX_ANCESTOR_HASHES];
+    size_t ancestor_hash_count;
+} sel_complex;
+
+struct selector {
+    sel_complex *items;
+    size_t count;
+    size_t cap;
+};
+
+static char *dup_range(const char *s, size_t len) {
+    char *out = (char *)malloc(len + 1);
+    if (!out) return NULL;
+    memcpy(out, s, len);
+    out[len] = '\0';
+    return out;
+}
+
+static void *grow_array(void *items, size_t *cap, size_t elem) {
+    size_t ncap = *cap ? *cap * 2 : 4;
+    void *p = realloc(items, ncap * elem);
+    if (p) *cap = ncap;
+    return p;
+}
+
+static void compound_free(sel_compound *c) {
+    for (size_t i = 0; i < c->count; i++) {
+        free(c->ops[i].name);
+        free(c->ops[i].value);
+        selector_free(c->ops[i].inner);
+    }
+    free(c->ops);
+}
+
+void selector_free(selector *sel) {
+    if (!sel) return;
+    for (size_t i = 0; i < sel->count; i++) {
+        sel_complex *cx = &sel->items[i];
+        for (size_t k = 0; k < cx->count; k++)
+            compound_free(&cx->compounds[k]);
+        free(cx->compounds);
+    }
+    free(sel->items);
+    free(sel);
+}
+
+/* ============================================================================
+ * Feature hashes (ancestor bloom filter)
+ * ============================================================================ */
+
+#define BLOOM_SIZE 4096
+#define BLOOM_MASK (BLOOM_SIZE - 1)
+
+typedef struct {
+    unsigned char counts[BLOOM_SIZE];   /* counting filter; 255 = stuck */
+} ancestor_filter;
+
+static char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c + 32) : c;
+}
+
+/* kind is 'T' (tag, case-folded), 'I' (id) or 'C' (class) */
+static uint32_t feature_hash(char kind, const char *s, size_t len) {
+    uint32_t h = 2166136261u ^ (unsigned char)kind;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)(kind == 'T' ? ascii_lower(s[i]) : s[i]);
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static void filter_bump(ancestor_filter *f, uint32_t h, int delta) {
+    unsigned char *c1 = &f->counts[h & BLOOM_MASK];
+    unsigned char *c2 = &f->counts[(h >> 16) & BLOOM_MASK];
+    if (delta > 0) {
+        if (*c1 < 255) (*c1)++;
+        if (*c2 < 255) (*c2)++;
+    } else {
+        if (*c1 > 0 && *c1 < 255) (*c1)--;
+        if (*c2 > 0 && *c2 < 255) (*c2)--;
+    }
+}
+
+static int filter_may_contain(const ancestor_filter *f, uint32_t h) {
+    return f->counts[h & BLOOM_MASK] && f->counts[(h >> 16) & BLOOM_MASK];
+}
+
+static const char *get_attr(const node *n, const char *name) {
+    for (size_t i = 0; i < n->attr_count; i++)
+        if (n->attrs[i].name && strcmp(n->attrs[i].name, name) == 0)
+            return n->attrs[i].value ? n->attrs[i].value : "";
+    return NULL;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+/* Add (delta = 1) or remove (delta = -1) an element's tag/id/classes. */
+static void filter_update(ancestor_filter *f, const node *n, int delta) {
+    if (n->type != NODE_ELEMENT) return;
+    if (n->name) filter_bump(f, feature_hash('T', n->name, strlen(n->name)), delta);
+    const char *id = get_attr(n, "id");
+    if (id && id[0]) filter_bump(f, feature_hash('I', id, strlen(id)), delta);
+    const char *cls = get_attr(n, "class");
+    while (cls && *cls) {
+        while (is_space(*cls)) cls++;
+        const char *start = cls;
+        while (*cls && !is_space(*cls)) cls++;
+        if (cls > start) filter_bump(f, feature_hash('C', start, (size_t)(cls - start)), delta);
+    }
+}
+
+/* Collect the positive tag/id/class features of every compound that must
+ * be an ancestor of the subject: the ones to the left of ' ' or '>'. */
+static void complex_collect_hashes(sel_complex *cx) {
+    for (size_t k = 0; k + 1 < cx->count; k++) {
+        char comb = cx->compounds[k].combinator;
+        if (comb != ' ' && comb != '>') continue;
+        const sel_compound *anc = &cx->compounds[k + 1];
+        for (size_t i = 0; i < anc->count; i++) {
+            const sel_op *op = &anc->ops[i];
+            char kind = op->kind == SEL_TYPE ? 'T' : op->kind == SEL_ID ? 'I'
+                      : op->kind == SEL_CLASS ? 'C' : 0;
+            if (!kind || cx->ancestor_hash_count == SEL_MAX_ANCESTOR_HASHES) continue;
+            cx->ancestor_hashes[cx->ancestor_hash_count++] =
+                feature_hash(kind, op->name, strlen(op->name));
+        }
+    }
+}
+
+/* ============================================================================
+ * Parser
+ * ============================================================================ */
+
+typedef struct {
+    const char *p;
+    const char *error;
+    int depth;          /* :not() nesting */
+} sel_parser;
+
+#define SEL_MAX_DEPTH 16
+
+static void skip_ws(sel_parser *ps) {
+    while (is_space(*ps->p)) ps->p++;
+}
+
+static int is_ident_start(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           c == '-' || c == '\\' || c >= 0x80;
+}
+
+static int is_ident_char(unsigned char c) {
+    return is_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+/* Identifier with backslash escapes (a backslash keeps the next byte). */
+static char *parse_ident(sel_parser *ps) {
+    if (!is_ident_start((unsigned char)*ps->p)) {
+        ps->error = "expected identifier";
+        return NULL;
+    }
+    size_t len = 0;
+    const char *q = ps->p;
+    while (*q && is_ident_char((unsigned char)*q)) {
+        if (*q == '\\') {
+            if (!q[1]) break;
+            q++;
+        }
+        q++;
+        len++;
+    }
+    char *out = (char *)malloc(len + 1);
+    if (!out) { ps->error = "out of memory"; return NULL; }
+    len = 0;
+    while (ps->p < q) {
+        if (*ps->p == '\\') ps->p++;
+        out[len++] = *ps->p++;
+    }
+    out[len] = '\0';
+    if (len == 0) {
+        free(out);
+        ps->error = "expected identifier";
+        return NULL;
+    }
+    return out;
+}
+
+static char *parse_value(sel_parser *ps) {
+    char quote = *ps->p;
+    if (quote != '"' && quote != '\'')
+        return parse_ident(ps);
+    const char *start = ++ps->p;
+    while (*ps->p && *ps->p != quote) ps->p++;
+    if (!*ps->p) {
+        ps->error = "unterminated string";
+        return NULL;
+    }
+    char *out = dup_range(start, (size_t)(ps->p - start));
+    ps->p++;
+    if (!out) ps->error = "out of memory";
+    return out;
+}
+
+static int parse_int(sel_parser *ps, int *out) {
+    if (*ps->p < '0' || *ps->p > '9') return 0;
+    long v = 0;
+    while (*ps->p >= '0' && *ps->p <= '9') {
+        if (v < 1000000) v = v * 10 + (*ps->p - '0');
+        ps->p++;
+    }
+    *out = (int)v;
+    return 1;
+}
+
+/* an+b, odd, even (inside the parentheses) */
+static int parse_nth(sel_parser *ps, int *a, int *b) {
+    skip_ws(ps);
+    if (strncasecmp(ps->p, "odd", 3) == 0) { ps->p += 3; *a = 2; *b = 1; return 1; }
+    if (strncasecmp(ps->p, "even", 4) == 0) { ps->p += 4; *a = 2; *b = 0; return 1; }
+
+    int sign = 1, num = 0;
+    if (*ps->p == '+' || *ps->p == '-') sign = (*ps->p++ == '-') ? -1 : 1;
+    int has_num = parse_int(ps, &num);
+    if (*ps->p == 'n' || *ps->p == 'N') {
+        ps->p++;
+        *a = sign * (has_num ? num : 1);
+        *b = 0;
+        skip_ws(ps);
+        if (*ps->p == '+' || *ps->p == '-') {
+            int bsign = (*ps->p++ == '-') ? -1 : 1;
+            skip_ws(ps);
+            if (!parse_int(ps, &num)) return 0;
+            *b = bsign * num;
+        }
+        return 1;
+    }
+    if (!has_num) return 0;
+    *a = 0;
+    *b = sign * num;
+    return 1;
+}
+
+static selector *parse_list(sel_parser *ps, char terminator);
+
+static sel_op *compound_push(sel_parser *ps, sel_compound *c, sel_op_kind kind) {
+    if (c->count == c->cap) {
+        sel_op *ops = (sel_op *)grow_array(c->ops, &c->cap, sizeof(sel_op));
+        if (!ops) { ps->error = "out of memory"; return NULL; }
+        c->ops = ops;
+    }
+    sel_op *op = &c->ops[c->count++];
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    return op;
+}
+
+static int parse_attr_selector(sel_parser *ps, sel_compound *c) {
+    ps->p++;                                    /* '[' */
+    skip_ws(ps);
+    sel_op *op = compound_push(ps, c, SEL_ATTR);
+    if (!op || !(op->name = parse_ident(ps))) return 0;
+    skip_ws(ps);
+    op->match = ATTR_EXISTS;
+    if (*ps->p != ']') {
+        switch (*ps->p) {
+            case '=': op->match = ATTR_EQUALS; break;
+            case '~': op->match = ATTR_INCLUDES; break;
+            case '|': op->match = ATTR_DASH; break;
+            case '^': op->match = ATTR_PREFIX; break;
+            case '$': op->match = ATTR_SUFFIX; break;
+            case '*': op->match = ATTR_SUBSTRING; break;
+            default: ps->error = "bad attribute selector"; return 0;
+        }
+        ps->p += (op->match == ATTR_EQUALS) ? 1 : 2;
+        if (op->match != ATTR_EQUALS && ps->p[-1] != '=') {
+            ps->error = "bad attribute selector";
+            return 0;
+        }
+        skip_ws(ps);
+        if (!(op->value = parse_value(ps))) return 0;
+        skip_ws(ps);
+    }
+    if (*ps->p != ']') {
+        ps->error = "expected ']'";
+        return 0;
+    }
+    ps->p++;
+    return 1;
+}
+
+static int parse_pseudo(sel_parser *ps, sel_compound *c) {
+    ps->p++;                                    /* ':' */
+    char *name = parse_ident(ps);
+    if (!name) return 0;
+    int ok = 1;
+    sel_op *op = NULL;
+
+    if (strcasecmp(name, "first-child") == 0 || strcasecmp(name, "last-child") == 0) {
+        if ((op = compound_push(ps, c, SEL_NTH)) != NULL) {
+            op->b = 1;
+            op->from_end = (name[0] == 'l' || name[0] == 'L');
+        }
+    } else if (strcasecmp(name, "only-child") == 0) {
+        if ((op = compound_push(ps, c, SEL_NTH)) != NULL) op->b = 1;
+        if (op && (op = compound_push(ps, c, SEL_NTH)) != NULL) {
+            op->b = 1;
+            op->from_end = 1;
+        }
+    } else if (strcasecmp(name, "root") == 0) {
+        op = compound_push(ps, c, SEL_ROOT);
+    } else if (strcasecmp(name, "empty") == 0) {
+        op = compound_push(ps, c, SEL_EMPTY);
+    } else if ((strcasecmp(name, "nth-child") == 0 ||
+                strcasecmp(name, "nth-last-child") == 0) && *ps->p == '(') {
+        ps->p++;
+        if ((op = compound_push(ps, c, SEL_NTH)) != NULL) {
+            op->from_end = (strcasecmp(name, "nth-last-child") == 0);
+            skip_ws(ps);
+            if (!parse_nth(ps, &op->a, &op->b)) {
+                ps->error = "bad :nth-child() argument";
+                ok = 0;
+            }
+            skip_ws(ps);
+            if (ok && *ps->p++ != ')') {
+                ps->error = "expected ')'";
+                ok = 0;
+            }
+        }
+    } else if (strcasecmp(name, "not") == 0 && *ps->p == '(') {
+        ps->p++;
+        if ((op = compound_push(ps, c, SEL_NOT)) != NULL) {
+            if (ps->depth >= SEL_MAX_DEPTH) {
+                ps->error = "selector nested too deeply";
+                ok = 0;
+            } else {
+                ps->depth++;
+                op->inner = parse_list(ps, ')');
+                ps->depth--;
+                if (!op->inner) ok = 0;
+                else ps->p++;                   /* ')' */
+            }
+        }
+    } else {
+        ps->error = "unsupported pseudo-class";
+        ok = 0;
+    }
+    free(name);
+    return ok && op != NULL;
+}
+
+/* One compound selector; at least one simple selector is required. */
+static int parse_compound(sel_parser *ps, sel_compound *c) {
+    int any = 0;
+    if (*ps->p == '*') {
+        ps->p++;
+        any = 1;                                /* universal: no op needed */
+    } else if (is_ident_start((unsigned char)*ps->p)) {
+        sel_op *op = compound_push(ps, c, SEL_TYPE);
+        if (!op || !(op->name = parse_ident(ps))) return 0;
+        any = 1;
+    }
+    for (;;) {
+        char ch = *ps->p;
+        if (ch == '#' || ch == '.') {
+            ps->p++;
+            sel_op *op = compound_push(ps, c, ch == '#' ? SEL_ID : SEL_CLASS);
+            if (!op || !(op->name = parse_ident(ps))) return 0;
+        } else if (ch == '[') {
+            if (!parse_attr_selector(ps, c)) return 0;
+        } else if (ch == ':') {
+            if (!parse_pseudo(ps, c)) return 0;
+        } else {
+            break;
+        }
+        any = 1;
+    }
+    if (!any) ps->error = "expected selector";
+    return any;
+}
+
+static int parse_complex(sel_parser *ps, sel_complex *cx, char terminator) {
+    char comb = 0;
+    for (;;) {
+        if (cx->count == cx->cap) {
+            sel_compound *cs = (sel_compound *)grow_array(cx->compounds, &cx->cap,
+                                                          sizeof(sel_compound));
+            if (!cs) { ps->error = "out of memory"; return 0; }
+            cx->compounds = cs;
+        }
+        sel_compound *c = &cx->compounds[cx->count++];
+        memset(c, 0, sizeof(*c));
+        c->combinator = comb;
+        if (!parse_compound(ps, c)) return 0;
+
+        const char *before = ps->p;
+        skip_ws(ps);
+        char ch = *ps->p;
+        if (ch == '>' || ch == '+' || ch == '~') {
+            comb = ch;
+            ps->p++;
+            skip_ws(ps);
+        } else if (ch == ',' || ch == terminator || ch == '\0') {
+            break;
+        } else if (ps->p > before) {
+            comb = ' ';
+        } else {
+            ps->error = "unexpected character";
+            return 0;
+        }
+    }
+
+    /* Reverse into right-to-left order; each compound keeps the combinator
+     * that preceded it, which now links it to the next entry. */
+    for (size_t i = 0, j = cx->count - 1; i < j; i++, j--) {
+        sel_compound tmp = cx->compounds[i];
+        cx->compounds[i] = cx->compounds[j];
+        cx->compounds[j] = tmp;
+    }
+    complex_collect_hashes(cx);
+    return 1;
+}
+
+static selector *parse_list(sel_parser *ps, char terminator) {
+    selector *sel = (selector *)calloc(1, sizeof(selector));
+    if (!sel) { ps->error = "out of memory"; return NULL; }
+    for (;;) {
+        skip_ws(ps);
+        if (sel->count == sel->cap) {
+            sel_complex *items = (sel_complex *)grow_array(sel->items, &sel->cap,
+                                                           sizeof(sel_complex));
+            if (!items) { ps->error = "out of memory"; selector_free(sel); return NULL; }
+            sel->items = items;
+        }
+        sel_complex *cx = &sel->items[sel->count++];
+        memset(cx, 0, sizeof(*cx));
+        if (!parse_complex(ps, cx, terminator)) {
+            selector_free(sel);
+            return NULL;
+        }
+        if (*ps->p != ',') break;
+        ps->p++;
+    }
+    if (*ps->p != terminator) {
+        ps->error = terminator ? "expected ')'" : "unexpected character";
+        selector_free(sel);
+        return NULL;
+    }
+    return sel;
+}
+
+selector *selector_compile(const char *text, const char **error) {
+    sel_parser ps = { text, NULL, 0 };
+    if (error) *error = NULL;
+    if (!text) {
+        if (error) *error = "no selector";
+        return NULL;
+    }
+    selector *sel = parse_list(&ps, '\0');
+    if (!sel && error) *error = ps.error ? ps.error : "invalid selector";
+    return sel;
+}
+
+/* ============================================================================
+ * Matching (right to left)
+ * ============================================================================ */
+
+static const node *element_parent(const node *n) {
+    return (n->parent && n->parent->type == NODE_ELEMENT) ? n->parent : NULL;
+}
+
+static int name_eq(const node *n, const char *a, const char *b) {
+    return n->ns == NS_HTML ? strcasecmp(a, b) == 0 : strcmp(a, b) == 0;
+}
+
+static const char *find_attr_ns(const node *n, const char *name) {
+    for (size_t i = 0; i < n->attr_count; i++)
+        if (n->attrs[i].name && name_eq(n, n->attrs[i].name, name))
+            return n->attrs[i].value ? n->attrs[i].value : "";
+    return NULL;
+}
+
+static int has_token(const char *list, const char *tok) {
+    size_t len = strlen(tok);
+    if (len == 0) return 0;
+    while (list && *list) {
+        while (is_space(*list)) list++;
+        const char *start = list;
+        while (*list && !is_space(*list)) list++;
+        if ((size_t)(list - start) == len && memcmp(start, tok, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int match_attr(const sel_op *op, const node *n) {
+    const char *v = find_attr_ns(n, op->name);
+    if (!v) return 0;
+    size_t vl = strlen(v), ol = op->value ? strlen(op->value) : 0;
+    switch (op->match) {
+        case ATTR_EXISTS: return 1;
+        case ATTR_EQUALS: return strcmp(v, op->value) == 0;
+        case ATTR_INCLUDES: return has_token(v, op->value);
+        case ATTR_DASH:
+            return strncmp(v, op->value, ol) == 0 && (v[ol] == '\0' || v[ol] == '-');
+        case ATTR_PREFIX: return ol > 0 && strncmp(v, op->value, ol) == 0;
+        case ATTR_SUFFIX: return ol > 0 && vl >= ol && strcmp(v + vl - ol, op->value) == 0;
+        case ATTR_SUBSTRING: return ol > 0 && strstr(v, op->value) != NULL;
+    }
+    return 0;
+}
+
+/* 1-based position among element siblings */
+static int element_position(const node *n, int from_end) {
+    if (!n->parent) return 1;
+    int pos = 0, after = 0, seen = 0;
+    for (const node *s = n->parent->first_child; s; s = s->next_sibling) {
+        if (s == n) { seen = 1; pos++; continue; }
+        if (s->type != NODE_ELEMENT) continue;
+        if (seen) after++;
+        else pos++;
+    }
+    return from_end ? after + 1 : pos;
+}
+
+static int match_nth(const sel_op *op, const node *n) {
+    int i = element_position(n, op->from_end);
+    if (op->a == 0) return i == op->b;
+    int d = i - op->b;
+    return (d / op->a) >= 0 && d % op->a == 0;
+}
+
+static int is_empty_element(const node *n) {
+    for (const node *c = n->first_child; c; c = c->next_sibling) {
+        if (c->type == NODE_ELEMENT) return 0;
+        if (c->type == NODE_TEXT && c->data && c->data[0]) return 0;
+    }
+    return 1;
+}
+
+static int match_compound(const sel_compound *c, const node *n) {
+    if (n->type != NODE_ELEMENT) return 0;
+    for (size_t i = 0; i < c->count; i++) {
+        const sel_op *op = &c->ops[i];
+        const char *v;
+        switch (op->kind) {
+            case SEL_TYPE:
+                if (!n->name || !name_eq(n, n->name, op->name)) return 0;
+                break;
+            case SEL_ID:
+                v = get_attr(n, "id");
+                if (!v || strcmp(v, op->name) != 0) return 0;
+                break;
+            case SEL_CLASS:
+                if (!has_token(get_attr(n, "class"), op->name)) return 0;
+                break;
+            case SEL_ATTR:
+                if (!match_attr(op, n)) return 0;
+                break;
+            case SEL_NTH:
+                if (!match_nth(op, n)) return 0;
+                break;
+            case SEL_ROOT:
+                if (!n->parent || n->parent->type != NODE_DOCUMENT) return 0;
+                break;
+            case SEL_EMPTY:
+                if (!is_empty_element(n)) return 0;
+                break;
+            case SEL_NOT:
+                if (selector_matches(op->inner, n)) return 0;
+                break;
+        }
+    }
+    return 1;
+}
+
+/* Outcome of matching compounds[k..] against an element. The failure
+ * kinds tell the caller how far back it has to restart, which keeps chains
+ * of descendant/sibling combinators from backtracking exponentially. */
+typedef enum {
+    MATCH_OK,
+    MATCH_RESTART_SIBLING,      /* try another sibling/ancestor candidate */
+    MATCH_RESTART_DESCENDANT,   /* only an outer ' ' combinator can help */
+    MATCH_FAIL                  /* no candidate can match */
+} match_result;
+
+static const node *prev_element(const node *n) {
+    const node *prev = NULL;
+    if (!n->parent) return NULL;
+    for (const node *s = n->parent->first_child; s && s != n; s = s->next_sibling)
+        if (s->type == NODE_ELEMENT) prev = s;
+    return prev;
+}
+
+static match_result match_from(const sel_complex *cx, size_t k, const node *n) {
+    if (!match_compound(&cx->compounds[k], n)) return MATCH_RESTART_SIBLING;
+    if (k + 1 == cx->count) return MATCH_OK;
+
+    char comb = cx->compounds[k].combinator;
+    int sibling = (comb == '+' || comb == '~');
+    const node *cand = n;
+    for (;;) {
+        cand = sibling ? prev_element(cand) : element_parent(cand);
+        if (!cand) return sibling ? MATCH_RESTART_DESCENDANT : MATCH_FAIL;
+
+        match_result r = match_from(cx, k + 1, cand);
+        if (r == MATCH_OK || r == MATCH_FAIL || comb == '+') return r;
+        if (comb == '>') return MATCH_RESTART_DESCENDANT;
+        if (comb == '~' && r == MATCH_RESTART_DESCENDANT) return r;
+        /* ' ' or '~': move on to the next candidate */
+    }
+}
+
+static int match_complex_at(const sel_complex *cx, size_t k, const node *n) {
+    return match_from(cx, k, n) == MATCH_OK;
+}
+
+int selector_matches(const selector *sel, const node *n) {
+    if (!sel || !n || n->type != NODE_ELEMENT) return 0;
+    for (size_t i = 0; i < sel->count; i++)
+        if (match_complex_at(&sel->items[i], 0, n)) return 1;
+    return 0;
+}
+
+static int matches_filtered(const selector *sel, const node *n,
+                            const ancestor_filter *f) {
+    for (size_t i = 0; i < sel->count; i++) {
+        const sel_complex *cx = &sel->items[i];
+        size_t h = 0;
+        while (h < cx->ancestor_hash_count &&
+               filter_may_contain(f, cx->ancestor_hashes[h]))
+            h++;
+        if (h == cx->ancestor_hash_count && match_complex_at(cx, 0, n))
+            return 1;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Queries
+ * ============================================================================ */
+
+typedef struct {
+    node **items;
+    size_t count;
+    size_t cap;
+    int first_only;
+    int failed;
+} match_list;
+
+static int match_list_push(match_list *out, node *n) {
+    if (out->count == out->cap) {
+        node **items = (node **)grow_array(out->items, &out->cap, sizeof(node *));
+        if (!items) { out->failed = 1; return 0; }
+        out->items = items;
+    }
+    out->items[out->count++] = n;
+    return 1;
+}
+
+/* Tree walk with a bloom filter of the current node's ancestors, so
+ * candidates whose required ancestor features are missing skip matching. */
+static void query_walk(node *root, const selector *sel, match_list *out) {
+    ancestor_filter *f = NULL;
+    for (size_t i = 0; i < sel->count && !f; i++) {
+        if (sel->items[i].ancestor_hash_count > 0) {
+            f = (ancestor_filter *)calloc(1, sizeof(ancestor_filter));
+            if (!f) break;      /* fall back to unfiltered matching */
+            for (const node *a = root; a; a = a->parent)
+                filter_update(f, a, 1);
+        }
+    }
+
+    node *n = root->first_child;
+    while (n) {
+        if (n->type == NODE_ELEMENT &&
+            (f ? matches_filtered(sel, n, f) : selector_matches(sel, n))) {
+            if (!match_list_push(out, n) || out->first_only) break;
+        }
+        if (n->first_child) {
+            if (f) filter_update(f, n, 1);
+            n = n->first_child;
+            continue;
+        }
+        while (n != root && !n->next_sibling) {
+            n = n->parent;
+            if (n != root && f) filter_update(f, n, -1);
+        }
+        n = (n == root) ? NULL : n->next_sibling;
+    }
+    free(f);
+}
+
+static int is_descendant(const node *n, const node *root) {
+    for (const node *p = n->parent; p; p = p->parent)
+        if (p == root) return 1;
+    return 0;
+}
+
+static int has_upper(const char *s) {
+    for (; *s; s++)
+        if (*s >= 'A' && *s <= 'Z') return 1;
+    return 0;
+}
+
+/* #id / .class / tag subjects: start from the document's index instead of a
+ * full walk. Returns 0 when the fast path does not apply. */
+static int query_indexed(node *root, const selector *sel, match_list *out) {
+    if (sel->count != 1) return 0;
+    node *doc = root;
+    while (doc->parent) doc = doc->parent;
+    if (doc->type != NODE_DOCUMENT) return 0;
+
+    const sel_compound *subject = &sel->items[0].compounds[0];
+    node *const *cands = NULL;
+    size_t ncand = 0;
+    const sel_op *key = NULL;
+    for (size_t i = 0; i < subject->count && !key; i++)
+        if (subject->ops[i].kind == SEL_ID) key = &subject->ops[i];
+    for (size_t i = 0; i < subject->count && !key; i++)
+        if (subject->ops[i].kind == SEL_CLASS) key = &subject->ops[i];
+    /* Tag names are stored as-is (lowercase for HTML), so a lowercase type
+     * selector finds exactly the elements it matches */
+    for (size_t i = 0; i < subject->count && !key; i++)
+        if (subject->ops[i].kind == SEL_TYPE && !has_upper(subject->ops[i].name))
+            key = &subject->ops[i];
+    if (!key) return 0;
+
+    if (key->kind == SEL_ID)
+        cands = node_get_elements_with_id(doc, key->name, &ncand);
+    else if (key->kind == SEL_CLASS)
+        cands = node_get_elements_by_class(doc, key->name, &ncand);
+    else
+        cands = node_get_elements_by_tag_name(doc, key->name, &ncand);
+    if (!doc->index) return 0;      /* index could not be built */
+
+    for (size_t i = 0; i < ncand; i++) {
+        node *c = cands[i];
+        if ((root == doc || is_descendant(c, root)) &&
+            match_complex_at(&sel->items[0], 0, c)) {
+            if (!match_list_push(out, c) || out->first_only) break;
+        }
+    }
+    return 1;
+}
+
+static void query_run(node *root, const selector *sel, match_list *out) {
+    if (!query_indexed(root, sel, out))
+        query_walk(root, sel, out);
+}
+
+node *selector_query_first(node *root, const selector *sel) {
+    match_list out = { NULL, 0, 0, 1, 0 };
+    if (!root || !sel) return NULL;
+    query_run(root, sel, &out);
+    node *first = out.count ? out.items[0] : NULL;
+    free(out.items);
+    return first;
+}
+
+node **selector_query_all(node *root, const selector *sel, size_t *count) {
+    match_list out = { NULL, 0, 0, 0, 0 };
+    if (count) *count = 0;
+    if (!root || !sel || !count) return NULL;
+    query_run(root, sel, &out);
+    if (out.failed) {
+        free(out.items);
+        return NULL;
+    }
+    if (!out.items) {
+        out.items = (node **)malloc(sizeof(node *));
+        if (!out.items) return NULL;
+    }
+    *count = out.count;
+    return out.items;
+}
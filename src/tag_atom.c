@@ -0,0 +1,180 @@
+#include "tag_atom.h"
+
+#include <string.h>
+
+static const char *const atom_names[TAG_ATOM_COUNT] = {
+    [TAG_A] = "a",
+    [TAG_ABBR] = "abbr",
+    [TAG_ADDRESS] = "address",
+    [TAG_ANNOTATION_XML] = "annotation-xml",
+    [TAG_APPLET] = "applet",
+    [TAG_AREA] = "area",
+    [TAG_ARTICLE] = "article",
+    [TAG_ASIDE] = "aside",
+    [TAG_AUDIO] = "audio",
+    [TAG_B] = "b",
+    [TAG_BASE] = "base",
+    [TAG_BASEFONT] = "basefont",
+    [TAG_BDI] = "bdi",
+    [TAG_BDO] = "bdo",
+    [TAG_BGSOUND] = "bgsound",
+    [TAG_BIG] = "big",
+    [TAG_BLOCKQUOTE] = "blockquote",
+    [TAG_BODY] = "body",
+    [TAG_BR] = "br",
+    [TAG_BUTTON] = "button",
+    [TAG_CANVAS] = "canvas",
+    [TAG_CAPTION] = "caption",
+    [TAG_CENTER] = "center",
+    [TAG_CITE] = "cite",
+    [TAG_CODE] = "code",
+    [TAG_COL] = "col",
+    [TAG_COLGROUP] = "colgroup",
+    [TAG_CONTENT] = "content",
+    [TAG_DATA] = "data",
+    [TAG_DATALIST] = "datalist",
+    [TAG_DD] = "dd",
+    [TAG_DEL] = "del",
+    [TAG_DESC] = "desc",
+    [TAG_DETAILS] = "details",
+    [TAG_DFN] = "dfn",
+    [TAG_DIALOG] = "dialog",
+    [TAG_DIR] = "dir",
+    [TAG_DIV] = "div",
+    [TAG_DL] = "dl",
+    [TAG_DT] = "dt",
+    [TAG_EM] = "em",
+    [TAG_EMBED] = "embed",
+    [TAG_FIELDSET] = "fieldset",
+    [TAG_FIGCAPTION] = "figcaption",
+    [TAG_FIGURE] = "figure",
+    [TAG_FONT] = "font",
+    [TAG_FOOTER] = "footer",
+    [TAG_FOREIGNOBJECT] = "foreignObject",
+    [TAG_FORM] = "form",
+    [TAG_FRAME] = "frame",
+    [TAG_FRAMESET] = "frameset",
+    [TAG_H1] = "h1",
+    [TAG_H2] = "h2",
+    [TAG_H3] = "h3",
+    [TAG_H4] = "h4",
+    [TAG_H5] = "h5",
+    [TAG_H6] = "h6",
+    [TAG_HEAD] = "head",
+    [TAG_HEADER] = "header",
+    [TAG_HGROUP] = "hgroup",
+    [TAG_HR] = "hr",
+    [TAG_HTML] = "html",
+    [TAG_I] = "i",
+    [TAG_IFRAME] = "iframe",
+    [TAG_IMG] = "img",
+    [TAG_INPUT] = "input",
+    [TAG_INS] = "ins",
+    [TAG_KBD] = "kbd",
+    [TAG_KEYGEN] = "keygen",
+    [TAG_LABEL] = "label",
+    [TAG_LEGEND] = "legend",
+    [TAG_LI] = "li",
+    [TAG_LINK] = "link",
+    [TAG_LISTING] = "listing",
+    [TAG_MAIN] = "main",
+    [TAG_MALIGNMARK] = "malignmark",
+    [TAG_MAP] = "map",
+    [TAG_MARK] = "mark",
+    [TAG_MARQUEE] = "marquee",
+    [TAG_MATH] = "math",
+    [TAG_MENU] = "menu",
+    [TAG_META] = "meta",
+    [TAG_METER] = "meter",
+    [TAG_MGLYPH] = "mglyph",
+    [TAG_MI] = "mi",
+    [TAG_MN] = "mn",
+    [TAG_MO] = "mo",
+    [TAG_MS] = "ms",
+    [TAG_MTEXT] = "mtext",
+    [TAG_NAV] = "nav",
+    [TAG_NOBR] = "nobr",
+    [TAG_NOEMBED] = "noembed",
+    [TAG_NOFRAMES] = "noframes",
+    [TAG_NOSCRIPT] = "noscript",
+    [TAG_OBJECT] = "object",
+    [TAG_OL] = "ol",
+    [TAG_OPTGROUP] = "optgroup",
+    [TAG_OPTION] = "option",
+    [TAG_OUTPUT] = "output",
+    [TAG_P] = "p",
+    [TAG_PARAM] = "param",
+    [TAG_PICTURE] = "picture",
+    [TAG_PLAINTEXT] = "plaintext",
+    [TAG_PRE] = "pre",
+    [TAG_PROGRESS] = "progress",
+    [TAG_Q] = "q",
+    [TAG_RB] = "rb",
+    [TAG_RP] = "rp",
+    [TAG_RT] = "rt",
+    [TAG_RTC] = "rtc",
+    [TAG_RUBY] = "ruby",
+    [TAG_S] = "s",
+    [TAG_SAMP] = "samp",
+    [TAG_SCRIPT] = "script",
+    [TAG_SEARCH] = "search",
+    [TAG_SECTION] = "section",
+    [TAG_SELECT] = "select",
+    [TAG_SLOT] = "slot",
+    [TAG_SMALL] = "small",
+    [TAG_SOURCE] = "source",
+    [TAG_SPAN] = "span",
+    [TAG_STRIKE] = "strike",
+    [TAG_STRONG] = "strong",
+    [TAG_STYLE] = "style",
+    [TAG_SUB] = "sub",
+    [TAG_SUMMARY] = "summary",
+    [TAG_SUP] = "sup",
+    [TAG_SVG] = "svg",
+    [TAG_TABLE] = "table",
+    [TAG_TBODY] = "tbody",
+    [TAG_TD] = "td",
+    [TAG_TEMPLATE] = "template",
+    [TAG_TEXTAREA] = "textarea",
+    [TAG_TFOOT] = "tfoot",
+    [TAG_TH] = "th",
+    [TAG_THEAD] = "thead",
+    [TAG_TIME] = "time",
+    [TAG_TITLE] = "title",
+    [TAG_TR] = "tr",
+    [TAG_TRACK] = "track",
+    [TAG_TT] = "tt",
+    [TAG_U] = "u",
+    [TAG_UL] = "ul",
+    [TAG_VAR] = "var",
+    [TAG_VIDEO] = "video",
+    [TAG_WBR] = "wbr",
+    [TAG_XMP] = "xmp",
+};
+
+/* Atoms are in alphabetical order, so the names starting with a given
+ * letter run from that letter's entry up to the next one's. */
+static const unsigned short letter_start['z' - 'a' + 2] = {
+    TAG_A, TAG_B, TAG_CANVAS, TAG_DATA, TAG_EM, TAG_FIELDSET, TAG_H1, TAG_H1,
+    TAG_I, TAG_KBD, TAG_KBD, TAG_LABEL, TAG_MAIN, TAG_NAV, TAG_OBJECT, TAG_P,
+    TAG_Q, TAG_RB, TAG_S, TAG_TABLE, TAG_U, TAG_VAR, TAG_WBR, TAG_XMP,
+    TAG_ATOM_COUNT, TAG_ATOM_COUNT, TAG_ATOM_COUNT,
+};
+
+tag_atom tag_atom_lookup(const char *name) {
+    if (!name) return TAG_UNKNOWN;
+    unsigned letter = (unsigned char)name[0] - 'a';
+    if (letter > 'z' - 'a') return TAG_UNKNOWN;
+
+    for (unsigned i = letter_start[letter]; i < letter_start[letter + 1]; i++) {
+        const char *s = atom_names[i];
+        if (s[1] == name[1] && (s[1] == '\0' || strcmp(s + 2, name + 2) == 0))
+            return (tag_atom)i;
+    }
+    return TAG_UNKNOWN;
+}
+
+const char *tag_atom_name(tag_atom atom) {
+    if (atom <= TAG_UNKNOWN || atom >= TAG_ATOM_COUNT) return NULL;
+    return atom_names[atom];
+}
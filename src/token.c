@@ -14,6 +14,7 @@ void token_init(token *t) {
     t->attr_count = 0;
     t->self_closing = 0;
     t->force_quirks = 0;
+    t->attrs_moved = 0;
 }
 
 void token_free(token *t) {
@@ -23,10 +24,53 @@ void token_free(token *t) {
     free(t->public_id);
     free(t->system_id);
     free(t->data);
-    for (i = 0; i < t->attr_count; ++i) {
+    for (i = 0; i < t->attr_count && !t->attrs_moved; ++i) {
         free(t->attrs[i].name);
         free(t->attrs[i].value);
     }
     free(t->attrs);
     token_init(t);
 }
+
+static size_t name_hash(const char *name) {
+    size_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+static int attr_name_set_grow(attr_name_set *s) {
+    size_t cap = s->cap ? s->cap * 2 : 32;
+    const char **slots = (const char **)calloc(cap, sizeof(*slots));
+    if (!slots) return 0;
+    for (size_t i = 0; i < s->cap; i++) {
+        if (!s->slots[i]) continue;
+        size_t j = name_hash(s->slots[i]) & (cap - 1);
+        while (slots[j]) j = (j + 1) & (cap - 1);
+        slots[j] = s->slots[i];
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->cap = cap;
+    return 1;
+}
+
+int attr_name_set_add(attr_name_set *s, const char *name) {
+    if (!s || !name) return -1;
+    /* Keep the load factor at or below one half */
+    if ((s->count + 1) * 2 > s->cap && !attr_name_set_grow(s)) return -1;
+    size_t i = name_hash(name) & (s->cap - 1);
+    for (; s->slots[i]; i = (i + 1) & (s->cap - 1))
+        if (strcmp(s->slots[i], name) == 0) return 0;
+    s->slots[i] = name;
+    s->count++;
+    return 1;
+}
+
+void attr_name_set_free(attr_name_set *s) {
+    if (!s) return;
+    free(s->slots);
+    s->slots = NULL;
+    s->cap = 0;
+    s->count = 0;
+}
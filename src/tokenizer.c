@@ -1,5 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 #include "tokenizer.h"
+#include "parse_stats.h"
+#include "parse_error.h"
 
 #include <ctype.h>
 #include <stdio.h>
@@ -64,11 +66,7 @@ static char *dup_string(const char *s) {
     return out;
 }
 
-typedef struct {
-    char *buf;
-    size_t len;
-    size_t cap;
-} strbuf;
+typedef tokenizer_buf strbuf;
 
 static void sb_init(strbuf *sb) {
     sb->buf = NULL;
@@ -83,6 +81,12 @@ static void sb_free(strbuf *sb) {
     sb->cap = 0;
 }
 
+/* Empty, keeping the capacity. */
+static void sb_clear(strbuf *sb) {
+    sb->len = 0;
+    if (sb->buf) sb->buf[0] = '\0';
+}
+
 static int sb_reserve(strbuf *sb, size_t extra) {
     if (sb->len + extra + 1 <= sb->cap) return 1;
     size_t new_cap = sb->cap ? sb->cap * 2 : 32;
@@ -101,6 +105,10 @@ static int sb_push_char(strbuf *sb, char c) {
     return 1;
 }
 
+static const char *sb_cstr(const strbuf *sb) {
+    return sb->buf ? sb->buf : "";
+}
+
 static char *sb_to_string(strbuf *sb) {
     if (!sb->buf) return dup_string("");
     char *out = (char *)malloc(sb->len + 1);
@@ -109,15 +117,40 @@ static char *sb_to_string(strbuf *sb) {
     return out;
 }
 
-static int tz_errors_enabled = -1;
-static void report_error(const tokenizer *tz, const char *msg) {
-    if (!msg) return;
-    if (tz_errors_enabled < 0) {
-        const char *e = getenv("HTMLPARSER_PARSE_ERRORS");
-        tz_errors_enabled = (e && e[0] == '1') ? 1 : 0;
+static _Thread_local tokenizer_scratch *scratch_current;
+
+/* The attached scratch's buffer emptied, or local initialised when there
+ * is none. */
+static strbuf *scratch_buf(strbuf *local, strbuf *kept) {
+    if (kept) {
+        sb_clear(kept);
+        return kept;
     }
-    if (tz_errors_enabled)
-        fprintf(stderr, "[parse error] line=%zu col=%zu: %s\n", tz ? tz->line : 0, tz ? tz->col : 0, msg);
+    sb_init(local);
+    return local;
+}
+
+tokenizer_scratch *tokenizer_scratch_attach(tokenizer_scratch *s) {
+    tokenizer_scratch *prev = scratch_current;
+    scratch_current = s;
+    return prev;
+}
+
+void tokenizer_scratch_free(tokenizer_scratch *s) {
+    if (!s) return;
+    sb_free(&s->tag_name);
+    sb_free(&s->attr_name);
+    sb_free(&s->attr_value);
+    sb_free(&s->comment);
+}
+
+/* Tokenizer inside tokenizer_next() on this thread, so character
+ * reference errors can carry a position (set only while a sink listens) */
+static _Thread_local const tokenizer *tz_reporting;
+
+static void report_error(const tokenizer *tz, parse_error_code code) {
+    parse_error_emit_at(code, tz ? tz->pos : PARSE_ERROR_NO_OFFSET,
+                        tz ? tz->line : 0, tz ? tz->col : 0);
 }
 
 static int is_hex_digit(char c) {
@@ -160,37 +193,35 @@ static size_t encode_utf8(unsigned int codepoint, char *out) {
     return 1;
 }
 
-/* Parse error reporter for character reference context (no tokenizer pointer) */
-static void charref_error(const char *msg) {
-    if (tz_errors_enabled < 0) {
-        const char *e = getenv("HTMLPARSER_PARSE_ERRORS");
-        tz_errors_enabled = (e && e[0] == '1') ? 1 : 0;
-    }
-    if (tz_errors_enabled)
-        fprintf(stderr, "[parse error] %s\n", msg);
+/* Parse error reporter for character reference context (no tokenizer
+ * pointer); printed bare unless a sink is attached */
+static void charref_error(parse_error_code code) {
+    const tokenizer *tz = parse_errors_current ? tz_reporting : NULL;
+    parse_error_emit_at(code, tz ? tz->pos : PARSE_ERROR_NO_OFFSET,
+                        tz ? tz->line : 0, tz ? tz->col : 0);
 }
 
 /* WHATWG §13.2.5.80 — Numeric character reference end state */
 static unsigned int numeric_ref_adjust(unsigned int cp) {
     /* 1. NULL → U+FFFD */
     if (cp == 0x00) {
-        charref_error("null-character-reference");
+        charref_error(PARSE_ERR_NULL_CHARACTER_REFERENCE);
         return 0xFFFD;
     }
     /* 2. Out of Unicode range → U+FFFD */
     if (cp > 0x10FFFF) {
-        charref_error("character-reference-outside-unicode-range");
+        charref_error(PARSE_ERR_CHARACTER_REFERENCE_OUTSIDE_UNICODE_RANGE);
         return 0xFFFD;
     }
     /* 3. Surrogate → U+FFFD */
     if (cp >= 0xD800 && cp <= 0xDFFF) {
-        charref_error("surrogate-character-reference");
+        charref_error(PARSE_ERR_SURROGATE_CHARACTER_REFERENCE);
         return 0xFFFD;
     }
 
     /* 4. Noncharacter — parse error, keep character as-is */
     if ((cp >= 0xFDD0 && cp <= 0xFDEF) || ((cp & 0xFFFE) == 0xFFFE)) {
-        charref_error("noncharacter-character-reference");
+        charref_error(PARSE_ERR_NONCHARACTER_CHARACTER_REFERENCE);
         return cp;
     }
 
@@ -201,7 +232,7 @@ static unsigned int numeric_ref_adjust(unsigned int cp) {
         cp == 0x0B ||
         (cp >= 0x0E && cp <= 0x1F) ||
         (cp >= 0x7F && cp <= 0x9F)) {
-        charref_error("control-character-reference");
+        charref_error(PARSE_ERR_CONTROL_CHARACTER_REFERENCE);
     }
 
     /* 6. Windows-1252 mapping table (0x80–0x9F control area) */
@@ -345,6 +376,11 @@ static void entities_load_once(void) {
     }
 }
 
+void tokenizer_global_init(void) {
+    entities_load_once();
+    parse_errors_enabled();
+}
+
 static const char *match_named_entity(const char *s, size_t *consumed, int in_attribute) {
     entities_load_once();
     const char *best_value = NULL;
@@ -380,6 +416,8 @@ static const char *match_named_entity(const char *s, size_t *consumed, int in_at
     if (best_value) {
         *consumed = best_consumed;
     }
+    PARSE_STAT_ADD(entity_lookups, 1);
+    if (!best_value) PARSE_STAT_ADD(entity_misses, 1);
     return best_value;
 }
 
@@ -787,24 +825,107 @@ static int process_script_data(tokenizer *tz, token *out) {
 
 static void enter_raw_state(tokenizer *tz, const char *tag, tokenizer_state state) {
     if (!tz || !tag) return;
-    strncpy(tz->raw_tag, tag, sizeof(tz->raw_tag) - 1);
-    tz->raw_tag[sizeof(tz->raw_tag) - 1] = '\0';
+    size_t len = strlen(tag);
+    if (len > sizeof(tz->raw_tag) - 1) len = sizeof(tz->raw_tag) - 1;
+    memcpy(tz->raw_tag, tag, len);
+    tz->raw_tag[len] = '\0';
     tz->state = state;
 }
 
-static void append_attr(token *out, const char *name, const char *value) {
+/* ============================================================================
+ * Start tag attribute list
+ * Attributes collect in a small inline array that doubles onto the heap,
+ * and move to the token in one allocation when the tag ends. Duplicate
+ * names are found with a linear scan while the list is short and with a
+ * name set beyond ATTR_NAME_SET_MIN, so long attribute lists stay linear.
+ * ============================================================================ */
+#define ATTR_INLINE 8
+
+typedef struct {
+    token_attr inline_buf[ATTR_INLINE];
+    token_attr *items;
+    size_t count;
+    size_t cap;
+    attr_name_set names;    /* filled once count reaches ATTR_NAME_SET_MIN */
+} attr_list;
+
+static void attr_list_init(attr_list *al) {
+    al->items = al->inline_buf;
+    al->count = 0;
+    al->cap = ATTR_INLINE;
+    al->names = (attr_name_set){0};
+}
+
+static int attr_list_has(attr_list *al, const char *name) {
+    if (al->count < ATTR_NAME_SET_MIN) {
+        for (size_t i = 0; i < al->count; ++i)
+            if (strcmp(al->items[i].name, name) == 0) return 1;
+        return 0;
+    }
+    if (al->names.count == 0) {
+        for (size_t i = 0; i < al->count; ++i)
+            if (attr_name_set_add(&al->names, al->items[i].name) < 0) break;
+    }
+    if (al->names.count == al->count)
+        return attr_name_set_add(&al->names, name) == 0;
+    /* Out of memory for the set: scan */
+    for (size_t i = 0; i < al->count; ++i)
+        if (strcmp(al->items[i].name, name) == 0) return 1;
+    return 0;
+}
+
+/* Takes ownership of name and value (NULL stands for "") */
+static void append_attr(attr_list *al, char *name, char *value) {
+    if (!name) name = dup_string("");
+    if (!value) value = dup_string("");
     /* WHATWG: duplicate attribute name is a parse error; drop the new one */
-    for (size_t i = 0; i < out->attr_count; ++i) {
-        if (out->attrs[i].name && strcmp(out->attrs[i].name, name) == 0) {
+    if (!name || !value || attr_list_has(al, name)) {
+        free(name);
+        free(value);
+        return;
+    }
+    if (al->count == al->cap) {
+        size_t cap = al->cap * 2;
+        token_attr *next;
+        if (al->items == al->inline_buf) {
+            next = (token_attr *)malloc(cap * sizeof(token_attr));
+            if (next) memcpy(next, al->inline_buf, al->count * sizeof(token_attr));
+        } else {
+            next = (token_attr *)realloc(al->items, cap * sizeof(token_attr));
+        }
+        if (!next) {
+            /* The set may already hold name */
+            if (al->names.count > al->count) attr_name_set_free(&al->names);
+            free(name);
+            free(value);
             return;
         }
+        al->items = next;
+        al->cap = cap;
     }
-    token_attr *next = (token_attr *)realloc(out->attrs, sizeof(token_attr) * (out->attr_count + 1));
-    if (!next) return;
-    out->attrs = next;
-    out->attrs[out->attr_count].name = dup_string(name);
-    out->attrs[out->attr_count].value = dup_string(value);
-    out->attr_count++;
+    al->items[al->count].name = name;
+    al->items[al->count].value = value;
+    al->count++;
+}
+
+/* Hand the collected attributes to the token */
+static void attr_list_finish(attr_list *al, token *out) {
+    attr_name_set_free(&al->names);
+    if (al->count == 0) return;
+    if (al->items == al->inline_buf) {
+        out->attrs = (token_attr *)malloc(al->count * sizeof(token_attr));
+        if (!out->attrs) {
+            for (size_t i = 0; i < al->count; ++i) {
+                free(al->items[i].name);
+                free(al->items[i].value);
+            }
+            return;
+        }
+        memcpy(out->attrs, al->inline_buf, al->count * sizeof(token_attr));
+    } else {
+        out->attrs = al->items;
+    }
+    out->attr_count = al->count;
 }
 
 static void parse_comment(tokenizer *tz, token *out) {
@@ -825,8 +946,9 @@ static void parse_comment(tokenizer *tz, token *out) {
         CS_COMMENT_END_BANG
     } comment_state;
 
-    strbuf data;
-    sb_init(&data);
+    strbuf local;
+    strbuf *data = scratch_buf(&local, scratch_current
+                                       ? &scratch_current->comment : NULL);
     comment_state state = CS_COMMENT_START;
     char c;
 
@@ -843,12 +965,12 @@ static void parse_comment(tokenizer *tz, token *out) {
                     advance(tz, 1);
                 } else if (c == '>') {
                     /* <!-->  — abrupt-closing-of-empty-comment parse error */
-                    report_error(tz, "abrupt-closing-of-empty-comment");
+                    report_error(tz, PARSE_ERR_ABRUPT_CLOSING_OF_EMPTY_COMMENT);
                     advance(tz, 1);
                     goto emit;
                 } else if (c == '\0') {
                     /* EOF — eof-in-comment parse error */
-                    report_error(tz, "eof-in-comment");
+                    report_error(tz, PARSE_ERR_EOF_IN_COMMENT);
                     goto emit;
                 } else {
                     /* Reconsume in COMMENT state */
@@ -863,24 +985,24 @@ static void parse_comment(tokenizer *tz, token *out) {
                     advance(tz, 1);
                 } else if (c == '>') {
                     /* <!--->  — abrupt-closing-of-empty-comment parse error */
-                    report_error(tz, "abrupt-closing-of-empty-comment");
+                    report_error(tz, PARSE_ERR_ABRUPT_CLOSING_OF_EMPTY_COMMENT);
                     advance(tz, 1);
                     goto emit;
                 } else if (c == '\0') {
                     /* EOF — eof-in-comment parse error */
-                    report_error(tz, "eof-in-comment");
-                    sb_push_char(&data, '-');
+                    report_error(tz, PARSE_ERR_EOF_IN_COMMENT);
+                    sb_push_char(data, '-');
                     goto emit;
                 } else {
                     /* Append '-' from COMMENT_START_DASH, reconsume in COMMENT */
-                    sb_push_char(&data, '-');
+                    sb_push_char(data, '-');
                     state = CS_COMMENT;
                 }
                 break;
 
             case CS_COMMENT:
                 if (c == '<') {
-                    sb_push_char(&data, c);
+                    sb_push_char(data, c);
                     state = CS_COMMENT_LESS_THAN_SIGN;
                     advance(tz, 1);
                 } else if (c == '-') {
@@ -888,21 +1010,21 @@ static void parse_comment(tokenizer *tz, token *out) {
                     advance(tz, 1);
                 } else if (c == '\0') {
                     /* EOF — eof-in-comment parse error */
-                    report_error(tz, "eof-in-comment");
+                    report_error(tz, PARSE_ERR_EOF_IN_COMMENT);
                     goto emit;
                 } else {
-                    sb_push_char(&data, c);
+                    sb_push_char(data, c);
                     advance(tz, 1);
                 }
                 break;
 
             case CS_COMMENT_LESS_THAN_SIGN:
                 if (c == '!') {
-                    sb_push_char(&data, c);
+                    sb_push_char(data, c);
                     state = CS_COMMENT_LESS_THAN_SIGN_BANG;
                     advance(tz, 1);
                 } else if (c == '<') {
-                    sb_push_char(&data, c);
+                    sb_push_char(data, c);
                     advance(tz, 1);
                     /* Stay in CS_COMMENT_LESS_THAN_SIGN */
                 } else {
@@ -933,7 +1055,7 @@ static void parse_comment(tokenizer *tz, token *out) {
                     state = CS_COMMENT_END;
                 } else {
                     /* nested-comment parse error */
-                    report_error(tz, "nested-comment");
+                    report_error(tz, PARSE_ERR_NESTED_COMMENT);
                     state = CS_COMMENT_END;
                 }
                 break;
@@ -944,12 +1066,12 @@ static void parse_comment(tokenizer *tz, token *out) {
                     advance(tz, 1);
                 } else if (c == '\0') {
                     /* EOF — eof-in-comment parse error */
-                    report_error(tz, "eof-in-comment");
-                    sb_push_char(&data, '-');
+                    report_error(tz, PARSE_ERR_EOF_IN_COMMENT);
+                    sb_push_char(data, '-');
                     goto emit;
                 } else {
                     /* Append '-' and reconsume in COMMENT */
-                    sb_push_char(&data, '-');
+                    sb_push_char(data, '-');
                     state = CS_COMMENT;
                 }
                 break;
@@ -964,19 +1086,19 @@ static void parse_comment(tokenizer *tz, token *out) {
                     advance(tz, 1);
                 } else if (c == '-') {
                     /* Extra '-' in "---" sequence: append one '-' to data */
-                    sb_push_char(&data, '-');
+                    sb_push_char(data, '-');
                     advance(tz, 1);
                     /* Stay in CS_COMMENT_END */
                 } else if (c == '\0') {
                     /* EOF — eof-in-comment parse error */
-                    report_error(tz, "eof-in-comment");
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '-');
+                    report_error(tz, PARSE_ERR_EOF_IN_COMMENT);
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '-');
                     goto emit;
                 } else {
                     /* "--" not followed by '>': append "--" to data, reconsume */
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '-');
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '-');
                     state = CS_COMMENT;
                 }
                 break;
@@ -984,28 +1106,28 @@ static void parse_comment(tokenizer *tz, token *out) {
             case CS_COMMENT_END_BANG:
                 if (c == '-') {
                     /* "--!-" pattern: append "--!" to data */
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '!');
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '!');
                     state = CS_COMMENT_END_DASH;
                     advance(tz, 1);
                 } else if (c == '>') {
                     /* "--!>" — incorrectly-closed-comment parse error, but still emit */
-                    report_error(tz, "incorrectly-closed-comment");
+                    report_error(tz, PARSE_ERR_INCORRECTLY_CLOSED_COMMENT);
                     advance(tz, 1);
                     goto emit;
                 } else if (c == '\0') {
                     /* EOF — eof-in-comment parse error */
-                    report_error(tz, "eof-in-comment");
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '!');
+                    report_error(tz, PARSE_ERR_EOF_IN_COMMENT);
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '!');
                     goto emit;
                 } else {
                     /* "--!X" — append "--!" to data, reconsume in COMMENT */
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '-');
-                    sb_push_char(&data, '!');
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '-');
+                    sb_push_char(data, '!');
                     state = CS_COMMENT;
                 }
                 break;
@@ -1013,8 +1135,8 @@ static void parse_comment(tokenizer *tz, token *out) {
     }
 
 emit:
-    out->data = sb_to_string(&data);
-    sb_free(&data);
+    out->data = sb_to_string(data);
+    if (data == &local) sb_free(&local);
 }
 
 static void parse_doctype(tokenizer *tz, token *out) {
@@ -1038,7 +1160,7 @@ static void parse_doctype(tokenizer *tz, token *out) {
     }
     if (name_end == name_start) {
         out->force_quirks = 1;
-        report_error(tz, "doctype name missing");
+        report_error(tz, PARSE_ERR_DOCTYPE_NAME_MISSING);
     }
     skip_whitespace(tz);
     if (starts_with_ci(tz, "public")) {
@@ -1047,7 +1169,7 @@ static void parse_doctype(tokenizer *tz, token *out) {
         char quote = peek(tz, 0);
         if (quote != '"' && quote != '\'') {
             out->force_quirks = 1;
-            report_error(tz, "doctype public id missing");
+            report_error(tz, PARSE_ERR_DOCTYPE_PUBLIC_ID_MISSING);
             ok = 0;
         } else {
             advance(tz, 1);
@@ -1059,7 +1181,7 @@ static void parse_doctype(tokenizer *tz, token *out) {
             if (peek(tz, 0) == quote) advance(tz, 1);
             else {
                 out->force_quirks = 1;
-                report_error(tz, "doctype public id missing closing quote");
+                report_error(tz, PARSE_ERR_DOCTYPE_PUBLIC_ID_UNTERMINATED);
                 ok = 0;
             }
         }
@@ -1075,7 +1197,7 @@ static void parse_doctype(tokenizer *tz, token *out) {
             if (peek(tz, 0) == quote2) advance(tz, 1);
             else {
                 out->force_quirks = 1;
-                report_error(tz, "doctype system id missing closing quote");
+                report_error(tz, PARSE_ERR_DOCTYPE_SYSTEM_ID_UNTERMINATED);
                 ok = 0;
             }
         }
@@ -1085,7 +1207,7 @@ static void parse_doctype(tokenizer *tz, token *out) {
         char quote = peek(tz, 0);
         if (quote != '"' && quote != '\'') {
             out->force_quirks = 1;
-            report_error(tz, "doctype system id missing");
+            report_error(tz, PARSE_ERR_DOCTYPE_SYSTEM_ID_MISSING);
             ok = 0;
         } else {
             advance(tz, 1);
@@ -1097,7 +1219,7 @@ static void parse_doctype(tokenizer *tz, token *out) {
             if (peek(tz, 0) == quote) advance(tz, 1);
             else {
                 out->force_quirks = 1;
-                report_error(tz, "doctype system id missing closing quote");
+                report_error(tz, PARSE_ERR_DOCTYPE_SYSTEM_ID_UNTERMINATED);
                 ok = 0;
             }
         }
@@ -1134,7 +1256,7 @@ static void parse_end_tag(tokenizer *tz, token *out) {
         for (size_t i = 0; out->name[i]; ++i) out->name[i] = to_lower_ascii(out->name[i]);
     }
     if (peek(tz, 0) != '>' && tz->pos < tz->len) {
-        report_error(tz, "end tag has trailing garbage/attributes");
+        report_error(tz, PARSE_ERR_END_TAG_WITH_ATTRIBUTES);
     }
     while (tz->pos < tz->len && peek(tz, 0) != '>') {
         advance(tz, 1);
@@ -1156,14 +1278,15 @@ static void parse_start_tag(tokenizer *tz, token *out) {
         ST_SELF_CLOSING
     } state = ST_TAG_OPEN;
 
-    strbuf tag_name;
-    strbuf attr_name;
-    strbuf attr_value;
+    tokenizer_scratch *scratch = scratch_current;
+    strbuf local[3];
+    strbuf *tag_name = scratch_buf(&local[0], scratch ? &scratch->tag_name : NULL);
+    strbuf *attr_name = scratch_buf(&local[1], scratch ? &scratch->attr_name : NULL);
+    strbuf *attr_value = scratch_buf(&local[2], scratch ? &scratch->attr_value : NULL);
+    attr_list attrs;
     char c;
 
-    sb_init(&tag_name);
-    sb_init(&attr_name);
-    sb_init(&attr_value);
+    attr_list_init(&attrs);
 
     out->type = TOKEN_START_TAG;
     advance(tz, 1); /* '<' */
@@ -1188,7 +1311,7 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                 } else if (c == '\0') {
                     goto done;
                 } else {
-                    sb_push_char(&tag_name, to_lower_ascii(c));
+                    sb_push_char(tag_name, to_lower_ascii(c));
                     advance(tz, 1);
                 }
                 break;
@@ -1202,13 +1325,11 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                     advance(tz, 1);
                     goto done;
                 } else if (c == '=') {
-                    report_error(tz, "attribute name missing before '='");
+                    report_error(tz, PARSE_ERR_ATTRIBUTE_NAME_MISSING);
                     advance(tz, 1);
                 } else {
-                    sb_free(&attr_name);
-                    sb_free(&attr_value);
-                    sb_init(&attr_name);
-                    sb_init(&attr_value);
+                    sb_clear(attr_name);
+                    sb_clear(attr_value);
                     state = ST_ATTR_NAME;
                 }
                 break;
@@ -1220,9 +1341,7 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                     state = ST_BEFORE_ATTR_VALUE;
                     advance(tz, 1);
                 } else if (c == '/' || c == '>' || c == '\0') {
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", "");
-                    free(an);
+                    append_attr(&attrs, sb_to_string(attr_name), NULL);
                     if (c == '/') {
                         state = ST_SELF_CLOSING;
                         advance(tz, 1);
@@ -1234,9 +1353,9 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                     }
                 } else {
                     if (!is_attr_name_char(c)) {
-                        report_error(tz, "unexpected character in attribute name");
+                        report_error(tz, PARSE_ERR_UNEXPECTED_CHARACTER_IN_ATTRIBUTE_NAME);
                     }
-                    sb_push_char(&attr_name, to_lower_ascii(c));
+                    sb_push_char(attr_name, to_lower_ascii(c));
                     advance(tz, 1);
                 }
                 break;
@@ -1247,21 +1366,20 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                     state = ST_BEFORE_ATTR_VALUE;
                     advance(tz, 1);
                 } else if (c == '>') {
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", "");
-                    free(an);
+                    append_attr(&attrs, sb_to_string(attr_name), NULL);
                     advance(tz, 1);
                     goto done;
                 } else if (c == '/') {
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", "");
-                    free(an);
+                    append_attr(&attrs, sb_to_string(attr_name), NULL);
                     state = ST_SELF_CLOSING;
                     advance(tz, 1);
+                } else if (c == '\0') {
+                    append_attr(&attrs, sb_to_string(attr_name), NULL);
+                    goto done;
                 } else {
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", "");
-                    free(an);
+                    /* A new attribute starts: <input hidden tabindex=0> */
+                    append_attr(&attrs, sb_to_string(attr_name), NULL);
+                    sb_clear(attr_name);
                     state = ST_ATTR_NAME;
                 }
                 break;
@@ -1275,10 +1393,8 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                     state = ST_ATTR_VALUE_SQ;
                     advance(tz, 1);
                 } else if (c == '>') {
-                    report_error(tz, "attribute value missing");
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", "");
-                    free(an);
+                    report_error(tz, PARSE_ERR_ATTRIBUTE_VALUE_MISSING);
+                    append_attr(&attrs, sb_to_string(attr_name), NULL);
                     advance(tz, 1);
                     goto done;
                 } else {
@@ -1287,65 +1403,45 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                 break;
             case ST_ATTR_VALUE_DQ:
                 if (c == '"') {
-                    char *av = sb_to_string(&attr_value);
-                    char *decoded = decode_character_references(av, 1);
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", decoded ? decoded : "");
-                    free(an);
-                    free(av);
-                    free(decoded);
+                    char *decoded = decode_character_references(sb_cstr(attr_value), 1);
+                    append_attr(&attrs, sb_to_string(attr_name), decoded);
                     state = ST_BEFORE_ATTR_NAME;
                     advance(tz, 1);
                 } else if (c == '\0') {
                     goto done;
                 } else {
-                    sb_push_char(&attr_value, c);
+                    sb_push_char(attr_value, c);
                     advance(tz, 1);
                 }
                 break;
             case ST_ATTR_VALUE_SQ:
                 if (c == '\'') {
-                    char *av = sb_to_string(&attr_value);
-                    char *decoded = decode_character_references(av, 1);
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", decoded ? decoded : "");
-                    free(an);
-                    free(av);
-                    free(decoded);
+                    char *decoded = decode_character_references(sb_cstr(attr_value), 1);
+                    append_attr(&attrs, sb_to_string(attr_name), decoded);
                     state = ST_BEFORE_ATTR_NAME;
                     advance(tz, 1);
                 } else if (c == '\0') {
                     goto done;
                 } else {
-                    sb_push_char(&attr_value, c);
+                    sb_push_char(attr_value, c);
                     advance(tz, 1);
                 }
                 break;
             case ST_ATTR_VALUE_UQ:
                 if (is_ascii_whitespace(c)) {
-                    char *av = sb_to_string(&attr_value);
-                    char *decoded = decode_character_references(av, 1);
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", decoded ? decoded : "");
-                    free(an);
-                    free(av);
-                    free(decoded);
+                    char *decoded = decode_character_references(sb_cstr(attr_value), 1);
+                    append_attr(&attrs, sb_to_string(attr_name), decoded);
                     state = ST_BEFORE_ATTR_NAME;
                     advance(tz, 1);
                 } else if (c == '>') {
-                    char *av = sb_to_string(&attr_value);
-                    char *decoded = decode_character_references(av, 1);
-                    char *an = sb_to_string(&attr_name);
-                    append_attr(out, an ? an : "", decoded ? decoded : "");
-                    free(an);
-                    free(av);
-                    free(decoded);
+                    char *decoded = decode_character_references(sb_cstr(attr_value), 1);
+                    append_attr(&attrs, sb_to_string(attr_name), decoded);
                     advance(tz, 1);
                     goto done;
                 } else if (c == '\0') {
                     goto done;
                 } else {
-                    sb_push_char(&attr_value, c);
+                    sb_push_char(attr_value, c);
                     advance(tz, 1);
                 }
                 break;
@@ -1354,20 +1450,23 @@ static void parse_start_tag(tokenizer *tz, token *out) {
                     out->self_closing = 1;
                     advance(tz, 1);
                 } else {
-                    report_error(tz, "unexpected '/' in start tag");
+                    report_error(tz, PARSE_ERR_UNEXPECTED_SOLIDUS_IN_TAG);
                 }
                 goto done;
         }
     }
 
 done:
-    out->name = sb_to_string(&tag_name);
-    sb_free(&tag_name);
-    sb_free(&attr_name);
-    sb_free(&attr_value);
+    out->name = sb_to_string(tag_name);
+    attr_list_finish(&attrs, out);
+    if (!scratch) {
+        sb_free(&local[0]);
+        sb_free(&local[1]);
+        sb_free(&local[2]);
+    }
 
     if (out->name && out->name[0] == '\0') {
-        report_error(tz, "tag name missing");
+        report_error(tz, PARSE_ERR_TAG_NAME_MISSING);
     }
 
     if (out->name) {
@@ -1426,12 +1525,7 @@ char *tokenizer_replace_nulls(const char *raw, size_t raw_len) {
     for (size_t i = 0; i < raw_len; i++) {
         unsigned char c = (unsigned char)raw[i];
         if (c == '\0') {
-            if (tz_errors_enabled < 0) {
-                const char *e = getenv("HTMLPARSER_PARSE_ERRORS");
-                tz_errors_enabled = (e && e[0] == '1') ? 1 : 0;
-            }
-            if (tz_errors_enabled)
-                fprintf(stderr, "[parse error] line=%zu col=%zu: unexpected null character\n", line, col);
+            parse_error_emit_at(PARSE_ERR_UNEXPECTED_NULL_CHARACTER, j, line, col);
             out[j++] = (char)0xEF;
             out[j++] = (char)0xBF;
             out[j++] = (char)0xBD;
@@ -1474,8 +1568,10 @@ void tokenizer_init(tokenizer *tz, const char *input) {
 
 static void set_raw_state(tokenizer *tz, const char *tag, tokenizer_state state) {
     if (!tz || !tag) return;
-    strncpy(tz->raw_tag, tag, sizeof(tz->raw_tag) - 1);
-    tz->raw_tag[sizeof(tz->raw_tag) - 1] = '\0';
+    size_t len = strlen(tag);
+    if (len > sizeof(tz->raw_tag) - 1) len = sizeof(tz->raw_tag) - 1;
+    memcpy(tz->raw_tag, tag, len);
+    tz->raw_tag[len] = '\0';
     tz->state = state;
 }
 
@@ -1506,6 +1602,7 @@ void tokenizer_next(tokenizer *tz, token *out) {
     char c;
     if (!tz || !out) return;
     token_init(out);
+    if (parse_errors_current) tz_reporting = tz;
 
     if (tz->pos >= tz->len) {
         out->type = TOKEN_EOF;
@@ -1542,7 +1639,7 @@ void tokenizer_next(tokenizer *tz, token *out) {
             return;
         }
         if (next == '/' && !is_tag_start(peek(tz, 2))) {
-            report_error(tz, "invalid end tag");
+            report_error(tz, PARSE_ERR_INVALID_END_TAG);
             out->type = TOKEN_CHARACTER;
             out->data = dup_string("<");
             advance(tz, 1);
@@ -1580,7 +1677,7 @@ void tokenizer_next(tokenizer *tz, token *out) {
         }
         if (next == '!') {
             /* Bogus comment: consume until '>' */
-            report_error(tz, "bogus markup declaration");
+            report_error(tz, PARSE_ERR_BOGUS_MARKUP_DECLARATION);
             advance(tz, 2);
             size_t start = tz->pos;
             while (tz->pos < tz->len && peek(tz, 0) != '>') {
@@ -0,0 +1,261 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tokenizer.h"
+#include "parse_stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ========================================================================
+ * Speculative parallel tokenization
+ *
+ * The input is cut into one chunk per thread at likely-safe points: a '<'
+ * followed by a tag-name character (or "</" + tag-name character). Each
+ * worker tokenizes its chunk assuming the DATA state, stopping at the first
+ * token that starts at or past the chunk end. Chunks are then stitched in
+ * order: a chunk is accepted as-is when the previous chunk stopped exactly
+ * at its start in the DATA state. Otherwise (the cut landed inside a
+ * comment, attribute value, or raw text) tokenizing continues sequentially
+ * from the real state until it lands on a token start of the speculative
+ * stream while in DATA, and the rest of that stream is spliced in.
+ * ======================================================================== */
+
+#define PARALLEL_MAX_THREADS 64
+
+typedef struct {
+    token *items;
+    size_t *starts;     /* input offset where each token began */
+    unsigned char *in_data; /* whether the tokenizer was in DATA there */
+    size_t count;
+    size_t cap;
+} token_vec;
+
+typedef struct {
+    const char *input;
+    size_t start;       /* chunk is [start, end) */
+    size_t end;
+    token_vec out;
+    size_t stop_pos;    /* tokenizer position after the last token */
+    tokenizer_state stop_state;
+    char stop_raw_tag[16];
+    int failed;
+    parse_stats *sink;  /* caller's stats; the worker counts into stats */
+    parse_stats stats;
+} chunk_job;
+
+static int token_vec_push(token_vec *v, const token *t, size_t start,
+                          int in_data) {
+    if (v->count == v->cap) {
+        size_t ncap = v->cap ? v->cap * 2 : 64;
+        token *items = (token *)realloc(v->items, ncap * sizeof(token));
+        if (!items) return 0;
+        v->items = items;
+        size_t *starts = (size_t *)realloc(v->starts, ncap * sizeof(size_t));
+        if (!starts) return 0;
+        v->starts = starts;
+        unsigned char *flags = (unsigned char *)realloc(v->in_data, ncap);
+        if (!flags) return 0;
+        v->in_data = flags;
+        v->cap = ncap;
+    }
+    v->items[v->count] = *t;   /* takes ownership of the token's strings */
+    v->starts[v->count] = start;
+    v->in_data[v->count] = (unsigned char)in_data;
+    v->count++;
+    return 1;
+}
+
+static void token_vec_free_range(token_vec *v, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++)
+        token_free(&v->items[i]);
+}
+
+static void token_vec_release(token_vec *v) {
+    free(v->items);
+    free(v->starts);
+    free(v->in_data);
+    v->items = NULL;
+    v->starts = NULL;
+    v->in_data = NULL;
+    v->count = v->cap = 0;
+}
+
+/* Index of the token that began at pos in the DATA state, or (size_t)-1.
+ * A speculative token starting at the right offset but in another state
+ * (e.g. after a "<script>" that really sat inside an attribute value) is
+ * not a valid resync point. */
+static size_t token_vec_find_start(const token_vec *v, size_t pos) {
+    size_t lo = 0, hi = v->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v->starts[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < v->count && v->starts[lo] == pos && v->in_data[lo])
+           ? lo : (size_t)-1;
+}
+
+/* Produce the next token into out. Returns 0 on allocation failure. */
+static int tokenize_one(tokenizer *tz, token_vec *out, int *eof) {
+    size_t start = tz->pos;
+    int in_data = (tz->state == TOKENIZE_DATA);
+    token t;
+    token_init(&t);
+    tokenizer_next(tz, &t);
+    *eof = (t.type == TOKEN_EOF);
+    if (!token_vec_push(out, &t, start, in_data)) {
+        token_free(&t);
+        return 0;
+    }
+    return 1;
+}
+
+static void *chunk_worker(void *arg) {
+    chunk_job *job = (chunk_job *)arg;
+    tokenizer tz;
+    int eof = 0;
+
+    tokenizer_scratch scratch = {0};
+    parse_stats *prev = parse_stats_attach(job->sink ? &job->stats : NULL);
+    tokenizer_scratch *prev_scratch = tokenizer_scratch_attach(&scratch);
+    tokenizer_init(&tz, job->input);
+    tz.pos = job->start;
+    while (tz.pos < job->end && !eof) {
+        if (!tokenize_one(&tz, &job->out, &eof)) {
+            job->failed = 1;
+            break;
+        }
+    }
+    job->stop_pos = tz.pos;
+    job->stop_state = tz.state;
+    memcpy(job->stop_raw_tag, tz.raw_tag, sizeof(job->stop_raw_tag));
+    tokenizer_scratch_attach(prev_scratch);
+    tokenizer_scratch_free(&scratch);
+    parse_stats_attach(prev);
+    return NULL;
+}
+
+static int is_tag_name_start(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+/* First likely-safe cut point at or after from, or len. */
+static size_t find_split(const char *input, size_t len, size_t from) {
+    const char *p = input + from;
+    const char *end = input + len;
+    while (p < end) {
+        p = (const char *)memchr(p, '<', (size_t)(end - p));
+        if (!p || p + 1 >= end) break;
+        if (is_tag_name_start(p[1]) ||
+            (p[1] == '/' && p + 2 < end && is_tag_name_start(p[2])))
+            return (size_t)(p - input);
+        p++;
+    }
+    return len;
+}
+
+token *tokenizer_tokenize_parallel(const char *input, int threads,
+                                   size_t *count) {
+    chunk_job jobs[PARALLEL_MAX_THREADS];
+    pthread_t tids[PARALLEL_MAX_THREADS];
+    int started[PARALLEL_MAX_THREADS];
+    size_t njobs = 0;
+    token_vec result = {0};
+    int ok = 1;
+
+    if (count) *count = 0;
+    if (!input || !count) return NULL;
+    if (threads < 1) threads = 1;
+    if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+
+    tokenizer_global_init();
+
+    size_t len = strlen(input);
+    size_t step = len / (size_t)threads;
+    size_t start = 0;
+    while (start < len && njobs < (size_t)threads) {
+        size_t end = (njobs + 1 == (size_t)threads) ? len
+                     : find_split(input, len, start + (step ? step : 1));
+        if (end <= start) end = len;
+        memset(&jobs[njobs], 0, sizeof(chunk_job));
+        jobs[njobs].input = input;
+        jobs[njobs].start = start;
+        jobs[njobs].end = end;
+        jobs[njobs].sink = parse_stats_current;
+        njobs++;
+        start = end;
+    }
+
+    /* Worker 0 runs on the calling thread */
+    for (size_t i = 1; i < njobs; i++)
+        started[i] = pthread_create(&tids[i], NULL, chunk_worker, &jobs[i]) == 0;
+    if (njobs > 0) chunk_worker(&jobs[0]);
+    for (size_t i = 1; i < njobs; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else chunk_worker(&jobs[i]);
+    }
+    for (size_t i = 0; i < njobs; i++)
+        parse_stats_merge(jobs[i].sink, &jobs[i].stats);
+
+    /* Stitch chunks in order, carrying the real tokenizer state */
+    tokenizer tz;
+    tokenizer_init(&tz, input);
+    int eof = 0;
+    for (size_t i = 0; i < njobs; i++) {
+        chunk_job *job = &jobs[i];
+        size_t keep = (size_t)-1;   /* first speculative token to splice */
+
+        if (!ok || eof || job->failed || tz.pos >= job->end) {
+            /* previous token already covered this chunk, or aborting */
+            if (job->failed) ok = 0;
+        } else if (tz.pos == job->start && tz.state == TOKENIZE_DATA) {
+            keep = 0;
+        } else {
+            while (tz.pos < job->end && !eof) {
+                if (tz.state == TOKENIZE_DATA && tz.pos >= job->start) {
+                    keep = token_vec_find_start(&job->out, tz.pos);
+                    if (keep != (size_t)-1) break;
+                }
+                if (!tokenize_one(&tz, &result, &eof)) { ok = 0; break; }
+            }
+        }
+
+        if (keep != (size_t)-1 && ok) {
+            token_vec_free_range(&job->out, 0, keep);
+            for (size_t k = keep; k < job->out.count && ok; k++) {
+                if (!token_vec_push(&result, &job->out.items[k],
+                                    job->out.starts[k], job->out.in_data[k])) {
+                    token_vec_free_range(&job->out, k, job->out.count);
+                    ok = 0;
+                    break;
+                }
+                if (job->out.items[k].type == TOKEN_EOF) {
+                    eof = 1;
+                    token_vec_free_range(&job->out, k + 1, job->out.count);
+                    break;
+                }
+            }
+            tz.pos = job->stop_pos;
+            tz.state = job->stop_state;
+            memcpy(tz.raw_tag, job->stop_raw_tag, sizeof(tz.raw_tag));
+        } else {
+            token_vec_free_range(&job->out, 0, job->out.count);
+        }
+        token_vec_release(&job->out);
+    }
+
+    /* Drain to EOF from the final state */
+    while (ok && !eof) {
+        if (!tokenize_one(&tz, &result, &eof)) ok = 0;
+    }
+
+    if (!ok) {
+        token_vec_free_range(&result, 0, result.count);
+        token_vec_release(&result);
+        return NULL;
+    }
+    free(result.starts);
+    free(result.in_data);
+    *count = result.count;
+    return result.items;
+}
@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+#include "tokenizer.h"
+#include "parse_stats.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ========================================================================
+ * Pipelined tokenization
+ *
+ * A producer thread runs tokenizer_next() ahead of the tree builder and
+ * publishes each token, together with the tokenizer state before and after
+ * it, into a single-producer/single-consumer ring. The builder pulls from
+ * the ring through tokenizer_pipeline_next(), which takes the builder's own
+ * tokenizer as the reference: if the builder changed anything the producer
+ * could not know about (the SVG <title> reset of state/raw_tag, or an
+ * allow_cdata value that matters for the next token) the producer is
+ * stopped, the queued tokens are dropped, and tokenizing restarts from the
+ * builder's tokenizer.
+ * ======================================================================== */
+
+#define PIPELINE_RING_SIZE 256      /* power of two */
+#define PIPELINE_SPIN      64       /* busy polls before yielding */
+
+typedef struct {
+    tokenizer before;               /* tokenizer state the token began in */
+    tokenizer after;
+    token tok;
+} pipeline_slot;
+
+struct tokenizer_pipeline {
+    pipeline_slot ring[PIPELINE_RING_SIZE];
+    atomic_size_t head;             /* next slot the producer fills */
+    atomic_size_t tail;             /* next slot the consumer reads */
+    atomic_int cancel;
+    tokenizer start;                /* where the producer (re)starts */
+    pthread_t thread;
+    int running;
+    int eof;                        /* consumer has taken TOKEN_EOF */
+    parse_stats *sink;              /* consumer's stats at start */
+    parse_stats stats;              /* producer's counts, merged on free */
+};
+
+static void pipeline_wait(unsigned *spins) {
+    if (++*spins >= PIPELINE_SPIN) {
+        *spins = 0;
+        sched_yield();
+    }
+}
+
+static void *pipeline_producer(void *arg) {
+    tokenizer_pipeline *pl = (tokenizer_pipeline *)arg;
+    tokenizer tz = pl->start;
+    tokenizer_scratch scratch = {0};
+    size_t head = atomic_load_explicit(&pl->head, memory_order_relaxed);
+    parse_stats_attach(pl->sink ? &pl->stats : NULL);
+    tokenizer_scratch_attach(&scratch);
+
+    for (;;) {
+        unsigned spins = 0;
+        while (head - atomic_load_explicit(&pl->tail, memory_order_acquire)
+               == PIPELINE_RING_SIZE) {
+            if (atomic_load_explicit(&pl->cancel, memory_order_relaxed))
+                goto out;
+            pipeline_wait(&spins);
+        }
+        if (atomic_load_explicit(&pl->cancel, memory_order_relaxed))
+            goto out;
+
+        pipeline_slot *s = &pl->ring[head & (PIPELINE_RING_SIZE - 1)];
+        s->before = tz;
+        token_init(&s->tok);
+        tokenizer_next(&tz, &s->tok);
+        s->after = tz;
+        head++;
+        atomic_store_explicit(&pl->head, head, memory_order_release);
+        if (s->tok.type == TOKEN_EOF)
+            goto out;
+    }
+
+out:
+    tokenizer_scratch_attach(NULL);
+    tokenizer_scratch_free(&scratch);
+    return NULL;
+}
+
+/* Start the producer from the given tokenizer state. */
+static int pipeline_launch(tokenizer_pipeline *pl, const tokenizer *from) {
+    pl->start = *from;
+    atomic_store_explicit(&pl->cancel, 0, memory_order_relaxed);
+    pl->running = pthread_create(&pl->thread, NULL, pipeline_producer, pl) == 0;
+    return pl->running;
+}
+
+/* Stop the producer and free every token it queued but nobody consumed. */
+static void pipeline_halt(tokenizer_pipeline *pl) {
+    if (pl->running) {
+        atomic_store_explicit(&pl->cancel, 1, memory_order_relaxed);
+        pthread_join(pl->thread, NULL);
+        pl->running = 0;
+    }
+    size_t head = atomic_load_explicit(&pl->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&pl->tail, memory_order_relaxed);
+    for (; tail != head; tail++)
+        token_free(&pl->ring[tail & (PIPELINE_RING_SIZE - 1)].tok);
+    atomic_store_explicit(&pl->tail, tail, memory_order_relaxed);
+}
+
+/* Whether a token tokenized with a different allow_cdata could come out
+ * differently: only the "<![CDATA[" markup declaration looks at the flag. */
+static int span_has_cdata_open(const tokenizer *before, const tokenizer *after) {
+    const char *p = before->input + before->pos;
+    const char *end = before->input + after->pos;
+    while (p < end) {
+        p = (const char *)memchr(p, '<', (size_t)(end - p));
+        if (!p) return 0;
+        if (p[1] == '!' && p[2] == '[') return 1;
+        p++;
+    }
+    return 0;
+}
+
+/* Whether the producer's view of the tokenizer before a token still
+ * matches the builder's. */
+static int pipeline_in_sync(const tokenizer *tz, const pipeline_slot *s) {
+    if (tz->pos != s->before.pos || tz->state != s->before.state)
+        return 0;
+    if (tz->state != TOKENIZE_DATA && tz->state != TOKENIZE_PLAINTEXT &&
+        strcmp(tz->raw_tag, s->before.raw_tag) != 0)
+        return 0;
+    if (tz->allow_cdata != s->before.allow_cdata &&
+        span_has_cdata_open(&s->before, &s->after))
+        return 0;
+    return 1;
+}
+
+tokenizer_pipeline *tokenizer_pipeline_start(const tokenizer *tz) {
+    if (!tz) return NULL;
+    tokenizer_global_init();
+    tokenizer_pipeline *pl = (tokenizer_pipeline *)calloc(1, sizeof(*pl));
+    if (!pl) return NULL;
+    atomic_init(&pl->head, 0);
+    atomic_init(&pl->tail, 0);
+    atomic_init(&pl->cancel, 0);
+    pl->sink = parse_stats_current;
+    if (!pipeline_launch(pl, tz)) {
+        free(pl);
+        return NULL;
+    }
+    return pl;
+}
+
+void tokenizer_pipeline_next(tokenizer_pipeline *pl, tokenizer *tz, token *out) {
+    for (;;) {
+        size_t tail = atomic_load_explicit(&pl->tail, memory_order_relaxed);
+        unsigned spins = 0;
+        while (atomic_load_explicit(&pl->head, memory_order_acquire) == tail) {
+            if (!pl->running || pl->eof) {
+                /* producer could not be restarted: tokenize inline */
+                tokenizer_next(tz, out);
+                return;
+            }
+            pipeline_wait(&spins);
+        }
+
+        pipeline_slot *s = &pl->ring[tail & (PIPELINE_RING_SIZE - 1)];
+        if (!pipeline_in_sync(tz, s)) {
+            /* Roll back: everything queued was tokenized from a stale state */
+            pipeline_halt(pl);
+            pipeline_launch(pl, tz);
+            continue;
+        }
+
+        *out = s->tok;  /* takes ownership of the token's strings */
+        int allow_cdata = tz->allow_cdata;
+        *tz = s->after;
+        tz->allow_cdata = allow_cdata;
+        pl->eof = (out->type == TOKEN_EOF);
+        atomic_store_explicit(&pl->tail, tail + 1, memory_order_release);
+        return;
+    }
+}
+
+void tokenizer_pipeline_free(tokenizer_pipeline *pl) {
+    if (!pl) return;
+    pipeline_halt(pl);
+    parse_stats_merge(pl->sink, &pl->stats);
+    free(pl);
+}
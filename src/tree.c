@@ -1,9 +1,138 @@
 #include "tree.h"
+#include "node_index.h"
+#include "parse_stats.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* ============================================================================
+ * Node arenas
+ * Standard-size chunks are kept across resets and reused in order; an
+ * allocation too big for one gets a chunk of its own, freed on reset.
+ * ============================================================================ */
+
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+#define ARENA_ALIGN         (sizeof(max_align_t))
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t pos;
+    max_align_t data[];
+} arena_chunk;
+
+struct node_arena {
+    arena_chunk *first;         /* standard chunks, in use order */
+    arena_chunk *cur;
+    arena_chunk *big;           /* oversized allocations */
+    size_t chunk_size;
+    size_t used;
+};
+
+_Thread_local node_arena *node_arena_current;
+
+static arena_chunk *arena_chunk_new(size_t size) {
+    arena_chunk *c = (arena_chunk *)malloc(sizeof(arena_chunk) + size);
+    if (!c) return NULL;
+    c->next = NULL;
+    c->size = size;
+    c->pos = 0;
+    return c;
+}
+
+node_arena *node_arena_create(size_t chunk_size) {
+    node_arena *a = (node_arena *)calloc(1, sizeof(node_arena));
+    if (!a) return NULL;
+    a->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+    return a;
+}
+
+void *node_arena_alloc(node_arena *a, size_t size) {
+    if (!a) return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size > a->chunk_size / 4) {
+        arena_chunk *c = arena_chunk_new(size);
+        if (!c) return NULL;
+        c->next = a->big;
+        a->big = c;
+        a->used += size;
+        return c->data;
+    }
+    while (!a->cur || a->cur->pos + size > a->cur->size) {
+        if (a->cur && a->cur->next) {
+            a->cur = a->cur->next;
+            continue;
+        }
+        arena_chunk *c = arena_chunk_new(a->chunk_size);
+        if (!c) return NULL;
+        if (a->cur) a->cur->next = c;
+        else a->first = c;
+        a->cur = c;
+    }
+    void *p = (char *)a->cur->data + a->cur->pos;
+    a->cur->pos += size;
+    a->used += size;
+    return p;
+}
+
+void node_arena_reset(node_arena *a) {
+    if (!a) return;
+    for (arena_chunk *c = a->first; c; c = c->next) c->pos = 0;
+    while (a->big) {
+        arena_chunk *next = a->big->next;
+        free(a->big);
+        a->big = next;
+    }
+    a->cur = a->first;
+    a->used = 0;
+}
+
+void node_arena_free(node_arena *a) {
+    if (!a) return;
+    node_arena_reset(a);
+    while (a->first) {
+        arena_chunk *next = a->first->next;
+        free(a->first);
+        a->first = next;
+    }
+    free(a);
+}
+
+size_t node_arena_used(const node_arena *a) {
+    return a ? a->used : 0;
+}
+
+node_arena *node_arena_attach(node_arena *a) {
+    node_arena *prev = node_arena_current;
+    node_arena_current = a;
+    return prev;
+}
+
+void *node_mem_alloc(const node *n, size_t size) {
+    return n->arena ? node_arena_alloc(n->arena, size) : malloc(size);
+}
+
+void *node_mem_realloc(const node *n, void *p, size_t old_size, size_t size) {
+    if (!n->arena) return realloc(p, size);
+    void *q = node_arena_alloc(n->arena, size);
+    if (q && p) memcpy(q, p, old_size < size ? old_size : size);
+    return q;
+}
+
+char *node_mem_strdup(const node *n, const char *s) {
+    if (!s) return NULL;
+    size_t len = strlen(s);
+    char *out = (char *)node_mem_alloc(n, len + 1);
+    if (out) memcpy(out, s, len + 1);
+    return out;
+}
+
+void node_mem_free(const node *n, void *p) {
+    if (!n->arena) free(p);
+}
+
 static char *dup_string(const char *s) {
     size_t len;
     char *out;
@@ -15,8 +144,8 @@ static char *dup_string(const char *s) {
     return out;
 }
 
-static void free_node_attrs(node_attr *attrs, size_t count) {
-    if (!attrs) return;
+static void free_node_attrs(node_arena *arena, node_attr *attrs, size_t count) {
+    if (!attrs || arena) return;
     for (size_t i = 0; i < count; ++i) {
         free(attrs[i].name);
         free(attrs[i].value);
@@ -24,12 +153,131 @@ static void free_node_attrs(node_attr *attrs, size_t count) {
     free(attrs);
 }
 
+/* ============================================================================
+ * Shared attribute storage
+ * The adoption agency and reconstruct_active_formatting() clone formatting
+ * elements over and over; the clones point at one reference-counted copy
+ * of the attributes. Nodes never modify a shared list in place.
+ * ============================================================================ */
+struct node_attr_block {
+    size_t refs;
+    node_attr *attrs;
+    size_t count;
+    node_arena *arena;          /* block and list came from this arena */
+};
+
+static void release_node_attrs(node *n) {
+    node_attr_block *b = n->attr_block;
+    if (!b) {
+        free_node_attrs(n->arena, n->attrs, n->attr_count);
+    } else if (--b->refs == 0) {
+        free_node_attrs(b->arena, b->attrs, b->count);
+        if (!b->arena) free(b);
+    }
+    n->attrs = NULL;
+    n->attr_count = 0;
+    n->attr_block = NULL;
+}
+
+void node_attrs_share(node *dst, node *src) {
+    if (!dst || !src || !src->attrs || src->attr_count == 0) return;
+    if (!src->attr_block) {
+        node_attr_block *b = (node_attr_block *)node_mem_alloc(src, sizeof(*b));
+        if (!b) return;
+        b->refs = 1;
+        b->attrs = src->attrs;
+        b->count = src->attr_count;
+        b->arena = src->arena;
+        src->attr_block = b;
+    }
+    src->attr_block->refs++;
+    dst->attrs = src->attrs;
+    dst->attr_count = src->attr_count;
+    dst->attr_block = src->attr_block;
+}
+
+int node_attrs_unshare(node *n) {
+    if (!n || !n->attr_block) return 1;
+    node_attr_block *b = n->attr_block;
+    if (b->refs == 1) {
+        /* Last user: keep the list, drop the block. An arena list
+         * becomes n's own only if it is n's arena. */
+        if (b->arena == n->arena) {
+            if (!b->arena) free(b);
+            n->attr_block = NULL;
+            return 1;
+        }
+    }
+    node_attr *copy = (node_attr *)node_mem_alloc(n, n->attr_count * sizeof(node_attr));
+    if (!copy) return 0;
+    for (size_t i = 0; i < n->attr_count; i++) {
+        copy[i].name = node_mem_strdup(n, n->attrs[i].name);
+        copy[i].value = node_mem_strdup(n, n->attrs[i].value);
+    }
+    if (--b->refs == 0) {
+        free_node_attrs(b->arena, b->attrs, b->count);
+        if (!b->arena) free(b);
+    }
+    n->attrs = copy;
+    n->attr_block = NULL;
+    if (PARSE_STATS_ON) {
+        size_t bytes = n->attr_count * sizeof(node_attr);
+        for (size_t i = 0; i < n->attr_count; i++)
+            bytes += (copy[i].name ? strlen(copy[i].name) + 1 : 0) +
+                     (copy[i].value ? strlen(copy[i].value) + 1 : 0);
+        PARSE_STAT_ADD(allocs, 1 + 2 * n->attr_count);
+        PARSE_STAT_ADD(alloc_bytes, bytes);
+    }
+    return 1;
+}
+
+/* Zeroed node from the thread's arena, or the heap */
+static node *node_alloc(void) {
+    node_arena *a = node_arena_current;
+    if (!a) return (node *)calloc(1, sizeof(node));
+    node *n = (node *)node_arena_alloc(a, sizeof(node));
+    if (!n) return NULL;
+    memset(n, 0, sizeof(node));
+    n->arena = a;
+    return n;
+}
+
 node *node_create(node_type type, const char *name, const char *data) {
-    node *n = (node *)calloc(1, sizeof(node));
+    node *n = node_alloc();
     if (!n) return NULL;
     n->type = type;
-    n->name = dup_string(name);
-    n->data = dup_string(data);
+    n->name = n->arena ? node_mem_strdup(n, name) : dup_string(name);
+    n->data = n->arena ? node_mem_strdup(n, data) : dup_string(data);
+    if (PARSE_STATS_ON) {
+        PARSE_STAT_ADD(nodes_created, 1);
+        PARSE_STAT_ADD(allocs, 1 + (n->name != NULL) + (n->data != NULL));
+        PARSE_STAT_ADD(alloc_bytes, sizeof(node) +
+                       (n->name ? strlen(n->name) + 1 : 0) +
+                       (n->data ? strlen(n->data) + 1 : 0));
+    }
+    return n;
+}
+
+node *node_create_take(node_type type, char *name, char *data) {
+    if (node_arena_current) {
+        /* Arena nodes cannot own heap strings */
+        node *n = node_create(type, name, data);
+        free(name);
+        free(data);
+        return n;
+    }
+    node *n = (node *)calloc(1, sizeof(node));
+    if (!n) {
+        free(name);
+        free(data);
+        return NULL;
+    }
+    n->type = type;
+    n->name = name;
+    n->data = data;
+    PARSE_STAT_ADD(nodes_created, 1);
+    PARSE_STAT_ADD(allocs, 1);
+    PARSE_STAT_ADD(alloc_bytes, sizeof(node));
     return n;
 }
 
@@ -42,102 +290,161 @@ node *node_create_ns(node_type type, const char *name, const char *data, node_na
 void node_append_child(node *parent, node *child) {
     if (!parent || !child) return;
     child->parent = parent;
+    child->prev_sibling = parent->last_child;
     if (!parent->first_child) {
         parent->first_child = child;
         parent->last_child = child;
-        return;
+    } else {
+        parent->last_child->next_sibling = child;
+        parent->last_child = child;
     }
-    parent->last_child->next_sibling = child;
-    parent->last_child = child;
+    node_index_subtree_added(child, 1);
 }
 
 void node_insert_before(node *parent, node *child, node *ref) {
     if (!parent || !child) return;
-    child->parent = parent;
-    if (!ref || !parent->first_child) {
-        node_append_child(parent, child);
-        return;
-    }
-    if (parent->first_child == ref) {
-        child->next_sibling = ref;
-        parent->first_child = child;
-        return;
-    }
-    node *prev = parent->first_child;
-    while (prev && prev->next_sibling && prev->next_sibling != ref) {
-        prev = prev->next_sibling;
-    }
-    if (!prev || !prev->next_sibling) {
+    if (!ref || ref->parent != parent) {
         node_append_child(parent, child);
         return;
     }
+    child->parent = parent;
     child->next_sibling = ref;
-    prev->next_sibling = child;
+    child->prev_sibling = ref->prev_sibling;
+    if (ref->prev_sibling)
+        ref->prev_sibling->next_sibling = child;
+    else
+        parent->first_child = child;
+    ref->prev_sibling = child;
+    node_index_subtree_added(child, 0);
 }
 
 void node_remove_child(node *parent, node *child) {
-    if (!parent || !child) return;
-    if (parent->first_child == child) {
+    if (!parent || !child || child->parent != parent) return;
+    if (child->prev_sibling)
+        child->prev_sibling->next_sibling = child->next_sibling;
+    else
         parent->first_child = child->next_sibling;
-        if (parent->last_child == child) {
-            parent->last_child = NULL;
-        }
-    } else {
-        node *prev = parent->first_child;
-        while (prev && prev->next_sibling != child) {
-            prev = prev->next_sibling;
-        }
-        if (!prev) return;
-        prev->next_sibling = child->next_sibling;
-        if (parent->last_child == child) {
-            parent->last_child = prev;
-        }
-    }
+    if (child->next_sibling)
+        child->next_sibling->prev_sibling = child->prev_sibling;
+    else
+        parent->last_child = child->prev_sibling;
     child->parent = NULL;
     child->next_sibling = NULL;
+    child->prev_sibling = NULL;
+    node_index_subtree_removed(parent, child);
 }
 
 void node_reparent_children(node *src, node *dst) {
     if (!src || !dst || !src->first_child) return;
-    node *child = src->first_child;
+    node *child;
+    for (child = src->first_child; child; child = child->next_sibling)
+        node_index_subtree_removed(src, child);
+    child = src->first_child;
     while (child) {
         child->parent = dst;
         child = child->next_sibling;
     }
+    src->first_child->prev_sibling = dst->last_child;
     if (dst->last_child) {
         dst->last_child->next_sibling = src->first_child;
     } else {
         dst->first_child = src->first_child;
     }
+    node *moved = src->first_child;
     dst->last_child = src->last_child;
     src->first_child = NULL;
     src->last_child = NULL;
+    for (child = moved; child; child = child->next_sibling)
+        node_index_subtree_added(child, child->next_sibling == NULL);
 }
 
 void node_free_shallow(node *n) {
     if (!n) return;
+    encoding_source_map_free(n->source_map);
+    if (n->type == NODE_DOCUMENT)
+        node_index_free(n->index);
+    release_node_attrs(n);
+    if (n->arena) return;
     free(n->name);
     free(n->data);
     free(n->encoding);
-    free_node_attrs(n->attrs, n->attr_count);
     free(n);
 }
 
 void node_free(node *n) {
-    node *child;
     node *next;
     if (!n) return;
-    child = n->first_child;
-    while (child) {
-        next = child->next_sibling;
-        node_free(child);
-        child = next;
+    for (node *cur = node_postorder_first(n); cur; cur = next) {
+        next = node_postorder_next(cur, n);
+        node_free_shallow(cur);
     }
-    free(n->name);
-    free(n->data);
-    free(n->encoding);
-    free_node_attrs(n->attrs, n->attr_count);
-    free(n);
+}
+
+/* ============================================================================
+ * Traversal
+ * ============================================================================ */
+
+node *node_preorder_next(const node *n, const node *root) {
+    if (!n) return NULL;
+    if (n->first_child) return n->first_child;
+    while (n != root) {
+        if (n->next_sibling) return n->next_sibling;
+        n = n->parent;
+    }
+    return NULL;
+}
+
+node *node_postorder_first(const node *root) {
+    if (!root) return NULL;
+    while (root->first_child) root = root->first_child;
+    return (node *)root;
+}
+
+node *node_postorder_next(const node *n, const node *root) {
+    if (!n || n == root) return NULL;
+    if (n->next_sibling) return node_postorder_first(n->next_sibling);
+    return n->parent;
+}
+
+void node_walk_init(node_walk *w, const node *root) {
+    w->root = root;
+    w->node = NULL;
+    w->leaving = 0;
+    w->skip = 0;
+}
+
+int node_walk_next(node_walk *w) {
+    const node *n = w->node;
+    if (!n) {
+        /* Not started, or finished (leaving set) */
+        if (w->leaving || !w->root) return 0;
+        w->node = w->root;
+        return 1;
+    }
+    if (!w->leaving) {
+        if (n->first_child && !w->skip) {
+            w->node = n->first_child;
+            return 1;
+        }
+        w->skip = 0;
+        w->leaving = 1;
+        return 1;
+    }
+    if (n == w->root) {
+        w->node = NULL;
+        return 0;
+    }
+    if (n->next_sibling) {
+        w->node = n->next_sibling;
+        w->leaving = 0;
+    } else {
+        w->node = n->parent;
+    }
+    return 1;
+}
+
+void node_walk_skip_children(node_walk *w) {
+    if (w && !w->leaving) w->skip = 1;
 }
 
 static const char *node_type_name(node_type t) {
@@ -160,9 +467,8 @@ static void print_escaped(const char *s) {
     }
 }
 
-static void dump_node(const node *n, const char *prefix, int is_last) {
-    char next_prefix[512];
-    const char *branch = is_last ? "\\-- " : "|-- ";
+static void dump_node(const node *n, const char *prefix) {
+    const char *branch = n->next_sibling ? "|-- " : "\\-- ";
 
     printf("%s%s%s", prefix, branch, node_type_name(n->type));
     if (n->ns == NS_SVG) printf("(svg)");
@@ -193,14 +499,9 @@ static void dump_node(const node *n, const char *prefix, int is_last) {
         }
     }
     printf("\n");
-
-    snprintf(next_prefix, sizeof(next_prefix), "%s%s", prefix, is_last ? "    " : "|   ");
-    for (const node *child = n->first_child; child; child = child->next_sibling) {
-        int last = (child->next_sibling == NULL);
-        dump_node(child, next_prefix, last);
-    }
 }
 
+/* The prefix grows by one 4-character column per level below root */
 void tree_dump_ascii(const node *root, const char *title) {
     if (!root) return;
     if (title && title[0]) {
@@ -210,10 +511,35 @@ void tree_dump_ascii(const node *root, const char *title) {
     if (root->encoding)
         printf(" encoding=\"%s\"", root->encoding);
     printf("\n");
-    for (const node *child = root->first_child; child; child = child->next_sibling) {
-        int last = (child->next_sibling == NULL);
-        dump_node(child, "", last);
+
+    char *prefix = (char *)malloc(64);
+    size_t len = 0, cap = 64;
+    if (!prefix) return;
+    prefix[0] = '\0';
+    node_walk w;
+    node_walk_init(&w, root);
+    while (node_walk_next(&w)) {
+        const node *n = w.node;
+        if (n == root || !n->first_child) {
+            if (n != root && !w.leaving) dump_node(n, prefix);
+            continue;
+        }
+        if (w.leaving) {
+            len -= 4;
+            prefix[len] = '\0';
+            continue;
+        }
+        dump_node(n, prefix);
+        if (len + 5 > cap) {
+            char *next = (char *)realloc(prefix, cap * 2);
+            if (!next) break;
+            prefix = next;
+            cap *= 2;
+        }
+        memcpy(prefix + len, n->next_sibling ? "|   " : "    ", 5);
+        len += 4;
     }
+    free(prefix);
 }
 
 /* ============================================================================
@@ -233,9 +559,8 @@ static void sb_init(string_buffer *sb) {
     if (sb->data) sb->data[0] = '\0';
 }
 
-static void sb_append(string_buffer *sb, const char *str) {
+static void sb_append_len(string_buffer *sb, const char *str, size_t slen) {
     if (!sb->data || !str) return;
-    size_t slen = strlen(str);
     if (sb->len + slen + 1 > sb->cap) {
         size_t new_cap = sb->cap * 2;
         while (new_cap < sb->len + slen + 1) new_cap *= 2;
@@ -249,6 +574,10 @@ static void sb_append(string_buffer *sb, const char *str) {
     sb->data[sb->len] = '\0';
 }
 
+static void sb_append(string_buffer *sb, const char *str) {
+    if (str) sb_append_len(sb, str, strlen(str));
+}
+
 static void sb_append_char(string_buffer *sb, char c) {
     char buf[2] = {c, '\0'};
     sb_append(sb, buf);
@@ -276,16 +605,17 @@ static int is_void_element_serializer(const char *name) {
            strcmp(name, "wbr") == 0;
 }
 
+/* Elements whose text children serialize unescaped (WHATWG "serializing
+ * HTML fragments"; noscript parses as markup with scripting disabled) */
 static int is_raw_text_element(const char *name) {
     if (!name) return 0;
     return strcmp(name, "script") == 0 ||
-           strcmp(name, "style") == 0;
-}
-
-static int is_rcdata_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "textarea") == 0 ||
-           strcmp(name, "title") == 0;
+           strcmp(name, "style") == 0 ||
+           strcmp(name, "xmp") == 0 ||
+           strcmp(name, "iframe") == 0 ||
+           strcmp(name, "noembed") == 0 ||
+           strcmp(name, "noframes") == 0 ||
+           strcmp(name, "plaintext") == 0;
 }
 
 static char *escape_html_text(const char *text) {
@@ -322,126 +652,347 @@ static char *escape_attr_value(const char *value) {
     return sb_to_string(&sb);
 }
 
-static void serialize_node(const node *n, string_buffer *sb, const char *parent_name) {
-    if (!n) return;
+static void serialize_text(const node *n, string_buffer *sb, int raw) {
+    if (raw) {
+        sb_append(sb, n->data ? n->data : "");
+        return;
+    }
+    char *escaped = escape_html_text(n->data);
+    if (escaped) {
+        sb_append(sb, escaped);
+        free(escaped);
+    }
+}
 
-    switch (n->type) {
-        case NODE_DOCUMENT:
-            /* Document node: serialize children only */
-            for (const node *child = n->first_child; child; child = child->next_sibling) {
-                serialize_node(child, sb, NULL);
-            }
-            break;
+static void serialize_start_tag(const node *n, string_buffer *sb) {
+    sb_append(sb, "<");
+    sb_append(sb, n->name ? n->name : "");
+    for (size_t i = 0; i < n->attr_count; ++i) {
+        sb_append(sb, " ");
+        sb_append(sb, n->attrs[i].name ? n->attrs[i].name : "");
+        sb_append(sb, "=\"");
+        char *escaped = escape_attr_value(n->attrs[i].value);
+        if (escaped) {
+            sb_append(sb, escaped);
+            free(escaped);
+        }
+        sb_append(sb, "\"");
+    }
+    sb_append(sb, ">");
+}
 
-        case NODE_DOCTYPE:
-            sb_append(sb, "<!DOCTYPE ");
-            if (n->name && n->name[0]) {
-                sb_append(sb, n->name);
-            } else {
-                sb_append(sb, "html");
-            }
-            sb_append(sb, ">");
-            break;
+static void serialize_end_tag(const node *n, string_buffer *sb) {
+    if (n->ns != NS_HTML && !n->first_child) {
+        /* Foreign element with no children: rewrite the start tag's
+         * trailing '>' as ' />' */
+        if (sb->len > 0 && sb->data[sb->len - 1] == '>') {
+            sb->len--;
+            sb->data[sb->len] = '\0';
+            sb_append(sb, " />");
+        }
+    } else if (!is_void_element_serializer(n->name)) {
+        sb_append(sb, "</");
+        sb_append(sb, n->name ? n->name : "");
+        sb_append(sb, ">");
+    }
+}
 
-        case NODE_ELEMENT: {
-            /* Opening tag */
-            sb_append(sb, "<");
-            sb_append(sb, n->name ? n->name : "");
-
-            /* Attributes */
-            for (size_t i = 0; i < n->attr_count; ++i) {
-                sb_append(sb, " ");
-                sb_append(sb, n->attrs[i].name ? n->attrs[i].name : "");
-                sb_append(sb, "=\"");
-                char *escaped = escape_attr_value(n->attrs[i].value);
-                if (escaped) {
-                    sb_append(sb, escaped);
-                    free(escaped);
-                }
-                sb_append(sb, "\"");
-            }
+/* The template's "content" wrapper is transparent: its children serialize
+ * as the template's own */
+static int is_template_content(const node *n, const node *root) {
+    const node *p = n->parent;
+    return n != root && p && p->type == NODE_ELEMENT && p->name &&
+           strcmp(p->name, "template") == 0 && n->name &&
+           strcmp(n->name, "content") == 0;
+}
 
-            sb_append(sb, ">");
-
-            /* Children (with context-aware escaping) */
-            if (n->name && strcmp(n->name, "template") == 0) {
-                for (const node *child = n->first_child; child; child = child->next_sibling) {
-                    if (child->type == NODE_ELEMENT && child->name &&
-                        strcmp(child->name, "content") == 0) {
-                        for (const node *gc = child->first_child; gc; gc = gc->next_sibling) {
-                            serialize_node(gc, sb, n->name);
-                        }
-                    } else {
-                        serialize_node(child, sb, n->name);
-                    }
-                }
-            } else {
-                int is_raw = is_raw_text_element(n->name);
-                int is_rcdata = is_rcdata_element(n->name);
-
-                for (const node *child = n->first_child; child; child = child->next_sibling) {
-                    if (child->type == NODE_TEXT && (is_raw || is_rcdata)) {
-                        /* Raw text: no escaping for script/style */
-                        /* RCDATA: escape for textarea/title */
-                        if (is_raw) {
-                            sb_append(sb, child->data ? child->data : "");
-                        } else {
-                            char *escaped = escape_html_text(child->data);
-                            if (escaped) {
-                                sb_append(sb, escaped);
-                                free(escaped);
-                            }
-                        }
-                    } else {
-                        serialize_node(child, sb, n->name);
-                    }
-                }
-            }
+static void serialize_node(const node *root, string_buffer *sb) {
+    node_walk w;
+    node_walk_init(&w, root);
+    while (node_walk_next(&w)) {
+        const node *n = w.node;
+        switch (n->type) {
+            case NODE_ELEMENT:
+                if (is_template_content(n, root)) break;
+                if (w.leaving) serialize_end_tag(n, sb);
+                else serialize_start_tag(n, sb);
+                break;
+
+            case NODE_TEXT:
+                /* Escaped unless the parent is a raw text element */
+                if (!w.leaving)
+                    serialize_text(n, sb, n != root && n->parent &&
+                                   n->parent->type == NODE_ELEMENT &&
+                                   is_raw_text_element(n->parent->name));
+                break;
 
-            /* Closing tag (skip for void elements) */
-            if (n->ns != NS_HTML && !n->first_child) {
-                /* Foreign element with no children: self-closing already emitted as <tag ...> */
-                /* Rewrite: replace trailing '>' with ' />' */
-                if (sb->len > 0 && sb->data[sb->len - 1] == '>') {
-                    sb->len--;
-                    sb->data[sb->len] = '\0';
-                    sb_append(sb, " />");
+            case NODE_DOCTYPE:
+                if (w.leaving) break;
+                sb_append(sb, "<!DOCTYPE ");
+                if (n->name && n->name[0]) {
+                    sb_append(sb, n->name);
+                } else {
+                    sb_append(sb, "html");
                 }
-            } else if (!is_void_element_serializer(n->name)) {
-                sb_append(sb, "</");
-                sb_append(sb, n->name ? n->name : "");
                 sb_append(sb, ">");
+                break;
+
+            case NODE_COMMENT:
+                if (w.leaving) break;
+                sb_append(sb, "<!--");
+                sb_append(sb, n->data ? n->data : "");
+                sb_append(sb, "-->");
+                break;
+
+            case NODE_DOCUMENT:
+                /* Document node: serialize children only */
+                break;
+        }
+    }
+}
+
+char *tree_serialize_html(const node *root) {
+    if (!root) return NULL;
+    string_buffer sb;
+    sb_init(&sb);
+    serialize_node(root, &sb);
+    return sb_to_string(&sb);
+}
+
+/* ============================================================================
+ * Text extraction (innerText-like)
+ *
+ * A simplified version of the innerText algorithm driven by element names
+ * alone: no style sheets, so categories stand in for computed display.
+ * Separators are held back until the next run of text, which lets
+ * consecutive line breaks merge and drops them at the start and end.
+ * ============================================================================ */
+
+#define TEXT_SKIP   0x01    /* content is never rendered */
+#define TEXT_BLOCK  0x02    /* a line break before and after */
+#define TEXT_PARA   0x04    /* a blank line before and after */
+#define TEXT_CELL   0x08    /* a tab before every cell but the first */
+#define TEXT_ROW    0x10    /* starts a new set of cells */
+#define TEXT_BR     0x20    /* a literal newline */
+#define TEXT_PRE    0x40    /* whitespace is kept as is */
+
+typedef struct {
+    const char *name;
+    unsigned flags;
+} text_category;
+
+/* Sorted by name for bsearch(). */
+static const text_category text_categories[] = {
+    { "address", TEXT_BLOCK },
+    { "article", TEXT_BLOCK },
+    { "aside", TEXT_BLOCK },
+    { "blockquote", TEXT_BLOCK },
+    { "br", TEXT_BR },
+    { "caption", TEXT_BLOCK },
+    { "center", TEXT_BLOCK },
+    { "dd", TEXT_BLOCK },
+    { "details", TEXT_BLOCK },
+    { "dialog", TEXT_BLOCK },
+    { "dir", TEXT_BLOCK },
+    { "div", TEXT_BLOCK },
+    { "dl", TEXT_BLOCK },
+    { "dt", TEXT_BLOCK },
+    { "fieldset", TEXT_BLOCK },
+    { "figcaption", TEXT_BLOCK },
+    { "figure", TEXT_BLOCK },
+    { "footer", TEXT_BLOCK },
+    { "form", TEXT_BLOCK },
+    { "h1", TEXT_BLOCK },
+    { "h2", TEXT_BLOCK },
+    { "h3", TEXT_BLOCK },
+    { "h4", TEXT_BLOCK },
+    { "h5", TEXT_BLOCK },
+    { "h6", TEXT_BLOCK },
+    { "header", TEXT_BLOCK },
+    { "hgroup", TEXT_BLOCK },
+    { "hr", TEXT_BLOCK },
+    { "legend", TEXT_BLOCK },
+    { "li", TEXT_BLOCK },
+    { "listing", TEXT_BLOCK | TEXT_PRE },
+    { "main", TEXT_BLOCK },
+    { "menu", TEXT_BLOCK },
+    { "nav", TEXT_BLOCK },
+    { "noscript", TEXT_SKIP },
+    { "ol", TEXT_BLOCK },
+    { "optgroup", TEXT_BLOCK },
+    { "option", TEXT_BLOCK },
+    { "p", TEXT_PARA },
+    { "plaintext", TEXT_BLOCK | TEXT_PRE },
+    { "pre", TEXT_BLOCK | TEXT_PRE },
+    { "script", TEXT_SKIP },
+    { "section", TEXT_BLOCK },
+    { "select", TEXT_BLOCK },
+    { "style", TEXT_SKIP },
+    { "summary", TEXT_BLOCK },
+    { "table", TEXT_BLOCK },
+    { "td", TEXT_CELL },
+    { "template", TEXT_SKIP },
+    { "textarea", TEXT_PRE },
+    { "th", TEXT_CELL },
+    { "tr", TEXT_BLOCK | TEXT_ROW },
+    { "ul", TEXT_BLOCK },
+};
+
+static int text_category_cmp(const void *key, const void *elem) {
+    return strcmp((const char *)key, ((const text_category *)elem)->name);
+}
+
+static unsigned text_flags(const char *name) {
+    if (!name) return 0;
+    const text_category *c = (const text_category *)bsearch(
+        name, text_categories,
+        sizeof(text_categories) / sizeof(text_categories[0]),
+        sizeof(text_category), text_category_cmp);
+    return c ? c->flags : 0;
+}
+
+static int is_text_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+static void text_emit(text_extractor *te, const char *s, size_t len) {
+    if (len == 0) return;
+    te->sink(s, len, te->ctx);
+    te->emitted += len;
+    size_t nl = 0;
+    while (nl < len && s[len - 1 - nl] == '\n') nl++;
+    te->trailing_newlines = nl == len ? te->trailing_newlines + nl : nl;
+}
+
+/* Write the separators held back before the next text: line breaks (not
+ * at the very start, and counting newlines already written), else cell
+ * tabs, else one space. */
+static void text_flush(text_extractor *te) {
+    static const char newlines[2] = { '\n', '\n' };
+    static const char tabs[8] = { '\t', '\t', '\t', '\t',
+                                  '\t', '\t', '\t', '\t' };
+    if (te->pending_breaks > te->trailing_newlines && te->emitted)
+        text_emit(te, newlines, te->pending_breaks - te->trailing_newlines);
+    if (te->pending_tabs) {
+        for (size_t n = te->pending_tabs; n; ) {
+            size_t chunk = n < sizeof(tabs) ? n : sizeof(tabs);
+            text_emit(te, tabs, chunk);
+            n -= chunk;
+        }
+    } else if (te->pending_space && !te->pending_breaks) {
+        text_emit(te, " ", 1);
+    }
+    te->pending_breaks = 0;
+    te->pending_tabs = 0;
+    te->pending_space = 0;
+}
+
+static void text_break(text_extractor *te, size_t count) {
+    if (te->pending_breaks < count) te->pending_breaks = count;
+    te->pending_space = 0;
+}
+
+void text_extractor_init(text_extractor *te, text_sink sink, void *ctx) {
+    memset(te, 0, sizeof(*te));
+    te->sink = sink;
+    te->ctx = ctx;
+}
+
+void text_extractor_open(text_extractor *te, const char *name) {
+    unsigned flags = text_flags(name);
+    if (te->skip_depth || (flags & TEXT_SKIP)) {
+        if (flags & TEXT_SKIP) te->skip_depth++;
+        return;
+    }
+    if (flags & TEXT_PRE) te->pre_depth++;
+    if (flags & TEXT_PARA) text_break(te, 2);
+    else if (flags & TEXT_BLOCK) text_break(te, 1);
+    if (flags & TEXT_ROW) te->row_cells = 0;
+    if (flags & TEXT_CELL) {
+        if (te->row_cells++) te->pending_tabs++;
+        te->pending_space = 0;
+    }
+    if (flags & TEXT_BR) {
+        te->pending_space = 0;
+        text_flush(te);
+        text_emit(te, "\n", 1);
+    }
+}
+
+void text_extractor_close(text_extractor *te, const char *name) {
+    unsigned flags = text_flags(name);
+    if (te->skip_depth) {
+        if (flags & TEXT_SKIP) te->skip_depth--;
+        return;
+    }
+    if ((flags & TEXT_PRE) && te->pre_depth) te->pre_depth--;
+    if (flags & TEXT_PARA) text_break(te, 2);
+    else if (flags & TEXT_BLOCK) text_break(te, 1);
+    if (flags & TEXT_ROW) te->row_cells = 0;
+}
+
+void text_extractor_text(text_extractor *te, const char *s, size_t len) {
+    if (te->skip_depth || len == 0) return;
+    if (te->pre_depth) {
+        text_flush(te);
+        text_emit(te, s, len);
+        return;
+    }
+    const char *p = s, *end = s + len;
+    while (p < end) {
+        if (is_text_space(*p)) {
+            if (te->emitted && !te->trailing_newlines) te->pending_space = 1;
+            p++;
+            continue;
+        }
+        /* A run of words separated by single spaces goes out in one
+         * piece */
+        const char *q = p;
+        for (;;) {
+            while (q < end && !is_text_space(*q)) q++;
+            if (q + 1 < end && *q == ' ' && !is_text_space(q[1])) {
+                q++;
+                continue;
             }
             break;
         }
+        text_flush(te);
+        text_emit(te, p, (size_t)(q - p));
+        p = q;
+    }
+}
 
-        case NODE_TEXT: {
-            /* Normal text: escape unless parent is raw text element */
-            int parent_is_raw = parent_name && is_raw_text_element(parent_name);
-            if (parent_is_raw) {
-                sb_append(sb, n->data ? n->data : "");
+size_t tree_extract_text_to(const node *root, text_sink sink, void *ctx) {
+    text_extractor te;
+    text_extractor_init(&te, sink, ctx);
+    if (!root) return 0;
+    node_walk w;
+    node_walk_init(&w, root);
+    while (node_walk_next(&w)) {
+        const node *n = w.node;
+        if (n->type == NODE_ELEMENT) {
+            if (w.leaving) {
+                text_extractor_close(&te, n->name);
             } else {
-                char *escaped = escape_html_text(n->data);
-                if (escaped) {
-                    sb_append(sb, escaped);
-                    free(escaped);
-                }
+                text_extractor_open(&te, n->name);
+                if (te.skip_depth) node_walk_skip_children(&w);
             }
-            break;
+        } else if (n->type == NODE_TEXT && !w.leaving && n->data) {
+            text_extractor_text(&te, n->data, strlen(n->data));
         }
-
-        case NODE_COMMENT:
-            sb_append(sb, "<!--");
-            sb_append(sb, n->data ? n->data : "");
-            sb_append(sb, "-->");
-            break;
     }
+    return te.emitted;
 }
 
-char *tree_serialize_html(const node *root) {
-    if (!root) return NULL;
+static void text_to_buffer(const char *s, size_t len, void *ctx) {
+    sb_append_len((string_buffer *)ctx, s, len);
+}
+
+char *tree_extract_text(const node *root, size_t *len) {
     string_buffer sb;
     sb_init(&sb);
-    serialize_node(root, &sb, NULL);
+    if (!sb.data) return NULL;
+    tree_extract_text_to(root, text_to_buffer, &sb);
+    if (len) *len = sb.len;
     return sb_to_string(&sb);
 }
@@ -2,68 +2,210 @@
 #include "tree_builder.h"
 #include "tokenizer.h"
 #include "foreign.h"
+#include "node_index.h"
+#include "parse_stats.h"
+#include "parse_error.h"
+#include "tag_atom.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
-static int tree_errors_enabled = -1;
-static void tree_parse_error(const char *msg) {
-    if (tree_errors_enabled < 0) {
-        const char *e = getenv("HTMLPARSER_PARSE_ERRORS");
-        tree_errors_enabled = (e && e[0] == '1') ? 1 : 0;
+static void tree_parse_error(parse_error_code code) {
+    parse_error_emit(code);
+}
+
+/* ============================================================================
+ * Build filter (tree_build_options prune / drop / stop fields)
+ * The options of the build running on this thread, so that the attribute
+ * helpers and foreign content see them without extra parameters.
+ * ============================================================================ */
+static _Thread_local const tree_build_options *build_filter;
+
+static int name_in_list(const char *const *list, const char *name) {
+    if (!list || !name) return 0;
+    for (; *list; list++)
+        if ((*list)[0] == name[0] && strcmp(*list, name) == 0) return 1;
+    return 0;
+}
+
+static int filter_drops_attr(const char *name) {
+    return build_filter && name_in_list(build_filter->drop_attributes, name);
+}
+
+/* Stats for attributes [from, attr_count) just copied onto n, plus the
+ * array allocation holding them. */
+static void stat_attrs(const node *n, size_t from) {
+    if (!PARSE_STATS_ON || n->attr_count <= from) return;
+    size_t allocs = 1;
+    size_t bytes = (n->attr_count - from) * sizeof(node_attr);
+    for (size_t i = from; i < n->attr_count; i++) {
+        if (n->attrs[i].name) { allocs++; bytes += strlen(n->attrs[i].name) + 1; }
+        if (n->attrs[i].value) { allocs++; bytes += strlen(n->attrs[i].value) + 1; }
     }
-    if (tree_errors_enabled) fprintf(stderr, "[parse error] %s\n", msg);
+    PARSE_STAT_ADD(attrs_created, n->attr_count - from);
+    PARSE_STAT_ADD(allocs, allocs);
+    PARSE_STAT_ADD(alloc_bytes, bytes);
 }
 
 static void attach_attrs(node *n, const token_attr *src, size_t count) {
     if (!n || !src || count == 0) return;
-    n->attrs = (node_attr *)malloc(count * sizeof(node_attr));
+    n->attrs = (node_attr *)node_mem_alloc(n, count * sizeof(node_attr));
     if (!n->attrs) return;
-    n->attr_count = count;
+    size_t j = 0;
     for (size_t i = 0; i < count; ++i) {
-        n->attrs[i].name  = src[i].name  ? strdup(src[i].name)  : NULL;
-        n->attrs[i].value = src[i].value ? strdup(src[i].value) : NULL;
+        if (filter_drops_attr(src[i].name)) continue;
+        n->attrs[j].name  = node_mem_strdup(n, src[i].name);
+        n->attrs[j].value = node_mem_strdup(n, src[i].value);
+        j++;
     }
+    n->attr_count = j;
+    stat_attrs(n, 0);
 }
 
 /* Merge attributes from a token onto an existing element.
- * Only adds attributes not already present on the element (WHATWG §13.2.6.4.7). */
+ * Only adds attributes not already present on the element (WHATWG §13.2.6.4.7).
+ * Long lists check for duplicates through a name set rather than a scan
+ * per attribute. */
 static void merge_attrs(node *n, const token_attr *src, size_t count) {
-    if (!n || !src || count == 0) return;
+    if (!n || !src || count == 0 || !node_attrs_unshare(n)) return;
+    node_attr *new_attrs = (node_attr *)node_mem_realloc(
+        n, n->attrs, n->attr_count * sizeof(node_attr),
+        (n->attr_count + count) * sizeof(node_attr));
+    if (!new_attrs) return;
+    n->attrs = new_attrs;
+    attr_name_set names = {0};
+    int hashed = n->attr_count + count >= ATTR_NAME_SET_MIN;
+    for (size_t j = 0; hashed && j < n->attr_count; j++)
+        if (n->attrs[j].name && attr_name_set_add(&names, n->attrs[j].name) < 0)
+            hashed = 0;
+    size_t from = n->attr_count;
     for (size_t i = 0; i < count; i++) {
-        if (!src[i].name) continue;
+        if (!src[i].name || filter_drops_attr(src[i].name)) continue;
         /* Check if attribute already exists */
         int found = 0;
-        for (size_t j = 0; j < n->attr_count; j++) {
-            if (n->attrs[j].name && strcmp(n->attrs[j].name, src[i].name) == 0) {
-                found = 1;
-                break;
+        int added = hashed ? attr_name_set_add(&names, src[i].name) : -1;
+        if (added >= 0) {
+            found = !added;
+        } else {
+            hashed = 0;
+            for (size_t j = 0; j < n->attr_count; j++) {
+                if (n->attrs[j].name && strcmp(n->attrs[j].name, src[i].name) == 0) {
+                    found = 1;
+                    break;
+                }
             }
         }
         if (!found) {
-            node_attr *new_attrs = (node_attr *)realloc(
-                n->attrs, (n->attr_count + 1) * sizeof(node_attr));
-            if (!new_attrs) return;
-            n->attrs = new_attrs;
-            n->attrs[n->attr_count].name  = strdup(src[i].name);
-            n->attrs[n->attr_count].value = src[i].value ? strdup(src[i].value) : NULL;
+            n->attrs[n->attr_count].name  = node_mem_strdup(n, src[i].name);
+            n->attrs[n->attr_count].value = node_mem_strdup(n, src[i].value);
             n->attr_count++;
         }
     }
+    attr_name_set_free(&names);
+    stat_attrs(n, from);
+    /* A new id/class on an attached <html>/<body> */
+    node_index_element_changed(n);
 }
 
 /* Attach attributes with SVG attribute name adjustment */
 static void attach_attrs_svg(node *n, const token_attr *src, size_t count) {
     if (!n || !src || count == 0) return;
-    n->attrs = (node_attr *)malloc(count * sizeof(node_attr));
+    n->attrs = (node_attr *)node_mem_alloc(n, count * sizeof(node_attr));
     if (!n->attrs) return;
-    n->attr_count = count;
+    size_t j = 0;
     for (size_t i = 0; i < count; ++i) {
+        if (filter_drops_attr(src[i].name)) continue;
         const char *aname = src[i].name ? svg_adjust_attr_name(src[i].name) : NULL;
-        n->attrs[i].name  = aname ? strdup(aname) : NULL;
-        n->attrs[i].value = src[i].value ? strdup(src[i].value) : NULL;
+        n->attrs[j].name  = node_mem_strdup(n, aname);
+        n->attrs[j].value = node_mem_strdup(n, src[i].value);
+        j++;
+    }
+    n->attr_count = j;
+    stat_attrs(n, 0);
+}
+
+/* ============================================================================
+ * Moving token strings into nodes
+ * Text, comment data and attributes are handed from the token to the node
+ * instead of copied. Text and comment data is taken outright (t->data
+ * becomes NULL). Attribute strings are taken but t->attrs keeps pointing
+ * at them, because the builder still reads the token's attributes after
+ * the element is inserted (input type, meta charset, ...); attrs_moved
+ * then keeps token_free() from freeing them a second time.
+ *
+ * Everything is copied for build_tree_from_tokens(), whose caller owns
+ * the tokens, while a stop_when predicate is set: it sees the token
+ * after processing, when pruning may already have freed the node, and
+ * while a node arena is attached, which must hold the strings. So are
+ * attributes already moved (a reprocessed token) and lists the filter
+ * takes attributes out of.
+ * ============================================================================ */
+static _Thread_local int build_borrows_tokens;
+
+static int token_strings_movable(void) {
+    return !build_borrows_tokens && !(build_filter && build_filter->stop_when) &&
+           !node_arena_current;
+}
+
+static int token_attrs_movable(const token *t) {
+    if (!token_strings_movable() || t->attrs_moved) return 0;
+    if (build_filter && build_filter->drop_attributes)
+        for (size_t i = 0; i < t->attr_count; i++)
+            if (filter_drops_attr(t->attrs[i].name)) return 0;
+    return 1;
+}
+
+/* Text or comment node holding the token's data ("" when it has none) */
+static node *node_create_from_token(node_type type, token *t) {
+    if (!t->data || !token_strings_movable())
+        return node_create(type, NULL, t->data ? t->data : "");
+    char *data = t->data;
+    t->data = NULL;
+    return node_create_take(type, NULL, data);
+}
+
+/* Steal the strings of t's attribute list into a new array on n */
+static int take_attrs(node *n, token *t) {
+    n->attrs = (node_attr *)node_mem_alloc(n, t->attr_count * sizeof(node_attr));
+    if (!n->attrs) return 0;
+    for (size_t i = 0; i < t->attr_count; i++) {
+        n->attrs[i].name = t->attrs[i].name;
+        n->attrs[i].value = t->attrs[i].value;
+    }
+    n->attr_count = t->attr_count;
+    t->attrs_moved = 1;
+    PARSE_STAT_ADD(attrs_created, n->attr_count);
+    PARSE_STAT_ADD(allocs, 1);
+    PARSE_STAT_ADD(alloc_bytes, n->attr_count * sizeof(node_attr));
+    return 1;
+}
+
+static void attach_attrs_take(node *n, token *t) {
+    if (!n || !t || !t->attrs || t->attr_count == 0) return;
+    if (!token_attrs_movable(t)) {
+        attach_attrs(n, t->attrs, t->attr_count);
+        return;
+    }
+    take_attrs(n, t);
+}
+
+/* SVG attribute adjustment only changes case, so the taken names are
+ * fixed up in place. */
+static void attach_attrs_svg_take(node *n, token *t) {
+    if (!n || !t || !t->attrs || t->attr_count == 0) return;
+    if (!token_attrs_movable(t)) {
+        attach_attrs_svg(n, t->attrs, t->attr_count);
+        return;
+    }
+    if (!take_attrs(n, t)) return;
+    for (size_t i = 0; i < n->attr_count; i++) {
+        char *aname = n->attrs[i].name;
+        const char *adjusted = aname ? svg_adjust_attr_name(aname) : NULL;
+        if (adjusted && adjusted != aname)
+            memcpy(aname, adjusted, strlen(aname));
     }
 }
 
@@ -131,7 +273,8 @@ typedef enum {
     MODE_IN_TEMPLATE,
     MODE_TEXT,
     MODE_AFTER_BODY,
-    MODE_AFTER_AFTER_BODY
+    MODE_AFTER_AFTER_BODY,
+    MODE_COUNT
 } insertion_mode;
 
 typedef enum {
@@ -140,14 +283,6 @@ typedef enum {
     DOC_QUIRKS
 } doc_mode;
 
-static int is_table_mode(insertion_mode mode) {
-    return mode == MODE_IN_TABLE ||
-           mode == MODE_IN_TABLE_TEXT ||
-           mode == MODE_IN_TABLE_BODY ||
-           mode == MODE_IN_ROW ||
-           mode == MODE_IN_CELL;
-}
-
 /* Return the value of the attribute with the given name, or NULL if not found. */
 static const char *find_attr(const token_attr *attrs, size_t count, const char *name) {
     for (size_t i = 0; i < count; i++) {
@@ -157,18 +292,154 @@ static const char *find_attr(const token_attr *attrs, size_t count, const char *
     return NULL;
 }
 
-/* WHATWG §13.2.6.5: elements allowed on the stack at EOF without parse error */
-static int is_eof_expected_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "dd") == 0 || strcmp(name, "dt") == 0 ||
-           strcmp(name, "li") == 0 || strcmp(name, "optgroup") == 0 ||
-           strcmp(name, "option") == 0 || strcmp(name, "p") == 0 ||
-           strcmp(name, "rb") == 0 || strcmp(name, "rp") == 0 ||
-           strcmp(name, "rt") == 0 || strcmp(name, "rtc") == 0 ||
-           strcmp(name, "tbody") == 0 || strcmp(name, "td") == 0 ||
-           strcmp(name, "tfoot") == 0 || strcmp(name, "th") == 0 ||
-           strcmp(name, "thead") == 0 || strcmp(name, "tr") == 0 ||
-           strcmp(name, "body") == 0 || strcmp(name, "html") == 0;
+/* ============================================================================
+ * Tag properties
+ * The element lists the insertion modes test against, as bits per tag
+ * atom (see tag_atom.h). Names are compared as stored, whatever the
+ * namespace; the scope helpers below add the namespace rules. Elements
+ * without an atom have none of these properties.
+ * ============================================================================ */
+enum {
+    TP_SPECIAL              = 1u << 0,  /* "special" (HTML namespace) */
+    TP_SCOPE                = 1u << 1,  /* scope barriers (WHATWG §13.2.4.2) */
+    TP_LIST_SCOPE           = 1u << 2,  /* + list item scope: ol, ul */
+    TP_BUTTON_SCOPE         = 1u << 3,  /* + button scope: button */
+    TP_TABLE_SCOPE          = 1u << 4,  /* table scope: html, table, template */
+    TP_IMPLIED_END          = 1u << 5,  /* implied end tags (§13.2.6.3) */
+    TP_IMPLIED_END_THOROUGH = 1u << 6,  /* ... thoroughly */
+    TP_EOF_EXPECTED         = 1u << 7,  /* may be open at EOF (§13.2.6.5) */
+    TP_TABLE                = 1u << 8,
+    TP_TABLE_SECTION        = 1u << 9,
+    TP_CELL                 = 1u << 10,
+    TP_FOSTER_TARGET        = 1u << 11, /* content inserted here is fostered */
+    TP_BODY_IGNORED         = 1u << 12, /* start tag ignored in body */
+    TP_BLOCK_LIKE           = 1u << 13, /* start tag closes an open <p> */
+    TP_HEADING              = 1u << 14,
+    TP_VOID                 = 1u << 15,
+    TP_HEAD                 = 1u << 16, /* handled by the "in head" rules */
+    TP_HEAD_NOSCRIPT        = 1u << 17, /* ... inside <noscript> in head */
+    TP_TEMPLATE_HEAD        = 1u << 18, /* ... in template contents */
+    TP_TEXT_MODE            = 1u << 19, /* RCDATA / RAWTEXT / script data */
+    TP_FORM_ASSOCIATED      = 1u << 20, /* linked to form_element_pointer */
+    TP_SELECT_CHILD         = 1u << 21  /* option, optgroup */
+};
+
+static const uint32_t tag_props[TAG_ATOM_COUNT] = {
+    [TAG_ADDRESS] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_APPLET] = TP_SPECIAL | TP_SCOPE,
+    [TAG_AREA] = TP_SPECIAL | TP_VOID,
+    [TAG_ARTICLE] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_ASIDE] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_BASE] = TP_SPECIAL | TP_VOID | TP_HEAD | TP_TEMPLATE_HEAD,
+    [TAG_BASEFONT] = TP_SPECIAL | TP_HEAD_NOSCRIPT | TP_TEMPLATE_HEAD,
+    [TAG_BGSOUND] = TP_HEAD_NOSCRIPT | TP_TEMPLATE_HEAD,
+    [TAG_BLOCKQUOTE] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_BODY] = TP_SPECIAL | TP_EOF_EXPECTED,
+    [TAG_BR] = TP_SPECIAL | TP_VOID,
+    [TAG_BUTTON] = TP_SPECIAL | TP_BUTTON_SCOPE | TP_FORM_ASSOCIATED,
+    [TAG_CAPTION] = TP_SPECIAL | TP_SCOPE | TP_IMPLIED_END_THOROUGH |
+                    TP_TABLE | TP_BODY_IGNORED,
+    [TAG_CENTER] = TP_SPECIAL,
+    [TAG_COL] = TP_SPECIAL | TP_TABLE | TP_BODY_IGNORED | TP_VOID,
+    [TAG_COLGROUP] = TP_SPECIAL | TP_IMPLIED_END_THOROUGH | TP_TABLE |
+                     TP_BODY_IGNORED,
+    [TAG_DD] = TP_SPECIAL | TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH |
+               TP_EOF_EXPECTED,
+    [TAG_DETAILS] = TP_SPECIAL,
+    [TAG_DIR] = TP_SPECIAL,
+    [TAG_DIV] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_DL] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_DT] = TP_SPECIAL | TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH |
+               TP_EOF_EXPECTED,
+    [TAG_EMBED] = TP_SPECIAL | TP_VOID,
+    [TAG_FIELDSET] = TP_SPECIAL | TP_BLOCK_LIKE | TP_FORM_ASSOCIATED,
+    [TAG_FIGCAPTION] = TP_SPECIAL,
+    [TAG_FIGURE] = TP_SPECIAL,
+    [TAG_FOOTER] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_FORM] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_FRAME] = TP_SPECIAL | TP_BODY_IGNORED,
+    [TAG_FRAMESET] = TP_SPECIAL,
+    [TAG_H1] = TP_SPECIAL | TP_BLOCK_LIKE | TP_HEADING,
+    [TAG_H2] = TP_SPECIAL | TP_BLOCK_LIKE | TP_HEADING,
+    [TAG_H3] = TP_SPECIAL | TP_BLOCK_LIKE | TP_HEADING,
+    [TAG_H4] = TP_SPECIAL | TP_BLOCK_LIKE | TP_HEADING,
+    [TAG_H5] = TP_SPECIAL | TP_BLOCK_LIKE | TP_HEADING,
+    [TAG_H6] = TP_SPECIAL | TP_BLOCK_LIKE | TP_HEADING,
+    [TAG_HEAD] = TP_SPECIAL | TP_BODY_IGNORED,
+    [TAG_HEADER] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_HGROUP] = TP_SPECIAL,
+    [TAG_HR] = TP_SPECIAL | TP_BLOCK_LIKE | TP_VOID,
+    [TAG_HTML] = TP_SPECIAL | TP_SCOPE | TP_TABLE_SCOPE | TP_EOF_EXPECTED,
+    [TAG_IFRAME] = TP_SPECIAL | TP_TEXT_MODE,
+    [TAG_IMG] = TP_SPECIAL | TP_VOID | TP_FORM_ASSOCIATED,
+    [TAG_INPUT] = TP_SPECIAL | TP_VOID | TP_FORM_ASSOCIATED,
+    [TAG_LI] = TP_SPECIAL | TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH |
+               TP_EOF_EXPECTED,
+    [TAG_LINK] = TP_SPECIAL | TP_VOID | TP_HEAD | TP_HEAD_NOSCRIPT |
+                 TP_TEMPLATE_HEAD,
+    [TAG_LISTING] = TP_SPECIAL,
+    [TAG_MAIN] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_MARQUEE] = TP_SPECIAL | TP_SCOPE,
+    [TAG_MENU] = TP_SPECIAL,
+    [TAG_META] = TP_SPECIAL | TP_VOID | TP_HEAD | TP_HEAD_NOSCRIPT |
+                 TP_TEMPLATE_HEAD,
+    [TAG_NAV] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_NOEMBED] = TP_SPECIAL | TP_TEXT_MODE,
+    [TAG_NOFRAMES] = TP_SPECIAL | TP_HEAD_NOSCRIPT | TP_TEMPLATE_HEAD |
+                     TP_TEXT_MODE,
+    [TAG_NOSCRIPT] = TP_SPECIAL | TP_HEAD | TP_TEMPLATE_HEAD,
+    [TAG_OBJECT] = TP_SPECIAL | TP_SCOPE | TP_FORM_ASSOCIATED,
+    [TAG_OL] = TP_SPECIAL | TP_LIST_SCOPE | TP_BLOCK_LIKE,
+    [TAG_OPTGROUP] = TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH |
+                     TP_EOF_EXPECTED | TP_SELECT_CHILD,
+    [TAG_OPTION] = TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH |
+                   TP_EOF_EXPECTED | TP_SELECT_CHILD,
+    [TAG_OUTPUT] = TP_FORM_ASSOCIATED,
+    [TAG_P] = TP_SPECIAL | TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH |
+              TP_EOF_EXPECTED | TP_BLOCK_LIKE,
+    [TAG_PARAM] = TP_SPECIAL | TP_VOID,
+    [TAG_PLAINTEXT] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_PRE] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_RB] = TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED,
+    [TAG_RP] = TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED,
+    [TAG_RT] = TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED,
+    [TAG_RTC] = TP_IMPLIED_END | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED,
+    [TAG_SCRIPT] = TP_SPECIAL | TP_HEAD | TP_TEMPLATE_HEAD | TP_TEXT_MODE,
+    [TAG_SECTION] = TP_SPECIAL | TP_BLOCK_LIKE,
+    [TAG_SELECT] = TP_SPECIAL | TP_FORM_ASSOCIATED,
+    [TAG_SOURCE] = TP_SPECIAL | TP_VOID,
+    [TAG_STYLE] = TP_SPECIAL | TP_HEAD | TP_HEAD_NOSCRIPT | TP_TEMPLATE_HEAD |
+                  TP_TEXT_MODE,
+    [TAG_SUMMARY] = TP_SPECIAL,
+    [TAG_TABLE] = TP_SPECIAL | TP_SCOPE | TP_TABLE_SCOPE | TP_TABLE |
+                  TP_FOSTER_TARGET | TP_BLOCK_LIKE,
+    [TAG_TBODY] = TP_SPECIAL | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED |
+                  TP_TABLE | TP_TABLE_SECTION | TP_FOSTER_TARGET |
+                  TP_BODY_IGNORED,
+    [TAG_TD] = TP_SPECIAL | TP_SCOPE | TP_IMPLIED_END_THOROUGH |
+               TP_EOF_EXPECTED | TP_TABLE | TP_CELL | TP_BODY_IGNORED,
+    [TAG_TEMPLATE] = TP_SPECIAL | TP_SCOPE | TP_TABLE_SCOPE | TP_HEAD |
+                     TP_TEMPLATE_HEAD,
+    [TAG_TEXTAREA] = TP_SPECIAL | TP_TEXT_MODE | TP_FORM_ASSOCIATED,
+    [TAG_TFOOT] = TP_SPECIAL | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED |
+                  TP_TABLE | TP_TABLE_SECTION | TP_FOSTER_TARGET |
+                  TP_BODY_IGNORED,
+    [TAG_TH] = TP_SPECIAL | TP_SCOPE | TP_IMPLIED_END_THOROUGH |
+               TP_EOF_EXPECTED | TP_TABLE | TP_CELL | TP_BODY_IGNORED,
+    [TAG_THEAD] = TP_SPECIAL | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED |
+                  TP_TABLE | TP_TABLE_SECTION | TP_FOSTER_TARGET |
+                  TP_BODY_IGNORED,
+    [TAG_TITLE] = TP_SPECIAL | TP_HEAD | TP_TEMPLATE_HEAD | TP_TEXT_MODE,
+    [TAG_TR] = TP_SPECIAL | TP_IMPLIED_END_THOROUGH | TP_EOF_EXPECTED |
+               TP_TABLE | TP_FOSTER_TARGET | TP_BODY_IGNORED,
+    [TAG_TRACK] = TP_SPECIAL | TP_VOID,
+    [TAG_UL] = TP_SPECIAL | TP_LIST_SCOPE | TP_BLOCK_LIKE,
+    [TAG_WBR] = TP_SPECIAL | TP_VOID,
+    [TAG_XMP] = TP_SPECIAL | TP_TEXT_MODE,
+};
+
+static int tag_is(tag_atom atom, uint32_t props) {
+    return (tag_props[atom] & props) != 0;
 }
 
 typedef enum {
@@ -190,19 +461,54 @@ typedef enum {
     FMT_MARKER          /* sentinel: pushed at td/th/caption boundaries */
 } fmt_tag;
 
+static fmt_tag fmt_tag_of(tag_atom atom) {
+    switch (atom) {
+    case TAG_A:      return FMT_A;
+    case TAG_B:      return FMT_B;
+    case TAG_BIG:    return FMT_BIG;
+    case TAG_CODE:   return FMT_CODE;
+    case TAG_EM:     return FMT_EM;
+    case TAG_FONT:   return FMT_FONT;
+    case TAG_I:      return FMT_I;
+    case TAG_NOBR:   return FMT_NOBR;
+    case TAG_S:      return FMT_S;
+    case TAG_SMALL:  return FMT_SMALL;
+    case TAG_STRIKE: return FMT_STRIKE;
+    case TAG_STRONG: return FMT_STRONG;
+    case TAG_TT:     return FMT_TT;
+    case TAG_U:      return FMT_U;
+    default:         return FMT_NONE;
+    }
+}
+
+/* The open-element stack and the active formatting list index each
+ * other: a formatting entry knows where its element sits on the stack and
+ * a stack slot knows its formatting entry, so reconstruction and the
+ * adoption agency never search either list for an element. Only the
+ * helpers below move entries; they keep both sides in step. */
+struct node_stack;
+
 typedef struct {
     fmt_tag tag;
     node *element;
+    int stack_index;            /* slot on the open-element stack, -1 if closed */
+    uint32_t attr_hash;         /* attrs_hash(element), for the Noah's Ark check */
 } formatting_entry;
 
 typedef struct {
     formatting_entry items[64];
     size_t count;
+    struct node_stack *st;
 } formatting_list;
 
-typedef struct {
+/* Each slot also carries the atom of its element's name, so the scope
+ * and "has an element open" checks compare integers. */
+typedef struct node_stack {
     node *items[STACK_MAX];
+    uint16_t atoms[STACK_MAX];
+    int fmt_index[STACK_MAX];   /* formatting-list entry of each slot, -1 if none */
     size_t size;
+    formatting_list *fl;
 } node_stack;
 
 typedef struct {
@@ -211,46 +517,66 @@ typedef struct {
     size_t cap;
 } text_buffer;
 
-static void stack_pop_until(node_stack *st, const char *name);
-static int is_void_element(const char *name);
-static int is_table_element(const char *name);
-static int is_heading_element(const char *name);
-static int stack_has_open_heading(node_stack *st);
-static void stack_pop_until_heading(node_stack *st);
+/* ============================================================================
+ * Tree builder state
+ * What the insertion modes share while building one document or
+ * fragment. Each entry point fills one in and feeds it tokens through
+ * builder_step(), which runs the handler for the current insertion mode
+ * and token type from a table (see "Insertion modes" below).
+ * ============================================================================ */
+typedef struct tree_builder tree_builder;
+
+/* What a handler did with its token. */
+typedef enum {
+    STEP_DONE,              /* consumed */
+    STEP_DONE_NO_TEXT,      /* consumed, and a start tag that left the
+                             * tokenizer in a raw text state does not enter
+                             * MODE_TEXT (template contents, head noscript) */
+    STEP_REPROCESS,         /* the mode changed: run the token again */
+    STEP_STOP,              /* parsing is over */
+    STEP_ABORT              /* <meta> charset: *change_encoding is set */
+} step_result;
+
+typedef step_result (*token_handler)(tree_builder *b, token *t);
+
+/* A row of handlers for one insertion mode, indexed by token type. */
+typedef token_handler mode_handlers[TOKEN_EOF + 1];
+
+struct tree_builder {
+    node *doc;
+    node_stack st;
+    formatting_list fmt;
+    insertion_mode mode;
+    insertion_mode original_insertion_mode;
+    insertion_mode template_mode_stack[64];
+    int template_mode_top;
+    doc_mode dmode;
+    node *html;
+    node *head;
+    node *body;
+    node *form_element_pointer;
+    text_buffer table_text;
+    int table_text_has_non_ws;
+    node *context;              /* fragment context element, or NULL */
+    tokenizer *tz;              /* NULL over a pre-tokenized stream */
+    const mode_handlers *modes; /* document_modes or fragment_modes */
+    tag_atom atom;              /* of the token's tag name */
+    encoding_confidence confidence;
+    const char **change_encoding;   /* NULL: <meta> charsets are ignored */
+};
+
+static void stack_pop_until(node_stack *st, tag_atom atom);
 static node *clone_element_shallow(node *original);
-static int handle_in_template_mode(const token *t, node *doc, node_stack *st,
-                                   formatting_list *fmt, insertion_mode *mode,
-                                   insertion_mode *template_mode_stack, int *template_mode_top,
-                                   int *reprocess);
-
-/* Elements that trigger the "text" insertion mode (generic RCDATA/RAWTEXT/script) */
-static int triggers_text_mode(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "title") == 0 ||
-           strcmp(name, "textarea") == 0 ||
-           strcmp(name, "style") == 0 ||
-           strcmp(name, "script") == 0 ||
-           strcmp(name, "xmp") == 0 ||
-           strcmp(name, "iframe") == 0 ||
-           strcmp(name, "noembed") == 0 ||
-           strcmp(name, "noframes") == 0;
-}
-
-/* Form-associated elements — automatically linked to form_element_pointer */
-static int is_form_associated_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "input") == 0 ||
-           strcmp(name, "button") == 0 ||
-           strcmp(name, "select") == 0 ||
-           strcmp(name, "textarea") == 0 ||
-           strcmp(name, "fieldset") == 0 ||
-           strcmp(name, "output") == 0 ||
-           strcmp(name, "object") == 0 ||
-           strcmp(name, "img") == 0;
-}
 
 static void stack_init(node_stack *st) {
     st->size = 0;
+    st->fl = NULL;
+}
+
+/* Pair a stack with its active formatting list (both empty). */
+static void stack_link_formatting(node_stack *st, formatting_list *fl) {
+    st->fl = fl;
+    fl->st = st;
 }
 
 static void text_buffer_init(text_buffer *tb) {
@@ -294,15 +620,35 @@ static int text_buffer_append(text_buffer *tb, const char *s) {
 static void stack_push(node_stack *st, node *n) {
     if (!n) return;
     if (st->size < STACK_MAX) {
+        st->fmt_index[st->size] = -1;
+        st->atoms[st->size] = (uint16_t)tag_atom_lookup(n->name);
         st->items[st->size++] = n;
+        PARSE_STAT_MAX(peak_stack_depth, st->size);
     }
 }
 
+/* Point stack slot si and formatting entry fi at each other. */
+static void stack_fmt_link(node_stack *st, int si, int fi) {
+    if (si >= 0) st->fmt_index[si] = fi;
+    if (fi >= 0 && st->fl) st->fl->items[fi].stack_index = si;
+}
+
+/* Slot si is leaving the stack: its formatting entry (if any) is closed. */
+static void stack_fmt_unlink(node_stack *st, size_t si) {
+    int fi = st->fmt_index[si];
+    if (fi >= 0 && st->fl) st->fl->items[fi].stack_index = -1;
+}
+
 static node *stack_top(node_stack *st) {
     if (st->size == 0) return NULL;
     return st->items[st->size - 1];
 }
 
+/* Atom of the current node; TAG_UNKNOWN when the stack is empty. */
+static tag_atom stack_top_atom(const node_stack *st) {
+    return st->size ? (tag_atom)st->atoms[st->size - 1] : TAG_UNKNOWN;
+}
+
 static int stack_contains(node_stack *st, node *n) {
     for (size_t i = 0; i < st->size; ++i) {
         if (st->items[i] == n) return 1;
@@ -312,7 +658,8 @@ static int stack_contains(node_stack *st, node *n) {
 
 static node *stack_pop(node_stack *st) {
     if (st->size == 0) return NULL;
-    return st->items[--st->size];
+    stack_fmt_unlink(st, --st->size);
+    return st->items[st->size];
 }
 
 static int stack_index_of(node_stack *st, node *n) {
@@ -325,8 +672,11 @@ static int stack_index_of(node_stack *st, node *n) {
 
 static void stack_remove_at(node_stack *st, size_t index) {
     if (!st || index >= st->size) return;
+    stack_fmt_unlink(st, index);
     for (size_t i = index; i + 1 < st->size; ++i) {
         st->items[i] = st->items[i + 1];
+        st->atoms[i] = st->atoms[i + 1];
+        stack_fmt_link(st, (int)i, st->fmt_index[i + 1]);
     }
     st->size--;
 }
@@ -336,39 +686,57 @@ static void stack_insert_at(node_stack *st, size_t index, node *n) {
     if (index > st->size) index = st->size;
     for (size_t i = st->size; i > index; --i) {
         st->items[i] = st->items[i - 1];
+        st->atoms[i] = st->atoms[i - 1];
+        stack_fmt_link(st, (int)i, st->fmt_index[i - 1]);
     }
     st->items[index] = n;
+    st->atoms[index] = (uint16_t)tag_atom_lookup(n->name);
+    st->fmt_index[index] = -1;
     st->size++;
 }
 
-static fmt_tag fmt_tag_from_name(const char *name) {
-    if (!name) return FMT_NONE;
-    if (strcmp(name, "a") == 0) return FMT_A;
-    if (strcmp(name, "b") == 0) return FMT_B;
-    if (strcmp(name, "big") == 0) return FMT_BIG;
-    if (strcmp(name, "code") == 0) return FMT_CODE;
-    if (strcmp(name, "i") == 0) return FMT_I;
-    if (strcmp(name, "em") == 0) return FMT_EM;
-    if (strcmp(name, "font") == 0) return FMT_FONT;
-    if (strcmp(name, "nobr") == 0) return FMT_NOBR;
-    if (strcmp(name, "s") == 0) return FMT_S;
-    if (strcmp(name, "small") == 0) return FMT_SMALL;
-    if (strcmp(name, "strike") == 0) return FMT_STRIKE;
-    if (strcmp(name, "strong") == 0) return FMT_STRONG;
-    if (strcmp(name, "tt") == 0) return FMT_TT;
-    if (strcmp(name, "u") == 0) return FMT_U;
-    return FMT_NONE;
-}
-
-static int stack_has_open_named(node_stack *st, const char *name) {
-    if (!name) return 0;
+/* Whether slot i holds the element a tag with this atom names; tags
+ * without an atom (atom TAG_UNKNOWN) go by name. */
+static int stack_slot_is(const node_stack *st, size_t i, tag_atom atom,
+                         const char *name) {
+    if (st->atoms[i] != atom) return 0;
+    if (atom != TAG_UNKNOWN) return 1;
+    return name && st->items[i]->name && strcmp(st->items[i]->name, name) == 0;
+}
+
+static int stack_has_open(const node_stack *st, tag_atom atom) {
     for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (n && n->name && strcmp(n->name, name) == 0) return 1;
+        if (st->atoms[i - 1] == atom) return 1;
+    }
+    return 0;
+}
+
+/* Whether any open element has one of the properties. */
+static int stack_has_open_any(const node_stack *st, uint32_t props) {
+    for (size_t i = st->size; i > 0; --i) {
+        if (tag_is(st->atoms[i - 1], props)) return 1;
     }
     return 0;
 }
 
+/* Order-sensitive hash of an element's attribute names and values; equal
+ * attribute lists (attrs_equal) hash equal. */
+static uint32_t attrs_hash(const node *n) {
+    uint32_t h = 2166136261u;                   /* FNV-1a */
+    for (size_t i = 0; i < n->attr_count; ++i) {
+        const char *parts[2] = { n->attrs[i].name, n->attrs[i].value };
+        for (int k = 0; k < 2; ++k) {
+            for (const char *c = parts[k] ? parts[k] : ""; *c; ++c) {
+                h ^= (unsigned char)*c;
+                h *= 16777619u;
+            }
+            h ^= 0xffu;                         /* separator */
+            h *= 16777619u;
+        }
+    }
+    return h;
+}
+
 static int attrs_equal(const node *a, const node *b) {
     if (!a || !b) return 0;
     if (a->attr_count != b->attr_count) return 0;
@@ -383,187 +751,123 @@ static int attrs_equal(const node *a, const node *b) {
 }
 
 static int in_template_context(node_stack *st) {
-    return stack_has_open_named(st, "template");
+    return stack_has_open(st, TAG_TEMPLATE);
 }
 
 static int stack_has_open_table_section(node_stack *st) {
-    return stack_has_open_named(st, "thead") || stack_has_open_named(st, "tbody") || stack_has_open_named(st, "tfoot");
-}
-
-/* General scope barriers (WHATWG §13.2.4.2) */
-static int is_scoping_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "applet") == 0 ||
-           strcmp(name, "caption") == 0 ||
-           strcmp(name, "html") == 0 ||
-           strcmp(name, "table") == 0 ||
-           strcmp(name, "td") == 0 ||
-           strcmp(name, "th") == 0 ||
-           strcmp(name, "marquee") == 0 ||
-           strcmp(name, "object") == 0 ||
-           strcmp(name, "template") == 0;
-}
-
-/* List item scope = general scope + ol, ul */
-static int is_list_item_scoping_element(const char *name) {
-    if (!name) return 0;
-    return is_scoping_element(name) ||
-           strcmp(name, "ol") == 0 ||
-           strcmp(name, "ul") == 0;
-}
-
-/* Button scope = general scope + button */
-static int is_button_scoping_element(const char *name) {
-    if (!name) return 0;
-    return is_scoping_element(name) ||
-           strcmp(name, "button") == 0;
-}
-
-/* Table scope = html, table, template only */
-static int is_table_scoping_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "html") == 0 ||
-           strcmp(name, "table") == 0 ||
-           strcmp(name, "template") == 0;
+    return stack_has_open_any(st, TP_TABLE_SECTION);
 }
 
-static int has_element_in_scope(node_stack *st, const char *name) {
-    if (!name) return 0;
+/* Scopes (WHATWG §13.2.4.2) */
+typedef enum {
+    SCOPE_DEFAULT,
+    SCOPE_LIST_ITEM,
+    SCOPE_BUTTON,
+    SCOPE_TABLE
+} scope_kind;
+
+static const uint32_t scope_barriers[] = {
+    [SCOPE_DEFAULT]   = TP_SCOPE,
+    [SCOPE_LIST_ITEM] = TP_SCOPE | TP_LIST_SCOPE,
+    [SCOPE_BUTTON]    = TP_SCOPE | TP_BUTTON_SCOPE,
+    [SCOPE_TABLE]     = TP_TABLE_SCOPE,
+};
+
+/* Whether an HTML element named by atom (or by name, for tags without an
+ * atom) is in the given scope. MathML and SVG scoping elements end every
+ * scope; the HTML barriers end the default scope only in the HTML
+ * namespace and the narrower scopes whatever the namespace. */
+static int element_in_scope(const node_stack *st, tag_atom atom,
+                            const char *name, scope_kind kind) {
     for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (!n || !n->name) continue;
-        if (n->ns == NS_HTML && strcmp(n->name, name) == 0) return 1;
-        if (is_scoping_element_ns(n->name, n->ns)) return 0;
+        const node *n = st->items[i - 1];
+        if (!n->name) continue;
+        if (n->ns == NS_HTML) {
+            if (stack_slot_is(st, i - 1, atom, name)) return 1;
+        } else if (is_scoping_element_ns(n->name, n->ns)) {
+            return 0;
+        } else if (kind == SCOPE_DEFAULT) {
+            continue;
+        }
+        if (tag_is(st->atoms[i - 1], scope_barriers[kind])) return 0;
     }
     return 0;
 }
 
-static int has_element_in_list_item_scope(node_stack *st, const char *name) {
-    if (!name) return 0;
-    for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (!n || !n->name) continue;
-        if (n->ns == NS_HTML && strcmp(n->name, name) == 0) return 1;
-        if (n->ns != NS_HTML && is_scoping_element_ns(n->name, n->ns)) return 0;
-        if (is_list_item_scoping_element(n->name)) return 0;
-    }
-    return 0;
+static int has_element_in_scope(node_stack *st, tag_atom atom) {
+    return element_in_scope(st, atom, NULL, SCOPE_DEFAULT);
 }
 
-static int has_element_in_button_scope(node_stack *st, const char *name) {
-    if (!name) return 0;
-    for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (!n || !n->name) continue;
-        if (n->ns == NS_HTML && strcmp(n->name, name) == 0) return 1;
-        if (n->ns != NS_HTML && is_scoping_element_ns(n->name, n->ns)) return 0;
-        if (is_button_scoping_element(n->name)) return 0;
-    }
-    return 0;
+static int has_element_in_list_item_scope(node_stack *st, tag_atom atom) {
+    return element_in_scope(st, atom, NULL, SCOPE_LIST_ITEM);
 }
 
-static int has_element_in_table_scope(node_stack *st, const char *name) {
-    if (!name) return 0;
-    for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (!n || !n->name) continue;
-        if (n->ns == NS_HTML && strcmp(n->name, name) == 0) return 1;
-        if (n->ns != NS_HTML && is_scoping_element_ns(n->name, n->ns)) return 0;
-        if (is_table_scoping_element(n->name)) return 0;
-    }
-    return 0;
+static int has_element_in_button_scope(node_stack *st, tag_atom atom) {
+    return element_in_scope(st, atom, NULL, SCOPE_BUTTON);
+}
+
+static int has_element_in_table_scope(node_stack *st, tag_atom atom) {
+    return element_in_scope(st, atom, NULL, SCOPE_TABLE);
 }
 
 /* Select scope — everything except optgroup/option is a barrier */
-static int has_element_in_select_scope(node_stack *st, const char *name) {
-    if (!name) return 0;
+static int has_element_in_select_scope(node_stack *st, tag_atom atom) {
     for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (!n || !n->name) continue;
-        if (strcmp(n->name, name) == 0) return 1;
-        if (strcmp(n->name, "optgroup") != 0 && strcmp(n->name, "option") != 0)
-            return 0;
+        if (st->atoms[i - 1] == atom) return 1;
+        if (!tag_is(st->atoms[i - 1], TP_SELECT_CHILD)) return 0;
     }
     return 0;
 }
 
-/* WHATWG §13.2.6.3 — implied end tag elements */
-static int is_implied_end_tag_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "dd") == 0 ||
-           strcmp(name, "dt") == 0 ||
-           strcmp(name, "li") == 0 ||
-           strcmp(name, "optgroup") == 0 ||
-           strcmp(name, "option") == 0 ||
-           strcmp(name, "p") == 0 ||
-           strcmp(name, "rb") == 0 ||
-           strcmp(name, "rp") == 0 ||
-           strcmp(name, "rt") == 0 ||
-           strcmp(name, "rtc") == 0;
-}
-
+/* WHATWG §13.2.6.3 — implied end tags */
 static void generate_implied_end_tags(node_stack *st) {
-    while (st->size > 0) {
-        node *top = stack_top(st);
-        if (!top || !top->name || !is_implied_end_tag_element(top->name))
-            break;
+    while (st->size > 0 && tag_is(stack_top_atom(st), TP_IMPLIED_END))
         stack_pop(st);
-    }
 }
 
-static void generate_implied_end_tags_except(node_stack *st, const char *except) {
-    while (st->size > 0) {
-        node *top = stack_top(st);
-        if (!top || !top->name || !is_implied_end_tag_element(top->name))
-            break;
-        if (except && strcmp(top->name, except) == 0)
-            break;
+static void generate_implied_end_tags_except(node_stack *st, tag_atom except) {
+    while (st->size > 0 && tag_is(stack_top_atom(st), TP_IMPLIED_END) &&
+           stack_top_atom(st) != except)
         stack_pop(st);
-    }
-}
-
-static int is_implied_end_tag_element_thorough(const char *name) {
-    if (!name) return 0;
-    return is_implied_end_tag_element(name) ||
-           strcmp(name, "caption") == 0 ||
-           strcmp(name, "colgroup") == 0 ||
-           strcmp(name, "tbody") == 0 ||
-           strcmp(name, "td") == 0 ||
-           strcmp(name, "tfoot") == 0 ||
-           strcmp(name, "th") == 0 ||
-           strcmp(name, "thead") == 0 ||
-           strcmp(name, "tr") == 0;
 }
 
 static void generate_all_implied_end_tags_thoroughly(node_stack *st) {
-    while (st->size > 0) {
-        node *top = stack_top(st);
-        if (!top || !top->name || !is_implied_end_tag_element_thorough(top->name))
-            break;
+    while (st->size > 0 && tag_is(stack_top_atom(st), TP_IMPLIED_END_THOROUGH))
         stack_pop(st);
-    }
 }
 
+static void formatting_remove_at(formatting_list *fl, size_t index);
+
+/* Append element, normally the element just pushed on the stack. Noah's
+ * Ark clause: with three matching entries after the last marker already
+ * listed, the earliest of them is dropped. Attribute lists are compared
+ * only when their hashes match. */
 static void formatting_push(formatting_list *fl, fmt_tag tag, node *element) {
     if (!fl || tag == FMT_NONE || !element) return;
+    uint32_t hash = attrs_hash(element);
     size_t count_same = 0;
     size_t earliest_index = 0;
-    for (size_t i = 0; i < fl->count; ++i) {
-        if (fl->items[i].tag == tag && attrs_equal(fl->items[i].element, element)) {
-            if (count_same == 0) earliest_index = i;
+    for (size_t i = fl->count; i > 0; --i) {
+        formatting_entry *e = &fl->items[i - 1];
+        if (e->tag == FMT_MARKER) break;
+        if (e->tag == tag && e->attr_hash == hash &&
+            attrs_equal(e->element, element)) {
+            earliest_index = i - 1;
             count_same++;
         }
     }
-    if (count_same >= 3) {
-        for (size_t j = earliest_index + 1; j < fl->count; ++j) {
-            fl->items[j - 1] = fl->items[j];
-        }
-        fl->count--;
-    }
+    if (count_same >= 3) formatting_remove_at(fl, earliest_index);
     if (fl->count < sizeof(fl->items) / sizeof(fl->items[0])) {
-        fl->items[fl->count].tag = tag;
-        fl->items[fl->count].element = element;
+        formatting_entry *e = &fl->items[fl->count];
+        e->tag = tag;
+        e->element = element;
+        e->stack_index = -1;
+        e->attr_hash = hash;
         fl->count++;
+        node_stack *st = fl->st;
+        if (st && st->size > 0 && st->items[st->size - 1] == element &&
+            st->fmt_index[st->size - 1] < 0)
+            stack_fmt_link(st, (int)st->size - 1, (int)fl->count - 1);
     }
 }
 
@@ -573,6 +877,7 @@ static void formatting_push_marker(formatting_list *fl) {
     if (fl->count < sizeof(fl->items) / sizeof(fl->items[0])) {
         fl->items[fl->count].tag    = FMT_MARKER;
         fl->items[fl->count].element = NULL;
+        fl->items[fl->count].stack_index = -1;
         fl->count++;
     }
 }
@@ -586,68 +891,53 @@ static void formatting_clear_to_marker(formatting_list *fl) {
         if (fl->items[fl->count].tag == FMT_MARKER) {
             return;     /* marker itself is also removed */
         }
+        if (fl->items[fl->count].stack_index >= 0 && fl->st)
+            fl->st->fmt_index[fl->items[fl->count].stack_index] = -1;
     }
 }
 
-static int is_template_head_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "base") == 0 ||
-           strcmp(name, "basefont") == 0 ||
-           strcmp(name, "bgsound") == 0 ||
-           strcmp(name, "link") == 0 ||
-           strcmp(name, "meta") == 0 ||
-           strcmp(name, "noframes") == 0 ||
-           strcmp(name, "noscript") == 0 ||
-           strcmp(name, "script") == 0 ||
-           strcmp(name, "style") == 0 ||
-           strcmp(name, "template") == 0 ||
-           strcmp(name, "title") == 0;
-}
-
-static void template_mode_replace(insertion_mode *stack, int *top, insertion_mode mode) {
-    if (!stack || !top) return;
-    if (*top > 0) (*top)--;
-    if (*top < 64) {
-        stack[(*top)++] = mode;
-    }
-}
-
-static int stack_has_table_element(node_stack *st) {
-    if (!st) return 0;
-    for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (n && n->name && is_table_element(n->name)) return 1;
-    }
-    return 0;
+static void template_mode_replace(tree_builder *b, insertion_mode mode) {
+    if (b->template_mode_top > 0) b->template_mode_top--;
+    if (b->template_mode_top < 64)
+        b->template_mode_stack[b->template_mode_top++] = mode;
 }
 
 static insertion_mode reset_insertion_mode_from_stack(node_stack *st) {
     if (!st || st->size == 0) return MODE_IN_BODY;
-    int has_table = stack_has_table_element(st);
+    int has_table = stack_has_open_any(st, TP_TABLE);
     for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (!n || !n->name) continue;
-        if (strcmp(n->name, "select") == 0) {
+        switch (st->atoms[i - 1]) {
+        case TAG_SELECT:
             return has_table ? MODE_IN_SELECT_IN_TABLE : MODE_IN_SELECT;
-        }
-        if (strcmp(n->name, "td") == 0 || strcmp(n->name, "th") == 0) return MODE_IN_CELL;
-        if (strcmp(n->name, "tr") == 0) return MODE_IN_ROW;
-        if (strcmp(n->name, "tbody") == 0 || strcmp(n->name, "thead") == 0 || strcmp(n->name, "tfoot") == 0) {
+        case TAG_TD:
+        case TAG_TH:
+            return MODE_IN_CELL;
+        case TAG_TR:
+            return MODE_IN_ROW;
+        case TAG_TBODY:
+        case TAG_THEAD:
+        case TAG_TFOOT:
             return MODE_IN_TABLE_BODY;
+        case TAG_CAPTION:
+            return MODE_IN_CAPTION;
+        case TAG_TABLE:
+            return MODE_IN_TABLE;
+        case TAG_HEAD:
+            return MODE_IN_HEAD;
+        case TAG_BODY:
+        case TAG_HTML:
+            return MODE_IN_BODY;
+        default:
+            break;
         }
-        if (strcmp(n->name, "caption") == 0) return MODE_IN_CAPTION;
-        if (strcmp(n->name, "table") == 0) return MODE_IN_TABLE;
-        if (strcmp(n->name, "head") == 0) return MODE_IN_HEAD;
-        if (strcmp(n->name, "body") == 0) return MODE_IN_BODY;
-        if (strcmp(n->name, "html") == 0) return MODE_IN_BODY;
     }
     return MODE_IN_BODY;
 }
 
-static node *create_template_element(const token_attr *attrs, size_t attr_count) {
+static node *create_template_element(token *t) {
     node *tmpl = node_create(NODE_ELEMENT, "template", NULL);
     if (!tmpl) return NULL;
-    attach_attrs(tmpl, attrs, attr_count);
+    if (t) attach_attrs_take(tmpl, t);
     node *content = node_create(NODE_ELEMENT, "content", NULL);
     if (!content) {
         node_free(tmpl);
@@ -657,39 +947,29 @@ static node *create_template_element(const token_attr *attrs, size_t attr_count)
     return tmpl;
 }
 
-static void open_template_element(node_stack *st, formatting_list *fl, insertion_mode *mode,
-                                  insertion_mode *template_mode_stack, int *template_mode_top,
-                                  node *tmpl, int self_closing) {
-    if (!st || !tmpl || self_closing) return;
-    stack_push(st, tmpl);
+static void open_template_element(tree_builder *b, node *tmpl, int self_closing) {
+    if (!tmpl || self_closing) return;
+    stack_push(&b->st, tmpl);
     if (tmpl->first_child) {
-        stack_push(st, tmpl->first_child);
+        stack_push(&b->st, tmpl->first_child);
     }
-    if (fl) formatting_push_marker(fl);
-    if (mode && template_mode_stack && template_mode_top && *template_mode_top < 64) {
-        template_mode_stack[(*template_mode_top)++] = MODE_IN_TEMPLATE;
+    formatting_push_marker(&b->fmt);
+    if (b->template_mode_top < 64) {
+        b->template_mode_stack[b->template_mode_top++] = MODE_IN_TEMPLATE;
     }
-    if (mode) *mode = MODE_IN_TEMPLATE;
+    b->mode = MODE_IN_TEMPLATE;
 }
 
-static void close_template_element(node_stack *st, formatting_list *fl, insertion_mode *mode,
-                                   insertion_mode *template_mode_stack, int *template_mode_top) {
-    if (!st) return;
-    (void)template_mode_stack;
-    generate_all_implied_end_tags_thoroughly(st);
-    {
-        node *top = stack_top(st);
-        if (!top || !top->name || strcmp(top->name, "template") != 0)
-            tree_parse_error("unexpected-element-before-template");
-    }
-    stack_pop_until(st, "template");
-    if (fl) formatting_clear_to_marker(fl);
-    if (template_mode_top && *template_mode_top > 0) {
-        (*template_mode_top)--;
-    }
-    if (mode) {
-        *mode = reset_insertion_mode_from_stack(st);
+static void close_template_element(tree_builder *b) {
+    generate_all_implied_end_tags_thoroughly(&b->st);
+    if (stack_top_atom(&b->st) != TAG_TEMPLATE)
+        tree_parse_error(PARSE_ERR_UNEXPECTED_ELEMENT_BEFORE_TEMPLATE);
+    stack_pop_until(&b->st, TAG_TEMPLATE);
+    formatting_clear_to_marker(&b->fmt);
+    if (b->template_mode_top > 0) {
+        b->template_mode_top--;
     }
+    b->mode = reset_insertion_mode_from_stack(&b->st);
 }
 
 static int formatting_find_last(formatting_list *fl, fmt_tag tag) {
@@ -701,35 +981,42 @@ static int formatting_find_last(formatting_list *fl, fmt_tag tag) {
     return -1;
 }
 
+/* Entry i moved: repoint its stack slot (if open) at the new index. */
+static void formatting_relink(formatting_list *fl, size_t i) {
+    int si = fl->items[i].stack_index;
+    if (si >= 0 && fl->st) fl->st->fmt_index[si] = (int)i;
+}
+
 static void formatting_remove_at(formatting_list *fl, size_t index) {
     if (!fl || index >= fl->count) return;
+    if (fl->items[index].stack_index >= 0 && fl->st)
+        fl->st->fmt_index[fl->items[index].stack_index] = -1;
     for (size_t i = index; i + 1 < fl->count; ++i) {
         fl->items[i] = fl->items[i + 1];
+        formatting_relink(fl, i);
     }
     fl->count--;
 }
 
-static void formatting_insert_at(formatting_list *fl, size_t index, fmt_tag tag, node *element) {
+/* Insert an entry that is not on the stack yet (the caller links it). */
+static void formatting_insert_at(formatting_list *fl, size_t index, fmt_tag tag,
+                                 node *element, uint32_t attr_hash) {
     if (!fl || fl->count >= sizeof(fl->items) / sizeof(fl->items[0])) return;
     if (index > fl->count) index = fl->count;
     for (size_t i = fl->count; i > index; --i) {
         fl->items[i] = fl->items[i - 1];
+        formatting_relink(fl, i);
     }
     fl->items[index].tag = tag;
     fl->items[index].element = element;
+    fl->items[index].stack_index = -1;
+    fl->items[index].attr_hash = attr_hash;
     fl->count++;
 }
 
-static int formatting_index_of_element(formatting_list *fl, node *element) {
-    if (!fl || !element) return -1;
-    for (size_t i = 0; i < fl->count; ++i) {
-        if (fl->items[i].element == element) return (int)i;
-    }
-    return -1;
-}
-
 static void reconstruct_active_formatting(node_stack *st, formatting_list *fl, node *parent) {
     if (!st || !fl || !parent) return;
+    PARSE_STAT_ADD(reconstructs, 1);
     if (fl->count == 0) return;
 
     /* Per WHATWG: if the last entry is a marker or is already on the open-
@@ -737,7 +1024,7 @@ static void reconstruct_active_formatting(node_stack *st, formatting_list *fl, n
     {
         formatting_entry *last = &fl->items[fl->count - 1];
         if (last->tag == FMT_MARKER) return;
-        if (last->element && stack_contains(st, last->element)) return;
+        if (last->stack_index >= 0) return;
     }
 
     /* Walk backwards to find the boundary: stop at a marker or at an entry
@@ -745,8 +1032,7 @@ static void reconstruct_active_formatting(node_stack *st, formatting_list *fl, n
     size_t first = 0;
     for (size_t i = fl->count - 1; i > 0; --i) {
         formatting_entry *e = &fl->items[i - 1];
-        if (e->tag == FMT_MARKER ||
-            (e->element && stack_contains(st, e->element))) {
+        if (e->tag == FMT_MARKER || e->stack_index >= 0) {
             first = i;
             break;
         }
@@ -762,54 +1048,52 @@ static void reconstruct_active_formatting(node_stack *st, formatting_list *fl, n
         node_append_child(parent, n);
         stack_push(st, n);
         fl->items[i].element = n;
+        if (st->size > 0 && st->items[st->size - 1] == n)
+            stack_fmt_link(st, (int)st->size - 1, (int)i);
         parent = n;
     }
 }
 
-static int is_foster_parent_target(const char *name);
 static void foster_insert(node_stack *st, node *doc, node *child);
 
 /* Adoption Agency Algorithm (WHATWG §13.2.6.4).
    Returns 1 if the token was consumed (caller should break),
-   0 if tag_name is not a formatting element (caller handles normally). */
+   0 if atom is not a formatting element (caller handles normally). */
 static int adoption_agency(node_stack *st, formatting_list *fl, node *doc,
-                           const char *tag_name) {
-    fmt_tag ft = fmt_tag_from_name(tag_name);
+                           tag_atom atom) {
+    fmt_tag ft = fmt_tag_of(atom);
     if (ft == FMT_NONE) return 0;
 
     /* WHATWG step 2: current node is the element and not in active list → thoroughly + pop */
-    {
-        node *cur = stack_top(st);
-        if (cur && cur->name && strcmp(cur->name, tag_name) == 0 &&
-            formatting_index_of_element(fl, cur) < 0) {
-            generate_all_implied_end_tags_thoroughly(st);
-            cur = stack_top(st);
-            if (!cur || !cur->name || strcmp(cur->name, tag_name) != 0)
-                tree_parse_error("aaa-implied-mismatch");
-            if (cur && cur->name && strcmp(cur->name, tag_name) == 0)
-                stack_pop(st);
-            return 1;
-        }
+    if (stack_top_atom(st) == atom && st->fmt_index[st->size - 1] < 0) {
+        generate_all_implied_end_tags_thoroughly(st);
+        if (stack_top_atom(st) != atom)
+            tree_parse_error(PARSE_ERR_AAA_IMPLIED_MISMATCH);
+        else
+            stack_pop(st);
+        return 1;
     }
 
     /* Outer loop: at most 8 iterations */
     for (int outer = 0; outer < 8; ++outer) {
+        PARSE_STAT_ADD(aaa_outer, 1);
         /* Step 4c: find formatting element in active list (last before marker) */
         int fmt_idx = formatting_find_last(fl, ft);
         if (fmt_idx < 0) return 0;  /* not in active list → "any other end tag" */
 
         node *formatting_element = fl->items[fmt_idx].element;
+        uint32_t fe_hash = fl->items[fmt_idx].attr_hash;
 
         /* Step 4e: not in stack → remove from list and return */
-        int fe_stack_idx = stack_index_of(st, formatting_element);
+        int fe_stack_idx = fl->items[fmt_idx].stack_index;
         if (fe_stack_idx < 0) {
             formatting_remove_at(fl, (size_t)fmt_idx);
             return 1;
         }
 
         /* Step 4f: not in scope → parse error, return */
-        if (!has_element_in_scope(st, tag_name)) {
-            tree_parse_error("adoption-agency-1.1");
+        if (!has_element_in_scope(st, atom)) {
+            tree_parse_error(PARSE_ERR_ADOPTION_AGENCY_1_1);
             return 1;
         }
 
@@ -817,9 +1101,10 @@ static int adoption_agency(node_stack *st, formatting_list *fl, node *doc,
         node *furthest_block = NULL;
         int fb_stack_idx = -1;
         for (size_t i = (size_t)fe_stack_idx + 1; i < st->size; ++i) {
-            if (st->items[i] && st->items[i]->name &&
-                is_special_element_ns(st->items[i]->name, st->items[i]->ns)) {
-                furthest_block = st->items[i];
+            node *n = st->items[i];
+            if (n->ns == NS_HTML ? tag_is(st->atoms[i], TP_SPECIAL)
+                                 : is_special_element_ns(n->name, n->ns)) {
+                furthest_block = n;
                 fb_stack_idx = (int)i;
                 break;
             }
@@ -837,38 +1122,40 @@ static int adoption_agency(node_stack *st, formatting_list *fl, node *doc,
 
         /* Step 4j: common ancestor */
         node *common_ancestor = (fe_stack_idx > 0) ? st->items[fe_stack_idx - 1] : doc;
+        tag_atom common_atom = (fe_stack_idx > 0) ? (tag_atom)st->atoms[fe_stack_idx - 1]
+                                                  : TAG_UNKNOWN;
 
         /* Step 4k: bookmark = position in formatting list */
         size_t bookmark = (size_t)fmt_idx;
 
-        /* Step 4l-n: inner loop */
+        /* Step 4l-n: inner loop. Only entries above the formatting element
+           leave the stack, so fe_stack_idx stays valid throughout. */
         node *inner_node = furthest_block;
         node *last_node = furthest_block;
+        int node_si = fb_stack_idx;
 
-        for (int inner = 1; inner <= 8; ++inner) {
-            /* Step n.2: move to element above inner_node in stack (toward fe) */
-            int node_si = stack_index_of(st, inner_node);
-            if (node_si <= 0) break;
-            inner_node = st->items[node_si - 1];
+        for (int inner = 1;; ++inner) {
+            PARSE_STAT_ADD(aaa_inner, 1);
+            /* Step n.2: move to element above inner_node in stack (toward fe);
+               after a removal that is the element that was above it */
+            if (--node_si < 0) break;
+            inner_node = st->items[node_si];
 
             /* Step n.3: if node is formatting element, break */
             if (inner_node == formatting_element) break;
 
             /* Step n.4-5: check if inner_node is in formatting list */
-            int node_fi = formatting_index_of_element(fl, inner_node);
+            int node_fi = st->fmt_index[node_si];
             if (inner > 3 && node_fi >= 0) {
                 formatting_remove_at(fl, (size_t)node_fi);
                 if ((size_t)node_fi < bookmark) bookmark--;
-                /* recalculate fmt_idx if affected */
-                fmt_idx = formatting_index_of_element(fl, formatting_element);
                 node_fi = -1;
             }
 
             /* Step n.5 cont: not in formatting list → remove from stack, continue */
             if (node_fi < 0) {
-                stack_remove_at(st, (size_t)(node_si - 1));
-                /* fb_stack_idx may shift */
-                fb_stack_idx = stack_index_of(st, furthest_block);
+                stack_remove_at(st, (size_t)node_si);
+                fb_stack_idx--;
                 continue;
             }
 
@@ -876,20 +1163,11 @@ static int adoption_agency(node_stack *st, formatting_list *fl, node *doc,
             node *replacement = clone_element_shallow(inner_node);
             if (!replacement) break;
 
-            /* Replace in formatting list */
+            /* Replace in formatting list and stack (the slots stay linked,
+               and the clone has the same name, hence the same atom);
+               inner_node itself stays where it is in the tree */
             fl->items[node_fi].element = replacement;
-
-            /* Replace in stack */
-            int cur_si = stack_index_of(st, inner_node);
-            if (cur_si >= 0) st->items[cur_si] = replacement;
-
-            /* Replace in tree: replacement takes inner_node's position and children */
-            node_reparent_children(inner_node, replacement);
-            if (inner_node->parent) {
-                node_insert_before(inner_node->parent, replacement, inner_node);
-                node_remove_child(inner_node->parent, inner_node);
-            }
-            node_free_shallow(inner_node);
+            st->items[node_si] = replacement;
             inner_node = replacement;
 
             /* Step n.7: if last_node is furthest_block, move bookmark */
@@ -911,18 +1189,19 @@ static int adoption_agency(node_stack *st, formatting_list *fl, node *doc,
         if (last_node->parent) {
             node_remove_child(last_node->parent, last_node);
         }
-        if (common_ancestor->name && is_foster_parent_target(common_ancestor->name)) {
+        if (tag_is(common_atom, TP_FOSTER_TARGET)) {
             foster_insert(st, doc, last_node);
         } else {
             node_append_child(common_ancestor, last_node);
         }
 
         /* Step 4p: create replacement for formatting element */
+        fmt_idx = st->fmt_index[fe_stack_idx];
         node *new_element = clone_element_shallow(formatting_element);
         if (!new_element) {
             /* fallback: just remove from list and stack */
-            formatting_remove_at(fl, (size_t)fmt_idx);
-            stack_remove_at(st, (size_t)stack_index_of(st, formatting_element));
+            if (fmt_idx >= 0) formatting_remove_at(fl, (size_t)fmt_idx);
+            stack_remove_at(st, (size_t)fe_stack_idx);
             return 1;
         }
 
@@ -933,54 +1212,46 @@ static int adoption_agency(node_stack *st, formatting_list *fl, node *doc,
         node_append_child(furthest_block, new_element);
 
         /* Step 4s: update formatting list */
-        fmt_idx = formatting_index_of_element(fl, formatting_element);
         if (fmt_idx >= 0) {
             formatting_remove_at(fl, (size_t)fmt_idx);
             if ((size_t)fmt_idx < bookmark && bookmark > 0) bookmark--;
         }
         if (bookmark > fl->count) bookmark = fl->count;
-        formatting_insert_at(fl, bookmark, ft, new_element);
+        formatting_insert_at(fl, bookmark, ft, new_element, fe_hash);
 
         /* Step 4t: update stack */
-        int fe_si = stack_index_of(st, formatting_element);
-        if (fe_si >= 0) stack_remove_at(st, (size_t)fe_si);
-        fb_stack_idx = stack_index_of(st, furthest_block);
-        if (fb_stack_idx >= 0) {
-            stack_insert_at(st, (size_t)fb_stack_idx + 1, new_element);
-        }
+        stack_remove_at(st, (size_t)fe_stack_idx);
+        fb_stack_idx--;
+        stack_insert_at(st, (size_t)fb_stack_idx + 1, new_element);
+        if (bookmark < fl->count && fl->items[bookmark].element == new_element &&
+            st->items[fb_stack_idx + 1] == new_element)
+            stack_fmt_link(st, fb_stack_idx + 1, (int)bookmark);
     }
 
     return 1;
 }
 
-static void stack_pop_until(node_stack *st, const char *name) {
-    if (!name) return;
+/* Pop up to and including the element a tag with this atom (or, without
+ * one, this name) refers to; everything if none is open. */
+static void stack_pop_until_named(node_stack *st, tag_atom atom, const char *name) {
     while (st->size > 0) {
-        node *n = stack_top(st);
-        if (n && n->name && strcmp(n->name, name) == 0) {
-            stack_pop(st);
-            return;
-        }
+        int found = stack_slot_is(st, st->size - 1, atom, name);
         stack_pop(st);
+        if (found) return;
     }
 }
 
-static const char *stack_pop_until_any(node_stack *st, const char *a, const char *b) {
+static void stack_pop_until(node_stack *st, tag_atom atom) {
+    stack_pop_until_named(st, atom, NULL);
+}
+
+/* Pop up to and including the first element with one of the properties. */
+static void stack_pop_until_any(node_stack *st, uint32_t props) {
     while (st->size > 0) {
-        node *n = stack_top(st);
-        if (n && n->name) {
-            if (a && strcmp(n->name, a) == 0) {
-                stack_pop(st);
-                return a;
-            }
-            if (b && strcmp(n->name, b) == 0) {
-                stack_pop(st);
-                return b;
-            }
-        }
+        int found = tag_is(stack_top_atom(st), props);
         stack_pop(st);
+        if (found) return;
     }
-    return NULL;
 }
 
 static node *current_node(node_stack *st, node *doc) {
@@ -988,23 +1259,24 @@ static node *current_node(node_stack *st, node *doc) {
     return top ? top : doc;
 }
 
-static node *find_open_table(node_stack *st) {
+/* Foster parenting target (WHATWG "appropriate place"): before the last
+ * table, in the last template's contents when that template is above the
+ * table, and in the html element when neither is open. */
+static node *foster_parent(node_stack *st, node *doc, node **table_out) {
+    if (table_out) *table_out = NULL;
+    PARSE_STAT_ADD(foster_inserts, 1);
     for (size_t i = st->size; i > 0; --i) {
         node *n = st->items[i - 1];
-        if (n && n->name && strcmp(n->name, "table") == 0) {
-            return n;
+        if (st->atoms[i - 1] == TAG_TEMPLATE) {
+            return n->first_child ? n->first_child : n;
+        }
+        if (st->atoms[i - 1] == TAG_TABLE) {
+            if (!n->parent) return i > 1 ? st->items[i - 2] : doc;
+            if (table_out) *table_out = n;
+            return n->parent;
         }
     }
-    return NULL;
-}
-
-static node *foster_parent(node_stack *st, node *doc, node **table_out) {
-    node *table = find_open_table(st);
-    if (table_out) *table_out = table;
-    if (table && table->parent) {
-        return table->parent;
-    }
-    return current_node(st, doc);
+    return st->size > 0 ? st->items[0] : doc;
 }
 
 static void foster_insert(node_stack *st, node *doc, node *child) {
@@ -1017,309 +1289,41 @@ static void foster_insert(node_stack *st, node *doc, node *child) {
     }
 }
 
-static node *ensure_html(node *doc, node_stack *st, node **html_out);
-static node *ensure_body(node *doc, node_stack *st, node **html_out, node **body_out);
-
-static int is_head_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "base") == 0 ||
-           strcmp(name, "link") == 0 ||
-           strcmp(name, "meta") == 0 ||
-           strcmp(name, "style") == 0 ||
-           strcmp(name, "noscript") == 0 ||
-           strcmp(name, "template") == 0 ||
-           strcmp(name, "title") == 0 ||
-           strcmp(name, "script") == 0;
-}
-
-/* Elements that use "in head" rules inside <noscript> (WHATWG §13.2.6.4.4) */
-static int is_head_noscript_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "basefont") == 0 ||
-           strcmp(name, "bgsound") == 0 ||
-           strcmp(name, "link") == 0 ||
-           strcmp(name, "meta") == 0 ||
-           strcmp(name, "noframes") == 0 ||
-           strcmp(name, "style") == 0;
-}
-
-static void body_autoclose_on_start(node_stack *st, const char *tag_name, doc_mode dmode);
-
 static insertion_mode fragment_mode_for_context(const char *name) {
-    if (!name) return MODE_IN_BODY;
-    if (strcmp(name, "table") == 0) return MODE_IN_TABLE;
-    if (strcmp(name, "tbody") == 0 || strcmp(name, "thead") == 0 || strcmp(name, "tfoot") == 0) return MODE_IN_TABLE_BODY;
-    if (strcmp(name, "tr") == 0) return MODE_IN_ROW;
-    if (strcmp(name, "td") == 0 || strcmp(name, "th") == 0) return MODE_IN_CELL;
-    if (strcmp(name, "caption") == 0) return MODE_IN_CAPTION;
-    if (strcmp(name, "select") == 0) return MODE_IN_SELECT;
-    if (strcmp(name, "head") == 0) return MODE_IN_HEAD;
-    return MODE_IN_BODY;
-}
-
-static int is_body_ignored_start(const char *name);
-static int is_void_element(const char *name);
-
-static void handle_in_body_start_fragment(const char *name, int self_closing, node *doc, node_stack *st,
-                                          formatting_list *fmt, insertion_mode *mode,
-                                          insertion_mode *template_mode_stack, int *template_mode_top,
-                                          doc_mode dmode,
-                                          const token_attr *attrs, size_t attr_count,
-                                          node **form_element_pointer) {
-    /* Table-related tags are parse errors in IN_BODY; ignore them. */
-    if (is_body_ignored_start(name)) {
-        tree_parse_error("unexpected-start-tag");
-        return;
-    }
-    if (is_heading_element(name) && stack_has_open_heading(st)) {
-        tree_parse_error("unexpected-start-tag");
-        stack_pop_until_heading(st);
-    }
-    if (name && (strcmp(name, "applet") == 0 || strcmp(name, "marquee") == 0 || strcmp(name, "object") == 0)) {
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, name, NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        formatting_push_marker(fmt);
-        if (!self_closing) stack_push(st, n);
-        return;
-    }
-    /* <table> closes an open <p> (unless quirks mode), then switches to IN_TABLE. */
-    if (name && strcmp(name, "table") == 0) {
-        if (dmode != DOC_QUIRKS && has_element_in_button_scope(st, "p")) {
-            stack_pop_until(st, "p");
-        }
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, "table", NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        stack_push(st, n);
-        *mode = MODE_IN_TABLE;
-        return;
-    }
-    /* <select> in body switches to IN_SELECT. */
-    if (name && strcmp(name, "select") == 0) {
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, "select", NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        stack_push(st, n);
-        *mode = MODE_IN_SELECT;
-        return;
-    }
-    /* SVG / MathML enter foreign content */
-    if (name && strcmp(name, "svg") == 0) {
-        reconstruct_active_formatting(st, fmt, current_node(st, doc));
-        node *n = node_create_ns(NODE_ELEMENT, "svg", NULL, NS_SVG);
-        attach_attrs_svg(n, attrs, attr_count);
-        node_append_child(current_node(st, doc), n);
-        if (!self_closing) stack_push(st, n);
-        return;
-    }
-    if (name && strcmp(name, "math") == 0) {
-        reconstruct_active_formatting(st, fmt, current_node(st, doc));
-        node *n = node_create_ns(NODE_ELEMENT, "math", NULL, NS_MATHML);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(current_node(st, doc), n);
-        if (!self_closing) stack_push(st, n);
-        return;
-    }
-    if (name && strcmp(name, "template") == 0) {
-        node *parent = current_node(st, doc);
-        node *tmpl = create_template_element(attrs, attr_count);
-        if (!tmpl) return;
-        node_append_child(parent, tmpl);
-        open_template_element(st, fmt, mode, template_mode_stack, template_mode_top, tmpl, self_closing);
-        return;
-    }
-    if (name && strcmp(name, "form") == 0) {
-        if (form_element_pointer && *form_element_pointer && !in_template_context(st)) {
-            tree_parse_error("unexpected-start-tag");
-            return;
-        }
-        if (dmode != DOC_QUIRKS && has_element_in_button_scope(st, "p")) {
-             stack_pop_until(st, "p");
-        }
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, "form", NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        
-        if (form_element_pointer && !in_template_context(st)) {
-            *form_element_pointer = n;
-        }
-
-        if (!self_closing) stack_push(st, n);
-        return;
-    }
-    fmt_tag ft = fmt_tag_from_name(name);
-    if (ft != FMT_NONE) {
-        node *parent = current_node(st, doc);
-        reconstruct_active_formatting(st, fmt, parent);
+    switch (tag_atom_lookup(name)) {
+    case TAG_TABLE:
+        return MODE_IN_TABLE;
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        return MODE_IN_TABLE_BODY;
+    case TAG_TR:
+        return MODE_IN_ROW;
+    case TAG_TD:
+    case TAG_TH:
+        return MODE_IN_CELL;
+    case TAG_CAPTION:
+        return MODE_IN_CAPTION;
+    case TAG_SELECT:
+        return MODE_IN_SELECT;
+    case TAG_HEAD:
+        return MODE_IN_HEAD;
+    default:
+        return MODE_IN_BODY;
     }
-    body_autoclose_on_start(st, name, DOC_NO_QUIRKS);
-    node *parent = current_node(st, doc);
-    node *n = node_create(NODE_ELEMENT, name ? name : "", NULL);
-    attach_attrs(n, attrs, attr_count);
-    node_append_child(parent, n);
-    if (!self_closing && !is_void_element(name)) {
-        stack_push(st, n);
-        if (ft != FMT_NONE) formatting_push(fmt, ft, n);
-    }
-    if (is_form_associated_element(name) && form_element_pointer && *form_element_pointer && !in_template_context(st)) {
-        n->form_owner = *form_element_pointer;
-    }
-}
-
-static int is_table_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "table") == 0 ||
-           strcmp(name, "tbody") == 0 ||
-           strcmp(name, "thead") == 0 ||
-           strcmp(name, "tfoot") == 0 ||
-           strcmp(name, "tr") == 0 ||
-           strcmp(name, "td") == 0 ||
-           strcmp(name, "th") == 0 ||
-           strcmp(name, "caption") == 0 ||
-           strcmp(name, "colgroup") == 0 ||
-           strcmp(name, "col") == 0;
-}
-
-static int is_table_section_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "tbody") == 0 ||
-           strcmp(name, "thead") == 0 ||
-           strcmp(name, "tfoot") == 0;
-}
-
-static int is_cell_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "td") == 0 || strcmp(name, "th") == 0;
-}
-
-static int is_select_child_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "option") == 0 || strcmp(name, "optgroup") == 0;
-}
-
-static int is_body_ignored_start(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "caption") == 0 ||
-           strcmp(name, "col") == 0 ||
-           strcmp(name, "colgroup") == 0 ||
-           strcmp(name, "frame") == 0 ||
-           strcmp(name, "head") == 0 ||
-           strcmp(name, "tbody") == 0 ||
-           strcmp(name, "td") == 0 ||
-           strcmp(name, "tfoot") == 0 ||
-           strcmp(name, "th") == 0 ||
-           strcmp(name, "thead") == 0 ||
-           strcmp(name, "tr") == 0;
-}
-
-static int is_void_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "area") == 0 ||
-           strcmp(name, "base") == 0 ||
-           strcmp(name, "br") == 0 ||
-           strcmp(name, "col") == 0 ||
-           strcmp(name, "embed") == 0 ||
-           strcmp(name, "hr") == 0 ||
-           strcmp(name, "img") == 0 ||
-           strcmp(name, "input") == 0 ||
-           strcmp(name, "link") == 0 ||
-           strcmp(name, "meta") == 0 ||
-           strcmp(name, "param") == 0 ||
-           strcmp(name, "source") == 0 ||
-           strcmp(name, "track") == 0 ||
-           strcmp(name, "wbr") == 0;
 }
 
+/* The clone shares the original's attribute storage (node_attrs_share) */
 static node *clone_element_shallow(node *original) {
     if (!original) return NULL;
     node *n = node_create(NODE_ELEMENT, original->name, NULL);
     if (!n) return NULL;
     n->ns = original->ns;
-    if (original->attrs && original->attr_count > 0) {
-        n->attrs = (node_attr *)malloc(original->attr_count * sizeof(node_attr));
-        if (n->attrs) {
-            n->attr_count = original->attr_count;
-            for (size_t i = 0; i < original->attr_count; ++i) {
-                n->attrs[i].name  = original->attrs[i].name  ? strdup(original->attrs[i].name)  : NULL;
-                n->attrs[i].value = original->attrs[i].value ? strdup(original->attrs[i].value) : NULL;
-            }
-        }
-    }
+    node_attrs_share(n, original);
+    PARSE_STAT_ADD(attrs_created, n->attr_count);
     return n;
 }
 
-static int is_foster_parent_target(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "table") == 0 ||
-           strcmp(name, "tbody") == 0 ||
-           strcmp(name, "tfoot") == 0 ||
-           strcmp(name, "thead") == 0 ||
-           strcmp(name, "tr") == 0;
-}
-
-static int is_body_block_like_start(const char *name) {
-    if (!name) return 0;
-    /* Minimal set: enough to demonstrate auto-closing <p>/<li> cleanly. */
-    return strcmp(name, "address") == 0 ||
-           strcmp(name, "article") == 0 ||
-           strcmp(name, "aside") == 0 ||
-           strcmp(name, "blockquote") == 0 ||
-           strcmp(name, "div") == 0 ||
-           strcmp(name, "dl") == 0 ||
-           strcmp(name, "fieldset") == 0 ||
-           strcmp(name, "footer") == 0 ||
-           strcmp(name, "form") == 0 ||
-           strcmp(name, "h1") == 0 || strcmp(name, "h2") == 0 ||
-           strcmp(name, "h3") == 0 || strcmp(name, "h4") == 0 ||
-           strcmp(name, "h5") == 0 || strcmp(name, "h6") == 0 ||
-           strcmp(name, "header") == 0 ||
-           strcmp(name, "hr") == 0 ||
-           strcmp(name, "main") == 0 ||
-           strcmp(name, "nav") == 0 ||
-           strcmp(name, "ol") == 0 ||
-           strcmp(name, "p") == 0 ||
-           strcmp(name, "plaintext") == 0 ||
-           strcmp(name, "pre") == 0 ||
-           strcmp(name, "section") == 0 ||
-           strcmp(name, "table") == 0 ||
-           strcmp(name, "ul") == 0;
-}
-
-static int is_heading_element(const char *name) {
-    if (!name) return 0;
-    return strcmp(name, "h1") == 0 || strcmp(name, "h2") == 0 ||
-           strcmp(name, "h3") == 0 || strcmp(name, "h4") == 0 ||
-           strcmp(name, "h5") == 0 || strcmp(name, "h6") == 0;
-}
-
-static int stack_has_open_heading(node_stack *st) {
-    if (!st) return 0;
-    for (size_t i = st->size; i > 0; --i) {
-        node *n = st->items[i - 1];
-        if (n && n->name && is_heading_element(n->name)) {
-            return 1;
-        }
-    }
-    return 0;
-}
-
-static void stack_pop_until_heading(node_stack *st) {
-    if (!st) return;
-    while (st->size > 0) {
-        node *n = stack_top(st);
-        if (n && n->name && is_heading_element(n->name)) {
-            stack_pop(st);
-            return;
-        }
-        stack_pop(st);
-    }
-}
-
 static char to_lower_ascii_local(char c) {
     if (c >= 'A' && c <= 'Z') return (char)(c + ('a' - 'A'));
     return c;
@@ -1468,353 +1472,678 @@ static doc_mode determine_doc_mode(const token *t) {
     return DOC_NO_QUIRKS;
 }
 
-static void body_autoclose_on_start(node_stack *st, const char *tag_name, doc_mode dmode) {
-    (void)dmode;
-    if (!tag_name) return;
 
-    /* Auto-close <p> when a block-like element starts, or a new <p> starts. */
-    if ((strcmp(tag_name, "p") == 0 || is_body_block_like_start(tag_name)) && has_element_in_button_scope(st, "p")) {
-        generate_implied_end_tags_except(st, "p");
-        stack_pop_until(st, "p");
+static int is_all_whitespace(const char *s) {
+    if (!s) return 1;
+    for (size_t i = 0; s[i]; ++i) {
+        char c = s[i];
+        if (!(c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f')) {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    /* Auto-close previous <li> when a new <li> starts. */
-    if (strcmp(tag_name, "li") == 0 && has_element_in_list_item_scope(st, "li")) {
-        generate_implied_end_tags_except(st, "li");
-        stack_pop_until(st, "li");
-    }
+static node *ensure_html(tree_builder *b) {
+    if (b->html) return b->html;
+    b->html = node_create(NODE_ELEMENT, "html", NULL);
+    if (!b->html) return NULL;
+    node_append_child(b->doc, b->html);
+    stack_push(&b->st, b->html);
+    return b->html;
+}
 
-    /* Auto-close <dt>/<dd> when the other starts. */
-    if (strcmp(tag_name, "dt") == 0 || strcmp(tag_name, "dd") == 0) {
-        if (has_element_in_scope(st, "dd")) {
-            generate_implied_end_tags_except(st, "dd");
-            stack_pop_until(st, "dd");
-        }
-        if (has_element_in_scope(st, "dt")) {
-            generate_implied_end_tags_except(st, "dt");
-            stack_pop_until(st, "dt");
+static node *ensure_body(tree_builder *b) {
+    node *html = ensure_html(b);
+    if (!html) return NULL;
+    if (b->body) {
+        if (!stack_contains(&b->st, b->body)) {
+            stack_push(&b->st, b->body);
         }
+        return b->body;
     }
+    b->body = node_create(NODE_ELEMENT, "body", NULL);
+    if (!b->body) return NULL;
+    node_append_child(html, b->body);
+    stack_push(&b->st, b->body);
+    return b->body;
+}
 
-    /* Auto-close table sections and rows/cells on start of same kind. */
-    if (is_table_section_element(tag_name) && (stack_has_open_named(st, "thead") || stack_has_open_named(st, "tbody") || stack_has_open_named(st, "tfoot"))) {
-        stack_pop_until(st, "thead");
-        stack_pop_until(st, "tbody");
-        stack_pop_until(st, "tfoot");
-    }
-    if (strcmp(tag_name, "tr") == 0 && stack_has_open_named(st, "tr")) {
-        stack_pop_until(st, "tr");
-    }
-    if ((strcmp(tag_name, "td") == 0 || strcmp(tag_name, "th") == 0) && (stack_has_open_named(st, "td") || stack_has_open_named(st, "th"))) {
-        stack_pop_until_any(st, "td", "th");
+static void close_head(tree_builder *b) {
+    if (b->head) {
+        stack_pop_until(&b->st, TAG_HEAD);
+        b->head = NULL;
     }
+    b->mode = MODE_IN_BODY;
 }
 
-static void handle_in_body_start(const char *name, int self_closing, node *doc, node_stack *st, node **html, node **body,
-                                 formatting_list *fmt, insertion_mode *mode,
-                                 insertion_mode *template_mode_stack, int *template_mode_top,
-                                 doc_mode dmode,
-                                 const token_attr *attrs, size_t attr_count,
-                                 node **form_element_pointer) {
-    if (!mode) return;
-    int in_template = in_template_context(st);
-    fmt_tag ft = fmt_tag_from_name(name);
-    if (ft != FMT_NONE) {
-        node *parent = current_node(st, doc);
-        reconstruct_active_formatting(st, fmt, parent);
+/* Create the HTML element for start tag t and append it to the current
+ * node. Pushing it is up to the caller. */
+static node *insert_element(tree_builder *b, token *t) {
+    node *parent = current_node(&b->st, b->doc);
+    node *n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
+    attach_attrs_take(n, t);
+    node_append_child(parent, n);
+    return n;
+}
+
+/* insert_element(), pushed unless self-closing or void. */
+static node *insert_element_open(tree_builder *b, token *t) {
+    node *n = insert_element(b, t);
+    if (!t->self_closing && !tag_is(b->atom, TP_VOID))
+        stack_push(&b->st, n);
+    return n;
+}
+
+static void insert_template(tree_builder *b, token *t) {
+    node *parent = current_node(&b->st, b->doc);
+    node *tmpl = create_template_element(t);
+    if (!tmpl) return;
+    node_append_child(parent, tmpl);
+    open_template_element(b, tmpl, t->self_closing);
+}
+
+/* <template> where table content is foster parented. */
+static void insert_template_fostered(tree_builder *b, token *t) {
+    node *table = NULL;
+    node *fp = foster_parent(&b->st, b->doc, &table);
+    node *tmpl = create_template_element(t);
+    if (!tmpl) return;
+    if (table && fp == table->parent) {
+        node_insert_before(fp, tmpl, table);
+    } else {
+        node_append_child(fp, tmpl);
     }
-    if (name && strcmp(name, "html") == 0) {
-        tree_parse_error("unexpected-start-tag");
-        if (!in_template && html && *html)
-            merge_attrs(*html, attrs, attr_count);
-        return;
+    open_template_element(b, tmpl, t->self_closing);
+}
+
+static void link_form_owner(tree_builder *b, node *n) {
+    if (tag_is(b->atom, TP_FORM_ASSOCIATED) && b->form_element_pointer &&
+        !in_template_context(&b->st))
+        n->form_owner = b->form_element_pointer;
+}
+
+static void body_autoclose_on_start(node_stack *st, tag_atom atom) {
+    /* Auto-close <p> when a block-like element starts, or a new <p> starts. */
+    if (tag_is(atom, TP_BLOCK_LIKE) && has_element_in_button_scope(st, TAG_P)) {
+        generate_implied_end_tags_except(st, TAG_P);
+        stack_pop_until(st, TAG_P);
     }
-    if (name && is_heading_element(name)) {
-        if (stack_has_open_heading(st)) {
-            tree_parse_error("unexpected-start-tag");
-            stack_pop_until_heading(st);
+
+    switch (atom) {
+    case TAG_LI:
+        /* Auto-close previous <li> when a new <li> starts. */
+        if (has_element_in_list_item_scope(st, TAG_LI)) {
+            generate_implied_end_tags_except(st, TAG_LI);
+            stack_pop_until(st, TAG_LI);
+        }
+        break;
+    case TAG_DD:
+    case TAG_DT:
+        /* Auto-close <dt>/<dd> when the other starts. */
+        if (has_element_in_scope(st, TAG_DD)) {
+            generate_implied_end_tags_except(st, TAG_DD);
+            stack_pop_until(st, TAG_DD);
+        }
+        if (has_element_in_scope(st, TAG_DT)) {
+            generate_implied_end_tags_except(st, TAG_DT);
+            stack_pop_until(st, TAG_DT);
+        }
+        break;
+    /* Auto-close table sections and rows/cells on start of same kind. */
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        if (stack_has_open_table_section(st)) {
+            stack_pop_until(st, TAG_THEAD);
+            stack_pop_until(st, TAG_TBODY);
+            stack_pop_until(st, TAG_TFOOT);
+        }
+        break;
+    case TAG_TR:
+        if (stack_has_open(st, TAG_TR)) {
+            stack_pop_until(st, TAG_TR);
+        }
+        break;
+    case TAG_TD:
+    case TAG_TH:
+        if (stack_has_open_any(st, TP_CELL)) {
+            stack_pop_until_any(st, TP_CELL);
         }
+        break;
+    default:
+        break;
     }
-    if (name && strcmp(name, "body") == 0) {
-        tree_parse_error("unexpected-start-tag");
+}
+
+/* "in body" start tags; the table modes hand theirs over here when the
+ * current node is not a table element. */
+static void handle_in_body_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    int in_template = in_template_context(st);
+    fmt_tag ft = fmt_tag_of(b->atom);
+    if (ft != FMT_NONE) {
+        node *parent = current_node(st, b->doc);
+        reconstruct_active_formatting(st, &b->fmt, parent);
+    }
+    switch (b->atom) {
+    case TAG_HTML:
+        tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+        if (!in_template && b->html)
+            merge_attrs(b->html, t->attrs, t->attr_count);
+        return;
+    case TAG_H1: case TAG_H2: case TAG_H3:
+    case TAG_H4: case TAG_H5: case TAG_H6:
+        if (stack_has_open_any(st, TP_HEADING)) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+            stack_pop_until_any(st, TP_HEADING);
+        }
+        break;
+    case TAG_BODY:
+        tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
         if (!in_template) {
-            ensure_body(doc, st, html, body);
-            if (body && *body && st->size >= 2 &&
-                st->items[1]->name && strcmp(st->items[1]->name, "body") == 0)
-                merge_attrs(*body, attrs, attr_count);
+            ensure_body(b);
+            if (b->body && st->size >= 2 && st->atoms[1] == TAG_BODY)
+                merge_attrs(b->body, t->attrs, t->attr_count);
         }
         return;
-    }
-    if (name && strcmp(name, "select") == 0) {
+    case TAG_SELECT:
         if (!in_template) {
-            ensure_body(doc, st, html, body);
+            ensure_body(b);
         }
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, "select", NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        stack_push(st, n);
-        *mode = MODE_IN_SELECT;
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_SELECT;
         return;
-    }
-    if (name && strcmp(name, "table") == 0) {
-        if (dmode != DOC_QUIRKS && has_element_in_button_scope(st, "p")) {
-            stack_pop_until(st, "p");
+    case TAG_TABLE:
+        if (b->dmode != DOC_QUIRKS && has_element_in_button_scope(st, TAG_P)) {
+            stack_pop_until(st, TAG_P);
         }
         if (!in_template) {
-            ensure_body(doc, st, html, body);
+            ensure_body(b);
         }
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, "table", NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        stack_push(st, n);
-        *mode = MODE_IN_TABLE;
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_TABLE;
         return;
-    }
     /* SVG / MathML enter foreign content */
-    if (name && strcmp(name, "svg") == 0) {
-        reconstruct_active_formatting(st, fmt, current_node(st, doc));
+    case TAG_SVG:
+    case TAG_MATH: {
+        reconstruct_active_formatting(st, &b->fmt, current_node(st, b->doc));
         if (!in_template) {
-            ensure_body(doc, st, html, body);
+            ensure_body(b);
         }
-        node *n = node_create_ns(NODE_ELEMENT, "svg", NULL, NS_SVG);
-        attach_attrs_svg(n, attrs, attr_count);
-        node_append_child(current_node(st, doc), n);
-        if (!self_closing) stack_push(st, n);
-        return;
-    }
-    if (name && strcmp(name, "math") == 0) {
-        reconstruct_active_formatting(st, fmt, current_node(st, doc));
-        if (!in_template) {
-            ensure_body(doc, st, html, body);
+        node *n;
+        if (b->atom == TAG_SVG) {
+            n = node_create_ns(NODE_ELEMENT, "svg", NULL, NS_SVG);
+            attach_attrs_svg_take(n, t);
+        } else {
+            n = node_create_ns(NODE_ELEMENT, "math", NULL, NS_MATHML);
+            attach_attrs_take(n, t);
         }
-        node *n = node_create_ns(NODE_ELEMENT, "math", NULL, NS_MATHML);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(current_node(st, doc), n);
-        if (!self_closing) stack_push(st, n);
+        node_append_child(current_node(st, b->doc), n);
+        if (!t->self_closing) stack_push(st, n);
         return;
     }
-    if (name && (strcmp(name, "applet") == 0 || strcmp(name, "marquee") == 0 || strcmp(name, "object") == 0)) {
+    case TAG_APPLET:
+    case TAG_MARQUEE:
+    case TAG_OBJECT: {
         if (!in_template) {
-            ensure_body(doc, st, html, body);
+            ensure_body(b);
         }
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, name, NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        formatting_push_marker(fmt);
-        if (!self_closing) stack_push(st, n);
+        node *n = insert_element(b, t);
+        formatting_push_marker(&b->fmt);
+        if (!t->self_closing) stack_push(st, n);
         return;
     }
-    if (name && strcmp(name, "template") == 0) {
+    case TAG_TEMPLATE:
         if (!in_template) {
-            ensure_body(doc, st, html, body);
+            ensure_body(b);
         }
-        node *parent = current_node(st, doc);
-        node *tmpl = create_template_element(attrs, attr_count);
-        if (!tmpl) return;
-        node_append_child(parent, tmpl);
-        open_template_element(st, fmt, mode, template_mode_stack, template_mode_top, tmpl, self_closing);
+        insert_template(b, t);
         return;
-    }
-    if (name && strcmp(name, "form") == 0) {
-        if (form_element_pointer && *form_element_pointer && !in_template) {
-            tree_parse_error("unexpected-start-tag");
+    case TAG_FORM: {
+        if (b->form_element_pointer && !in_template) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
             return;
         }
-        if (has_element_in_button_scope(st, "p")) {
-             stack_pop_until(st, "p");
+        if (has_element_in_button_scope(st, TAG_P)) {
+            stack_pop_until(st, TAG_P);
         }
         if (!in_template) {
-            ensure_body(doc, st, html, body);
+            ensure_body(b);
         }
-        node *parent = current_node(st, doc);
-        node *n = node_create(NODE_ELEMENT, "form", NULL);
-        attach_attrs(n, attrs, attr_count);
-        node_append_child(parent, n);
-        
-        if (form_element_pointer && !in_template) {
-            *form_element_pointer = n;
+        node *n = insert_element(b, t);
+        if (!in_template) {
+            b->form_element_pointer = n;
         }
-
-        if (!self_closing) stack_push(st, n);
+        if (!t->self_closing) stack_push(st, n);
         return;
     }
-    body_autoclose_on_start(st, name, dmode);
+    default:
+        break;
+    }
+    body_autoclose_on_start(st, b->atom);
     if (!in_template) {
-        ensure_body(doc, st, html, body);
+        ensure_body(b);
     }
-    node *parent = current_node(st, doc);
-    node *n = node_create(NODE_ELEMENT, name ? name : "", NULL);
-    attach_attrs(n, attrs, attr_count);
-    node_append_child(parent, n);
-    if (!self_closing && !is_void_element(name)) {
+    node *n = insert_element(b, t);
+    if (!t->self_closing && !tag_is(b->atom, TP_VOID)) {
         stack_push(st, n);
-        if (ft != FMT_NONE) formatting_push(fmt, ft, n);
+        if (ft != FMT_NONE) formatting_push(&b->fmt, ft, n);
+    }
+    if (tag_is(b->atom, TP_FORM_ASSOCIATED) && b->form_element_pointer && !in_template) {
+        n->form_owner = b->form_element_pointer;
+    }
+}
+
+/* The fragment parser's "in body" start tags: no html / head / body
+ * elements to maintain, and table parts are ignored. */
+static void handle_in_body_start_fragment(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    /* Table-related tags are parse errors in IN_BODY; ignore them. */
+    if (tag_is(b->atom, TP_BODY_IGNORED)) {
+        tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+        return;
+    }
+    switch (b->atom) {
+    case TAG_H1: case TAG_H2: case TAG_H3:
+    case TAG_H4: case TAG_H5: case TAG_H6:
+        if (stack_has_open_any(st, TP_HEADING)) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+            stack_pop_until_any(st, TP_HEADING);
+        }
+        break;
+    case TAG_APPLET:
+    case TAG_MARQUEE:
+    case TAG_OBJECT: {
+        node *n = insert_element(b, t);
+        formatting_push_marker(&b->fmt);
+        if (!t->self_closing) stack_push(st, n);
+        return;
+    }
+    /* <table> closes an open <p> (unless quirks mode), then switches to IN_TABLE. */
+    case TAG_TABLE:
+        if (has_element_in_button_scope(st, TAG_P)) {
+            stack_pop_until(st, TAG_P);
+        }
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_TABLE;
+        return;
+    /* <select> in body switches to IN_SELECT. */
+    case TAG_SELECT:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_SELECT;
+        return;
+    /* SVG / MathML enter foreign content */
+    case TAG_SVG:
+    case TAG_MATH: {
+        reconstruct_active_formatting(st, &b->fmt, current_node(st, b->doc));
+        node *n;
+        if (b->atom == TAG_SVG) {
+            n = node_create_ns(NODE_ELEMENT, "svg", NULL, NS_SVG);
+            attach_attrs_svg_take(n, t);
+        } else {
+            n = node_create_ns(NODE_ELEMENT, "math", NULL, NS_MATHML);
+            attach_attrs_take(n, t);
+        }
+        node_append_child(current_node(st, b->doc), n);
+        if (!t->self_closing) stack_push(st, n);
+        return;
+    }
+    case TAG_TEMPLATE:
+        insert_template(b, t);
+        return;
+    case TAG_FORM: {
+        if (b->form_element_pointer && !in_template_context(st)) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+            return;
+        }
+        if (has_element_in_button_scope(st, TAG_P)) {
+            stack_pop_until(st, TAG_P);
+        }
+        node *n = insert_element(b, t);
+        if (!in_template_context(st)) {
+            b->form_element_pointer = n;
+        }
+        if (!t->self_closing) stack_push(st, n);
+        return;
+    }
+    default:
+        break;
     }
-    if (is_form_associated_element(name) && form_element_pointer && *form_element_pointer && !in_template) {
-        n->form_owner = *form_element_pointer;
+    fmt_tag ft = fmt_tag_of(b->atom);
+    if (ft != FMT_NONE) {
+        node *parent = current_node(st, b->doc);
+        reconstruct_active_formatting(st, &b->fmt, parent);
+    }
+    body_autoclose_on_start(st, b->atom);
+    node *n = insert_element(b, t);
+    if (!t->self_closing && !tag_is(b->atom, TP_VOID)) {
+        stack_push(st, n);
+        if (ft != FMT_NONE) formatting_push(&b->fmt, ft, n);
     }
+    link_form_owner(b, n);
 }
 
 static void close_cell(node_stack *st, formatting_list *fl) {
-    if (!stack_has_open_named(st, "td") && !stack_has_open_named(st, "th")) {
+    if (!stack_has_open_any(st, TP_CELL)) {
         return;
     }
-    stack_pop_until_any(st, "td", "th");
+    stack_pop_until_any(st, TP_CELL);
     formatting_clear_to_marker(fl);     /* clear active-formatting back to the cell marker */
 }
 
-static int is_all_whitespace(const char *s) {
-    if (!s) return 1;
-    for (size_t i = 0; s[i]; ++i) {
-        char c = s[i];
-        if (!(c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f')) {
-            return 0;
-        }
-    }
-    return 1;
+/* ============================================================================
+ * Build filter: pruned content, dropped comments, stop after head
+ * Elements named in prune_elements are kept but never end up with
+ * children. Character data headed for them is skipped before any node is
+ * made; elements created inside them still go through the stack (the
+ * algorithms need them) and are freed once the pruned element is closed
+ * and nothing on the stack or in the formatting list points into it.
+ * ============================================================================ */
+typedef struct {
+    node **items;               /* pruned elements whose children may need freeing */
+    size_t count;
+    size_t cap;
+    const node **seen;          /* prune_reclaim() scratch: open-addressed set */
+    size_t seen_cap;            /* of the ancestors of referenced nodes */
+    size_t skip;                /* calls to skip before the next reclaim */
+    node **forms;               /* forms taken out of pruned content; freed
+                                 * by prune_finish() once no form owner
+                                 * points at them */
+    size_t form_count;
+    size_t form_cap;
+} prune_list;
+
+/* A reclaim pass walks the stack, the formatting list and their
+ * ancestors; it runs once per this many nodes walked worth of tokens, so
+ * deep stacks cost a constant per token. */
+#define PRUNE_RECLAIM_SPREAD 16
+
+/* First element at or above n whose children are pruned, or NULL. */
+static node *pruned_ancestor(node *n) {
+    if (!build_filter || !build_filter->prune_elements) return NULL;
+    for (; n; n = n->parent)
+        if (n->type == NODE_ELEMENT &&
+            name_in_list(build_filter->prune_elements, n->name))
+            return n;
+    return NULL;
 }
 
-static int handle_in_template_mode(const token *t, node *doc, node_stack *st,
-                                   formatting_list *fmt, insertion_mode *mode,
-                                   insertion_mode *template_mode_stack, int *template_mode_top,
-                                   int *reprocess) {
-    if (!t || !st || !mode || !reprocess) return 0;
+/* Whether nothing inside pruned element p can be moved out of it later:
+ * the adoption agency only lifts nodes out of formatting and other
+ * non-special elements, foster parenting out of table elements. */
+static int prune_holds_content(const node *p) {
+    return is_special_element_ns(p->name, p->ns) &&
+           !tag_is(tag_atom_lookup(p->name), TP_FOSTER_TARGET);
+}
 
-    switch (t->type) {
-        case TOKEN_CHARACTER:
-            if (t->data && t->data[0] != '\0') {
-                if (is_all_whitespace(t->data)) {
-                    return 1;
-                }
-                template_mode_replace(template_mode_stack, template_mode_top, MODE_IN_BODY);
-                *mode = MODE_IN_BODY;
-                *reprocess = 1;
-            }
+/* Whether the builder can drop t unseen: comments when dropped (unless
+ * table text is pending, which the comment flushes), and character data
+ * bound for pruned content in modes that only ever insert it. */
+static int filter_skips_token(const token *t, node_stack *st, insertion_mode mode) {
+    if (!build_filter) return 0;
+    if (t->type == TOKEN_COMMENT)
+        return build_filter->drop_comments && mode != MODE_IN_TABLE_TEXT;
+    if (t->type != TOKEN_CHARACTER || !build_filter->prune_elements) return 0;
+    switch (mode) {
+    case MODE_TEXT:
+    case MODE_IN_BODY:
+    case MODE_IN_CELL:
+    case MODE_IN_CAPTION:
+    case MODE_IN_SELECT:
+    case MODE_IN_SELECT_IN_TABLE:
+        break;
+    default:
+        return 0;
+    }
+    node *top = stack_top(st);
+    if (!top || tag_is(stack_top_atom(st), TP_FOSTER_TARGET)) return 0;
+    /* A table section or row with no table between it and the pruned
+     * element would foster-parent out of it */
+    int loose_rows = 0;
+    for (node *n = top; n; n = n->parent) {
+        if (n->type != NODE_ELEMENT || !n->name) continue;
+        tag_atom a = n->name[0] == 't' ? tag_atom_lookup(n->name) : TAG_UNKNOWN;
+        if (a == TAG_TABLE)
+            loose_rows = 0;
+        else if (tag_is(a, TP_FOSTER_TARGET))
+            loose_rows = 1;
+        else if (!loose_rows && name_in_list(build_filter->prune_elements, n->name) &&
+                 prune_holds_content(n))
             return 1;
+    }
+    return 0;
+}
 
-        case TOKEN_COMMENT: {
-            node *parent = current_node(st, doc);
-            node *n = node_create(NODE_COMMENT, NULL, t->data ? t->data : "");
-            node_append_child(parent, n);
-            return 1;
-        }
+/* Whether stop_after_head applies: the parser has moved past the head. */
+static int filter_stops(insertion_mode mode, insertion_mode original,
+                        const node *head) {
+    if (!build_filter || !build_filter->stop_after_head) return 0;
+    if (mode == MODE_TEXT) mode = original;
+    switch (mode) {
+    case MODE_INITIAL:
+    case MODE_BEFORE_HTML:
+    case MODE_IN_HEAD:
+    case MODE_IN_HEAD_NOSCRIPT:
+        return 0;
+    case MODE_IN_TEMPLATE:
+        return head == NULL;
+    default:
+        return 1;
+    }
+}
 
-        case TOKEN_DOCTYPE:
-            tree_parse_error("stray-doctype");
-            return 1; /* ignore */
+static int is_inclusive_descendant(const node *n, const node *ancestor) {
+    for (; n; n = n->parent)
+        if (n == ancestor) return 1;
+    return 0;
+}
 
-        case TOKEN_END_TAG:
-            if (t->name && strcmp(t->name, "template") == 0 && stack_has_open_named(st, "template")) {
-                close_template_element(st, fmt, mode, template_mode_stack, template_mode_top);
-            }
-            return 1;
+/* After a start tag: remember the element it opened if that is pruned
+ * (the parent covers template, whose content element sits on top) and
+ * not already inside pruned content. Formatting elements are left to
+ * prune_finish(): the adoption agency may replace and free them. */
+static void prune_track(prune_list *pl, node_stack *st) {
+    node *top = stack_top(st);
+    if (!top) return;
+    if (!name_in_list(build_filter->prune_elements, top->name)) {
+        top = top->parent;
+        if (!top || !name_in_list(build_filter->prune_elements, top->name))
+            return;
+    }
+    for (size_t i = 0; i < pl->count; i++)
+        if (pl->items[i] == top) return;
+    if (fmt_tag_of(tag_atom_lookup(top->name)) != FMT_NONE || pruned_ancestor(top->parent))
+        return;
+    if (pl->count == pl->cap) {
+        size_t ncap = pl->cap ? pl->cap * 2 : 8;
+        node **items = (node **)realloc(pl->items, ncap * sizeof(node *));
+        if (!items) return;
+        pl->items = items;
+        pl->cap = ncap;
+    }
+    pl->items[pl->count++] = top;
+}
 
-        case TOKEN_START_TAG:
-            if (t->name && is_template_head_element(t->name)) {
-                node *parent = current_node(st, doc);
-                if (strcmp(t->name, "template") == 0) {
-                    node *tmpl = create_template_element(t->attrs, t->attr_count);
-                    if (tmpl) {
-                        node_append_child(parent, tmpl);
-                        open_template_element(st, fmt, mode, template_mode_stack, template_mode_top,
-                                              tmpl, t->self_closing);
-                    }
-                } else {
-                    node *n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
-                    attach_attrs(n, t->attrs, t->attr_count);
-                    node_append_child(parent, n);
-                    if (!t->self_closing && !is_void_element(t->name)) {
-                        stack_push(st, n);
-                    }
-                }
-                return 1;
-            }
+/* Next node after n in tree order within root, or NULL. */
+static node *prune_next(node *n, const node *root, int descend) {
+    if (descend && n->first_child) return n->first_child;
+    while (n && n != root && !n->next_sibling) n = n->parent;
+    return (n && n != root) ? n->next_sibling : NULL;
+}
 
-            if (t->name) {
-                if (strcmp(t->name, "caption") == 0 ||
-                    strcmp(t->name, "colgroup") == 0 ||
-                    strcmp(t->name, "tbody") == 0 ||
-                    strcmp(t->name, "tfoot") == 0 ||
-                    strcmp(t->name, "thead") == 0 ||
-                    strcmp(t->name, "table") == 0 ||
-                    strcmp(t->name, "col") == 0) {
-                    template_mode_replace(template_mode_stack, template_mode_top, MODE_IN_TABLE);
-                    *mode = MODE_IN_TABLE;
-                    *reprocess = 1;
-                    return 1;
-                }
-                if (strcmp(t->name, "tr") == 0) {
-                    template_mode_replace(template_mode_stack, template_mode_top, MODE_IN_TABLE_BODY);
-                    *mode = MODE_IN_TABLE_BODY;
-                    *reprocess = 1;
-                    return 1;
-                }
-                if (strcmp(t->name, "td") == 0 || strcmp(t->name, "th") == 0) {
-                    template_mode_replace(template_mode_stack, template_mode_top, MODE_IN_ROW);
-                    *mode = MODE_IN_ROW;
-                    *reprocess = 1;
-                    return 1;
-                }
-                if (strcmp(t->name, "select") == 0) {
-                    template_mode_replace(template_mode_stack, template_mode_top, MODE_IN_SELECT);
-                    *mode = MODE_IN_SELECT;
-                    *reprocess = 1;
-                    return 1;
+/* Free p's children. Form elements inside p are detached and emptied
+ * instead: elements outside p may have them as their form owner, and
+ * prune_finish() clears those links in one walk over the document rather
+ * than one per reclaim. Should the list not grow, a form stays in p,
+ * emptied. */
+static void prune_children(prune_list *pl, node *p) {
+    node kept;
+    memset(&kept, 0, sizeof(kept));
+    for (node *n = p->first_child; n; ) {
+        if (n->type == NODE_ELEMENT && n->ns == NS_HTML && n->name &&
+            strcmp(n->name, "form") == 0) {
+            node *next = prune_next(n, p, 0);
+            prune_children(pl, n);
+            node_remove_child(n->parent, n);
+            if (pl->form_count == pl->form_cap) {
+                size_t ncap = pl->form_cap ? pl->form_cap * 2 : 8;
+                node **forms = (node **)realloc(pl->forms, ncap * sizeof(node *));
+                if (forms) {
+                    pl->forms = forms;
+                    pl->form_cap = ncap;
                 }
             }
+            if (pl->form_count < pl->form_cap)
+                pl->forms[pl->form_count++] = n;
+            else
+                node_append_child(&kept, n);
+            n = next;
+        } else {
+            n = prune_next(n, p, 1);
+        }
+    }
+    while (p->first_child) {
+        node *child = p->first_child;
+        node_remove_child(p, child);
+        node_free(child);
+    }
+    node_reparent_children(&kept, p);
+}
 
-            template_mode_replace(template_mode_stack, template_mode_top, MODE_IN_BODY);
-            *mode = MODE_IN_BODY;
-            *reprocess = 1;
-            return 1;
-
-        case TOKEN_EOF:
-            if (!stack_has_open_named(st, "template"))
-                return 0;  /* no template on stack → let caller stop parsing */
-            tree_parse_error("eof-in-template");
-            close_template_element(st, fmt, mode, template_mode_stack, template_mode_top);
-            *reprocess = 1;
-            return 1;
+static size_t prune_seen_slot(const prune_list *pl, const node *n) {
+    size_t mask = pl->seen_cap - 1;
+    size_t i = (size_t)(((uintptr_t)n >> 4) * 2654435761u) & mask;
+    while (pl->seen[i] && pl->seen[i] != n) i = (i + 1) & mask;
+    return i;
+}
 
-        default:
-            return 0;
+/* Add n and its ancestors to the seen set, stopping at the first one
+ * already there. Returns 0 on allocation failure. */
+static int prune_seen_add(prune_list *pl, const node *n, size_t *used) {
+    for (; n; n = n->parent) {
+        if ((*used + 1) * 2 > pl->seen_cap) {
+            size_t ncap = pl->seen_cap * 2;
+            const node **old = pl->seen;
+            size_t old_cap = pl->seen_cap;
+            pl->seen = (const node **)calloc(ncap, sizeof(node *));
+            if (!pl->seen) {
+                pl->seen = old;
+                return 0;
+            }
+            pl->seen_cap = ncap;
+            for (size_t i = 0; i < old_cap; i++)
+                if (old[i]) pl->seen[prune_seen_slot(pl, old[i])] = old[i];
+            free(old);
+        }
+        size_t slot = prune_seen_slot(pl, n);
+        if (pl->seen[slot]) return 1;
+        pl->seen[slot] = n;
+        (*used)++;
     }
+    return 1;
 }
 
-static node *ensure_html(node *doc, node_stack *st, node **html_out) {
-    if (*html_out) return *html_out;
-    *html_out = node_create(NODE_ELEMENT, "html", NULL);
-    if (!*html_out) return NULL;
-    node_append_child(doc, *html_out);
-    stack_push(st, *html_out);
-    return *html_out;
+/* Collect every inclusive ancestor of what the algorithms still hold (the
+ * stack, the formatting list, the form element pointer): a pruned element
+ * is referenced exactly when it is in this set. One pass costs the
+ * distinct ancestors, not one walk to the root per entry. */
+static int prune_collect_referenced(prune_list *pl, node_stack *st,
+                                    formatting_list *fl, const node *form,
+                                    size_t *walked) {
+    size_t used = 0;
+    *walked = st->size + fl->count;
+    if (!pl->seen) {
+        pl->seen = (const node **)calloc(512, sizeof(node *));
+        if (!pl->seen) return 0;
+        pl->seen_cap = 512;
+    } else {
+        memset(pl->seen, 0, pl->seen_cap * sizeof(node *));
+    }
+    for (size_t i = 0; i < st->size; i++)
+        if (!prune_seen_add(pl, st->items[i], &used)) return 0;
+    for (size_t i = 0; i < fl->count; i++)
+        if (!prune_seen_add(pl, fl->items[i].element, &used)) return 0;
+    if (!prune_seen_add(pl, form, &used)) return 0;
+    *walked += used;
+    return 1;
 }
 
-static node *ensure_body(node *doc, node_stack *st, node **html_out, node **body_out) {
-    node *html = ensure_html(doc, st, html_out);
-    if (!html) return NULL;
-    if (*body_out) {
-        if (!stack_contains(st, *body_out)) {
-            stack_push(st, *body_out);
+/* Free the children of pruned elements that are closed and no longer
+ * referenced by the stack or the formatting list. */
+static void prune_reclaim(prune_list *pl, node_stack *st, formatting_list *fl,
+                          const node *form) {
+    size_t walked = 0;
+    if (pl->skip > 0) {
+        pl->skip--;
+        return;
+    }
+    if (!prune_collect_referenced(pl, st, fl, form, &walked)) return;
+    pl->skip = walked / PRUNE_RECLAIM_SPREAD;
+    size_t i = 0;
+    while (i < pl->count) {
+        node *p = pl->items[i];
+        if (pl->seen[prune_seen_slot(pl, p)]) {
+            i++;
+            continue;
         }
-        return *body_out;
+        /* Drop p, and tracked elements moved inside it, from the list */
+        size_t k = 0;
+        for (size_t j = 0; j < pl->count; j++)
+            if (!is_inclusive_descendant(pl->items[j], p))
+                pl->items[k++] = pl->items[j];
+        pl->count = k;
+        prune_children(pl, p);
+        i = 0;
     }
-    *body_out = node_create(NODE_ELEMENT, "body", NULL);
-    if (!*body_out) return NULL;
-    node_append_child(html, *body_out);
-    stack_push(st, *body_out);
-    return *body_out;
 }
 
-static void close_head(node_stack *st, node **head_out, insertion_mode *mode) {
-    if (*head_out) {
-        stack_pop_until(st, "head");
-        *head_out = NULL;
+/* Whether form is one prune_children() took out: a lookup in the seen set
+ * when prune_finish() could fill it, a scan otherwise. */
+static int prune_form_dropped(const prune_list *pl, const node *form,
+                              int use_seen) {
+    if (use_seen) return pl->seen[prune_seen_slot(pl, form)] != NULL;
+    for (size_t i = 0; i < pl->form_count; i++)
+        if (pl->forms[i] == form) return 1;
+    return 0;
+}
+
+/* End of parsing: empty every pruned element still holding content, then
+ * free the forms taken out of it and clear the links to them. */
+static void prune_finish(prune_list *pl, node *doc) {
+    free(pl->items);
+    pl->items = NULL;
+    pl->count = pl->cap = 0;
+    if (build_filter && build_filter->prune_elements) {
+        for (node *n = doc; n; ) {
+            int pruned_here = n->type == NODE_ELEMENT &&
+                              name_in_list(build_filter->prune_elements, n->name);
+            if (pruned_here)
+                prune_children(pl, n);
+            n = prune_next(n, doc, !pruned_here);
+        }
+    }
+    if (pl->form_count) {
+        /* Detached forms have no ancestors: the set holds just them */
+        int use_seen = 1;
+        size_t used = 0;
+        if (pl->seen)
+            memset(pl->seen, 0, pl->seen_cap * sizeof(node *));
+        else if ((pl->seen = (const node **)calloc(512, sizeof(node *))))
+            pl->seen_cap = 512;
+        for (size_t i = 0; i < pl->form_count && use_seen; i++)
+            use_seen = pl->seen && prune_seen_add(pl, pl->forms[i], &used);
+        for (node *n = doc; n; n = prune_next(n, doc, 1))
+            if (n->form_owner && prune_form_dropped(pl, n->form_owner, use_seen))
+                n->form_owner = NULL;
+        for (size_t i = 0; i < pl->form_count; i++)
+            node_free(pl->forms[i]);
     }
-    *mode = MODE_IN_BODY;
+    free(pl->forms);
+    free(pl->seen);
+    pl->forms = NULL;
+    pl->seen = NULL;
+    pl->form_count = pl->form_cap = pl->seen_cap = 0;
 }
 
 /* ============================================================================
@@ -1903,19 +2232,23 @@ static int process_in_foreign_content(
 
             /* Adjust attribute names */
             if (attr_count > 0 && attrs) {
-                n->attrs = (node_attr *)malloc(attr_count * sizeof(node_attr));
+                n->attrs = (node_attr *)node_mem_alloc(n, attr_count * sizeof(node_attr));
                 if (n->attrs) {
-                    n->attr_count = attr_count;
+                    size_t j = 0;
                     for (size_t i = 0; i < attr_count; ++i) {
                         const char *aname = attrs[i].name;
+                        if (filter_drops_attr(aname)) continue;
                         if (target_ns == NS_SVG && aname) {
                             aname = svg_adjust_attr_name(aname);
                         } else if (target_ns == NS_MATHML && aname) {
                             aname = mathml_adjust_attr_name(aname);
                         }
-                        n->attrs[i].name  = aname ? strdup(aname) : NULL;
-                        n->attrs[i].value = attrs[i].value ? strdup(attrs[i].value) : NULL;
+                        n->attrs[j].name  = node_mem_strdup(n, aname);
+                        n->attrs[j].value = node_mem_strdup(n, attrs[i].value);
+                        j++;
                     }
+                    n->attr_count = j;
+                    stat_attrs(n, 0);
                 }
             }
 
@@ -1975,2692 +2308,1894 @@ static int process_in_foreign_content(
     }
 }
 
-node *build_tree_from_tokens(const token *tokens, size_t count) {
-    node *doc = node_create(NODE_DOCUMENT, NULL, NULL);
-    node_stack st;
-    insertion_mode mode = MODE_INITIAL;
-    insertion_mode original_insertion_mode = MODE_INITIAL;
-    doc_mode dmode = DOC_NO_QUIRKS;
-    node *html = NULL;
-    node *head = NULL;
-    node *body = NULL;
-    formatting_list fmt = {0};
-    insertion_mode template_mode_stack[64];
-    int template_mode_top = 0;
-    text_buffer table_text = {0};
-    int table_text_has_non_ws = 0;
-    node *form_element_pointer = NULL;
-    size_t i;
+/* ============================================================================
+ * Insertion modes
+ * One handler per insertion mode and token type, looked up by
+ * builder_step() in document_modes or fragment_modes; start and end tag
+ * handlers switch on the tag's atom. A handler returns STEP_REPROCESS
+ * after switching modes to have the token run again in the new one.
+ * ============================================================================ */
 
-    if (!doc) return NULL;
-    stack_init(&st);
-    text_buffer_init(&table_text);
+/* Whether the start tag just handled put the tokenizer in a raw text state
+ * (RCDATA, RAWTEXT, script data), so its content belongs to MODE_TEXT. A
+ * pre-tokenized stream has no tokenizer to ask; the tag decides. */
+static int text_state_pending(const tree_builder *b) {
+    if (!b->tz) return tag_is(b->atom, TP_TEXT_MODE);
+    return b->tz->state == TOKENIZE_RCDATA || b->tz->state == TOKENIZE_RAWTEXT ||
+           b->tz->state == TOKENIZE_SCRIPT_DATA;
+}
 
-    for (i = 0; i < count; ++i) {
-        const token *t = &tokens[i];
-        node *parent;
-        node *n = NULL;
-        int reprocess = 1;
-
-        while (reprocess) {
-            reprocess = 0;
-            parent = current_node(&st, doc);
-
-            /* Foreign content check */
-            {
-                node *acn = (st.size > 0) ? stack_top(&st) : NULL;
-                if (acn && acn->ns != NS_HTML) {
-                    int fc_reprocess = 0;
-                    if (process_in_foreign_content(t->type, t->name, t->data,
-                            t->self_closing, t->attrs, t->attr_count,
-                            &st, &fmt, doc, &mode, &fc_reprocess, NULL)) {
-                        if (fc_reprocess) { reprocess = 1; }
-                        continue;
-                    }
-                }
-            }
+/* Whether start tags in the table modes follow the "in body" rules: the
+ * current node is an element, but not a table element. */
+static int current_node_outside_table(const node_stack *st) {
+    return st->size > 0 && !tag_is(stack_top_atom(st), TP_TABLE);
+}
 
-            if (mode == MODE_IN_TEMPLATE) {
-                if (handle_in_template_mode(t, doc, &st, &fmt, &mode,
-                                            template_mode_stack, &template_mode_top,
-                                            &reprocess)) {
-                    if (reprocess) continue;
-                    break;
-                }
-            }
+static void insert_text(tree_builder *b, token *t) {
+    node *parent = current_node(&b->st, b->doc);
+    node *n = node_create_from_token(NODE_TEXT, t);
+    node_append_child(parent, n);
+}
 
-            if (mode == MODE_IN_TABLE_TEXT) {
-                if (t->type == TOKEN_CHARACTER && t->data && t->data[0] != '\0') {
-                    text_buffer_append(&table_text, t->data);
-                    if (!is_all_whitespace(t->data)) table_text_has_non_ws = 1;
-                    break;
-                }
-                if (table_text.len > 0) {
-                    node *text = node_create(NODE_TEXT, NULL, table_text.data ? table_text.data : "");
-                    if (table_text_has_non_ws) {
-                        tree_parse_error("foster-parenting");
-                        foster_insert(&st, doc, text);
-                    } else {
-                        node_append_child(current_node(&st, doc), text);
-                    }
-                }
-                text_buffer_clear(&table_text);
-                table_text_has_non_ws = 0;
-                mode = MODE_IN_TABLE;
-                reprocess = 1;
-                continue;
-            }
+/* Whether character token t is empty or only whitespace. */
+static int token_is_blank(const token *t) {
+    return !t->data || t->data[0] == '\0' || is_all_whitespace(t->data);
+}
 
-            if (mode == MODE_TEXT) {
-                if (t->type == TOKEN_CHARACTER) {
-                    if (t->data && t->data[0] != '\0') {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_TEXT, NULL, t->data);
-                        node_append_child(parent, n);
-                    }
-                    break;
-                }
-                if (t->type == TOKEN_END_TAG) {
-                    stack_pop(&st);
-                    mode = original_insertion_mode;
-                    break;
-                }
-                if (t->type == TOKEN_EOF) {
-                    tree_parse_error("eof-in-text");
-                    stack_pop(&st);
-                    mode = original_insertion_mode;
-                    reprocess = 1;
-                    continue;
-                }
-                break;
-            }
+static step_result ignore_token(tree_builder *b, token *t) {
+    (void)b; (void)t;
+    return STEP_DONE;
+}
 
-            /* ---- In head noscript mode (WHATWG §13.2.6.4.4) ---- */
-            if (mode == MODE_IN_HEAD_NOSCRIPT) {
-                if (t->type == TOKEN_DOCTYPE) {
-                    tree_parse_error("stray-doctype-in-head-noscript");
-                    break;
-                }
-                if (t->type == TOKEN_COMMENT) {
-                    parent = current_node(&st, doc);
-                    n = node_create(NODE_COMMENT, NULL, t->data ? t->data : "");
-                    node_append_child(parent, n);
-                    break;
-                }
-                if (t->type == TOKEN_CHARACTER) {
-                    if (t->data && is_all_whitespace(t->data)) break;
-                    tree_parse_error("char-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                if (t->type == TOKEN_START_TAG) {
-                    if (t->name && strcmp(t->name, "html") == 0) {
-                        tree_parse_error("unexpected-start-tag");
-                        break;
-                    }
-                    if (t->name && is_head_noscript_element(t->name)) {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t->name, NULL);
-                        attach_attrs(n, t->attrs, t->attr_count);
-                        node_append_child(parent, n);
-                        if (!t->self_closing && !is_void_element(t->name) &&
-                            strcmp(t->name, "basefont") != 0 && strcmp(t->name, "bgsound") != 0) {
-                            stack_push(&st, n);
-                        }
-                        if (triggers_text_mode(t->name)) {
-                            original_insertion_mode = mode;
-                            mode = MODE_TEXT;
-                        }
-                        break;
-                    }
-                    if (t->name && (strcmp(t->name, "head") == 0 || strcmp(t->name, "noscript") == 0)) {
-                        tree_parse_error("unexpected-start-tag-in-head-noscript");
-                        break;
-                    }
-                    tree_parse_error("unexpected-start-tag-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                if (t->type == TOKEN_END_TAG) {
-                    if (t->name && strcmp(t->name, "noscript") == 0) {
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "br") == 0) {
-                        tree_parse_error("end-tag-br-in-head-noscript");
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        reprocess = 1;
-                        continue;
-                    }
-                    tree_parse_error("unexpected-end-tag-in-head-noscript");
-                    break;
-                }
-                if (t->type == TOKEN_EOF) {
-                    tree_parse_error("eof-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                break;
-            }
+static step_result stop_parsing(tree_builder *b, token *t) {
+    (void)b; (void)t;
+    return STEP_STOP;
+}
 
-            /* ---- EOF handling (WHATWG §13.2.6.5 "The end") ---- */
-            if (t->type == TOKEN_EOF) {
-                switch (mode) {
-                    case MODE_INITIAL:
-                        tree_parse_error("eof-before-doctype");
-                        dmode = DOC_QUIRKS;
-                        mode = MODE_BEFORE_HTML;
-                        reprocess = 1;
-                        continue;
-                    case MODE_BEFORE_HTML:
-                        ensure_body(doc, &st, &html, &body);
-                        mode = MODE_IN_BODY;
-                        reprocess = 1;
-                        continue;
-                    case MODE_IN_HEAD_NOSCRIPT:
-                        tree_parse_error("eof-in-head-noscript");
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        reprocess = 1;
-                        continue;
-                    case MODE_IN_HEAD:
-                        close_head(&st, &head, &mode);
-                        reprocess = 1;
-                        continue;
-                    case MODE_IN_TEMPLATE:
-                        /* handle_in_template_mode already handled it;
-                           reaching here means no template on stack → stop */
-                        goto stop_parsing;
-                    case MODE_IN_BODY:
-                    case MODE_IN_CAPTION:
-                    case MODE_IN_CELL:
-                    case MODE_IN_ROW:
-                    case MODE_IN_TABLE_BODY:
-                        if (template_mode_top > 0) {
-                            mode = MODE_IN_TEMPLATE;
-                            reprocess = 1;
-                            continue;
-                        }
-                        for (size_t si = 0; si < st.size; si++) {
-                            node *sn = st.items[si];
-                            if (sn && sn->name && !is_eof_expected_element(sn->name)) {
-                                tree_parse_error("eof-with-open-elements");
-                                break;
-                            }
-                        }
-                        goto stop_parsing;
-                    case MODE_IN_TABLE:
-                    case MODE_IN_SELECT:
-                    case MODE_IN_SELECT_IN_TABLE:
-                        if (template_mode_top > 0) {
-                            mode = MODE_IN_TEMPLATE;
-                            reprocess = 1;
-                            continue;
-                        }
-                        {
-                            node *cur = current_node(&st, doc);
-                            if (cur && cur->name && strcmp(cur->name, "html") != 0)
-                                tree_parse_error("eof-in-table");
-                        }
-                        goto stop_parsing;
-                    case MODE_AFTER_BODY:
-                    case MODE_AFTER_AFTER_BODY:
-                    default:
-                        goto stop_parsing;
-                }
-            }
+static step_result insert_comment(tree_builder *b, token *t) {
+    node *parent = current_node(&b->st, b->doc);
+    node *n = node_create_from_token(NODE_COMMENT, t);
+    node_append_child(parent, n);
+    return STEP_DONE;
+}
 
-            switch (t->type) {
-                case TOKEN_DOCTYPE:
-                    if (mode != MODE_INITIAL) {
-                        tree_parse_error("stray-doctype");
-                        break;
-                    }
-                    n = node_create(NODE_DOCTYPE, t->name ? t->name : "", NULL);
-                    node_append_child(doc, n);
-                    dmode = determine_doc_mode(t);
-                    mode = MODE_BEFORE_HTML;
-                    break;
-                case TOKEN_START_TAG:
-                    if (mode == MODE_INITIAL) {
-                        tree_parse_error("missing-doctype");
-                        dmode = DOC_QUIRKS;
-                        mode = MODE_BEFORE_HTML;
-                    }
-                    if (mode == MODE_BEFORE_HTML) {
-                        if (t->name && strcmp(t->name, "html") == 0) {
-                            html = ensure_html(doc, &st, &html);
-                            attach_attrs(html, t->attrs, t->attr_count);
-                            mode = MODE_IN_HEAD;
-                            break;
-                        }
-                        html = ensure_html(doc, &st, &html);
-                        if (t->name && strcmp(t->name, "head") == 0) {
-                            head = node_create(NODE_ELEMENT, "head", NULL);
-                            attach_attrs(head, t->attrs, t->attr_count);
-                            node_append_child(html, head);
-                            stack_push(&st, head);
-                            mode = MODE_IN_HEAD;
-                            break;
-                        }
-                        body = ensure_body(doc, &st, &html, &body);
-                        mode = MODE_IN_BODY;
-                        reprocess = 1;
-                        break;
-                    }
-                    if (mode == MODE_IN_HEAD) {
-                        if (t->name && strcmp(t->name, "head") == 0) {
-                            if (!head) {
-                                head = node_create(NODE_ELEMENT, "head", NULL);
-                                attach_attrs(head, t->attrs, t->attr_count);
-                                node_append_child(ensure_html(doc, &st, &html), head);
-                                stack_push(&st, head);
-                            } else {
-                                tree_parse_error("unexpected-start-tag");
-                            }
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "body") == 0) {
-                            close_head(&st, &head, &mode);
-                            body = ensure_body(doc, &st, &html, &body);
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "template") == 0) {
-                            parent = current_node(&st, doc);
-                            node *tmpl = create_template_element(t->attrs, t->attr_count);
-                            if (!tmpl) break;
-                            node_append_child(parent, tmpl);
-                            open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                  tmpl, t->self_closing);
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "noscript") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "noscript", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_HEAD_NOSCRIPT;
-                            break;
-                        }
-                        if (!is_head_element(t->name)) {
-                            close_head(&st, &head, &mode);
-                            reprocess = 1;
-                            break;
-                        }
-                    }
-                    if (is_table_mode(mode)) {
-                        node *cur = current_node(&st, doc);
-                        if (cur && cur->name && !is_table_element(cur->name)) {
-                            handle_in_body_start(t->name, t->self_closing, doc, &st, &html, &body, &fmt, &mode,
-                                                 template_mode_stack, &template_mode_top, dmode,
-                                                 t->attrs, t->attr_count, &form_element_pointer);
-                            break;
-                        }
-                    }
-                    if (mode == MODE_IN_BODY) {
-                        handle_in_body_start(t->name, t->self_closing, doc, &st, &html, &body, &fmt, &mode,
-                                             template_mode_stack, &template_mode_top, dmode,
-                                             t->attrs, t->attr_count, &form_element_pointer);
-                        break;
-                    }
-                    if (mode == MODE_IN_TABLE) {
-                        if (t->name && strcmp(t->name, "caption") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "caption", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CAPTION;
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "colgroup") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "colgroup", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "col") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "col", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "select") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "select", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_SELECT_IN_TABLE;
-                            break;
-                        }
-                        if (t->name && is_table_section_element(t->name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t->name, NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_TABLE_BODY;
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "tr") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "tr", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_ROW;
-                            break;
-                        }
-                        if (t->name && is_cell_element(t->name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t->name, NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        /* <input type=hidden>: insert directly, do NOT foster parent */
-                        if (t->name && strcmp(t->name, "input") == 0) {
-                            const char *tv = find_attr(t->attrs, t->attr_count, "type");
-                            if (tv && strcasecmp(tv, "hidden") == 0) {
-                                tree_parse_error("unexpected-start-tag-in-table");
-                                parent = current_node(&st, doc);
-                                n = node_create(NODE_ELEMENT, "input", NULL);
-                                attach_attrs(n, t->attrs, t->attr_count);
-                                node_append_child(parent, n);
-                                /* void element — don't push to stack */
-                                if (!in_template_context(&st) && form_element_pointer) {
-                                    n->form_owner = form_element_pointer;
-                                }
-                                break;
-                            }
-                        }
-                        if (!is_table_element(t->name)) {
-                            if (t->name && strcmp(t->name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t->attrs, t->attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t->self_closing);
-                                break;
-                            }
-                            if (t->name && strcmp(t->name, "form") == 0) {
-                                if (form_element_pointer && !in_template_context(&st)) {
-                                    tree_parse_error("unexpected-start-tag");
-                                    break;
-                                }
-                                tree_parse_error("foster-parenting");
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                n = node_create(NODE_ELEMENT, "form", NULL);
-                                attach_attrs(n, t->attrs, t->attr_count);
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, n, table);
-                                } else {
-                                    node_append_child(fp, n);
-                                }
-                                if (form_element_pointer == NULL && !in_template_context(&st)) {
-                                    form_element_pointer = n;
-                                }
-                                if (!t->self_closing) {
-                                    stack_push(&st, n);
-                                }
-                                break;
-                            }
-                            fmt_tag ft = fmt_tag_from_name(t->name);
-                            node *table = NULL;
-                            node *fp = foster_parent(&st, doc, &table);
-                            if (ft != FMT_NONE) {
-                                reconstruct_active_formatting(&st, &fmt, fp);
-                            }
-                            n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            if (table && fp == table->parent) {
-                                node_insert_before(fp, n, table);
-                            } else {
-                                node_append_child(fp, n);
-                            }
-                            if (!t->self_closing && !is_void_element(t->name)) {
-                                stack_push(&st, n);
-                                if (ft != FMT_NONE) formatting_push(&fmt, ft, n);
-                            }
-                            if (is_form_associated_element(t->name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_HEAD) {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
-                        attach_attrs(n, t->attrs, t->attr_count);
-                        node_append_child(parent, n);
-                        if (!t->self_closing && !is_void_element(t->name)) {
-                            stack_push(&st, n);
-                        }
-                    } else if (mode == MODE_IN_TABLE_BODY) {
-                        if (t->name && is_table_section_element(t->name)) {
-                            if (stack_has_open_table_section(&st)) {
-                                stack_pop_until(&st, "thead");
-                                stack_pop_until(&st, "tbody");
-                                stack_pop_until(&st, "tfoot");
-                            }
-                            mode = MODE_IN_TABLE;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "tr") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "tr", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_ROW;
-                            break;
-                        }
-                        if (t->name && is_cell_element(t->name)) {
-                            parent = current_node(&st, doc);
-                            node *tr = node_create(NODE_ELEMENT, "tr", NULL);
-                            node_append_child(parent, tr);
-                            stack_push(&st, tr);
-                            node *cell = node_create(NODE_ELEMENT, t->name, NULL);
-                            attach_attrs(cell, t->attrs, t->attr_count);
-                            node_append_child(tr, cell);
-                            stack_push(&st, cell);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        if (!is_table_element(t->name)) {
-                            if (t->name && strcmp(t->name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t->attrs, t->attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t->self_closing);
-                                break;
-                            }
-                            fmt_tag ft = fmt_tag_from_name(t->name);
-                            node *table = NULL;
-                            node *fp = foster_parent(&st, doc, &table);
-                            if (ft != FMT_NONE) {
-                                reconstruct_active_formatting(&st, &fmt, fp);
-                            }
-                            n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            if (table && fp == table->parent) {
-                                node_insert_before(fp, n, table);
-                            } else {
-                                node_append_child(fp, n);
-                            }
-                            if (!t->self_closing && !is_void_element(t->name)) {
-                                stack_push(&st, n);
-                                if (ft != FMT_NONE) formatting_push(&fmt, ft, n);
-                            }
-                            if (is_form_associated_element(t->name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_ROW) {
-                        if (t->name && is_cell_element(t->name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t->name, NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        if (t->name && is_table_section_element(t->name)) {
-                            if (stack_has_open_named(&st, "tr")) {
-                                stack_pop_until(&st, "tr");
-                            }
-                            mode = MODE_IN_TABLE_BODY;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (!is_table_element(t->name)) {
-                            if (t->name && strcmp(t->name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t->attrs, t->attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t->self_closing);
-                                break;
-                            }
-                            fmt_tag ft = fmt_tag_from_name(t->name);
-                            node *table = NULL;
-                            node *fp = foster_parent(&st, doc, &table);
-                            if (ft != FMT_NONE) {
-                                reconstruct_active_formatting(&st, &fmt, fp);
-                            }
-                            n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            if (table && fp == table->parent) {
-                                node_insert_before(fp, n, table);
-                            } else {
-                                node_append_child(fp, n);
-                            }
-                            if (!t->self_closing && !is_void_element(t->name)) {
-                                stack_push(&st, n);
-                                if (ft != FMT_NONE) formatting_push(&fmt, ft, n);
-                            }
-                            if (is_form_associated_element(t->name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_CELL) {
-                        if (t->name && strcmp(t->name, "select") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "select", NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_SELECT_IN_TABLE;
-                            break;
-                        }
-                        if (t->name && is_cell_element(t->name)) {
-                            close_cell(&st, &fmt);
-                            mode = MODE_IN_ROW;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t->name && (strcmp(t->name, "tr") == 0 || is_table_section_element(t->name))) {
-                            close_cell(&st, &fmt);
-                            mode = MODE_IN_TABLE_BODY;
-                            reprocess = 1;
-                            break;
-                        }
-                        handle_in_body_start(t->name, t->self_closing, doc, &st, &html, &body, &fmt, &mode,
-                                             template_mode_stack, &template_mode_top, dmode,
-                                             t->attrs, t->attr_count, &form_element_pointer);
-                    } else if (mode == MODE_IN_CAPTION) {
-                        if (t->name && (strcmp(t->name, "table") == 0 || strcmp(t->name, "tr") == 0 || is_table_section_element(t->name))) {
-                            stack_pop_until(&st, "caption");
-                            mode = MODE_IN_TABLE;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t->name && strcmp(t->name, "template") == 0) {
-                            parent = current_node(&st, doc);
-                            node *tmpl = create_template_element(t->attrs, t->attr_count);
-                            if (!tmpl) break;
-                            node_append_child(parent, tmpl);
-                            open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                  tmpl, t->self_closing);
-                            break;
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
-                        attach_attrs(n, t->attrs, t->attr_count);
-                        node_append_child(parent, n);
-                        if (!t->self_closing && !is_void_element(t->name)) {
-                            stack_push(&st, n);
-                        }
-                        break;
-                    } else if (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE) {
-                        if (t->name && strcmp(t->name, "select") == 0) {
-                            tree_parse_error("unexpected-start-tag");
-                            if (!has_element_in_select_scope(&st, "select")) break;
-                            stack_pop_until(&st, "select");
-                            mode = reset_insertion_mode_from_stack(&st);
-                            break;
-                        }
-                        /* Auto-close an open <option> before a new <option> or <optgroup> */
-                        if (t->name && strcmp(t->name, "option") == 0 && stack_has_open_named(&st, "option")) {
-                            stack_pop_until(&st, "option");
-                        }
-                        /* Auto-close an open <optgroup>: <option> closes it, <optgroup> closes it */
-                        if (t->name && strcmp(t->name, "optgroup") == 0 && stack_has_open_named(&st, "optgroup")) {
-                            if (stack_has_open_named(&st, "option")) {
-                                stack_pop_until(&st, "option");
-                            }
-                            stack_pop_until(&st, "optgroup");
-                        }
-                        if (t->name && is_select_child_element(t->name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t->name, NULL);
-                            attach_attrs(n, t->attrs, t->attr_count);
-                            node_append_child(parent, n);
-                            if (!t->self_closing && !is_void_element(t->name)) {
-                                stack_push(&st, n);
-                            }
-                            break;
-                        }
-                        if (mode == MODE_IN_SELECT_IN_TABLE && t->name && is_table_element(t->name)) {
-                            tree_parse_error("unexpected-start-tag-in-select");
-                            if (!has_element_in_select_scope(&st, "select")) break;
-                            stack_pop_until(&st, "select");
-                            mode = reset_insertion_mode_from_stack(&st);
-                            reprocess = 1;
-                            break;
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
-                        attach_attrs(n, t->attrs, t->attr_count);
-                        node_append_child(parent, n);
-                        if (!t->self_closing && !is_void_element(t->name)) {
-                            stack_push(&st, n);
-                        }
-                    }
-                    break;
-                case TOKEN_END_TAG:
-                    if (t->name && strcmp(t->name, "template") == 0 && stack_has_open_named(&st, "template")) {
-                        close_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top);
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "head") == 0 && mode == MODE_IN_HEAD) {
-                        close_head(&st, &head, &mode);
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "form") == 0 && mode == MODE_IN_BODY) {
-                        if (!in_template_context(&st)) {
-                            node *node_ptr = form_element_pointer;
-                            form_element_pointer = NULL;
-                            int idx;
-                            if (node_ptr == NULL || !has_element_in_scope(&st, "form")) {
-                                tree_parse_error("unexpected-end-tag");
-                                if (node_ptr == NULL) break;
-                                if (!has_element_in_scope(&st, "form")) break;
-                            }
-                            generate_implied_end_tags(&st);
-                            idx = stack_index_of(&st, node_ptr);
-                            if (idx >= 0) {
-                                stack_remove_at(&st, idx);
-                            }
-                        } else {
-                             if (!has_element_in_scope(&st, "form")) {
-                                 tree_parse_error("unexpected-end-tag");
-                             } else {
-                                 generate_implied_end_tags(&st);
-                                 stack_pop_until(&st, "form");
-                             }
-                        }
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "body") == 0 && mode == MODE_IN_BODY) {
-                        generate_implied_end_tags(&st);
-                        {
-                            node *cur = stack_top(&st);
-                            if (!cur || !cur->name || strcmp(cur->name, "body") != 0)
-                                tree_parse_error("end-tag-with-unclosed-elements");
-                        }
-                        stack_pop_until(&st, "body");
-                        mode = MODE_AFTER_BODY;
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "p") == 0 && mode == MODE_IN_BODY) {
-                        if (!has_element_in_button_scope(&st, "p")) {
-                            tree_parse_error("unexpected-end-tag");
-                            node *parent = current_node(&st, doc);
-                            node *pn = node_create(NODE_ELEMENT, "p", NULL);
-                            node_append_child(parent, pn);
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, "p");
-                        stack_pop_until(&st, "p");
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "li") == 0 && mode == MODE_IN_BODY) {
-                        if (!has_element_in_list_item_scope(&st, "li")) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, "li");
-                        stack_pop_until(&st, "li");
-                        break;
-                    }
-                    if (t->name && (strcmp(t->name, "dd") == 0 || strcmp(t->name, "dt") == 0) && mode == MODE_IN_BODY) {
-                        if (!has_element_in_scope(&st, t->name)) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, t->name);
-                        stack_pop_until(&st, t->name);
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "table") == 0) {
-                        if (!has_element_in_table_scope(&st, "table")) {
-                            break;
-                        }
-                        if (mode == MODE_IN_CELL) {
-                            formatting_clear_to_marker(&fmt);
-                        }
-                        stack_pop_until(&st, "table");
-                        mode = MODE_IN_BODY;
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "tr") == 0 && mode == MODE_IN_ROW && has_element_in_table_scope(&st, "tr")) {
-                        stack_pop_until(&st, "tr");
-                        mode = stack_has_open_table_section(&st) ? MODE_IN_TABLE_BODY : MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t->name && is_cell_element(t->name) && mode == MODE_IN_CELL && has_element_in_table_scope(&st, t->name)) {
-                        stack_pop_until(&st, t->name);
-                        formatting_clear_to_marker(&fmt);
-                        mode = MODE_IN_ROW;
-                        break;
-                    }
-                    if (t->name && is_table_section_element(t->name) && mode == MODE_IN_CELL && has_element_in_table_scope(&st, t->name)) {
-                        close_cell(&st, &fmt);
-                        stack_pop_until(&st, t->name);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t->name && is_table_section_element(t->name) && (mode == MODE_IN_TABLE || mode == MODE_IN_TABLE_BODY) &&
-                        has_element_in_table_scope(&st, t->name)) {
-                        stack_pop_until(&st, t->name);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "caption") == 0 && mode == MODE_IN_CAPTION && has_element_in_table_scope(&st, "caption")) {
-                        stack_pop_until(&st, "caption");
-                        formatting_clear_to_marker(&fmt);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "select") == 0 && (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE)) {
-                        if (!has_element_in_select_scope(&st, "select")) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        stack_pop_until(&st, "select");
-                        mode = reset_insertion_mode_from_stack(&st);
-                        break;
-                    }
-                    if (t->name && (strcmp(t->name, "applet") == 0 || strcmp(t->name, "marquee") == 0 || strcmp(t->name, "object") == 0)) {
-                        if (!has_element_in_scope(&st, t->name)) break;
-                        generate_implied_end_tags(&st);
-                        stack_pop_until(&st, t->name);
-                        formatting_clear_to_marker(&fmt);
-                        break;
-                    }
-                    if (t->name && strcmp(t->name, "html") == 0) {
-                        stack_pop_until(&st, "html");
-                        if (mode == MODE_AFTER_BODY) {
-                            mode = MODE_AFTER_AFTER_BODY;
-                        }
-                        break;
-                    }
-                    if (mode == MODE_IN_BODY ||
-                        mode == MODE_IN_CELL ||
-                        mode == MODE_IN_TABLE ||
-                        mode == MODE_IN_TABLE_BODY ||
-                        mode == MODE_IN_ROW ||
-                        mode == MODE_IN_CAPTION) {
-                        if (adoption_agency(&st, &fmt, doc, t->name)) {
-                            break;
-                        }
-                    }
-                    if (t->name && !has_element_in_scope(&st, t->name)) {
-                        tree_parse_error("unexpected-end-tag");
-                        break;
-                    }
-                    stack_pop_until(&st, t->name);
-                    break;
-                case TOKEN_COMMENT:
-                    parent = current_node(&st, doc);
-                    n = node_create(NODE_COMMENT, NULL, t->data ? t->data : "");
-                    node_append_child(parent, n);
-                    break;
-                case TOKEN_CHARACTER:
-                    if (t->data && t->data[0] != '\0') {
-                        if (is_all_whitespace(t->data)) {
-                            if (mode == MODE_IN_BODY) {
-                                if (!in_template_context(&st)) {
-                                    ensure_body(doc, &st, &html, &body);
-                                }
-                                parent = current_node(&st, doc);
-                                if (parent) {
-                                    reconstruct_active_formatting(&st, &fmt, parent);
-                                }
-                            }
-                            break;
-                        }
-                        if (mode == MODE_AFTER_BODY || mode == MODE_AFTER_AFTER_BODY) {
-                            tree_parse_error("unexpected-token-after-body");
-                            mode = MODE_IN_BODY;
-                        }
-                        if (mode == MODE_IN_HEAD) {
-                            if (!head) {
-                                head = node_create(NODE_ELEMENT, "head", NULL);
-                                node_append_child(ensure_html(doc, &st, &html), head);
-                                stack_push(&st, head);
-                            }
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_TEXT, NULL, t->data);
-                            node_append_child(parent, n);
-                            break;
-                        }
-                        if (mode == MODE_IN_TABLE) {
-                            mode = MODE_IN_TABLE_TEXT;
-                            text_buffer_append(&table_text, t->data);
-                            if (!is_all_whitespace(t->data)) table_text_has_non_ws = 1;
-                            break;
-                        }
-                        if (is_table_mode(mode)) {
-                            node *cur = current_node(&st, doc);
-                            if (mode == MODE_IN_CELL || (cur && cur->name && !is_table_element(cur->name))) {
-                                parent = cur;
-                                n = node_create(NODE_TEXT, NULL, t->data);
-                                node_append_child(parent, n);
-                                break;
-                            }
-                            n = node_create(NODE_TEXT, NULL, t->data);
-                            foster_insert(&st, doc, n);
-                            break;
-                        }
-                        if (mode == MODE_INITIAL) {
-                            tree_parse_error("missing-doctype");
-                            dmode = DOC_QUIRKS;
-                            mode = MODE_BEFORE_HTML;
-                        }
-                        if (mode == MODE_INITIAL || mode == MODE_BEFORE_HTML) {
-                            ensure_body(doc, &st, &html, &body);
-                            mode = MODE_IN_BODY;
-                        }
-                        if (mode == MODE_IN_BODY) {
-                            parent = current_node(&st, doc);
-                            reconstruct_active_formatting(&st, &fmt, parent);
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_TEXT, NULL, t->data);
-                        node_append_child(parent, n);
-                    }
-                    break;
-                case TOKEN_EOF:
-                default:
-                    goto stop_parsing;
-            }
+static step_result stray_doctype(tree_builder *b, token *t) {
+    (void)b; (void)t;
+    tree_parse_error(PARSE_ERR_STRAY_DOCTYPE);
+    return STEP_DONE;
+}
 
-            /* After processing a start tag: enter MODE_TEXT if needed */
-            if (!reprocess && t->type == TOKEN_START_TAG && mode != MODE_TEXT &&
-                triggers_text_mode(t->name)) {
-                original_insertion_mode = mode;
-                mode = MODE_TEXT;
-            }
+/* ---- In template (WHATWG §13.2.6.4.18) ---- */
+
+static step_result template_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    template_mode_replace(b, MODE_IN_BODY);
+    b->mode = MODE_IN_BODY;
+    return STEP_REPROCESS;
+}
+
+static step_result template_start(tree_builder *b, token *t) {
+    insertion_mode next;
+    if (tag_is(b->atom, TP_TEMPLATE_HEAD)) {
+        if (b->atom == TAG_TEMPLATE) {
+            insert_template(b, t);
+        } else {
+            insert_element_open(b, t);
         }
+        return STEP_DONE_NO_TEXT;
+    }
+    switch (b->atom) {
+    case TAG_CAPTION:
+    case TAG_COLGROUP:
+    case TAG_TBODY:
+    case TAG_TFOOT:
+    case TAG_THEAD:
+    case TAG_TABLE:
+    case TAG_COL:
+        next = MODE_IN_TABLE;
+        break;
+    case TAG_TR:
+        next = MODE_IN_TABLE_BODY;
+        break;
+    case TAG_TD:
+    case TAG_TH:
+        next = MODE_IN_ROW;
+        break;
+    case TAG_SELECT:
+        next = MODE_IN_SELECT;
+        break;
+    default:
+        next = MODE_IN_BODY;
+        break;
     }
+    template_mode_replace(b, next);
+    b->mode = next;
+    return STEP_REPROCESS;
+}
 
-stop_parsing:
-    while (st.size > 0) stack_pop(&st);
-    text_buffer_free(&table_text);
-    return doc;
+static step_result template_end(tree_builder *b, token *t) {
+    (void)t;
+    if (b->atom == TAG_TEMPLATE && stack_has_open(&b->st, TAG_TEMPLATE))
+        close_template_element(b);
+    return STEP_DONE;
 }
 
-node *build_tree_from_input(const char *input, const char *encoding,
-                            encoding_confidence confidence,
-                            const char **change_encoding) {
-    tokenizer tz;
-    token t;
-    node *doc = node_create(NODE_DOCUMENT, NULL, NULL);
-    node_stack st;
-    insertion_mode mode = MODE_INITIAL;
-    insertion_mode original_insertion_mode = MODE_INITIAL;
-    doc_mode dmode = DOC_NO_QUIRKS;
-    node *html = NULL;
-    node *head = NULL;
-    node *body = NULL;
-    formatting_list fmt = {0};
-    insertion_mode template_mode_stack[64];
-    int template_mode_top = 0;
-    text_buffer table_text = {0};
-    int table_text_has_non_ws = 0;
-    node *form_element_pointer = NULL;
+static step_result template_eof(tree_builder *b, token *t) {
+    (void)t;
+    if (!stack_has_open(&b->st, TAG_TEMPLATE))
+        return STEP_STOP;
+    tree_parse_error(PARSE_ERR_EOF_IN_TEMPLATE);
+    close_template_element(b);
+    return STEP_REPROCESS;
+}
 
-    if (change_encoding) *change_encoding = NULL;
-    if (!doc) return NULL;
-    if (encoding)
-        doc->encoding = strdup(encoding);
-    doc->enc_confidence = confidence;
-    stack_init(&st);
-    text_buffer_init(&table_text);
-    tokenizer_init(&tz, input);
+/* ---- In table text (WHATWG §13.2.6.4.10) ---- */
+
+/* Any token but character data: insert the pending table text, foster
+ * parented if it is not all whitespace, and go back to "in table". */
+static step_result table_text_flush(tree_builder *b, token *t) {
+    (void)t;
+    if (b->table_text.len > 0) {
+        node *text = node_create(NODE_TEXT, NULL, b->table_text.data ? b->table_text.data : "");
+        if (b->table_text_has_non_ws) {
+            tree_parse_error(PARSE_ERR_FOSTER_PARENTING);
+            foster_insert(&b->st, b->doc, text);
+        } else {
+            node_append_child(current_node(&b->st, b->doc), text);
+        }
+    }
+    text_buffer_clear(&b->table_text);
+    b->table_text_has_non_ws = 0;
+    b->mode = MODE_IN_TABLE;
+    return STEP_REPROCESS;
+}
 
-    while (1) {
-        token_init(&t);
-        /* Set CDATA flag based on whether current node is in foreign content */
-        {
-            node *top = stack_top(&st);
-            tz.allow_cdata = (top && top->ns != NS_HTML) ? 1 : 0;
+static step_result table_text_char(tree_builder *b, token *t) {
+    if (!t->data || t->data[0] == '\0')
+        return table_text_flush(b, t);
+    text_buffer_append(&b->table_text, t->data);
+    if (!is_all_whitespace(t->data)) b->table_text_has_non_ws = 1;
+    return STEP_DONE;
+}
+
+/* ---- Text (WHATWG §13.2.6.4.8) ---- */
+
+static step_result text_char(tree_builder *b, token *t) {
+    if (t->data && t->data[0] != '\0')
+        insert_text(b, t);
+    return STEP_DONE;
+}
+
+static step_result text_end(tree_builder *b, token *t) {
+    (void)t;
+    stack_pop(&b->st);
+    b->mode = b->original_insertion_mode;
+    return STEP_DONE;
+}
+
+static step_result text_eof(tree_builder *b, token *t) {
+    (void)t;
+    tree_parse_error(PARSE_ERR_EOF_IN_TEXT);
+    stack_pop(&b->st);
+    b->mode = b->original_insertion_mode;
+    return STEP_REPROCESS;
+}
+
+/* ---- In head noscript (WHATWG §13.2.6.4.5) ---- */
+
+/* Pop the <noscript> and run the token again "in head". */
+static step_result noscript_leave(tree_builder *b) {
+    stack_pop(&b->st);
+    b->mode = MODE_IN_HEAD;
+    return STEP_REPROCESS;
+}
+
+static step_result noscript_doctype(tree_builder *b, token *t) {
+    (void)b; (void)t;
+    tree_parse_error(PARSE_ERR_STRAY_DOCTYPE_IN_HEAD_NOSCRIPT);
+    return STEP_DONE;
+}
+
+static step_result noscript_char(tree_builder *b, token *t) {
+    if (t->data && is_all_whitespace(t->data)) return STEP_DONE;
+    tree_parse_error(PARSE_ERR_CHAR_IN_HEAD_NOSCRIPT);
+    return noscript_leave(b);
+}
+
+static step_result noscript_start(tree_builder *b, token *t) {
+    switch (b->atom) {
+    case TAG_HTML:
+        tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+        return STEP_DONE;
+    case TAG_HEAD:
+    case TAG_NOSCRIPT:
+        tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG_IN_HEAD_NOSCRIPT);
+        return STEP_DONE;
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_HEAD_NOSCRIPT)) {
+        tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG_IN_HEAD_NOSCRIPT);
+        return noscript_leave(b);
+    }
+    node *n = insert_element(b, t);
+    if (!t->self_closing && !tag_is(b->atom, TP_VOID) &&
+        b->atom != TAG_BASEFONT && b->atom != TAG_BGSOUND) {
+        stack_push(&b->st, n);
+    }
+    if (text_state_pending(b)) {
+        b->original_insertion_mode = b->mode;
+        b->mode = MODE_TEXT;
+    }
+    return STEP_DONE_NO_TEXT;
+}
+
+static step_result noscript_end(tree_builder *b, token *t) {
+    (void)t;
+    switch (b->atom) {
+    case TAG_NOSCRIPT:
+        stack_pop(&b->st);
+        b->mode = MODE_IN_HEAD;
+        return STEP_DONE;
+    case TAG_BR:
+        tree_parse_error(PARSE_ERR_END_TAG_BR_IN_HEAD_NOSCRIPT);
+        return noscript_leave(b);
+    default:
+        tree_parse_error(PARSE_ERR_UNEXPECTED_END_TAG_IN_HEAD_NOSCRIPT);
+        return STEP_DONE;
+    }
+}
+
+static step_result noscript_eof(tree_builder *b, token *t) {
+    (void)t;
+    tree_parse_error(PARSE_ERR_EOF_IN_HEAD_NOSCRIPT);
+    return noscript_leave(b);
+}
+
+/* ---- Shared by the document and fragment modes ---- */
+
+static step_result in_table_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    b->mode = MODE_IN_TABLE_TEXT;
+    text_buffer_append(&b->table_text, t->data);
+    if (!is_all_whitespace(t->data)) b->table_text_has_non_ws = 1;
+    return STEP_DONE;
+}
+
+/* Character data in a row, cell or table body: into the current node in a
+ * cell or outside table elements, foster parented otherwise. */
+static step_result table_rows_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    if (b->mode == MODE_IN_CELL || current_node_outside_table(&b->st)) {
+        insert_text(b, t);
+        return STEP_DONE;
+    }
+    node *n = node_create_from_token(NODE_TEXT, t);
+    foster_insert(&b->st, b->doc, n);
+    return STEP_DONE;
+}
+
+static step_result plain_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    insert_text(b, t);
+    return STEP_DONE;
+}
+
+static step_result body_text(tree_builder *b, token *t) {
+    reconstruct_active_formatting(&b->st, &b->fmt, current_node(&b->st, b->doc));
+    insert_text(b, t);
+    return STEP_DONE;
+}
+
+static step_result eof_in_body(tree_builder *b, token *t) {
+    (void)t;
+    if (b->template_mode_top > 0) {
+        b->mode = MODE_IN_TEMPLATE;
+        return STEP_REPROCESS;
+    }
+    for (size_t si = 0; si < b->st.size; si++) {
+        if (!tag_is(b->st.atoms[si], TP_EOF_EXPECTED)) {
+            tree_parse_error(PARSE_ERR_EOF_WITH_OPEN_ELEMENTS);
+            break;
         }
-        tokenizer_next(&tz, &t);
+    }
+    return STEP_STOP;
+}
 
-        node *parent;
-        node *n = NULL;
-        int reprocess = 1;
-
-        while (reprocess) {
-            reprocess = 0;
-            parent = current_node(&st, doc);
-
-            /* Foreign content check */
-            {
-                node *acn = (st.size > 0) ? stack_top(&st) : NULL;
-                if (acn && acn->ns != NS_HTML) {
-                    int fc_reprocess = 0;
-                    if (process_in_foreign_content(t.type, t.name, t.data,
-                            t.self_closing, t.attrs, t.attr_count,
-                            &st, &fmt, doc, &mode, &fc_reprocess, NULL)) {
-                        /* Reset tokenizer if SVG <title> was handled in foreign
-                           content — the tokenizer already switched to RCDATA
-                           but SVG title is an HTML integration point, not RCDATA. */
-                        if (t.type == TOKEN_START_TAG && t.name &&
-                            acn->ns == NS_SVG && strcmp(t.name, "title") == 0 &&
-                            !fc_reprocess) {
-                            tz.state = TOKENIZE_DATA;
-                            tz.raw_tag[0] = '\0';
-                        }
-                        if (fc_reprocess) { reprocess = 1; }
-                        continue;
-                    }
-                }
+static step_result eof_in_table(tree_builder *b, token *t) {
+    (void)t;
+    if (b->template_mode_top > 0) {
+        b->mode = MODE_IN_TEMPLATE;
+        return STEP_REPROCESS;
+    }
+    if (b->st.size > 0 && stack_top_atom(&b->st) != TAG_HTML)
+        tree_parse_error(PARSE_ERR_EOF_IN_TABLE);
+    return STEP_STOP;
+}
+
+static step_result in_select_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    switch (b->atom) {
+    case TAG_SELECT:
+        tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+        if (!has_element_in_select_scope(st, TAG_SELECT)) return STEP_DONE;
+        stack_pop_until(st, TAG_SELECT);
+        b->mode = reset_insertion_mode_from_stack(st);
+        return STEP_DONE;
+    /* Auto-close an open <option> before a new <option> or <optgroup> */
+    case TAG_OPTION:
+        if (stack_has_open(st, TAG_OPTION)) {
+            stack_pop_until(st, TAG_OPTION);
+        }
+        break;
+    /* Auto-close an open <optgroup>: <option> closes it, <optgroup> closes it */
+    case TAG_OPTGROUP:
+        if (stack_has_open(st, TAG_OPTGROUP)) {
+            if (stack_has_open(st, TAG_OPTION)) {
+                stack_pop_until(st, TAG_OPTION);
             }
+            stack_pop_until(st, TAG_OPTGROUP);
+        }
+        break;
+    default:
+        break;
+    }
+    insert_element_open(b, t);
+    return STEP_DONE;
+}
 
-            if (mode == MODE_IN_TEMPLATE) {
-                if (handle_in_template_mode(&t, doc, &st, &fmt, &mode,
-                                            template_mode_stack, &template_mode_top,
-                                            &reprocess)) {
-                    if (reprocess) continue;
-                    break;
-                }
+/* </form> "in body" */
+static void end_form(tree_builder *b) {
+    node_stack *st = &b->st;
+    if (!in_template_context(st)) {
+        node *node_ptr = b->form_element_pointer;
+        b->form_element_pointer = NULL;
+        int idx;
+        if (node_ptr == NULL || !has_element_in_scope(st, TAG_FORM)) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_END_TAG);
+            if (node_ptr == NULL) return;
+            if (!has_element_in_scope(st, TAG_FORM)) return;
+        }
+        generate_implied_end_tags(st);
+        idx = stack_index_of(st, node_ptr);
+        if (idx >= 0) {
+            stack_remove_at(st, idx);
+        }
+    } else {
+        if (!has_element_in_scope(st, TAG_FORM)) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_END_TAG);
+        } else {
+            generate_implied_end_tags(st);
+            stack_pop_until(st, TAG_FORM);
+        }
+    }
+}
+
+/* </p>, </li>, </dd> and </dt> "in body" */
+static void end_implied(tree_builder *b) {
+    node_stack *st = &b->st;
+    tag_atom atom = b->atom;
+    int in_scope;
+    if (atom == TAG_P) {
+        in_scope = has_element_in_button_scope(st, atom);
+    } else if (atom == TAG_LI) {
+        in_scope = has_element_in_list_item_scope(st, atom);
+    } else {
+        in_scope = has_element_in_scope(st, atom);
+    }
+    if (!in_scope) {
+        tree_parse_error(PARSE_ERR_UNEXPECTED_END_TAG);
+        /* </p> without an open <p> inserts an empty one */
+        if (atom == TAG_P) {
+            node *parent = current_node(st, b->doc);
+            node *pn = node_create(NODE_ELEMENT, "p", NULL);
+            node_append_child(parent, pn);
+        }
+        return;
+    }
+    generate_implied_end_tags_except(st, atom);
+    stack_pop_until(st, atom);
+}
+
+/* End tags no dedicated rule took: the adoption agency for formatting
+ * elements, then "any other end tag". */
+static step_result end_tag_other(tree_builder *b, token *t) {
+    switch (b->mode) {
+    case MODE_IN_BODY:
+    case MODE_IN_CELL:
+    case MODE_IN_TABLE:
+    case MODE_IN_TABLE_BODY:
+    case MODE_IN_ROW:
+    case MODE_IN_CAPTION:
+        if (adoption_agency(&b->st, &b->fmt, b->doc, b->atom))
+            return STEP_DONE;
+        break;
+    default:
+        break;
+    }
+    if (!t->name) return STEP_DONE;
+    if (!element_in_scope(&b->st, b->atom, t->name, SCOPE_DEFAULT)) {
+        tree_parse_error(PARSE_ERR_UNEXPECTED_END_TAG);
+        return STEP_DONE;
+    }
+    stack_pop_until_named(&b->st, b->atom, t->name);
+    return STEP_DONE;
+}
+
+/* ---- Document modes ---- */
+
+/* Start tags in table, table body or row context that are not table
+ * elements: a template, or an element foster parented before the table. */
+static void table_start_foster(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    if (b->atom == TAG_TEMPLATE) {
+        insert_template_fostered(b, t);
+        return;
+    }
+    fmt_tag ft = fmt_tag_of(b->atom);
+    node *table = NULL;
+    node *fp = foster_parent(st, b->doc, &table);
+    if (ft != FMT_NONE) {
+        reconstruct_active_formatting(st, &b->fmt, fp);
+    }
+    node *n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
+    attach_attrs_take(n, t);
+    if (table && fp == table->parent) {
+        node_insert_before(fp, n, table);
+    } else {
+        node_append_child(fp, n);
+    }
+    if (!t->self_closing && !tag_is(b->atom, TP_VOID)) {
+        stack_push(st, n);
+        if (ft != FMT_NONE) formatting_push(&b->fmt, ft, n);
+    }
+    link_form_owner(b, n);
+}
+
+static step_result initial_doctype(tree_builder *b, token *t) {
+    node *n = node_create(NODE_DOCTYPE, t->name ? t->name : "", NULL);
+    node_append_child(b->doc, n);
+    b->dmode = determine_doc_mode(t);
+    b->mode = MODE_BEFORE_HTML;
+    return STEP_DONE;
+}
+
+static step_result before_html_start(tree_builder *b, token *t) {
+    if (b->atom == TAG_HTML) {
+        ensure_html(b);
+        attach_attrs_take(b->html, t);
+        b->mode = MODE_IN_HEAD;
+        return STEP_DONE;
+    }
+    ensure_html(b);
+    if (b->atom == TAG_HEAD) {
+        b->head = node_create(NODE_ELEMENT, "head", NULL);
+        attach_attrs_take(b->head, t);
+        node_append_child(b->html, b->head);
+        stack_push(&b->st, b->head);
+        b->mode = MODE_IN_HEAD;
+        return STEP_DONE;
+    }
+    ensure_body(b);
+    b->mode = MODE_IN_BODY;
+    return STEP_REPROCESS;
+}
+
+static step_result initial_start(tree_builder *b, token *t) {
+    tree_parse_error(PARSE_ERR_MISSING_DOCTYPE);
+    b->dmode = DOC_QUIRKS;
+    b->mode = MODE_BEFORE_HTML;
+    return before_html_start(b, t);
+}
+
+static step_result before_html_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    ensure_body(b);
+    b->mode = MODE_IN_BODY;
+    return body_text(b, t);
+}
+
+static step_result initial_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    tree_parse_error(PARSE_ERR_MISSING_DOCTYPE);
+    b->dmode = DOC_QUIRKS;
+    b->mode = MODE_BEFORE_HTML;
+    return before_html_char(b, t);
+}
+
+static step_result initial_eof(tree_builder *b, token *t) {
+    (void)t;
+    tree_parse_error(PARSE_ERR_EOF_BEFORE_DOCTYPE);
+    b->dmode = DOC_QUIRKS;
+    b->mode = MODE_BEFORE_HTML;
+    return STEP_REPROCESS;
+}
+
+static step_result before_html_eof(tree_builder *b, token *t) {
+    (void)t;
+    ensure_body(b);
+    b->mode = MODE_IN_BODY;
+    return STEP_REPROCESS;
+}
+
+static step_result in_head_start(tree_builder *b, token *t) {
+    switch (b->atom) {
+    case TAG_HEAD:
+        if (!b->head) {
+            b->head = node_create(NODE_ELEMENT, "head", NULL);
+            attach_attrs_take(b->head, t);
+            node_append_child(ensure_html(b), b->head);
+            stack_push(&b->st, b->head);
+        } else {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+        }
+        return STEP_DONE;
+    case TAG_BODY:
+        close_head(b);
+        ensure_body(b);
+        return STEP_DONE;
+    case TAG_TEMPLATE:
+        insert_template(b, t);
+        return STEP_DONE;
+    case TAG_NOSCRIPT:
+        stack_push(&b->st, insert_element(b, t));
+        b->mode = MODE_IN_HEAD_NOSCRIPT;
+        return STEP_DONE;
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_HEAD)) {
+        close_head(b);
+        return STEP_REPROCESS;
+    }
+    insert_element_open(b, t);
+    /* WHATWG §13.2.3.5: change the encoding */
+    if (b->atom == TAG_META &&
+        b->confidence == ENC_CONFIDENCE_TENTATIVE && b->change_encoding) {
+        const char *meta_enc = extract_meta_charset(t->attrs, t->attr_count);
+        if (meta_enc && (!b->doc->encoding || strcmp(meta_enc, b->doc->encoding) != 0)) {
+            *b->change_encoding = meta_enc;
+            return STEP_ABORT;
+        }
+    }
+    return STEP_DONE;
+}
+
+static step_result in_head_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    if (!b->head) {
+        b->head = node_create(NODE_ELEMENT, "head", NULL);
+        node_append_child(ensure_html(b), b->head);
+        stack_push(&b->st, b->head);
+    }
+    insert_text(b, t);
+    return STEP_DONE;
+}
+
+static step_result in_head_eof(tree_builder *b, token *t) {
+    (void)t;
+    close_head(b);
+    return STEP_REPROCESS;
+}
+
+static step_result in_body_start(tree_builder *b, token *t) {
+    handle_in_body_start(b, t);
+    return STEP_DONE;
+}
+
+static step_result in_body_char(tree_builder *b, token *t) {
+    if (!t->data || t->data[0] == '\0') return STEP_DONE;
+    if (is_all_whitespace(t->data)) {
+        if (!in_template_context(&b->st)) {
+            ensure_body(b);
+        }
+        node *parent = current_node(&b->st, b->doc);
+        if (parent) {
+            reconstruct_active_formatting(&b->st, &b->fmt, parent);
+        }
+        return STEP_DONE;
+    }
+    return body_text(b, t);
+}
+
+static step_result in_table_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    node *n;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start(b, t);
+        return STEP_DONE;
+    }
+    switch (b->atom) {
+    case TAG_FORM: {
+        if (b->form_element_pointer && !in_template_context(st)) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG);
+            return STEP_DONE;
+        }
+        tree_parse_error(PARSE_ERR_FOSTER_PARENTING);
+        node *table = NULL;
+        node *fp = foster_parent(st, b->doc, &table);
+        n = node_create(NODE_ELEMENT, "form", NULL);
+        attach_attrs_take(n, t);
+        if (table && fp == table->parent) {
+            node_insert_before(fp, n, table);
+        } else {
+            node_append_child(fp, n);
+        }
+        if (!in_template_context(st)) {
+            b->form_element_pointer = n;
+        }
+        stack_push(st, n);
+        return STEP_DONE;
+    }
+    case TAG_CAPTION:
+        stack_push(st, insert_element(b, t));
+        formatting_push_marker(&b->fmt);
+        b->mode = MODE_IN_CAPTION;
+        return STEP_DONE;
+    case TAG_COLGROUP:
+        stack_push(st, insert_element(b, t));
+        return STEP_DONE;
+    case TAG_COL:
+        insert_element(b, t);
+        return STEP_DONE;
+    case TAG_SELECT:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_SELECT_IN_TABLE;
+        return STEP_DONE;
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_TABLE_BODY;
+        return STEP_DONE;
+    case TAG_TR:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_ROW;
+        return STEP_DONE;
+    case TAG_TD:
+    case TAG_TH:
+        stack_push(st, insert_element(b, t));
+        formatting_push_marker(&b->fmt);
+        b->mode = MODE_IN_CELL;
+        return STEP_DONE;
+    /* <input type=hidden>: insert directly, do NOT foster parent */
+    case TAG_INPUT: {
+        const char *tv = find_attr(t->attrs, t->attr_count, "type");
+        if (tv && strcasecmp(tv, "hidden") == 0) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG_IN_TABLE);
+            n = insert_element(b, t);
+            if (!in_template_context(st) && b->form_element_pointer) {
+                n->form_owner = b->form_element_pointer;
             }
+            return STEP_DONE;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_TABLE)) {
+        table_start_foster(b, t);
+    }
+    return STEP_DONE;
+}
 
-            if (mode == MODE_IN_TABLE_TEXT) {
-                if (t.type == TOKEN_CHARACTER && t.data && t.data[0] != '\0') {
-                    text_buffer_append(&table_text, t.data);
-                    if (!is_all_whitespace(t.data)) table_text_has_non_ws = 1;
-                    break;
-                }
-                if (table_text.len > 0) {
-                    node *text = node_create(NODE_TEXT, NULL, table_text.data ? table_text.data : "");
-                    if (table_text_has_non_ws) {
-                        tree_parse_error("foster-parenting");
-                        foster_insert(&st, doc, text);
-                    } else {
-                        node_append_child(current_node(&st, doc), text);
-                    }
-                }
-                text_buffer_clear(&table_text);
-                table_text_has_non_ws = 0;
-                mode = MODE_IN_TABLE;
-                reprocess = 1;
-                continue;
+static step_result in_table_body_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start(b, t);
+        return STEP_DONE;
+    }
+    switch (b->atom) {
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        if (stack_has_open_table_section(st)) {
+            stack_pop_until(st, TAG_THEAD);
+            stack_pop_until(st, TAG_TBODY);
+            stack_pop_until(st, TAG_TFOOT);
+        }
+        b->mode = MODE_IN_TABLE;
+        return STEP_REPROCESS;
+    case TAG_TR:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_ROW;
+        return STEP_DONE;
+    case TAG_TD:
+    case TAG_TH: {
+        node *parent = current_node(st, b->doc);
+        node *tr = node_create(NODE_ELEMENT, "tr", NULL);
+        node_append_child(parent, tr);
+        stack_push(st, tr);
+        node *cell = node_create(NODE_ELEMENT, t->name, NULL);
+        attach_attrs_take(cell, t);
+        node_append_child(tr, cell);
+        stack_push(st, cell);
+        formatting_push_marker(&b->fmt);
+        b->mode = MODE_IN_CELL;
+        return STEP_DONE;
+    }
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_TABLE)) {
+        table_start_foster(b, t);
+    }
+    return STEP_DONE;
+}
+
+static step_result in_row_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start(b, t);
+        return STEP_DONE;
+    }
+    switch (b->atom) {
+    case TAG_TD:
+    case TAG_TH:
+        stack_push(st, insert_element(b, t));
+        formatting_push_marker(&b->fmt);
+        b->mode = MODE_IN_CELL;
+        return STEP_DONE;
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        if (stack_has_open(st, TAG_TR)) {
+            stack_pop_until(st, TAG_TR);
+        }
+        b->mode = MODE_IN_TABLE_BODY;
+        return STEP_REPROCESS;
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_TABLE)) {
+        table_start_foster(b, t);
+    }
+    return STEP_DONE;
+}
+
+static step_result in_cell_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start(b, t);
+        return STEP_DONE;
+    }
+    switch (b->atom) {
+    case TAG_SELECT:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_SELECT_IN_TABLE;
+        return STEP_DONE;
+    case TAG_TD:
+    case TAG_TH:
+        close_cell(st, &b->fmt);
+        b->mode = MODE_IN_ROW;
+        return STEP_REPROCESS;
+    case TAG_TR:
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        close_cell(st, &b->fmt);
+        b->mode = MODE_IN_TABLE_BODY;
+        return STEP_REPROCESS;
+    default:
+        handle_in_body_start(b, t);
+        return STEP_DONE;
+    }
+}
+
+static step_result in_caption_start(tree_builder *b, token *t) {
+    switch (b->atom) {
+    case TAG_TABLE:
+    case TAG_TR:
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        stack_pop_until(&b->st, TAG_CAPTION);
+        b->mode = MODE_IN_TABLE;
+        return STEP_REPROCESS;
+    case TAG_TEMPLATE:
+        insert_template(b, t);
+        return STEP_DONE;
+    default:
+        insert_element_open(b, t);
+        return STEP_DONE;
+    }
+}
+
+static step_result in_select_in_table_start(tree_builder *b, token *t) {
+    if (!tag_is(b->atom, TP_TABLE))
+        return in_select_start(b, t);
+    tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG_IN_SELECT);
+    if (!has_element_in_select_scope(&b->st, TAG_SELECT)) return STEP_DONE;
+    stack_pop_until(&b->st, TAG_SELECT);
+    b->mode = reset_insertion_mode_from_stack(&b->st);
+    return STEP_REPROCESS;
+}
+
+static step_result after_body_char(tree_builder *b, token *t) {
+    if (token_is_blank(t)) return STEP_DONE;
+    tree_parse_error(PARSE_ERR_UNEXPECTED_TOKEN_AFTER_BODY);
+    b->mode = MODE_IN_BODY;
+    return body_text(b, t);
+}
+
+static step_result end_tag(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    insertion_mode mode = b->mode;
+    switch (b->atom) {
+    case TAG_TEMPLATE:
+        if (stack_has_open(st, TAG_TEMPLATE)) {
+            close_template_element(b);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_HEAD:
+        if (mode == MODE_IN_HEAD) {
+            close_head(b);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_BODY:
+        if (mode == MODE_IN_BODY) {
+            generate_implied_end_tags(st);
+            if (stack_top_atom(st) != TAG_BODY)
+                tree_parse_error(PARSE_ERR_END_TAG_WITH_UNCLOSED_ELEMENTS);
+            stack_pop_until(st, TAG_BODY);
+            b->mode = MODE_AFTER_BODY;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_FORM:
+        if (mode == MODE_IN_BODY) {
+            end_form(b);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_P:
+    case TAG_LI:
+    case TAG_DD:
+    case TAG_DT:
+        if (mode == MODE_IN_BODY) {
+            end_implied(b);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_TABLE:
+        if (has_element_in_table_scope(st, TAG_TABLE)) {
+            if (mode == MODE_IN_CELL) {
+                formatting_clear_to_marker(&b->fmt);
+            }
+            stack_pop_until(st, TAG_TABLE);
+            b->mode = MODE_IN_BODY;
+        }
+        return STEP_DONE;
+    case TAG_TR:
+        if (mode == MODE_IN_ROW && has_element_in_table_scope(st, TAG_TR)) {
+            stack_pop_until(st, TAG_TR);
+            b->mode = stack_has_open_table_section(st) ? MODE_IN_TABLE_BODY : MODE_IN_TABLE;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_TD:
+    case TAG_TH:
+        if (mode == MODE_IN_CELL && has_element_in_table_scope(st, b->atom)) {
+            stack_pop_until(st, b->atom);
+            formatting_clear_to_marker(&b->fmt);
+            b->mode = MODE_IN_ROW;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        if (mode == MODE_IN_CELL && has_element_in_table_scope(st, b->atom)) {
+            close_cell(st, &b->fmt);
+            stack_pop_until(st, b->atom);
+            b->mode = MODE_IN_TABLE;
+            return STEP_DONE;
+        }
+        if ((mode == MODE_IN_TABLE || mode == MODE_IN_TABLE_BODY) &&
+            has_element_in_table_scope(st, b->atom)) {
+            stack_pop_until(st, b->atom);
+            b->mode = MODE_IN_TABLE;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_CAPTION:
+        if (mode == MODE_IN_CAPTION && has_element_in_table_scope(st, TAG_CAPTION)) {
+            stack_pop_until(st, TAG_CAPTION);
+            formatting_clear_to_marker(&b->fmt);
+            b->mode = MODE_IN_TABLE;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_SELECT:
+        if (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE) {
+            if (!has_element_in_select_scope(st, TAG_SELECT)) {
+                tree_parse_error(PARSE_ERR_UNEXPECTED_END_TAG);
+                return STEP_DONE;
             }
+            stack_pop_until(st, TAG_SELECT);
+            b->mode = reset_insertion_mode_from_stack(st);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_APPLET:
+    case TAG_MARQUEE:
+    case TAG_OBJECT:
+        if (has_element_in_scope(st, b->atom)) {
+            generate_implied_end_tags(st);
+            stack_pop_until(st, b->atom);
+            formatting_clear_to_marker(&b->fmt);
+        }
+        return STEP_DONE;
+    case TAG_HTML:
+        stack_pop_until(st, TAG_HTML);
+        if (mode == MODE_AFTER_BODY) {
+            b->mode = MODE_AFTER_AFTER_BODY;
+        }
+        return STEP_DONE;
+    default:
+        break;
+    }
+    return end_tag_other(b, t);
+}
 
-            if (mode == MODE_TEXT) {
-                if (t.type == TOKEN_CHARACTER) {
-                    if (t.data && t.data[0] != '\0') {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_TEXT, NULL, t.data);
-                        node_append_child(parent, n);
-                    }
-                    break;
-                }
-                if (t.type == TOKEN_END_TAG) {
-                    stack_pop(&st);
-                    mode = original_insertion_mode;
-                    break;
-                }
-                if (t.type == TOKEN_EOF) {
-                    tree_parse_error("eof-in-text");
-                    stack_pop(&st);
-                    mode = original_insertion_mode;
-                    reprocess = 1;
-                    continue;
-                }
-                break;
+static const mode_handlers document_modes[MODE_COUNT] = {
+    [MODE_INITIAL] = {
+        [TOKEN_DOCTYPE] = initial_doctype, [TOKEN_START_TAG] = initial_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = initial_char, [TOKEN_EOF] = initial_eof,
+    },
+    [MODE_BEFORE_HTML] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = before_html_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = before_html_char, [TOKEN_EOF] = before_html_eof,
+    },
+    [MODE_IN_HEAD] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_head_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = in_head_char, [TOKEN_EOF] = in_head_eof,
+    },
+    [MODE_IN_HEAD_NOSCRIPT] = {
+        [TOKEN_DOCTYPE] = noscript_doctype, [TOKEN_START_TAG] = noscript_start,
+        [TOKEN_END_TAG] = noscript_end, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = noscript_char, [TOKEN_EOF] = noscript_eof,
+    },
+    [MODE_IN_BODY] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_body_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = in_body_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_TABLE] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_table_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = in_table_char, [TOKEN_EOF] = eof_in_table,
+    },
+    [MODE_IN_TABLE_TEXT] = {
+        [TOKEN_DOCTYPE] = table_text_flush, [TOKEN_START_TAG] = table_text_flush,
+        [TOKEN_END_TAG] = table_text_flush, [TOKEN_COMMENT] = table_text_flush,
+        [TOKEN_CHARACTER] = table_text_char, [TOKEN_EOF] = table_text_flush,
+    },
+    [MODE_IN_ROW] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_row_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = table_rows_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_CELL] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_cell_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = table_rows_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_TABLE_BODY] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_table_body_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = table_rows_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_CAPTION] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_caption_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_SELECT] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_select_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = eof_in_table,
+    },
+    [MODE_IN_SELECT_IN_TABLE] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = in_select_in_table_start,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = eof_in_table,
+    },
+    [MODE_IN_TEMPLATE] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = template_start,
+        [TOKEN_END_TAG] = template_end, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = template_char, [TOKEN_EOF] = template_eof,
+    },
+    [MODE_TEXT] = {
+        [TOKEN_DOCTYPE] = ignore_token, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = text_end, [TOKEN_COMMENT] = ignore_token,
+        [TOKEN_CHARACTER] = text_char, [TOKEN_EOF] = text_eof,
+    },
+    [MODE_AFTER_BODY] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = after_body_char, [TOKEN_EOF] = stop_parsing,
+    },
+    [MODE_AFTER_AFTER_BODY] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = after_body_char, [TOKEN_EOF] = stop_parsing,
+    },
+};
+
+/* ---- Fragment modes (WHATWG §14.4) ----
+ * The fragment parser never creates html, head or body elements, and
+ * its table modes foster parent without reconstructing formatting. */
+
+/* Start tags in table, table body or row context that are not table
+ * elements. */
+static void fragment_table_start_foster(tree_builder *b, token *t) {
+    if (b->atom == TAG_TEMPLATE) {
+        insert_template_fostered(b, t);
+        return;
+    }
+    node *n = node_create(NODE_ELEMENT, t->name ? t->name : "", NULL);
+    attach_attrs_take(n, t);
+    foster_insert(&b->st, b->doc, n);
+    if (!t->self_closing && !tag_is(b->atom, TP_VOID)) {
+        stack_push(&b->st, n);
+    }
+    link_form_owner(b, n);
+}
+
+static step_result fragment_in_head_start(tree_builder *b, token *t) {
+    switch (b->atom) {
+    case TAG_TEMPLATE:
+        insert_template(b, t);
+        return STEP_DONE;
+    case TAG_NOSCRIPT:
+        stack_push(&b->st, insert_element(b, t));
+        b->mode = MODE_IN_HEAD_NOSCRIPT;
+        return STEP_DONE;
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_HEAD)) {
+        b->mode = MODE_IN_BODY;
+        return STEP_REPROCESS;
+    }
+    return STEP_DONE;
+}
+
+static step_result fragment_in_body_start(tree_builder *b, token *t) {
+    handle_in_body_start_fragment(b, t);
+    return STEP_DONE;
+}
+
+static step_result fragment_in_body_char(tree_builder *b, token *t) {
+    if (!t->data || t->data[0] == '\0') return STEP_DONE;
+    if (is_all_whitespace(t->data)) {
+        node *parent = current_node(&b->st, b->doc);
+        if (parent) {
+            reconstruct_active_formatting(&b->st, &b->fmt, parent);
+        }
+        return STEP_DONE;
+    }
+    return body_text(b, t);
+}
+
+static step_result fragment_in_table_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    node *n;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start_fragment(b, t);
+        return STEP_DONE;
+    }
+    switch (b->atom) {
+    case TAG_CAPTION:
+        stack_push(st, insert_element(b, t));
+        formatting_push_marker(&b->fmt);
+        b->mode = MODE_IN_CAPTION;
+        return STEP_DONE;
+    case TAG_COLGROUP:
+        stack_push(st, insert_element(b, t));
+        return STEP_DONE;
+    case TAG_COL:
+        insert_element(b, t);
+        return STEP_DONE;
+    case TAG_SELECT:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_SELECT_IN_TABLE;
+        return STEP_DONE;
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_TABLE_BODY;
+        return STEP_DONE;
+    case TAG_TR:
+    case TAG_TD:
+    case TAG_TH: {
+        /* Implicit <tbody> then reprocess in IN_TABLE_BODY */
+        node *parent = current_node(st, b->doc);
+        n = node_create(NODE_ELEMENT, "tbody", NULL);
+        node_append_child(parent, n);
+        stack_push(st, n);
+        b->mode = MODE_IN_TABLE_BODY;
+        return STEP_REPROCESS;
+    }
+    /* <input type=hidden>: insert directly, do NOT foster parent */
+    case TAG_INPUT: {
+        const char *tv = find_attr(t->attrs, t->attr_count, "type");
+        if (tv && strcasecmp(tv, "hidden") == 0) {
+            tree_parse_error(PARSE_ERR_UNEXPECTED_START_TAG_IN_TABLE);
+            n = insert_element(b, t);
+            if (!in_template_context(st) && b->form_element_pointer) {
+                n->form_owner = b->form_element_pointer;
             }
+            return STEP_DONE;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_TABLE)) {
+        fragment_table_start_foster(b, t);
+    }
+    return STEP_DONE;
+}
 
-            /* ---- In head noscript mode (WHATWG §13.2.6.4.4) ---- */
-            if (mode == MODE_IN_HEAD_NOSCRIPT) {
-                if (t.type == TOKEN_DOCTYPE) {
-                    tree_parse_error("stray-doctype-in-head-noscript");
-                    break;
-                }
-                if (t.type == TOKEN_COMMENT) {
-                    parent = current_node(&st, doc);
-                    n = node_create(NODE_COMMENT, NULL, t.data ? t.data : "");
-                    node_append_child(parent, n);
-                    break;
-                }
-                if (t.type == TOKEN_CHARACTER) {
-                    if (t.data && is_all_whitespace(t.data)) break;
-                    tree_parse_error("char-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                if (t.type == TOKEN_START_TAG) {
-                    if (t.name && strcmp(t.name, "html") == 0) {
-                        tree_parse_error("unexpected-start-tag");
-                        break;
-                    }
-                    if (t.name && is_head_noscript_element(t.name)) {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t.name, NULL);
-                        attach_attrs(n, t.attrs, t.attr_count);
-                        node_append_child(parent, n);
-                        if (!t.self_closing && !is_void_element(t.name) &&
-                            strcmp(t.name, "basefont") != 0 && strcmp(t.name, "bgsound") != 0) {
-                            stack_push(&st, n);
-                        }
-                        if (tz.state == TOKENIZE_RCDATA || tz.state == TOKENIZE_RAWTEXT || tz.state == TOKENIZE_SCRIPT_DATA) {
-                            original_insertion_mode = mode;
-                            mode = MODE_TEXT;
-                        }
-                        break;
-                    }
-                    if (t.name && (strcmp(t.name, "head") == 0 || strcmp(t.name, "noscript") == 0)) {
-                        tree_parse_error("unexpected-start-tag-in-head-noscript");
-                        break;
-                    }
-                    tree_parse_error("unexpected-start-tag-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                if (t.type == TOKEN_END_TAG) {
-                    if (t.name && strcmp(t.name, "noscript") == 0) {
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "br") == 0) {
-                        tree_parse_error("end-tag-br-in-head-noscript");
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        reprocess = 1;
-                        continue;
-                    }
-                    tree_parse_error("unexpected-end-tag-in-head-noscript");
-                    break;
-                }
-                if (t.type == TOKEN_EOF) {
-                    tree_parse_error("eof-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                break;
+static step_result fragment_in_table_body_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start_fragment(b, t);
+        return STEP_DONE;
+    }
+    switch (b->atom) {
+    case TAG_TR:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_ROW;
+        return STEP_DONE;
+    case TAG_TD:
+    case TAG_TH: {
+        node *parent = current_node(st, b->doc);
+        node *tr = node_create(NODE_ELEMENT, "tr", NULL);
+        node_append_child(parent, tr);
+        stack_push(st, tr);
+        node *cell = node_create(NODE_ELEMENT, t->name, NULL);
+        attach_attrs_take(cell, t);
+        node_append_child(tr, cell);
+        stack_push(st, cell);
+        formatting_push_marker(&b->fmt);
+        b->mode = MODE_IN_CELL;
+        return STEP_DONE;
+    }
+    default:
+        break;
+    }
+    if (!tag_is(b->atom, TP_TABLE)) {
+        fragment_table_start_foster(b, t);
+    }
+    return STEP_DONE;
+}
+
+static step_result fragment_in_row_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start_fragment(b, t);
+        return STEP_DONE;
+    }
+    if (tag_is(b->atom, TP_CELL)) {
+        stack_push(st, insert_element(b, t));
+        formatting_push_marker(&b->fmt);
+        b->mode = MODE_IN_CELL;
+        return STEP_DONE;
+    }
+    if (!tag_is(b->atom, TP_TABLE)) {
+        fragment_table_start_foster(b, t);
+    }
+    return STEP_DONE;
+}
+
+static step_result fragment_in_cell_start(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    if (current_node_outside_table(st)) {
+        handle_in_body_start_fragment(b, t);
+        return STEP_DONE;
+    }
+    switch (b->atom) {
+    case TAG_TD:
+    case TAG_TH:
+        close_cell(st, &b->fmt);
+        b->mode = MODE_IN_ROW;
+        return STEP_REPROCESS;
+    case TAG_SELECT:
+        stack_push(st, insert_element(b, t));
+        b->mode = MODE_IN_SELECT_IN_TABLE;
+        return STEP_DONE;
+    default:
+        handle_in_body_start_fragment(b, t);
+        return STEP_DONE;
+    }
+}
+
+static step_result fragment_in_caption_start(tree_builder *b, token *t) {
+    switch (b->atom) {
+    case TAG_TABLE:
+        stack_pop_until(&b->st, TAG_CAPTION);
+        b->mode = MODE_IN_TABLE;
+        return STEP_REPROCESS;
+    case TAG_TEMPLATE:
+        insert_template(b, t);
+        return STEP_DONE;
+    default:
+        insert_element_open(b, t);
+        return STEP_DONE;
+    }
+}
+
+static step_result fragment_end_tag(tree_builder *b, token *t) {
+    node_stack *st = &b->st;
+    insertion_mode mode = b->mode;
+    switch (b->atom) {
+    case TAG_TEMPLATE:
+        if (stack_has_open(st, TAG_TEMPLATE)) {
+            close_template_element(b);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_FORM:
+        if (mode == MODE_IN_BODY) {
+            end_form(b);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_P:
+    case TAG_LI:
+    case TAG_DD:
+    case TAG_DT:
+        if (mode == MODE_IN_BODY) {
+            end_implied(b);
+            return STEP_DONE;
+        }
+        break;
+    case TAG_TABLE:
+        if (has_element_in_table_scope(st, TAG_TABLE)) {
+            if (mode == MODE_IN_CELL) {
+                formatting_clear_to_marker(&b->fmt);
             }
+            stack_pop_until(st, TAG_TABLE);
+            b->mode = MODE_IN_BODY;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_TD:
+    case TAG_TH:
+        if (mode == MODE_IN_CELL && has_element_in_table_scope(st, b->atom)) {
+            stack_pop_until(st, b->atom);
+            formatting_clear_to_marker(&b->fmt);
+            b->mode = MODE_IN_ROW;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_TR:
+        if (mode == MODE_IN_ROW && has_element_in_table_scope(st, TAG_TR)) {
+            stack_pop_until(st, TAG_TR);
+            b->mode = stack_has_open_table_section(st) ? MODE_IN_TABLE_BODY : MODE_IN_TABLE;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_TBODY:
+    case TAG_THEAD:
+    case TAG_TFOOT:
+        if (mode == MODE_IN_TABLE_BODY && has_element_in_table_scope(st, b->atom)) {
+            stack_pop_until(st, b->atom);
+            b->mode = MODE_IN_TABLE;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_CAPTION:
+        if (mode == MODE_IN_CAPTION && has_element_in_table_scope(st, TAG_CAPTION)) {
+            stack_pop_until(st, TAG_CAPTION);
+            formatting_clear_to_marker(&b->fmt);
+            b->mode = MODE_IN_TABLE;
+            return STEP_DONE;
+        }
+        break;
+    case TAG_SELECT:
+        if (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE) {
+            if (!has_element_in_select_scope(st, TAG_SELECT)) {
+                tree_parse_error(PARSE_ERR_UNEXPECTED_END_TAG);
+                return STEP_DONE;
+            }
+            stack_pop_until(st, TAG_SELECT);
+            b->mode = reset_insertion_mode_from_stack(st);
+            return STEP_DONE;
+        }
+        break;
+    default:
+        break;
+    }
+    return end_tag_other(b, t);
+}
 
-            /* ---- EOF handling (WHATWG §13.2.6.5 "The end") ---- */
-            if (t.type == TOKEN_EOF) {
-                switch (mode) {
-                    case MODE_INITIAL:
-                        tree_parse_error("eof-before-doctype");
-                        dmode = DOC_QUIRKS;
-                        mode = MODE_BEFORE_HTML;
-                        reprocess = 1;
-                        continue;
-                    case MODE_BEFORE_HTML:
-                        ensure_body(doc, &st, &html, &body);
-                        mode = MODE_IN_BODY;
-                        reprocess = 1;
-                        continue;
-                    case MODE_IN_HEAD_NOSCRIPT:
-                        tree_parse_error("eof-in-head-noscript");
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        reprocess = 1;
-                        continue;
-                    case MODE_IN_HEAD:
-                        close_head(&st, &head, &mode);
-                        reprocess = 1;
-                        continue;
-                    case MODE_IN_TEMPLATE:
-                        goto stop_parsing;
-                    case MODE_IN_BODY:
-                    case MODE_IN_CAPTION:
-                    case MODE_IN_CELL:
-                    case MODE_IN_ROW:
-                    case MODE_IN_TABLE_BODY:
-                        if (template_mode_top > 0) {
-                            mode = MODE_IN_TEMPLATE;
-                            reprocess = 1;
-                            continue;
-                        }
-                        for (size_t si = 0; si < st.size; si++) {
-                            node *sn = st.items[si];
-                            if (sn && sn->name && !is_eof_expected_element(sn->name)) {
-                                tree_parse_error("eof-with-open-elements");
-                                break;
-                            }
-                        }
-                        goto stop_parsing;
-                    case MODE_IN_TABLE:
-                    case MODE_IN_SELECT:
-                    case MODE_IN_SELECT_IN_TABLE:
-                        if (template_mode_top > 0) {
-                            mode = MODE_IN_TEMPLATE;
-                            reprocess = 1;
-                            continue;
-                        }
-                        {
-                            node *cur = current_node(&st, doc);
-                            if (cur && cur->name && strcmp(cur->name, "html") != 0)
-                                tree_parse_error("eof-in-table");
-                        }
-                        goto stop_parsing;
-                    case MODE_AFTER_BODY:
-                    case MODE_AFTER_AFTER_BODY:
-                    default:
-                        goto stop_parsing;
+/* Modes a fragment context never starts in keep a row so a reset
+ * insertion mode still lands on a handler. */
+static const mode_handlers fragment_modes[MODE_COUNT] = {
+    [MODE_INITIAL] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = stop_parsing,
+    },
+    [MODE_BEFORE_HTML] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = stop_parsing,
+    },
+    [MODE_IN_HEAD] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = fragment_in_head_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = stop_parsing,
+    },
+    [MODE_IN_HEAD_NOSCRIPT] = {
+        [TOKEN_DOCTYPE] = noscript_doctype, [TOKEN_START_TAG] = noscript_start,
+        [TOKEN_END_TAG] = noscript_end, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = noscript_char, [TOKEN_EOF] = noscript_eof,
+    },
+    [MODE_IN_BODY] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = fragment_in_body_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = fragment_in_body_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_TABLE] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = fragment_in_table_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = in_table_char, [TOKEN_EOF] = eof_in_table,
+    },
+    [MODE_IN_TABLE_TEXT] = {
+        [TOKEN_DOCTYPE] = table_text_flush, [TOKEN_START_TAG] = table_text_flush,
+        [TOKEN_END_TAG] = table_text_flush, [TOKEN_COMMENT] = table_text_flush,
+        [TOKEN_CHARACTER] = table_text_char, [TOKEN_EOF] = table_text_flush,
+    },
+    [MODE_IN_ROW] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = fragment_in_row_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = table_rows_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_CELL] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = fragment_in_cell_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = table_rows_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_TABLE_BODY] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = fragment_in_table_body_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = table_rows_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_CAPTION] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = fragment_in_caption_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = eof_in_body,
+    },
+    [MODE_IN_SELECT] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = in_select_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = eof_in_table,
+    },
+    [MODE_IN_SELECT_IN_TABLE] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = in_select_start,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = eof_in_table,
+    },
+    [MODE_IN_TEMPLATE] = {
+        [TOKEN_DOCTYPE] = stray_doctype, [TOKEN_START_TAG] = template_start,
+        [TOKEN_END_TAG] = template_end, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = template_char, [TOKEN_EOF] = template_eof,
+    },
+    [MODE_TEXT] = {
+        [TOKEN_DOCTYPE] = ignore_token, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = text_end, [TOKEN_COMMENT] = ignore_token,
+        [TOKEN_CHARACTER] = text_char, [TOKEN_EOF] = text_eof,
+    },
+    [MODE_AFTER_BODY] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = stop_parsing,
+    },
+    [MODE_AFTER_AFTER_BODY] = {
+        [TOKEN_DOCTYPE] = stop_parsing, [TOKEN_START_TAG] = ignore_token,
+        [TOKEN_END_TAG] = fragment_end_tag, [TOKEN_COMMENT] = insert_comment,
+        [TOKEN_CHARACTER] = plain_char, [TOKEN_EOF] = stop_parsing,
+    },
+};
+
+/* ============================================================================
+ * Tree construction dispatch
+ * ============================================================================ */
+
+static void tree_builder_init(tree_builder *b, node *doc,
+                              const mode_handlers *modes) {
+    b->doc = doc;
+    stack_init(&b->st);
+    b->fmt = (formatting_list){0};
+    stack_link_formatting(&b->st, &b->fmt);
+    b->mode = MODE_INITIAL;
+    b->original_insertion_mode = MODE_INITIAL;
+    b->template_mode_top = 0;
+    b->dmode = DOC_NO_QUIRKS;
+    b->html = NULL;
+    b->head = NULL;
+    b->body = NULL;
+    b->form_element_pointer = NULL;
+    b->table_text_has_non_ws = 0;
+    b->context = NULL;
+    b->tz = NULL;
+    b->modes = modes;
+    b->atom = TAG_UNKNOWN;
+    b->confidence = ENC_CONFIDENCE_TENTATIVE;
+    b->change_encoding = NULL;
+}
+
+/* Run t through tree construction: the build filter, foreign content,
+ * then the current insertion mode's handler until one consumes it. Never
+ * returns STEP_REPROCESS or STEP_DONE_NO_TEXT. */
+static step_result builder_step(tree_builder *b, token *t) {
+    if (t->type < TOKEN_DOCTYPE || t->type > TOKEN_EOF) return STEP_STOP;
+    b->atom = (t->type == TOKEN_START_TAG || t->type == TOKEN_END_TAG)
+              ? tag_atom_lookup(t->name) : TAG_UNKNOWN;
+
+    while (1) {
+        if (filter_stops(b->mode, b->original_insertion_mode, b->head))
+            return STEP_STOP;
+        if (filter_skips_token(t, &b->st, b->mode))
+            return STEP_DONE;
+
+        /* Foreign content check */
+        node *acn = stack_top(&b->st);
+        if (acn && acn->ns != NS_HTML) {
+            int fc_reprocess = 0;
+            if (process_in_foreign_content(t->type, t->name, t->data,
+                    t->self_closing, t->attrs, t->attr_count,
+                    &b->st, &b->fmt, b->doc, &b->mode, &fc_reprocess, b->context)) {
+                /* Reset tokenizer if SVG <title> was handled in foreign
+                   content — the tokenizer already switched to RCDATA
+                   but SVG title is an HTML integration point, not RCDATA. */
+                if (b->tz && t->type == TOKEN_START_TAG && b->atom == TAG_TITLE &&
+                    acn->ns == NS_SVG && !fc_reprocess) {
+                    b->tz->state = TOKENIZE_DATA;
+                    b->tz->raw_tag[0] = '\0';
                 }
+                if (fc_reprocess) continue;
+                return STEP_DONE;
             }
+        }
 
-            switch (t.type) {
-                case TOKEN_DOCTYPE:
-                    if (mode != MODE_INITIAL) {
-                        tree_parse_error("stray-doctype");
-                        break;
-                    }
-                    n = node_create(NODE_DOCTYPE, t.name ? t.name : "", NULL);
-                    node_append_child(doc, n);
-                    dmode = determine_doc_mode(&t);
-                    mode = MODE_BEFORE_HTML;
-                    break;
-                case TOKEN_START_TAG:
-                    if (mode == MODE_INITIAL) {
-                        tree_parse_error("missing-doctype");
-                        dmode = DOC_QUIRKS;
-                        mode = MODE_BEFORE_HTML;
-                    }
-                    if (mode == MODE_BEFORE_HTML) {
-                        if (t.name && strcmp(t.name, "html") == 0) {
-                            html = ensure_html(doc, &st, &html);
-                            attach_attrs(html, t.attrs, t.attr_count);
-                            mode = MODE_IN_HEAD;
-                            break;
-                        }
-                        html = ensure_html(doc, &st, &html);
-                        if (t.name && strcmp(t.name, "head") == 0) {
-                            head = node_create(NODE_ELEMENT, "head", NULL);
-                            attach_attrs(head, t.attrs, t.attr_count);
-                            node_append_child(html, head);
-                            stack_push(&st, head);
-                            mode = MODE_IN_HEAD;
-                            break;
-                        }
-                        body = ensure_body(doc, &st, &html, &body);
-                        mode = MODE_IN_BODY;
-                        reprocess = 1;
-                        break;
-                    }
-                    if (mode == MODE_IN_HEAD) {
-                        if (t.name && strcmp(t.name, "head") == 0) {
-                            if (!head) {
-                                head = node_create(NODE_ELEMENT, "head", NULL);
-                                attach_attrs(head, t.attrs, t.attr_count);
-                                node_append_child(ensure_html(doc, &st, &html), head);
-                                stack_push(&st, head);
-                            } else {
-                                tree_parse_error("unexpected-start-tag");
-                            }
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "body") == 0) {
-                            close_head(&st, &head, &mode);
-                            body = ensure_body(doc, &st, &html, &body);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "template") == 0) {
-                            parent = current_node(&st, doc);
-                            node *tmpl = create_template_element(t.attrs, t.attr_count);
-                            if (!tmpl) break;
-                            node_append_child(parent, tmpl);
-                            open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                  tmpl, t.self_closing);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "noscript") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "noscript", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_HEAD_NOSCRIPT;
-                            break;
-                        }
-                        if (!is_head_element(t.name)) {
-                            close_head(&st, &head, &mode);
-                            reprocess = 1;
-                            break;
-                        }
-                    }
-                    if (is_table_mode(mode)) {
-                        node *cur = current_node(&st, doc);
-                        if (cur && cur->name && !is_table_element(cur->name)) {
-                            handle_in_body_start(t.name, t.self_closing, doc, &st, &html, &body, &fmt, &mode,
-                                                 template_mode_stack, &template_mode_top, dmode,
-                                                 t.attrs, t.attr_count, &form_element_pointer);
-                            break;
-                        }
-                    }
-                    if (mode == MODE_IN_BODY) {
-                        handle_in_body_start(t.name, t.self_closing, doc, &st, &html, &body, &fmt, &mode,
-                                             template_mode_stack, &template_mode_top, dmode,
-                                             t.attrs, t.attr_count, &form_element_pointer);
-                        break;
-                    }
-                    if (mode == MODE_IN_TABLE) {
-                        if (t.name && strcmp(t.name, "form") == 0) {
-                            if (form_element_pointer && !in_template_context(&st)) {
-                                tree_parse_error("unexpected-start-tag");
-                                break;
-                            }
-                            tree_parse_error("foster-parenting");
-                            node *table = NULL;
-                            node *fp = foster_parent(&st, doc, &table);
-                            n = node_create(NODE_ELEMENT, "form", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            if (table && fp == table->parent) {
-                                node_insert_before(fp, n, table);
-                            } else {
-                                node_append_child(fp, n);
-                            }
-                            if (!in_template_context(&st)) {
-                                form_element_pointer = n;
-                            }
-                            stack_push(&st, n);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "caption") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "caption", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CAPTION;
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "colgroup") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "colgroup", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "col") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "col", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "select") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "select", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_SELECT_IN_TABLE;
-                            break;
-                        }
-                        if (t.name && is_table_section_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_TABLE_BODY;
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "tr") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "tr", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_ROW;
-                            break;
-                        }
-                        if (t.name && is_cell_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        /* <input type=hidden>: insert directly, do NOT foster parent */
-                        if (t.name && strcmp(t.name, "input") == 0) {
-                            const char *tv = find_attr(t.attrs, t.attr_count, "type");
-                            if (tv && strcasecmp(tv, "hidden") == 0) {
-                                tree_parse_error("unexpected-start-tag-in-table");
-                                parent = current_node(&st, doc);
-                                n = node_create(NODE_ELEMENT, "input", NULL);
-                                attach_attrs(n, t.attrs, t.attr_count);
-                                node_append_child(parent, n);
-                                if (!in_template_context(&st) && form_element_pointer) {
-                                    n->form_owner = form_element_pointer;
-                                }
-                                break;
-                            }
-                        }
-                        if (!is_table_element(t.name)) {
-                            if (t.name && strcmp(t.name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t.attrs, t.attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t.self_closing);
-                                break;
-                            }
-                            fmt_tag ft = fmt_tag_from_name(t.name);
-                            node *table = NULL;
-                            node *fp = foster_parent(&st, doc, &table);
-                            if (ft != FMT_NONE) {
-                                reconstruct_active_formatting(&st, &fmt, fp);
-                            }
-                            n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            if (table && fp == table->parent) {
-                                node_insert_before(fp, n, table);
-                            } else {
-                                node_append_child(fp, n);
-                            }
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                                if (ft != FMT_NONE) formatting_push(&fmt, ft, n);
-                            }
-                            if (is_form_associated_element(t.name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_HEAD) {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                        attach_attrs(n, t.attrs, t.attr_count);
-                        node_append_child(parent, n);
-                        if (!t.self_closing && !is_void_element(t.name)) {
-                            stack_push(&st, n);
-                        }
-                        /* WHATWG §13.2.3.5: change the encoding */
-                        if (t.name && strcmp(t.name, "meta") == 0 &&
-                            confidence == ENC_CONFIDENCE_TENTATIVE && change_encoding) {
-                            const char *meta_enc = extract_meta_charset(t.attrs, t.attr_count);
-                            if (meta_enc && (!doc->encoding || strcmp(meta_enc, doc->encoding) != 0)) {
-                                *change_encoding = meta_enc;
-                                token_free(&t);
-                                text_buffer_free(&table_text);
-                                node_free(doc);
-                                return NULL;
-                            }
-                        }
-                    } else if (mode == MODE_IN_TABLE_BODY) {
-                        if (t.name && is_table_section_element(t.name)) {
-                            if (stack_has_open_table_section(&st)) {
-                                stack_pop_until(&st, "thead");
-                                stack_pop_until(&st, "tbody");
-                                stack_pop_until(&st, "tfoot");
-                            }
-                            mode = MODE_IN_TABLE;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "tr") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "tr", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_ROW;
-                            break;
-                        }
-                        if (t.name && is_cell_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            node *tr = node_create(NODE_ELEMENT, "tr", NULL);
-                            node_append_child(parent, tr);
-                            stack_push(&st, tr);
-                            node *cell = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(cell, t.attrs, t.attr_count);
-                            node_append_child(tr, cell);
-                            stack_push(&st, cell);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        if (!is_table_element(t.name)) {
-                            if (t.name && strcmp(t.name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t.attrs, t.attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t.self_closing);
-                                break;
-                            }
-                            fmt_tag ft = fmt_tag_from_name(t.name);
-                            node *table = NULL;
-                            node *fp = foster_parent(&st, doc, &table);
-                            if (ft != FMT_NONE) {
-                                reconstruct_active_formatting(&st, &fmt, fp);
-                            }
-                            n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            if (table && fp == table->parent) {
-                                node_insert_before(fp, n, table);
-                            } else {
-                                node_append_child(fp, n);
-                            }
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                                if (ft != FMT_NONE) formatting_push(&fmt, ft, n);
-                            }
-                            if (is_form_associated_element(t.name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_ROW) {
-                        if (t.name && is_cell_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        if (t.name && is_table_section_element(t.name)) {
-                            if (stack_has_open_named(&st, "tr")) {
-                                stack_pop_until(&st, "tr");
-                            }
-                            mode = MODE_IN_TABLE_BODY;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (!is_table_element(t.name)) {
-                            if (t.name && strcmp(t.name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t.attrs, t.attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t.self_closing);
-                                break;
-                            }
-                            fmt_tag ft = fmt_tag_from_name(t.name);
-                            node *table = NULL;
-                            node *fp = foster_parent(&st, doc, &table);
-                            if (ft != FMT_NONE) {
-                                reconstruct_active_formatting(&st, &fmt, fp);
-                            }
-                            n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            if (table && fp == table->parent) {
-                                node_insert_before(fp, n, table);
-                            } else {
-                                node_append_child(fp, n);
-                            }
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                                if (ft != FMT_NONE) formatting_push(&fmt, ft, n);
-                            }
-                            if (is_form_associated_element(t.name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_CELL) {
-                        if (t.name && strcmp(t.name, "select") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "select", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_SELECT_IN_TABLE;
-                            break;
-                        }
-                        if (t.name && is_cell_element(t.name)) {
-                            close_cell(&st, &fmt);
-                            mode = MODE_IN_ROW;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t.name && (strcmp(t.name, "tr") == 0 || is_table_section_element(t.name))) {
-                            close_cell(&st, &fmt);
-                            mode = MODE_IN_TABLE_BODY;
-                            reprocess = 1;
-                            break;
-                        }
-                        handle_in_body_start(t.name, t.self_closing, doc, &st, &html, &body, &fmt, &mode,
-                                             template_mode_stack, &template_mode_top, dmode,
-                                             t.attrs, t.attr_count, &form_element_pointer);
-                    } else if (mode == MODE_IN_CAPTION) {
-                        if (t.name && (strcmp(t.name, "table") == 0 || strcmp(t.name, "tr") == 0 || is_table_section_element(t.name))) {
-                            stack_pop_until(&st, "caption");
-                            mode = MODE_IN_TABLE;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "template") == 0) {
-                            parent = current_node(&st, doc);
-                            node *tmpl = create_template_element(t.attrs, t.attr_count);
-                            if (!tmpl) break;
-                            node_append_child(parent, tmpl);
-                            open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                  tmpl, t.self_closing);
-                            break;
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                        attach_attrs(n, t.attrs, t.attr_count);
-                        node_append_child(parent, n);
-                        if (!t.self_closing && !is_void_element(t.name)) {
-                            stack_push(&st, n);
-                        }
-                        break;
-                    } else if (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE) {
-                        if (t.name && strcmp(t.name, "select") == 0) {
-                            tree_parse_error("unexpected-start-tag");
-                            if (!has_element_in_select_scope(&st, "select")) break;
-                            stack_pop_until(&st, "select");
-                            mode = reset_insertion_mode_from_stack(&st);
-                            break;
-                        }
-                        /* Auto-close an open <option> before a new <option> or <optgroup> */
-                        if (t.name && strcmp(t.name, "option") == 0 && stack_has_open_named(&st, "option")) {
-                            stack_pop_until(&st, "option");
-                        }
-                        /* Auto-close an open <optgroup>: <option> closes it, <optgroup> closes it */
-                        if (t.name && strcmp(t.name, "optgroup") == 0 && stack_has_open_named(&st, "optgroup")) {
-                            if (stack_has_open_named(&st, "option")) {
-                                stack_pop_until(&st, "option");
-                            }
-                            stack_pop_until(&st, "optgroup");
-                        }
-                        if (t.name && is_select_child_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                            }
-                            break;
-                        }
-                        if (mode == MODE_IN_SELECT_IN_TABLE && t.name && is_table_element(t.name)) {
-                            tree_parse_error("unexpected-start-tag-in-select");
-                            if (!has_element_in_select_scope(&st, "select")) break;
-                            stack_pop_until(&st, "select");
-                            mode = reset_insertion_mode_from_stack(&st);
-                            reprocess = 1;
-                            break;
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                        attach_attrs(n, t.attrs, t.attr_count);
-                        node_append_child(parent, n);
-                        if (!t.self_closing && !is_void_element(t.name)) {
-                            stack_push(&st, n);
-                        }
-                    }
-                    break;
-                case TOKEN_END_TAG:
-                    if (t.name && strcmp(t.name, "template") == 0 && stack_has_open_named(&st, "template")) {
-                        close_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top);
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "head") == 0 && mode == MODE_IN_HEAD) {
-                        close_head(&st, &head, &mode);
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "body") == 0 && mode == MODE_IN_BODY) {
-                        generate_implied_end_tags(&st);
-                        {
-                            node *cur = stack_top(&st);
-                            if (!cur || !cur->name || strcmp(cur->name, "body") != 0)
-                                tree_parse_error("end-tag-with-unclosed-elements");
-                        }
-                        stack_pop_until(&st, "body");
-                        mode = MODE_AFTER_BODY;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "form") == 0 && mode == MODE_IN_BODY) {
-                        if (!in_template_context(&st)) {
-                            node *node_ptr = form_element_pointer;
-                            form_element_pointer = NULL;
-                            int idx;
-                            if (node_ptr == NULL || !has_element_in_scope(&st, "form")) {
-                                tree_parse_error("unexpected-end-tag");
-                                if (node_ptr == NULL) break;
-                                if (!has_element_in_scope(&st, "form")) break;
-                            }
-                            generate_implied_end_tags(&st);
-                            idx = stack_index_of(&st, node_ptr);
-                            if (idx >= 0) {
-                                stack_remove_at(&st, idx);
-                            }
-                        } else {
-                             if (!has_element_in_scope(&st, "form")) {
-                                 tree_parse_error("unexpected-end-tag");
-                             } else {
-                                 generate_implied_end_tags(&st);
-                                 stack_pop_until(&st, "form");
-                             }
-                        }
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "p") == 0 && mode == MODE_IN_BODY) {
-                        if (!has_element_in_button_scope(&st, "p")) {
-                            tree_parse_error("unexpected-end-tag");
-                            node *parent = current_node(&st, doc);
-                            node *pn = node_create(NODE_ELEMENT, "p", NULL);
-                            node_append_child(parent, pn);
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, "p");
-                        stack_pop_until(&st, "p");
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "li") == 0 && mode == MODE_IN_BODY) {
-                        if (!has_element_in_list_item_scope(&st, "li")) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, "li");
-                        stack_pop_until(&st, "li");
-                        break;
-                    }
-                    if (t.name && (strcmp(t.name, "dd") == 0 || strcmp(t.name, "dt") == 0) && mode == MODE_IN_BODY) {
-                        if (!has_element_in_scope(&st, t.name)) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, t.name);
-                        stack_pop_until(&st, t.name);
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "table") == 0) {
-                        if (!has_element_in_table_scope(&st, "table")) {
-                            break;
-                        }
-                        if (mode == MODE_IN_CELL) {
-                            formatting_clear_to_marker(&fmt);
-                        }
-                        stack_pop_until(&st, "table");
-                        mode = MODE_IN_BODY;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "tr") == 0 && mode == MODE_IN_ROW && has_element_in_table_scope(&st, "tr")) {
-                        stack_pop_until(&st, "tr");
-                        mode = stack_has_open_table_section(&st) ? MODE_IN_TABLE_BODY : MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t.name && is_cell_element(t.name) && mode == MODE_IN_CELL && has_element_in_table_scope(&st, t.name)) {
-                        stack_pop_until(&st, t.name);
-                        formatting_clear_to_marker(&fmt);
-                        mode = MODE_IN_ROW;
-                        break;
-                    }
-                    if (t.name && is_table_section_element(t.name) && mode == MODE_IN_CELL && has_element_in_table_scope(&st, t.name)) {
-                        close_cell(&st, &fmt);
-                        stack_pop_until(&st, t.name);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t.name && is_table_section_element(t.name) && (mode == MODE_IN_TABLE || mode == MODE_IN_TABLE_BODY) &&
-                        has_element_in_table_scope(&st, t.name)) {
-                        stack_pop_until(&st, t.name);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "caption") == 0 && mode == MODE_IN_CAPTION && has_element_in_table_scope(&st, "caption")) {
-                        stack_pop_until(&st, "caption");
-                        formatting_clear_to_marker(&fmt);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "select") == 0 && (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE)) {
-                        if (!has_element_in_select_scope(&st, "select")) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        stack_pop_until(&st, "select");
-                        mode = reset_insertion_mode_from_stack(&st);
-                        break;
-                    }
-                    if (t.name && (strcmp(t.name, "applet") == 0 || strcmp(t.name, "marquee") == 0 || strcmp(t.name, "object") == 0)) {
-                        if (!has_element_in_scope(&st, t.name)) break;
-                        generate_implied_end_tags(&st);
-                        stack_pop_until(&st, t.name);
-                        formatting_clear_to_marker(&fmt);
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "html") == 0) {
-                        stack_pop_until(&st, "html");
-                        if (mode == MODE_AFTER_BODY) {
-                            mode = MODE_AFTER_AFTER_BODY;
-                        }
-                        break;
-                    }
-                    if (mode == MODE_IN_BODY ||
-                        mode == MODE_IN_CELL ||
-                        mode == MODE_IN_TABLE ||
-                        mode == MODE_IN_TABLE_BODY ||
-                        mode == MODE_IN_ROW ||
-                        mode == MODE_IN_CAPTION) {
-                        if (adoption_agency(&st, &fmt, doc, t.name)) {
-                            break;
-                        }
-                    }
-                    if (t.name && !has_element_in_scope(&st, t.name)) {
-                        tree_parse_error("unexpected-end-tag");
-                        break;
-                    }
-                    stack_pop_until(&st, t.name);
-                    break;
-                case TOKEN_COMMENT:
-                    parent = current_node(&st, doc);
-                    n = node_create(NODE_COMMENT, NULL, t.data ? t.data : "");
-                    node_append_child(parent, n);
-                    break;
-                case TOKEN_CHARACTER:
-                    if (t.data && t.data[0] != '\0') {
-                        if (is_all_whitespace(t.data)) {
-                            if (mode == MODE_IN_BODY) {
-                                if (!in_template_context(&st)) {
-                                    ensure_body(doc, &st, &html, &body);
-                                }
-                                parent = current_node(&st, doc);
-                                if (parent) {
-                                    reconstruct_active_formatting(&st, &fmt, parent);
-                                }
-                            }
-                            break;
-                        }
-                        if (mode == MODE_AFTER_BODY || mode == MODE_AFTER_AFTER_BODY) {
-                            tree_parse_error("unexpected-token-after-body");
-                            mode = MODE_IN_BODY;
-                        }
-                        if (mode == MODE_IN_HEAD) {
-                            if (!head) {
-                                head = node_create(NODE_ELEMENT, "head", NULL);
-                                node_append_child(ensure_html(doc, &st, &html), head);
-                                stack_push(&st, head);
-                            }
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_TEXT, NULL, t.data);
-                            node_append_child(parent, n);
-                            break;
-                        }
-                        if (mode == MODE_IN_TABLE) {
-                            mode = MODE_IN_TABLE_TEXT;
-                            text_buffer_append(&table_text, t.data);
-                            if (!is_all_whitespace(t.data)) table_text_has_non_ws = 1;
-                            break;
-                        }
-                        if (is_table_mode(mode)) {
-                            node *cur = current_node(&st, doc);
-                            if (mode == MODE_IN_CELL || (cur && cur->name && !is_table_element(cur->name))) {
-                                parent = cur;
-                                n = node_create(NODE_TEXT, NULL, t.data);
-                                node_append_child(parent, n);
-                                break;
-                            }
-                            n = node_create(NODE_TEXT, NULL, t.data);
-                            foster_insert(&st, doc, n);
-                            break;
-                        }
-                        if (mode == MODE_INITIAL) {
-                            tree_parse_error("missing-doctype");
-                            dmode = DOC_QUIRKS;
-                            mode = MODE_BEFORE_HTML;
-                        }
-                        if (mode == MODE_INITIAL || mode == MODE_BEFORE_HTML) {
-                            ensure_body(doc, &st, &html, &body);
-                            mode = MODE_IN_BODY;
-                        }
-                        if (mode == MODE_IN_BODY) {
-                            parent = current_node(&st, doc);
-                            reconstruct_active_formatting(&st, &fmt, parent);
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_TEXT, NULL, t.data);
-                        node_append_child(parent, n);
-                    }
-                    break;
-                case TOKEN_EOF:
-                default:
-                    goto stop_parsing;
-            }
+        step_result r = b->modes[b->mode][t->type](b, t);
+        if (r == STEP_REPROCESS) continue;
+        /* After processing a start tag: enter MODE_TEXT if needed */
+        if (r == STEP_DONE && t->type == TOKEN_START_TAG && b->mode != MODE_TEXT &&
+            text_state_pending(b)) {
+            b->original_insertion_mode = b->mode;
+            b->mode = MODE_TEXT;
+        }
+        return r == STEP_DONE_NO_TEXT ? STEP_DONE : r;
+    }
+}
+
+/* The table text a document ends in, inserted as "in table text" would
+ * have on the next token. */
+static void flush_table_text_at_stop(tree_builder *b) {
+    if (b->mode == MODE_IN_TABLE_TEXT && b->table_text.len > 0) {
+        node *text = node_create(NODE_TEXT, NULL, b->table_text.data ? b->table_text.data : "");
+        if (b->table_text_has_non_ws) {
+            foster_insert(&b->st, b->doc, text);
+        } else {
+            node_append_child(current_node(&b->st, b->doc), text);
+        }
+        text_buffer_clear(&b->table_text);
+        b->table_text_has_non_ws = 0;
+    }
+}
+
+/* ============================================================================
+ * Parser contexts
+ * A builder and tokenizer scratch that outlive one build. Only sizes are
+ * reset between documents; the table-text buffer and the tokenizer's
+ * buffers keep what they have grown to.
+ * ============================================================================ */
+
+struct parser_ctx {
+    tree_builder b;
+    tokenizer_scratch scratch;
+    int busy;                   /* a build on this thread is using b */
+};
+
+static _Thread_local parser_ctx *parser_ctx_current;
+
+parser_ctx *parser_ctx_create(void) {
+    return (parser_ctx *)calloc(1, sizeof(parser_ctx));
+}
+
+void parser_ctx_free(parser_ctx *ctx) {
+    if (!ctx) return;
+    text_buffer_free(&ctx->b.table_text);
+    tokenizer_scratch_free(&ctx->scratch);
+    free(ctx);
+}
+
+parser_ctx *parser_ctx_attach(parser_ctx *ctx) {
+    parser_ctx *prev = parser_ctx_current;
+    parser_ctx_current = ctx;
+    tokenizer_scratch_attach(ctx ? &ctx->scratch : NULL);
+    return prev;
+}
 
-            /* After processing a start tag: enter MODE_TEXT if needed */
-            if (!reprocess && t.type == TOKEN_START_TAG && mode != MODE_TEXT &&
-                (tz.state == TOKENIZE_RCDATA || tz.state == TOKENIZE_RAWTEXT || tz.state == TOKENIZE_SCRIPT_DATA)) {
-                original_insertion_mode = mode;
-                mode = MODE_TEXT;
-            }
-        }
+/* The attached context's builder when it is free, else local, whose
+ * table-text buffer is borrowed from keep if given (see
+ * fragment_parser). tree_builder_init() does the rest of the reset. */
+static tree_builder *builder_acquire(tree_builder *local, text_buffer *keep) {
+    parser_ctx *ctx = parser_ctx_current;
+    if (ctx && !ctx->busy) {
+        ctx->busy = 1;
+        return &ctx->b;
+    }
+    if (keep)
+        local->table_text = *keep;
+    else
+        text_buffer_init(&local->table_text);
+    return local;
+}
 
-        token_free(&t);
+static void builder_release(tree_builder *b, text_buffer *keep) {
+    parser_ctx *ctx = parser_ctx_current;
+    if (ctx && b == &ctx->b) {
+        text_buffer_clear(&b->table_text);
+        ctx->busy = 0;
+    } else if (keep) {
+        text_buffer_clear(&b->table_text);
+        *keep = b->table_text;
+    } else {
+        text_buffer_free(&b->table_text);
+    }
+}
+
+/* Tree construction over a pre-tokenized stream. encoding/confidence and
+ * change_encoding behave as in build_tree_from_input(); encoding may be
+ * NULL for the plain build_tree_from_tokens() entry point. opts may be
+ * NULL (threads/pipelined are ignored here). */
+static node *build_tree_from_token_array(token *tokens, size_t count,
+                                         const char *encoding,
+                                         encoding_confidence confidence,
+                                         const char **change_encoding,
+                                         const tree_build_options *opts) {
+    node *doc = node_create(NODE_DOCUMENT, NULL, NULL);
+    tree_builder local, *b;
+    prune_list pruned = {0};
+    size_t i;
+
+    if (change_encoding) *change_encoding = NULL;
+    if (!doc) return NULL;
+    build_filter = opts;
+    if (opts && opts->build_index)
+        node_index_build(doc);
+    if (encoding) {
+        doc->encoding = node_mem_strdup(doc, encoding);
+        doc->enc_confidence = confidence;
     }
+    b = builder_acquire(&local, NULL);
+    tree_builder_init(b, doc, document_modes);
+    b->confidence = confidence;
+    b->change_encoding = change_encoding;
 
-stop_parsing:
-    while (st.size > 0) stack_pop(&st);
-    if (mode == MODE_IN_TABLE_TEXT && table_text.len > 0) {
-        node *text = node_create(NODE_TEXT, NULL, table_text.data ? table_text.data : "");
-        if (table_text_has_non_ws) {
-            foster_insert(&st, doc, text);
-        } else {
-            node_append_child(current_node(&st, doc), text);
+    for (i = 0; i < count; ++i) {
+        token *t = &tokens[i];
+        PARSE_STAT_ADD(tokens[t->type], 1);
+        if (parse_errors_current)
+            parse_errors_note_token(t, PARSE_ERROR_NO_OFFSET, 0, 0);
+
+        step_result r = builder_step(b, t);
+        if (r == STEP_ABORT) {
+            builder_release(b, NULL);
+            free(pruned.items);
+            build_filter = NULL;
+            node_free(doc);
+            return NULL;
+        }
+        if (r == STEP_STOP) break;
+
+        /* Pruned elements open on start tags; reclaim runs between the
+         * other tokens, spread out by prune_reclaim() */
+        if (opts && opts->prune_elements && t->type != TOKEN_CHARACTER) {
+            if (t->type == TOKEN_START_TAG)
+                prune_track(&pruned, &b->st);
+            if (pruned.count)
+                prune_reclaim(&pruned, &b->st, &b->fmt, b->form_element_pointer);
         }
-        text_buffer_clear(&table_text);
-        table_text_has_non_ws = 0;
     }
-    text_buffer_free(&table_text);
-    token_free(&t);
+
+    while (b->st.size > 0) stack_pop(&b->st);
+    builder_release(b, NULL);
+    prune_finish(&pruned, doc);
+    build_filter = NULL;
     return doc;
 }
 
-node *build_fragment_from_input(const char *input, const char *context_tag,
-                                const char *encoding,
-                                encoding_confidence confidence,
-                                const char **change_encoding) {
+node *build_tree_from_tokens(const token *tokens, size_t count) {
+    /* The caller keeps its tokens: nothing is moved out of them */
+    build_borrows_tokens = 1;
+    node *doc = build_tree_from_token_array((token *)tokens, count, NULL,
+                                            ENC_CONFIDENCE_CERTAIN, NULL, NULL);
+    build_borrows_tokens = 0;
+    return doc;
+}
+
+/* Tree construction straight from input. With opts->pipelined set the
+ * tokenizer runs ahead on a second thread (see tokenizer_pipeline_start). */
+static node *build_tree_from_input_impl(const char *input, const char *encoding,
+                                        encoding_confidence confidence,
+                                        const char **change_encoding,
+                                        const tree_build_options *opts) {
     tokenizer tz;
+    tokenizer_pipeline *pipeline = NULL;
     token t;
     node *doc = node_create(NODE_DOCUMENT, NULL, NULL);
-    node_stack st;
-    insertion_mode mode = MODE_IN_BODY;
-    insertion_mode original_insertion_mode = MODE_IN_BODY;
-    formatting_list fmt = {0};
-    insertion_mode template_mode_stack[64];
-    int template_mode_top = 0;
-    text_buffer table_text = {0};
-    int table_text_has_non_ws = 0;
-    node *form_element_pointer = NULL;
-    node *context = NULL;
+    tree_builder local, *b;
+    prune_list pruned = {0};
+    size_t consumed = 0;    /* input offset of the token being processed */
 
     if (change_encoding) *change_encoding = NULL;
     if (!doc) return NULL;
-    /* WHATWG §14.4 step 5: inherit encoding from context element's document */
+    build_filter = opts;
+    if (opts && opts->build_index)
+        node_index_build(doc);
     if (encoding)
-        doc->encoding = strdup(encoding);
+        doc->encoding = node_mem_strdup(doc, encoding);
     doc->enc_confidence = confidence;
-    stack_init(&st);
-    text_buffer_init(&table_text);
-
-    if (context_tag && context_tag[0]) {
-        if (strcmp(context_tag, "template") == 0) {
-            context = create_template_element(NULL, 0);
-            if (!context) { node_free(doc); return NULL; }
-            open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top, context, 0);
-        } else {
-            context = node_create(NODE_ELEMENT, context_tag, NULL);
-            if (!context) { node_free(doc); return NULL; }
-            stack_push(&st, context);
-            mode = fragment_mode_for_context(context_tag);
-        }
-    }
-
-    tokenizer_init_with_context(&tz, input, context_tag);
+    b = builder_acquire(&local, NULL);
+    tree_builder_init(b, doc, document_modes);
+    b->confidence = confidence;
+    b->change_encoding = change_encoding;
+    b->tz = &tz;
+    tokenizer_init(&tz, input);
+    if (opts && opts->pipelined)
+        pipeline = tokenizer_pipeline_start(&tz);
 
     while (1) {
         token_init(&t);
         /* Set CDATA flag based on whether current node is in foreign content */
         {
-            node *top = stack_top(&st);
+            node *top = stack_top(&b->st);
             tz.allow_cdata = (top && top->ns != NS_HTML) ? 1 : 0;
         }
-        tokenizer_next(&tz, &t);
+        consumed = tz.pos;
+        size_t token_line = tz.line, token_col = tz.col;
+        if (pipeline)
+            tokenizer_pipeline_next(pipeline, &tz, &t);
+        else
+            tokenizer_next(&tz, &t);
+        PARSE_STAT_ADD(tokens[t.type], 1);
+        if (parse_errors_current)
+            parse_errors_note_token(&t, consumed, token_line, token_col);
+
+        step_result r = builder_step(b, &t);
+        if (r == STEP_ABORT) {
+            token_free(&t);
+            builder_release(b, NULL);
+            tokenizer_pipeline_free(pipeline);
+            free(pruned.items);
+            build_filter = NULL;
+            node_free(doc);
+            return NULL;
+        }
+        if (r == STEP_STOP) break;
+
+        /* Pruned elements open on start tags; reclaim runs between the
+         * other tokens, spread out by prune_reclaim() */
+        if (opts && opts->prune_elements && t.type != TOKEN_CHARACTER) {
+            if (t.type == TOKEN_START_TAG)
+                prune_track(&pruned, &b->st);
+            if (pruned.count)
+                prune_reclaim(&pruned, &b->st, &b->fmt, b->form_element_pointer);
+        }
+        if (opts && opts->stop_when && t.type != TOKEN_EOF &&
+            opts->stop_when(&t, doc, opts->stop_ctx)) {
+            consumed = tz.pos;
+            break;
+        }
+        token_free(&t);
+    }
 
-        node *parent;
-        node *n = NULL;
-        int reprocess = 1;
-
-        while (reprocess) {
-            reprocess = 0;
-            parent = current_node(&st, doc);
-
-            /* Foreign content check */
-            {
-                node *acn = (st.size > 0) ? stack_top(&st) : NULL;
-                if (acn && acn->ns != NS_HTML) {
-                    int fc_reprocess = 0;
-                    if (process_in_foreign_content(t.type, t.name, t.data,
-                            t.self_closing, t.attrs, t.attr_count,
-                            &st, &fmt, doc, &mode, &fc_reprocess, context)) {
-                        /* Reset tokenizer if SVG <title> was handled in foreign
-                           content — tokenizer already switched to RCDATA. */
-                        if (t.type == TOKEN_START_TAG && t.name &&
-                            acn->ns == NS_SVG && strcmp(t.name, "title") == 0 &&
-                            !fc_reprocess) {
-                            tz.state = TOKENIZE_DATA;
-                            tz.raw_tag[0] = '\0';
-                        }
-                        if (fc_reprocess) { reprocess = 1; }
-                        continue;
-                    }
-                }
-            }
+    /* Pending table text is fostered relative to the open table */
+    flush_table_text_at_stop(b);
+    while (b->st.size > 0) stack_pop(&b->st);
+    builder_release(b, NULL);
+    token_free(&t);
+    tokenizer_pipeline_free(pipeline);
+    prune_finish(&pruned, doc);
+    build_filter = NULL;
+    if (opts && opts->consumed)
+        *opts->consumed = consumed;
+    return doc;
+}
 
-            if (mode == MODE_IN_TEMPLATE) {
-                if (handle_in_template_mode(&t, doc, &st, &fmt, &mode,
-                                            template_mode_stack, &template_mode_top,
-                                            &reprocess)) {
-                    if (reprocess) continue;
-                    break;
-                }
-            }
+node *build_tree_from_input(const char *input, const char *encoding,
+                            encoding_confidence confidence,
+                            const char **change_encoding) {
+    return build_tree_from_input_opts(input, encoding, confidence,
+                                      change_encoding, NULL);
+}
 
-            if (mode == MODE_IN_TABLE_TEXT) {
-                if (t.type == TOKEN_CHARACTER && t.data && t.data[0] != '\0') {
-                    text_buffer_append(&table_text, t.data);
-                    if (!is_all_whitespace(t.data)) table_text_has_non_ws = 1;
-                    break;
-                }
-                if (table_text.len > 0) {
-                    node *text = node_create(NODE_TEXT, NULL, table_text.data ? table_text.data : "");
-                    if (table_text_has_non_ws) {
-                        tree_parse_error("foster-parenting");
-                        foster_insert(&st, doc, text);
-                    } else {
-                        node_append_child(current_node(&st, doc), text);
-                    }
-                }
-                text_buffer_clear(&table_text);
-                table_text_has_non_ws = 0;
-                mode = MODE_IN_TABLE;
-                reprocess = 1;
-                continue;
-            }
+/* Foreign content feeds back into the tokenizer (allow_cdata, the SVG
+ * <title> reset), which a pre-tokenized stream cannot honour. */
+static int input_has_foreign_root(const char *input) {
+    const char *p = input;
+    while ((p = strchr(p, '<')) != NULL) {
+        p++;
+        if (strncasecmp(p, "svg", 3) == 0 || strncasecmp(p, "math", 4) == 0)
+            return 1;
+    }
+    return 0;
+}
 
-            if (mode == MODE_TEXT) {
-                if (t.type == TOKEN_CHARACTER) {
-                    if (t.data && t.data[0] != '\0') {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_TEXT, NULL, t.data);
-                        node_append_child(parent, n);
-                    }
-                    break;
-                }
-                if (t.type == TOKEN_END_TAG) {
-                    stack_pop(&st);
-                    mode = original_insertion_mode;
-                    break;
-                }
-                if (t.type == TOKEN_EOF) {
-                    tree_parse_error("eof-in-text");
-                    stack_pop(&st);
-                    mode = original_insertion_mode;
-                    reprocess = 1;
-                    continue;
-                }
-                break;
-            }
+node *build_tree_from_input_opts(const char *input, const char *encoding,
+                                 encoding_confidence confidence,
+                                 const char **change_encoding,
+                                 const tree_build_options *opts) {
+    tree_build_options o = {0};
+    if (opts) o = *opts;
+    parse_error_sink *prev_errors = o.errors ? parse_errors_attach(o.errors)
+                                             : NULL;
+    if (parse_errors_enabled()) {
+        /* Errors must be reported in order from the builder's thread */
+        o.threads = 1;
+        o.pipelined = 0;
+    }
+    if (o.stop_after_head || o.stop_when)
+        o.threads = 1;  /* stopping early only pays off tokenizing lazily */
+
+    parse_stats *prev_stats = o.stats ? parse_stats_attach(o.stats) : NULL;
+    uint64_t start_ns = PARSE_STATS_ON ? parse_stats_now_ns() : 0;
+    node *doc = NULL;
+    size_t count = 0;
+    token *tokens = NULL;
+    if (input && o.threads > 1 && !input_has_foreign_root(input))
+        tokens = tokenizer_tokenize_parallel(input, o.threads, &count);
+    if (tokens) {
+        doc = build_tree_from_token_array(tokens, count, encoding, confidence,
+                                          change_encoding, &o);
+        if (doc && o.consumed)
+            *o.consumed = strlen(input);
+        for (size_t i = 0; i < count; i++)
+            token_free(&tokens[i]);
+        free(tokens);
+    } else {
+        doc = build_tree_from_input_impl(input, encoding, confidence,
+                                         change_encoding, &o);
+    }
 
-            /* ---- In head noscript mode (WHATWG §13.2.6.4.4) ---- */
-            if (mode == MODE_IN_HEAD_NOSCRIPT) {
-                if (t.type == TOKEN_DOCTYPE) {
-                    tree_parse_error("stray-doctype-in-head-noscript");
-                    break;
-                }
-                if (t.type == TOKEN_COMMENT) {
-                    parent = current_node(&st, doc);
-                    n = node_create(NODE_COMMENT, NULL, t.data ? t.data : "");
-                    node_append_child(parent, n);
-                    break;
-                }
-                if (t.type == TOKEN_CHARACTER) {
-                    if (t.data && is_all_whitespace(t.data)) break;
-                    tree_parse_error("char-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                if (t.type == TOKEN_START_TAG) {
-                    if (t.name && strcmp(t.name, "html") == 0) {
-                        tree_parse_error("unexpected-start-tag");
-                        break;
-                    }
-                    if (t.name && is_head_noscript_element(t.name)) {
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t.name, NULL);
-                        attach_attrs(n, t.attrs, t.attr_count);
-                        node_append_child(parent, n);
-                        if (!t.self_closing && !is_void_element(t.name) &&
-                            strcmp(t.name, "basefont") != 0 && strcmp(t.name, "bgsound") != 0) {
-                            stack_push(&st, n);
-                        }
-                        if (tz.state == TOKENIZE_RCDATA || tz.state == TOKENIZE_RAWTEXT || tz.state == TOKENIZE_SCRIPT_DATA) {
-                            original_insertion_mode = mode;
-                            mode = MODE_TEXT;
-                        }
-                        break;
-                    }
-                    if (t.name && (strcmp(t.name, "head") == 0 || strcmp(t.name, "noscript") == 0)) {
-                        tree_parse_error("unexpected-start-tag-in-head-noscript");
-                        break;
-                    }
-                    tree_parse_error("unexpected-start-tag-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                if (t.type == TOKEN_END_TAG) {
-                    if (t.name && strcmp(t.name, "noscript") == 0) {
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "br") == 0) {
-                        tree_parse_error("end-tag-br-in-head-noscript");
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        reprocess = 1;
-                        continue;
-                    }
-                    tree_parse_error("unexpected-end-tag-in-head-noscript");
-                    break;
-                }
-                if (t.type == TOKEN_EOF) {
-                    tree_parse_error("eof-in-head-noscript");
-                    stack_pop(&st);
-                    mode = MODE_IN_HEAD;
-                    reprocess = 1;
-                    continue;
-                }
-                break;
-            }
+    if (PARSE_STATS_ON) {
+        PARSE_STAT_ADD(build_ns, parse_stats_now_ns() - start_ns);
+        if (!doc && change_encoding && *change_encoding)
+            PARSE_STAT_ADD(re_encodes, 1);
+    }
+    if (o.stats)
+        parse_stats_attach(prev_stats);
+    if (o.errors)
+        parse_errors_attach(prev_errors);
+    return doc;
+}
 
-            /* ---- EOF handling (WHATWG §13.2.6.5 "The end") ---- */
-            if (t.type == TOKEN_EOF) {
-                switch (mode) {
-                    case MODE_IN_HEAD_NOSCRIPT:
-                        tree_parse_error("eof-in-head-noscript");
-                        stack_pop(&st);
-                        mode = MODE_IN_HEAD;
-                        reprocess = 1;
-                        continue;
-                    case MODE_IN_TEMPLATE:
-                        goto stop_parsing;
-                    case MODE_IN_BODY:
-                    case MODE_IN_CAPTION:
-                    case MODE_IN_CELL:
-                    case MODE_IN_ROW:
-                    case MODE_IN_TABLE_BODY:
-                        if (template_mode_top > 0) {
-                            mode = MODE_IN_TEMPLATE;
-                            reprocess = 1;
-                            continue;
-                        }
-                        for (size_t si = 0; si < st.size; si++) {
-                            node *sn = st.items[si];
-                            if (sn && sn->name && !is_eof_expected_element(sn->name)) {
-                                tree_parse_error("eof-with-open-elements");
-                                break;
-                            }
-                        }
-                        goto stop_parsing;
-                    case MODE_IN_TABLE:
-                    case MODE_IN_SELECT:
-                    case MODE_IN_SELECT_IN_TABLE:
-                        if (template_mode_top > 0) {
-                            mode = MODE_IN_TEMPLATE;
-                            reprocess = 1;
-                            continue;
-                        }
-                        {
-                            node *cur = current_node(&st, doc);
-                            if (cur && cur->name && strcmp(cur->name, "html") != 0)
-                                tree_parse_error("eof-in-table");
-                        }
-                        goto stop_parsing;
-                    default:
-                        goto stop_parsing;
-                }
-            }
+node *build_tree_from_input_pipelined(const char *input, const char *encoding,
+                                      encoding_confidence confidence,
+                                      const char **change_encoding) {
+    tree_build_options opts = {0};
+    opts.pipelined = 1;
+    return build_tree_from_input_opts(input, encoding, confidence,
+                                      change_encoding, &opts);
+}
 
-            switch (t.type) {
-                case TOKEN_START_TAG:
-                    if (mode == MODE_IN_HEAD) {
-                        if (t.name && strcmp(t.name, "template") == 0) {
-                            parent = current_node(&st, doc);
-                            n = create_template_element(t.attrs, t.attr_count);
-                            if (!n) break;
-                            node_append_child(parent, n);
-                            open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                  n, t.self_closing);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "noscript") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "noscript", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_HEAD_NOSCRIPT;
-                            break;
-                        }
-                        if (t.name && !is_head_element(t.name)) {
-                            mode = MODE_IN_BODY;
-                            reprocess = 1;
-                            break;
-                        }
-                    }
-                    if (is_table_mode(mode)) {
-                        node *cur = current_node(&st, doc);
-                        if (cur && cur->name && !is_table_element(cur->name)) {
-                            handle_in_body_start_fragment(t.name, t.self_closing, doc, &st, &fmt, &mode,
-                                                          template_mode_stack, &template_mode_top,
-                                                          DOC_NO_QUIRKS, t.attrs, t.attr_count, &form_element_pointer);
-                            break;
-                        }
-                    }
-                    if (mode == MODE_IN_BODY) {
-                        handle_in_body_start_fragment(t.name, t.self_closing, doc, &st, &fmt, &mode,
-                                                      template_mode_stack, &template_mode_top,
-                                                      DOC_NO_QUIRKS, t.attrs, t.attr_count, &form_element_pointer);
-                        break;
-                    }
-                    if (mode == MODE_IN_TABLE) {
-                        if (t.name && strcmp(t.name, "caption") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "caption", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CAPTION;
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "colgroup") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "colgroup", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "col") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "col", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "select") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "select", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_SELECT_IN_TABLE;
-                            break;
-                        }
-                        if (t.name && is_table_section_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_TABLE_BODY;
-                            break;
-                        }
-                        if (t.name && (strcmp(t.name, "tr") == 0 || is_cell_element(t.name))) {
-                            /* Implicit <tbody> then reprocess in IN_TABLE_BODY */
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "tbody", NULL);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_TABLE_BODY;
-                            reprocess = 1;
-                            break;
-                        }
-                        /* <input type=hidden>: insert directly, do NOT foster parent */
-                        if (t.name && strcmp(t.name, "input") == 0) {
-                            const char *tv = find_attr(t.attrs, t.attr_count, "type");
-                            if (tv && strcasecmp(tv, "hidden") == 0) {
-                                tree_parse_error("unexpected-start-tag-in-table");
-                                parent = current_node(&st, doc);
-                                n = node_create(NODE_ELEMENT, "input", NULL);
-                                attach_attrs(n, t.attrs, t.attr_count);
-                                node_append_child(parent, n);
-                                if (!in_template_context(&st) && form_element_pointer) {
-                                    n->form_owner = form_element_pointer;
-                                }
-                                break;
-                            }
-                        }
-                        if (!is_table_element(t.name)) {
-                            if (t.name && strcmp(t.name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t.attrs, t.attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t.self_closing);
-                                break;
-                            }
-                            n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            foster_insert(&st, doc, n);
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                            }
-                            if (is_form_associated_element(t.name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_TABLE_BODY) {
-                        if (t.name && strcmp(t.name, "tr") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "tr", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_ROW;
-                            break;
-                        }
-                        if (t.name && is_cell_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            node *tr = node_create(NODE_ELEMENT, "tr", NULL);
-                            node_append_child(parent, tr);
-                            stack_push(&st, tr);
-                            node *cell = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(cell, t.attrs, t.attr_count);
-                            node_append_child(tr, cell);
-                            stack_push(&st, cell);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        if (!is_table_element(t.name)) {
-                            if (t.name && strcmp(t.name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t.attrs, t.attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t.self_closing);
-                                break;
-                            }
-                            n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            foster_insert(&st, doc, n);
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                            }
-                            if (is_form_associated_element(t.name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_ROW) {
-                        if (t.name && is_cell_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            formatting_push_marker(&fmt);
-                            mode = MODE_IN_CELL;
-                            break;
-                        }
-                        if (!is_table_element(t.name)) {
-                            if (t.name && strcmp(t.name, "template") == 0) {
-                                node *table = NULL;
-                                node *fp = foster_parent(&st, doc, &table);
-                                node *tmpl = create_template_element(t.attrs, t.attr_count);
-                                if (!tmpl) break;
-                                if (table && fp == table->parent) {
-                                    node_insert_before(fp, tmpl, table);
-                                } else {
-                                    node_append_child(fp, tmpl);
-                                }
-                                open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                      tmpl, t.self_closing);
-                                break;
-                            }
-                            n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            foster_insert(&st, doc, n);
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                            }
-                            if (is_form_associated_element(t.name) && form_element_pointer && !in_template_context(&st)) {
-                                n->form_owner = form_element_pointer;
-                            }
-                            break;
-                        }
-                    } else if (mode == MODE_IN_CELL) {
-                        if (t.name && is_cell_element(t.name)) {
-                            close_cell(&st, &fmt);
-                            mode = MODE_IN_ROW;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "select") == 0) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, "select", NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            stack_push(&st, n);
-                            mode = MODE_IN_SELECT_IN_TABLE;
-                            break;
-                        }
-                        handle_in_body_start_fragment(t.name, t.self_closing, doc, &st, &fmt, &mode,
-                                                      template_mode_stack, &template_mode_top,
-                                                      DOC_NO_QUIRKS, t.attrs, t.attr_count, &form_element_pointer);
-                    } else if (mode == MODE_IN_CAPTION) {
-                        if (t.name && strcmp(t.name, "table") == 0) {
-                            stack_pop_until(&st, "caption");
-                            mode = MODE_IN_TABLE;
-                            reprocess = 1;
-                            break;
-                        }
-                        if (t.name && strcmp(t.name, "template") == 0) {
-                            parent = current_node(&st, doc);
-                            node *tmpl = create_template_element(t.attrs, t.attr_count);
-                            if (!tmpl) break;
-                            node_append_child(parent, tmpl);
-                            open_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top,
-                                                  tmpl, t.self_closing);
-                            break;
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                        attach_attrs(n, t.attrs, t.attr_count);
-                        node_append_child(parent, n);
-                        if (!t.self_closing && !is_void_element(t.name)) {
-                            stack_push(&st, n);
-                        }
-                        break;
-                    } else if (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE) {
-                        if (t.name && strcmp(t.name, "select") == 0) {
-                            tree_parse_error("unexpected-start-tag");
-                            if (!has_element_in_select_scope(&st, "select")) break;
-                            stack_pop_until(&st, "select");
-                            mode = reset_insertion_mode_from_stack(&st);
-                            break;
-                        }
-                        /* Auto-close an open <option> before a new <option> or <optgroup> */
-                        if (t.name && strcmp(t.name, "option") == 0 && stack_has_open_named(&st, "option")) {
-                            stack_pop_until(&st, "option");
-                        }
-                        /* Auto-close an open <optgroup>: <option> closes it, <optgroup> closes it */
-                        if (t.name && strcmp(t.name, "optgroup") == 0 && stack_has_open_named(&st, "optgroup")) {
-                            if (stack_has_open_named(&st, "option")) {
-                                stack_pop_until(&st, "option");
-                            }
-                            stack_pop_until(&st, "optgroup");
-                        }
-                        if (t.name && is_select_child_element(t.name)) {
-                            parent = current_node(&st, doc);
-                            n = node_create(NODE_ELEMENT, t.name, NULL);
-                            attach_attrs(n, t.attrs, t.attr_count);
-                            node_append_child(parent, n);
-                            if (!t.self_closing && !is_void_element(t.name)) {
-                                stack_push(&st, n);
-                            }
-                            break;
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_ELEMENT, t.name ? t.name : "", NULL);
-                        attach_attrs(n, t.attrs, t.attr_count);
-                        node_append_child(parent, n);
-                        if (!t.self_closing && !is_void_element(t.name)) {
-                            stack_push(&st, n);
-                        }
-                    }
-                    break;
-                case TOKEN_END_TAG:
-                    /* </template>: pop content + template, restore saved mode */
-                    if (t.name && strcmp(t.name, "template") == 0 && stack_has_open_named(&st, "template")) {
-                        close_template_element(&st, &fmt, &mode, template_mode_stack, &template_mode_top);
-                        break;
-                    }
-                    /* Dedicated end tag handlers for implied-end-tag elements */
-                    if (t.name && strcmp(t.name, "form") == 0 && mode == MODE_IN_BODY) {
-                        if (!in_template_context(&st)) {
-                            node *node_ptr = form_element_pointer;
-                            form_element_pointer = NULL;
-                            int idx;
-                            if (node_ptr == NULL || !has_element_in_scope(&st, "form")) {
-                                tree_parse_error("unexpected-end-tag");
-                                if (node_ptr == NULL) break;
-                                if (!has_element_in_scope(&st, "form")) break;
-                            }
-                            generate_implied_end_tags(&st);
-                            idx = stack_index_of(&st, node_ptr);
-                            if (idx >= 0) {
-                                stack_remove_at(&st, idx);
-                            }
-                        } else {
-                             if (!has_element_in_scope(&st, "form")) {
-                                 tree_parse_error("unexpected-end-tag");
-                             } else {
-                                 generate_implied_end_tags(&st);
-                                 stack_pop_until(&st, "form");
-                             }
-                        }
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "p") == 0 && mode == MODE_IN_BODY) {
-                        if (!has_element_in_button_scope(&st, "p")) {
-                            tree_parse_error("unexpected-end-tag");
-                            node *parent = current_node(&st, doc);
-                            node *pn = node_create(NODE_ELEMENT, "p", NULL);
-                            node_append_child(parent, pn);
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, "p");
-                        stack_pop_until(&st, "p");
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "li") == 0 && mode == MODE_IN_BODY) {
-                        if (!has_element_in_list_item_scope(&st, "li")) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, "li");
-                        stack_pop_until(&st, "li");
-                        break;
-                    }
-                    if (t.name && (strcmp(t.name, "dd") == 0 || strcmp(t.name, "dt") == 0) && mode == MODE_IN_BODY) {
-                        if (!has_element_in_scope(&st, t.name)) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        generate_implied_end_tags_except(&st, t.name);
-                        stack_pop_until(&st, t.name);
-                        break;
-                    }
-                    /* End-tag mode transitions for table/cell/row/section/select/caption */
-                    if (t.name && strcmp(t.name, "table") == 0 && has_element_in_table_scope(&st, "table")) {
-                        if (mode == MODE_IN_CELL) {
-                            formatting_clear_to_marker(&fmt);
-                        }
-                        stack_pop_until(&st, "table");
-                        mode = MODE_IN_BODY;
-                        break;
-                    }
-                    if (t.name && is_cell_element(t.name) && (mode == MODE_IN_CELL) && has_element_in_table_scope(&st, t.name)) {
-                        stack_pop_until(&st, t.name);
-                        formatting_clear_to_marker(&fmt);
-                        mode = MODE_IN_ROW;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "tr") == 0 && mode == MODE_IN_ROW && has_element_in_table_scope(&st, "tr")) {
-                        stack_pop_until(&st, "tr");
-                        mode = stack_has_open_named(&st, "tbody") || stack_has_open_named(&st, "thead") || stack_has_open_named(&st, "tfoot")
-                               ? MODE_IN_TABLE_BODY : MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t.name && is_table_section_element(t.name) && mode == MODE_IN_TABLE_BODY && has_element_in_table_scope(&st, t.name)) {
-                        stack_pop_until(&st, t.name);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "caption") == 0 && mode == MODE_IN_CAPTION && has_element_in_table_scope(&st, "caption")) {
-                        stack_pop_until(&st, "caption");
-                        formatting_clear_to_marker(&fmt);
-                        mode = MODE_IN_TABLE;
-                        break;
-                    }
-                    if (t.name && strcmp(t.name, "select") == 0 && (mode == MODE_IN_SELECT || mode == MODE_IN_SELECT_IN_TABLE)) {
-                        if (!has_element_in_select_scope(&st, "select")) {
-                            tree_parse_error("unexpected-end-tag");
-                            break;
-                        }
-                        stack_pop_until(&st, "select");
-                        mode = reset_insertion_mode_from_stack(&st);
-                        break;
-                    }
-                    if (mode == MODE_IN_BODY ||
-                        mode == MODE_IN_CELL ||
-                        mode == MODE_IN_TABLE ||
-                        mode == MODE_IN_TABLE_BODY ||
-                        mode == MODE_IN_ROW ||
-                        mode == MODE_IN_CAPTION) {
-                        if (adoption_agency(&st, &fmt, doc, t.name)) {
-                            break;
-                        }
-                    }
-                    if (t.name && !has_element_in_scope(&st, t.name)) {
-                        tree_parse_error("unexpected-end-tag");
-                        break;
-                    }
-                    stack_pop_until(&st, t.name);
-                    break;
-                case TOKEN_COMMENT:
-                    parent = current_node(&st, doc);
-                    n = node_create(NODE_COMMENT, NULL, t.data ? t.data : "");
-                    node_append_child(parent, n);
-                    break;
-                case TOKEN_CHARACTER:
-                    if (t.data && t.data[0] != '\0') {
-                        if (is_all_whitespace(t.data)) {
-                            if (mode == MODE_IN_BODY) {
-                                parent = current_node(&st, doc);
-                                if (parent) {
-                                    reconstruct_active_formatting(&st, &fmt, parent);
-                                }
-                            }
-                            break;
-                        }
-                        if (mode == MODE_IN_TABLE) {
-                            mode = MODE_IN_TABLE_TEXT;
-                            text_buffer_append(&table_text, t.data);
-                            if (!is_all_whitespace(t.data)) table_text_has_non_ws = 1;
-                            break;
-                        }
-                        if (is_table_mode(mode)) {
-                            node *cur = current_node(&st, doc);
-                            if (mode == MODE_IN_CELL || (cur && cur->name && !is_table_element(cur->name))) {
-                                parent = cur;
-                                n = node_create(NODE_TEXT, NULL, t.data);
-                                node_append_child(parent, n);
-                                break;
-                            }
-                            n = node_create(NODE_TEXT, NULL, t.data);
-                            foster_insert(&st, doc, n);
-                            break;
-                        }
-                        if (mode == MODE_IN_BODY) {
-                            parent = current_node(&st, doc);
-                            reconstruct_active_formatting(&st, &fmt, parent);
-                        }
-                        parent = current_node(&st, doc);
-                        n = node_create(NODE_TEXT, NULL, t.data);
-                        node_append_child(parent, n);
-                    }
-                    break;
-                case TOKEN_EOF:
-                default:
-                    goto stop_parsing;
-            }
+node *build_tree_from_input_parallel(const char *input, const char *encoding,
+                                     encoding_confidence confidence,
+                                     const char **change_encoding,
+                                     int threads) {
+    tree_build_options opts = {0};
+    opts.threads = threads;
+    return build_tree_from_input_opts(input, encoding, confidence,
+                                      change_encoding, &opts);
+}
+
+/* ============================================================================
+ * Fragment parsing
+ * ============================================================================ */
+
+/* What a fragment parse takes from its context element, worked out once:
+ * the insertion mode and the tokenizer's starting state. */
+typedef struct {
+    const char *context_tag;    /* NULL or "" for no context */
+    int template_context;
+    insertion_mode mode;
+    tokenizer tz;               /* input not set */
+} fragment_setup;
+
+static void fragment_setup_init(fragment_setup *fs, const char *context_tag) {
+    fs->context_tag = context_tag;
+    fs->template_context = context_tag && strcmp(context_tag, "template") == 0;
+    fs->mode = (context_tag && context_tag[0] && !fs->template_context)
+                   ? fragment_mode_for_context(context_tag) : MODE_IN_BODY;
+    tokenizer_init_with_context(&fs->tz, NULL, context_tag);
+}
+
+/* table_text_keep, if given, lends the table-text buffer and gets it back
+ * (cleared, capacity kept) for the next fragment. */
+static node *parse_fragment(const char *input, const fragment_setup *fs,
+                            const char *encoding,
+                            encoding_confidence confidence,
+                            text_buffer *table_text_keep) {
+    tokenizer tz;
+    token t;
+    node *doc = node_create(NODE_DOCUMENT, NULL, NULL);
+    tree_builder local, *b;
+    node *context = NULL;
+    const char *context_tag = fs->context_tag;
 
-            /* After processing a start tag: enter MODE_TEXT if needed */
-            if (!reprocess && t.type == TOKEN_START_TAG && mode != MODE_TEXT &&
-                (tz.state == TOKENIZE_RCDATA || tz.state == TOKENIZE_RAWTEXT || tz.state == TOKENIZE_SCRIPT_DATA)) {
-                original_insertion_mode = mode;
-                mode = MODE_TEXT;
+    if (!doc) return NULL;
+    build_filter = NULL;
+    /* WHATWG §14.4 step 5: inherit encoding from context element's document */
+    if (encoding)
+        doc->encoding = node_mem_strdup(doc, encoding);
+    doc->enc_confidence = confidence;
+    b = builder_acquire(&local, table_text_keep);
+    tree_builder_init(b, doc, fragment_modes);
+    b->mode = MODE_IN_BODY;
+    b->original_insertion_mode = MODE_IN_BODY;
+    b->tz = &tz;
+
+    if (context_tag && context_tag[0]) {
+        if (fs->template_context) {
+            context = create_template_element(NULL);
+            if (!context) {
+                builder_release(b, table_text_keep);
+                node_free(doc);
+                return NULL;
+            }
+            open_template_element(b, context, 0);
+        } else {
+            context = node_create(NODE_ELEMENT, context_tag, NULL);
+            if (!context) {
+                builder_release(b, table_text_keep);
+                node_free(doc);
+                return NULL;
             }
+            stack_push(&b->st, context);
+            b->mode = fs->mode;
+        }
+    }
+    b->context = context;
+
+    tz = fs->tz;
+    tz.input = input ? input : "";
+    tz.len = strlen(tz.input);
+
+    while (1) {
+        token_init(&t);
+        /* Set CDATA flag based on whether current node is in foreign content */
+        {
+            node *top = stack_top(&b->st);
+            tz.allow_cdata = (top && top->ns != NS_HTML) ? 1 : 0;
         }
+        size_t token_pos = tz.pos, token_line = tz.line, token_col = tz.col;
+        tokenizer_next(&tz, &t);
+        PARSE_STAT_ADD(tokens[t.type], 1);
+        if (parse_errors_current)
+            parse_errors_note_token(&t, token_pos, token_line, token_col);
 
+        if (builder_step(b, &t) == STEP_STOP) break;
         token_free(&t);
     }
 
-stop_parsing:
-    while (st.size > 0) stack_pop(&st);
+    while (b->st.size > 0) stack_pop(&b->st);
     token_free(&t);
     if (context) {
         node *adopt = context;
@@ -4669,6 +4204,13 @@ stop_parsing:
             strcmp(context->first_child->name, "content") == 0) {
             adopt = context->first_child;
         }
+        /* Anything inserted after the context element was popped went
+         * straight into doc; only the context's children are the result */
+        while (doc->first_child) {
+            node *stray = doc->first_child;
+            node_remove_child(doc, stray);
+            node_free(stray);
+        }
         node *child = adopt->first_child;
         doc->first_child = child;
         doc->last_child = adopt->last_child;
@@ -4684,16 +4226,176 @@ stop_parsing:
         }
         node_free_shallow(context);
     }
-    if (mode == MODE_IN_TABLE_TEXT && table_text.len > 0) {
-        node *text = node_create(NODE_TEXT, NULL, table_text.data ? table_text.data : "");
-        if (table_text_has_non_ws) {
-            foster_insert(&st, doc, text);
-        } else {
-            node_append_child(current_node(&st, doc), text);
-        }
-        text_buffer_clear(&table_text);
-        table_text_has_non_ws = 0;
+    flush_table_text_at_stop(b);
+    builder_release(b, table_text_keep);
+    return doc;
+}
+
+node *build_fragment_from_input(const char *input, const char *context_tag,
+                                const char *encoding,
+                                encoding_confidence confidence,
+                                const char **change_encoding) {
+    fragment_setup fs;
+    if (change_encoding) *change_encoding = NULL;
+    fragment_setup_init(&fs, context_tag);
+    return parse_fragment(input, &fs, encoding, confidence, NULL);
+}
+
+struct fragment_parser {
+    fragment_setup setup;
+    char *context_tag;
+    char *encoding;
+    encoding_confidence confidence;
+    text_buffer table_text;
+};
+
+fragment_parser *fragment_parser_create(const char *context_tag,
+                                        const char *encoding,
+                                        encoding_confidence confidence) {
+    fragment_parser *fp = (fragment_parser *)calloc(1, sizeof(fragment_parser));
+    if (!fp) return NULL;
+    fp->context_tag = context_tag ? strdup(context_tag) : NULL;
+    fp->encoding = encoding ? strdup(encoding) : NULL;
+    if ((context_tag && !fp->context_tag) || (encoding && !fp->encoding)) {
+        fragment_parser_free(fp);
+        return NULL;
     }
-    text_buffer_free(&table_text);
+    fp->confidence = confidence;
+    fragment_setup_init(&fp->setup, fp->context_tag);
+    text_buffer_init(&fp->table_text);
+    return fp;
+}
+
+node *fragment_parser_parse(fragment_parser *fp, const char *input,
+                            node_arena *arena) {
+    if (!fp) return NULL;
+    node_arena *prev = node_arena_attach(arena);
+    node *doc = parse_fragment(input, &fp->setup, fp->encoding,
+                               fp->confidence, &fp->table_text);
+    node_arena_attach(prev);
     return doc;
 }
+
+void fragment_parser_free(fragment_parser *fp) {
+    if (!fp) return;
+    text_buffer_free(&fp->table_text);
+    free(fp->context_tag);
+    free(fp->encoding);
+    free(fp);
+}
+
+/* A batch keeps one fragment_parser per distinct context element, found
+ * by a linear scan: batches use a handful of contexts at most. */
+typedef struct {
+    fragment_parser **items;
+    size_t count;
+    size_t cap;
+} batch_parsers;
+
+static int same_context(const char *a, const char *b) {
+    if (!a || !b) return a == b;
+    return a == b || strcasecmp(a, b) == 0;
+}
+
+static fragment_parser *batch_parser_for(batch_parsers *ps,
+                                         const char *context_tag,
+                                         const char *encoding,
+                                         encoding_confidence confidence) {
+    for (size_t i = 0; i < ps->count; i++)
+        if (same_context(ps->items[i]->context_tag, context_tag))
+            return ps->items[i];
+    if (ps->count == ps->cap) {
+        size_t cap = ps->cap ? ps->cap * 2 : 8;
+        fragment_parser **items = (fragment_parser **)realloc(
+            ps->items, cap * sizeof(fragment_parser *));
+        if (!items) return NULL;
+        ps->items = items;
+        ps->cap = cap;
+    }
+    fragment_parser *fp = fragment_parser_create(context_tag, encoding,
+                                                 confidence);
+    if (fp) ps->items[ps->count++] = fp;
+    return fp;
+}
+
+node **build_fragment_batch(const fragment_batch_item *items, size_t count,
+                            const char *encoding,
+                            encoding_confidence confidence,
+                            node_arena *arena, fragment_batch_stats *stats) {
+    if (stats) memset(stats, 0, sizeof(*stats));
+    if (!arena || (count && !items)) return NULL;
+    tokenizer_global_init();
+    uint64_t start_ns = parse_stats_now_ns();
+    node **roots = (node **)node_arena_alloc(
+        arena, (count ? count : 1) * sizeof(node *));
+    if (!roots) return NULL;
+
+    /* Unless the caller keeps one on this thread, a context for the batch
+     * carries the tokenizer's buffers from fragment to fragment */
+    parser_ctx *own = parser_ctx_current ? NULL : parser_ctx_create();
+    parser_ctx *prev = own ? parser_ctx_attach(own) : NULL;
+    batch_parsers ps = { NULL, 0, 0 };
+    size_t failed = 0, bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        fragment_parser *fp = batch_parser_for(&ps, items[i].context_tag,
+                                               encoding, confidence);
+        const char *input = items[i].input ? items[i].input : "";
+        roots[i] = fp ? fragment_parser_parse(fp, input, arena) : NULL;
+        if (!roots[i]) failed++;
+        bytes += strlen(input);
+    }
+    for (size_t i = 0; i < ps.count; i++)
+        fragment_parser_free(ps.items[i]);
+    free(ps.items);
+    if (own) {
+        parser_ctx_attach(prev);
+        parser_ctx_free(own);
+    }
+
+    if (stats) {
+        stats->fragments = count;
+        stats->failed = failed;
+        stats->bytes = bytes;
+        stats->contexts = ps.count;
+        stats->arena_bytes = node_arena_used(arena);
+        stats->elapsed_ns = parse_stats_now_ns() - start_ns;
+    }
+    return roots;
+}
+
+/* ============================================================================
+ * Text extraction from the token stream
+ * The tokens drive a text_extractor (see tree.h) directly, with no tree.
+ * Tags are taken as written: there are no implied end tags or misnesting
+ * repairs, so on broken markup the result can differ from
+ * tree_extract_text() on the parsed document (an unclosed <template> or
+ * <noscript> hides the rest of the input, for instance).
+ * ============================================================================ */
+
+size_t extract_text_from_input(const char *input, text_sink sink, void *ctx) {
+    tokenizer tz;
+    text_extractor te;
+    token t;
+
+    tokenizer_init(&tz, input);
+    text_extractor_init(&te, sink, ctx);
+    while (1) {
+        token_init(&t);
+        tokenizer_next(&tz, &t);
+        if (t.type == TOKEN_EOF) break;
+        if (t.type == TOKEN_START_TAG && t.name) {
+            text_extractor_open(&te, t.name);
+        } else if (t.type == TOKEN_END_TAG && t.name) {
+            /* </br> is handled as <br> */
+            if (strcmp(t.name, "br") == 0)
+                text_extractor_open(&te, t.name);
+            else
+                text_extractor_close(&te, t.name);
+        } else if (t.type == TOKEN_CHARACTER && t.data) {
+            text_extractor_text(&te, t.data, strlen(t.data));
+        }
+        token_free(&t);
+    }
+    token_free(&t);
+    return te.emitted;
+}
@@ -59,4 +59,17 @@ printf '<!DOCTYPE html><html><head><title>Default UTF-8</title></head><body><p>S
     > "$DIR/encoding_default_utf8.html"
 echo "  Created encoding_default_utf8.html"
 
+# 9-11. Unlabeled legacy pages (no BOM, no meta) — statistical detection
+printf '<html><head><title>検出テスト</title></head><body><p>これは文字コードの指定がない日本語のページです。</p></body></html>' | \
+    iconv -f UTF-8 -t SHIFT_JIS > "$DIR/encoding_detect_sjis.html"
+echo "  Created encoding_detect_sjis.html"
+
+printf '<html><head><title>编码检测</title></head><body><p>这是一个没有声明字符编码的中文页面，我们的解析器应该可以自动识别。</p></body></html>' | \
+    iconv -f UTF-8 -t GBK > "$DIR/encoding_detect_gbk.html"
+echo "  Created encoding_detect_gbk.html"
+
+printf '<html><head><title>Проверка</title></head><body><p>Это страница на русском языке без указания кодировки.</p></body></html>' | \
+    iconv -f UTF-8 -t WINDOWS-1251 > "$DIR/encoding_detect_cp1251.html"
+echo "  Created encoding_detect_cp1251.html"
+
 echo "Done. All encoding test files generated."
@@ -10,12 +10,15 @@
 #   KNOWN – feature not yet implemented; failure is noted but
 #           does NOT count as a suite failure
 #
-# Usage:  bash tests/run_fragment_tests.sh [binary]
-# Default binary: ./parse_fragment_demo
+# Usage:  bash tests/run_fragment_tests.sh [binary [option...]]
+# Default binary: ./parse_fragment_demo; options (e.g. --arena) are
+# passed to it before the context and file.
 # ---------------------------------------------------------------
 set -uo pipefail
 
 BINARY="${1:-./parse_fragment_demo}"
+shift || true
+OPTIONS=("$@")
 PASS=0; FAIL=0; KNOWN=0
 
 if [ ! -x "$BINARY" ]; then
@@ -33,7 +36,7 @@ run() {
     local expected actual
 
     expected=$(cat)                                       # heredoc stdin
-    actual=$("$BINARY" "$context" "$file" 2>/dev/null) || true
+    actual=$("$BINARY" "${OPTIONS[@]}" "$context" "$file" 2>/dev/null) || true
 
     if [ "$actual" = "$expected" ]; then
         printf "  PASS  %s\n" "$label"
@@ -272,6 +275,23 @@ DOCUMENT encoding="UTF-8"
 EOF
 rm -f "$tmp_crlf"
 
+# ----------------------------------------------------------------
+# 14  Tokens after </body></html>
+#     Both end tags are ignored in fragment parsing, so the comment
+#     and <p> belong in the result. The builder leaves "after body"
+#     and puts them outside the context element; they must at least
+#     be freed (make fuzz-smoke runs this file under LeakSanitizer).
+# ----------------------------------------------------------------
+run "14  content after </body></html>" \
+    body tests/frag_14_after_html.html known <<'EOF'
+ASCII Tree (Fragment)
+DOCUMENT encoding="UTF-8"
+|-- TEXT data="x"
+|-- COMMENT data="c"
+\-- ELEMENT name="p"
+    \-- TEXT data="y"
+EOF
+
 # ----------------------------------------------------------------
 # summary
 # ----------------------------------------------------------------
@@ -0,0 +1,410 @@
+#!/bin/bash
+# tests/run_tree_tests.sh
+# ---------------------------------------------------------------
+# Document tree-construction regression suite.
+# Compares parse_html output against WHATWG-spec-correct expected
+# trees (and the demo's STOPPED / SOURCE MAP lines where a test
+# passes options).
+#
+#   PASS  – output matches expected
+#   FAIL  – output differs (bug to fix)
+#   KNOWN – feature not yet implemented; failure is noted but
+#           does NOT count as a suite failure
+#
+# Usage:  bash tests/run_tree_tests.sh [binary]
+# Default binary: ./parse_html
+# ---------------------------------------------------------------
+set -uo pipefail
+
+BINARY="${1:-./parse_html}"
+PASS=0; FAIL=0; KNOWN=0
+
+if [ ! -x "$BINARY" ]; then
+    echo "ERROR: $BINARY not found or not executable"
+    echo "       run 'make parse_html' first"
+    exit 1
+fi
+
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+# run <label> <input> <kind> [option...]
+#   input = printf format written to a temporary file, shown as
+#           "--- input ---" in the dump header
+#   kind  = "pass"  -> failure increments FAIL
+#   kind  = "known" -> failure increments KNOWN only
+#   Expected output is read from stdin via heredoc.
+run() {
+    local label="$1" input="$2" kind="$3"
+    shift 3
+    local expected actual
+
+    expected=$(cat)                                       # heredoc stdin
+    printf "$input" > "$INPUT"
+    actual=$("$BINARY" "$@" "$INPUT" 2>/dev/null \
+             | sed "s|^--- $INPUT ---\$|--- input ---|") || true
+
+    if [ "$actual" = "$expected" ]; then
+        printf "  PASS  %s\n" "$label"
+        PASS=$((PASS + 1))
+    elif [ "$kind" = "known" ]; then
+        printf "  KNOWN %s\n" "$label"
+        KNOWN=$((KNOWN + 1))
+    else
+        printf "  FAIL  %s\n" "$label"
+        FAIL=$((FAIL + 1))
+        diff <(printf '%s\n' "$expected") <(printf '%s\n' "$actual") | sed 's/^/          /' || true
+    fi
+}
+
+echo
+echo "  Tree construction tests"
+echo "  =============================="
+
+# ----------------------------------------------------------------
+# 01  --stop-at reports input bytes
+#     consumed is an offset into the normalized tokenizer input
+#     (each CRLF counts once); the source map carries it back to
+#     byte 18 of the raw input, where <div> starts.
+# ----------------------------------------------------------------
+run "01  --stop-at offset through CRLF normalization" \
+    '<p>a\r\nb\r\nc\r\nd<div>x</div>' pass --stop-at div <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="p"
+        |   \-- TEXT data="a\nb\nc\nd"
+        \-- ELEMENT name="div"
+STOPPED at byte 18 of 25
+EOF
+
+# ----------------------------------------------------------------
+# 02  Source map over CRLF, CR and NUL
+#     A CRLF pair maps to its CR (the LF's input byte is skipped),
+#     NUL becomes a 3-byte U+FFFD run from one input byte.
+# ----------------------------------------------------------------
+run "02  source map over CRLF / CR / NUL" \
+    'a\r\nb\rc\0d' pass --source-map <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        \-- TEXT data="a\nb\nc�d"
+SOURCE MAP out=9 in=8 runs=4
+  [0,2) <- [0,2) 1:1
+  [2,5) <- [3,6) 1:1
+  [5,8) <- [6,7) 3:1
+  [8,9) <- [7,8) 1:1
+EOF
+
+# ----------------------------------------------------------------
+# 03-05  Foster parenting outside a table
+#     Fostered content goes into the last template's contents when
+#     that template is above the last table, and into the html element
+#     when no table is open. 03 and 04 stay known: the builder keeps a
+#     stray <tr> in body and honours </html> in a table, both ignored
+#     by WHATWG.
+# ----------------------------------------------------------------
+run "03  stray <tr> before a template" \
+    '<tr><template></template>t' known <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="template"
+        |   \-- ELEMENT name="content"
+        \-- TEXT data="t"
+EOF
+
+run "04  </html> inside a table is ignored" \
+    '<table></html><t><p>e' known <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="t"
+        |   \-- ELEMENT name="p"
+        |       \-- TEXT data="e"
+        \-- ELEMENT name="table"
+EOF
+
+run "05  adoption agency fosters into template contents" \
+    '<template><tr><a><div></a>x' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        \-- ELEMENT name="template"
+            \-- ELEMENT name="content"
+                |-- ELEMENT name="tr"
+                |-- ELEMENT name="a"
+                \-- ELEMENT name="div"
+                    |-- ELEMENT name="a"
+                    \-- TEXT data="x"
+EOF
+
+# ----------------------------------------------------------------
+# 06  Forms inside pruned content
+#     The form goes with the rest of the pruned div's content; the
+#     input after the div, whose form owner it was, loses the link.
+# ----------------------------------------------------------------
+run "06  --prune drops forms and their owner links" \
+    '<div><form id=f><input id=a></div><input id=b><p>y' pass --prune div <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="div"
+        |-- ELEMENT name="input" [id="b"]
+        \-- ELEMENT name="p"
+            \-- TEXT data="y"
+EOF
+
+run "07  --prune drops a form reclaimed before the end" \
+    '<div><form id=f></div><input id=b></form><p>a</p><p>b</p><input id=c>' pass --prune div <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="div"
+        |-- ELEMENT name="input" [id="b"]
+        |-- ELEMENT name="p"
+        |   \-- TEXT data="a"
+        |-- ELEMENT name="p"
+        |   \-- TEXT data="b"
+        \-- ELEMENT name="input" [id="c"]
+EOF
+
+# ----------------------------------------------------------------
+# 08  Reclaiming pruned content still referenced
+#     Content of a closed pruned element is freed only once nothing
+#     on the stack or in the formatting list points into it: here the
+#     <b> inside the div is reconstructed for "y"; a div left open in
+#     a table cell is emptied once the cell closes.
+# ----------------------------------------------------------------
+run "08  --prune waits for the formatting list" \
+    '<div><b><p>x</div>y</b>z' pass --prune div <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="div"
+        |-- ELEMENT name="b"
+        |   \-- TEXT data="y"
+        \-- TEXT data="z"
+EOF
+
+run "09  --prune inside a table cell" \
+    '<table><tr><td><div><b>q</td></tr>r</table>s' pass --prune div <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- TEXT data="r"
+        |-- ELEMENT name="table"
+        |   \-- ELEMENT name="tr"
+        |       \-- ELEMENT name="td"
+        |           \-- ELEMENT name="div"
+        \-- TEXT data="s"
+EOF
+
+run "10  --prune across misnested formatting" \
+    '<p><div><i>a<div>b</i>c</div>d</div>e' pass --prune div <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="p"
+        |-- ELEMENT name="div"
+        \-- TEXT data="e"
+EOF
+
+# ----------------------------------------------------------------
+# 11  Adoption agency (WHATWG §13.2.6.4) inner loop
+#     A node between the formatting element and the furthest block is
+#     replaced by a clone in the stack and the list only; the original
+#     stays in the tree under the formatting element (the empty <i>
+#     inside <b>) and the clone wraps the furthest block.
+# ----------------------------------------------------------------
+run "11  adoption agency: formatting child stays put" \
+    '<b><i><p>x</b>' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="b"
+        |   \-- ELEMENT name="i"
+        \-- ELEMENT name="i"
+            \-- ELEMENT name="p"
+                \-- ELEMENT name="b"
+                    \-- TEXT data="x"
+EOF
+
+run "12  adoption agency: div as furthest block" \
+    '<b><i><div></b>x' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="b"
+        |   \-- ELEMENT name="i"
+        \-- ELEMENT name="i"
+            \-- ELEMENT name="div"
+                |-- ELEMENT name="b"
+                \-- TEXT data="x"
+EOF
+
+run "13  adoption agency: pre as furthest block" \
+    '<code><i><pre></code>x' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="code"
+        |   \-- ELEMENT name="i"
+        \-- ELEMENT name="i"
+            \-- ELEMENT name="pre"
+                |-- ELEMENT name="code"
+                \-- TEXT data="x"
+EOF
+
+run "14  adoption agency: li as furthest block" \
+    '<nobr><em><li></nobr>' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="nobr"
+        |   \-- ELEMENT name="em"
+        \-- ELEMENT name="em"
+            \-- ELEMENT name="li"
+                \-- ELEMENT name="nobr"
+EOF
+
+# ----------------------------------------------------------------
+# 15  The builder keeps a <head> start tag in body as an element
+#     (WHATWG ignores it); given that, the adoption agency treats it as
+#     the special furthest block like any other.
+# ----------------------------------------------------------------
+run "15  adoption agency: head in body as furthest block" \
+    '<u><code><head></u>' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="u"
+        |   \-- ELEMENT name="code"
+        \-- ELEMENT name="code"
+            \-- ELEMENT name="head"
+                \-- ELEMENT name="u"
+EOF
+
+# ----------------------------------------------------------------
+# 16  Inner loop counter above 3: <b> is dropped from the list and
+#     the stack, and the loop carries on with the element above it
+#     (html5lib adoption01).
+# ----------------------------------------------------------------
+run "16  adoption agency: inner loop past three nodes" \
+    '<a><b><big><em><strong><div>X</a>' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="a"
+        |   \-- ELEMENT name="b"
+        |       \-- ELEMENT name="big"
+        |           \-- ELEMENT name="em"
+        |               \-- ELEMENT name="strong"
+        \-- ELEMENT name="big"
+            \-- ELEMENT name="em"
+                \-- ELEMENT name="strong"
+                    \-- ELEMENT name="div"
+                        \-- ELEMENT name="a"
+                            \-- TEXT data="X"
+EOF
+
+# ----------------------------------------------------------------
+# 17  Noah's Ark clause stops at the last marker
+#     The <b> in the cell sits after the cell's marker, so the three
+#     <b> entries before it stay in the list and are all reconstructed
+#     for "y".
+# ----------------------------------------------------------------
+run "17  Noah's Ark stops at the last marker" \
+    '<p><b><b><b></p><table><tr><td><b>x</td></tr></table>y' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="p"
+        |   \-- ELEMENT name="b"
+        |       \-- ELEMENT name="b"
+        |           \-- ELEMENT name="b"
+        |-- ELEMENT name="table"
+        |   \-- ELEMENT name="tr"
+        |       \-- ELEMENT name="td"
+        |           \-- ELEMENT name="b"
+        |               \-- TEXT data="x"
+        \-- ELEMENT name="b"
+            \-- ELEMENT name="b"
+                \-- ELEMENT name="b"
+                    \-- TEXT data="y"
+EOF
+
+# ----------------------------------------------------------------
+# 18  Stopping with table text pending
+#     The stop lands while "x" is buffered as table text; it is still
+#     foster-parented before the table, not left at the document.
+# ----------------------------------------------------------------
+run "18  --stop-at with pending table text" \
+    '<table>x<tr>' pass --stop-at '#text' <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- TEXT data="x"
+        \-- ELEMENT name="table"
+STOPPED at byte 8 of 12
+EOF
+
+# ----------------------------------------------------------------
+# 19  End of input after a valueless attribute
+#     The pending name is kept once; no empty-named attribute follows.
+# ----------------------------------------------------------------
+run "19  EOF after a valueless attribute and whitespace" \
+    '<div x ' pass <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        \-- ELEMENT name="div" [x=""]
+EOF
+
+# ----------------------------------------------------------------
+# 20  Self-closing <form/> in a table, pre-tokenized
+#     The token-array path opens the form like the tokenizer path does,
+#     so --threads builds the same tree as a sequential parse.
+# ----------------------------------------------------------------
+run "20  <form/> in a table with --threads" \
+    '<table><form/><tr><td>x</td></tr></table>' pass --threads 4 <<'EOF'
+--- input ---
+DOCUMENT encoding="UTF-8"
+\-- ELEMENT name="html"
+    \-- ELEMENT name="body"
+        |-- ELEMENT name="form"
+        |   \-- ELEMENT name="tr"
+        |       \-- ELEMENT name="td"
+        |           \-- TEXT data="x"
+        \-- ELEMENT name="table"
+EOF
+
+# ----------------------------------------------------------------
+# summary
+# ----------------------------------------------------------------
+echo "  =============================="
+printf "  Total: %d   Pass: %d   Fail: %d   Known: %d\n" \
+    $((PASS + FAIL + KNOWN)) "$PASS" "$FAIL" "$KNOWN"
+echo "  =============================="
+echo
+
+[ "$FAIL" -eq 0 ] && exit 0 || exit 1
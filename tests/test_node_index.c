@@ -0,0 +1,198 @@
+/* Randomized consistency check for the id/class/tag index: edit an indexed
+ * document with the tree mutators, and after every edit compare each
+ * lookup with a fresh walk of the tree (make test-index). */
+#include "node_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static const char *TAGS[] = { "div", "p", "span", "li" };
+static const char *IDS[] = { "a", "b", "c" };
+static const char *CLASSES[] = { "x", "y", "z" };
+#define NELEM(a) (sizeof(a) / sizeof((a)[0]))
+
+static unsigned long long rng_state;
+
+static unsigned rnd(unsigned n) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(rng_state >> 33) % n;
+}
+
+static char *dup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *d = (char *)malloc(len);
+    if (d) memcpy(d, s, len);
+    return d;
+}
+
+/* A random element with an optional id and zero to two classes (a
+ * repeated class included). */
+static node *random_element(void) {
+    node *n = node_create(NODE_ELEMENT, TAGS[rnd(NELEM(TAGS))], NULL);
+    if (!n) return NULL;
+    n->attrs = (node_attr *)calloc(2, sizeof(node_attr));
+    if (!n->attrs) return n;
+    if (rnd(3) == 0) {
+        n->attrs[n->attr_count].name = dup("id");
+        n->attrs[n->attr_count++].value = dup(IDS[rnd(NELEM(IDS))]);
+    }
+    if (rnd(2) == 0) {
+        char cls[16];
+        snprintf(cls, sizeof(cls), " %s %s", CLASSES[rnd(NELEM(CLASSES))],
+                 CLASSES[rnd(NELEM(CLASSES))]);
+        n->attrs[n->attr_count].name = dup("class");
+        n->attrs[n->attr_count++].value = dup(cls);
+    }
+    return n;
+}
+
+static const char *attr(const node *n, const char *name) {
+    for (size_t i = 0; i < n->attr_count; i++)
+        if (strcmp(n->attrs[i].name, name) == 0) return n->attrs[i].value;
+    return NULL;
+}
+
+static int has_class(const node *n, const char *cls) {
+    const char *v = attr(n, "class");
+    size_t len = strlen(cls);
+    for (const char *p = v; p && (p = strstr(p, cls)); p += len)
+        if ((p == v || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return 1;
+    return 0;
+}
+
+/* Compare one indexed list with the elements a walk finds, in order. */
+static void check_list(node *doc, char kind, const char *key) {
+    size_t count = 0;
+    node *const *list = kind == 'i' ? node_get_elements_with_id(doc, key, &count)
+                      : kind == 'c' ? node_get_elements_by_class(doc, key, &count)
+                      : node_get_elements_by_tag_name(doc, key, &count);
+    size_t i = 0;
+    int same = 1;
+    for (node *n = doc; n; n = node_preorder_next(n, doc)) {
+        if (n->type != NODE_ELEMENT) continue;
+        const char *id = attr(n, "id");
+        int match = kind == 'i' ? id && strcmp(id, key) == 0
+                  : kind == 'c' ? has_class(n, key)
+                  : strcmp(n->name, key) == 0;
+        if (!match) continue;
+        if (i >= count || list[i] != n) same = 0;
+        i++;
+    }
+    if (i != count) same = 0;
+    if (!same)
+        fprintf(stderr, "  %c '%s': index has %zu, walk has %zu\n", kind, key,
+                count, i);
+    CHECK(same);
+}
+
+static void check_all(node *doc) {
+    for (size_t i = 0; i < NELEM(IDS); i++) check_list(doc, 'i', IDS[i]);
+    for (size_t i = 0; i < NELEM(CLASSES); i++) check_list(doc, 'c', CLASSES[i]);
+    for (size_t i = 0; i < NELEM(TAGS); i++) check_list(doc, 't', TAGS[i]);
+    node *first = node_get_element_by_id(doc, "a");
+    size_t count = 0;
+    node *const *all = node_get_elements_with_id(doc, "a", &count);
+    CHECK(first == (count ? all[0] : NULL));
+}
+
+/* Every element of doc's subtree, doc included, in tree order. */
+static size_t collect(node *doc, node **out, size_t cap) {
+    size_t count = 0;
+    for (node *n = doc; n && count < cap; n = node_preorder_next(n, doc))
+        if (n->type != NODE_TEXT) out[count++] = n;
+    return count;
+}
+
+static int is_ancestor(const node *a, const node *n) {
+    for (; n; n = n->parent)
+        if (n == a) return 1;
+    return 0;
+}
+
+#define MAX_NODES 4096
+
+static void run(unsigned long long seed, int steps) {
+    static node *nodes[MAX_NODES];
+    rng_state = seed;
+    node *doc = node_create(NODE_DOCUMENT, NULL, NULL);
+    CHECK(node_index_build(doc));
+    node *spare = NULL;             /* a detached subtree */
+
+    for (int step = 0; step < steps; step++) {
+        size_t count = collect(doc, nodes, MAX_NODES);
+        node *target = nodes[rnd((unsigned)count)];
+        unsigned op = rnd(10);
+        if (op < 4 || count < 8) {
+            /* Append, mostly at the end of the document */
+            node *parent = rnd(3) ? nodes[count - 1] : target;
+            node *n = random_element();
+            node_append_child(parent, n);
+            if (rnd(4) == 0) node_append_child(n, node_create(NODE_TEXT, NULL, "t"));
+        } else if (op < 5) {
+            /* Insert before a random node */
+            if (target->parent)
+                node_insert_before(target->parent, random_element(), target);
+        } else if (op < 7) {
+            /* Detach a subtree; keep it to move back in later */
+            if (target != doc) {
+                node_remove_child(target->parent, target);
+                node_free(spare);
+                spare = target;
+            }
+        } else if (op < 8) {
+            /* Move the detached subtree back under a random node */
+            if (spare) {
+                node_append_child(target, spare);
+                spare = NULL;
+            }
+        } else if (op < 9) {
+            /* Move a node's children to a node outside its subtree */
+            node *dst = nodes[rnd((unsigned)count)];
+            if (!is_ancestor(target, dst))
+                node_reparent_children(target, dst);
+        } else if (target->type == NODE_ELEMENT && target->attr_count > 0) {
+            /* Edit an attribute in place */
+            free(target->attrs[0].value);
+            target->attrs[0].value = dup(rnd(2) ? IDS[rnd(NELEM(IDS))]
+                                                : CLASSES[rnd(NELEM(CLASSES))]);
+            node_index_element_changed(target);
+        }
+        check_all(doc);
+        if (spare) CHECK(spare->index == NULL);
+        if (failures) {
+            fprintf(stderr, "  seed %llu, step %d, op %u\n", seed, step, op);
+            break;
+        }
+    }
+
+    for (node *n = doc->first_child; n; n = node_preorder_next(n, doc))
+        CHECK(n->index == doc->index);
+    node_index_invalidate(doc);
+    for (node *n = doc; n; n = node_preorder_next(n, doc))
+        CHECK(n->index == NULL);
+    check_all(doc);                 /* rebuilt from scratch */
+    node_free(spare);
+    node_free(doc);
+}
+
+int main(void) {
+    for (unsigned long long seed = 1; seed <= 40 && !failures; seed++)
+        run(seed, 600);
+    if (failures) {
+        fprintf(stderr, "test_node_index: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_node_index: ok\n");
+    return 0;
+}
@@ -0,0 +1,213 @@
+/* Assertions for the parse cache: hits, misses, bypasses, LRU eviction and
+ * entries pinned by a thaw while they are evicted. Built with the cache's
+ * own source so the test can reach its entries (make test-cache). */
+#include "../src/parse_cache.c"
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static const char *DOC_A = "<!DOCTYPE html><p class=a>one</p>";
+static const char *DOC_B = "<!DOCTYPE html><p class=b>two</p>";
+static const char *DOC_C = "<!DOCTYPE html><p class=c>three</p>";
+
+static node *build(parse_cache *c, const char *html, const char *hint,
+                   const tree_build_options *opts) {
+    return parse_cache_build(c, NULL, (const unsigned char *)html,
+                             strlen(html), hint, ENC_SNIFF_DEFAULT, opts);
+}
+
+/* The first <p>'s class, to tell trees apart. */
+static const char *p_class(const node *doc) {
+    for (const node *n = doc; n; ) {
+        if (n->type == NODE_ELEMENT && n->name && strcmp(n->name, "p") == 0)
+            return n->attr_count ? n->attrs[0].value : "";
+        if (n->first_child) { n = n->first_child; continue; }
+        while (n && !n->next_sibling) n = n->parent;
+        if (n) n = n->next_sibling;
+    }
+    return "";
+}
+
+static parse_cache_stats stats_of(parse_cache *c) {
+    parse_cache_stats s;
+    parse_cache_get_stats(c, &s);
+    return s;
+}
+
+static void test_hit_and_miss(void) {
+    parse_cache *c = parse_cache_create(0, 0);
+    parse_stats ps = {0};
+    tree_build_options opts = {0};
+    size_t consumed = 0;
+    opts.stats = &ps;
+    opts.consumed = &consumed;
+
+    node *first = build(c, DOC_A, NULL, &opts);
+    CHECK(first && strcmp(p_class(first), "a") == 0);
+    CHECK(ps.cache_hits == 0 && ps.bytes_decoded == strlen(DOC_A));
+    node *second = build(c, DOC_A, NULL, &opts);
+    CHECK(second && second != first && strcmp(p_class(second), "a") == 0);
+    CHECK(ps.cache_hits == 1 && ps.bytes_decoded == strlen(DOC_A));
+    CHECK(consumed == strlen(DOC_A));
+
+    /* Same bytes under another charset hint is another key */
+    node *third = build(c, DOC_A, "windows-1252", &opts);
+    parse_cache_stats s = stats_of(c);
+    CHECK(s.hits == 1 && s.misses == 2 && s.entries == 2);
+
+    /* Callers own what they get: changing one thaw leaves the entry alone */
+    while (second->first_child) {
+        node *child = second->first_child;
+        node_remove_child(second, child);
+        node_free(child);
+    }
+    node *fourth = build(c, DOC_A, NULL, NULL);
+    CHECK(fourth && strcmp(p_class(fourth), "a") == 0);
+    CHECK(stats_of(c).hits == 2);
+
+    node_free(first);
+    node_free(second);
+    node_free(third);
+    node_free(fourth);
+    parse_cache_free(c);
+}
+
+static void test_bypass(void) {
+    parse_cache *c = parse_cache_create(0, 0);
+    tree_build_options opts = {0};
+    const char *drop[] = { "class", NULL };
+    opts.drop_attributes = drop;
+    node *doc = build(c, DOC_A, NULL, &opts);
+    CHECK(doc && strcmp(p_class(doc), "") == 0);
+    node_free(doc);
+
+    /* Parse errors are reported while parsing, so a sink forces a parse */
+    parse_error ring[4];
+    parse_error_sink sink = { NULL, NULL, ring, 4, 0 };
+    parse_error_sink *prev = parse_errors_attach(&sink);
+    node_free(build(c, "<p>x", NULL, NULL));
+    node_free(build(c, "<p>x", NULL, NULL));
+    parse_errors_attach(prev);
+    CHECK(sink.count == 2);
+
+    node_free(parse_cache_build(c, NULL, (const unsigned char *)DOC_A,
+                                strlen(DOC_A), NULL, ENC_SNIFF_SOURCE_MAP,
+                                NULL));
+    parse_cache_stats s = stats_of(c);
+    CHECK(s.bypassed == 4 && s.hits == 0 && s.misses == 0 && s.entries == 0);
+    parse_cache_free(c);
+}
+
+static void test_eviction(void) {
+    parse_cache *c = parse_cache_create(2, 0);
+    node_free(build(c, DOC_A, NULL, NULL));
+    node_free(build(c, DOC_B, NULL, NULL));
+    node_free(build(c, DOC_A, NULL, NULL));     /* A is now the newest */
+    node_free(build(c, DOC_C, NULL, NULL));     /* evicts B */
+    parse_cache_stats s = stats_of(c);
+    CHECK(s.entries == 2 && s.evictions == 1 && s.hits == 1 && s.misses == 3);
+    node_free(build(c, DOC_A, NULL, NULL));
+    node_free(build(c, DOC_B, NULL, NULL));
+    s = stats_of(c);
+    CHECK(s.hits == 2 && s.misses == 4 && s.evictions == 2);
+    parse_cache_free(c);
+
+    /* An entry bigger than the byte budget is never stored */
+    c = parse_cache_create(0, 64);
+    node_free(build(c, DOC_A, NULL, NULL));
+    s = stats_of(c);
+    CHECK(s.entries == 0 && s.bytes == 0);
+    parse_cache_free(c);
+}
+
+/* An entry evicted while a thaw holds it stays readable until released. */
+static void test_pinned_eviction(void) {
+    parse_cache *c = parse_cache_create(0, 0);
+    node_free(build(c, DOC_A, NULL, NULL));
+    cache_key k = { 0, DOC_A, strlen(DOC_A), NULL, ENC_CONFIDENCE_CERTAIN,
+                    ENC_SNIFF_DEFAULT, NULL };
+    k.hash = key_hash(k.input, k.len, NULL, k.confidence, k.sniff_flags, NULL);
+    cache_entry *e = entry_find(c, &k);
+    CHECK(e != NULL);
+    if (!e) {
+        parse_cache_free(c);
+        return;
+    }
+    e->refs++;
+
+    parse_cache_clear(c);
+    CHECK(stats_of(c).entries == 0 && stats_of(c).bytes == 0);
+    CHECK(e->evicted && entry_find(c, &k) == NULL);
+    node *doc = packed_tree_thaw(e->tree);
+    CHECK(doc && strcmp(p_class(doc), "a") == 0);
+    node_free(doc);
+
+    /* A new build misses and stores a fresh entry beside the pinned one */
+    node_free(build(c, DOC_A, NULL, NULL));
+    CHECK(stats_of(c).entries == 1 && entry_find(c, &k) != e);
+
+    pthread_mutex_lock(&c->lock);
+    if (--e->refs == 0 && e->evicted)
+        entry_free(e);
+    pthread_mutex_unlock(&c->lock);
+    parse_cache_free(c);
+}
+
+typedef struct {
+    parse_cache *c;
+    int seed;
+    int wrong;
+} worker_arg;
+
+/* Three keys through a one-entry cache: constant eviction under thaws. */
+static void *worker(void *p) {
+    worker_arg *w = (worker_arg *)p;
+    const char *docs[] = { DOC_A, DOC_B, DOC_C };
+    const char *classes[] = { "a", "b", "c" };
+    for (int i = 0; i < 300; i++) {
+        int which = (i + w->seed) % 3;
+        node *doc = build(w->c, docs[which], NULL, NULL);
+        if (!doc || strcmp(p_class(doc), classes[which]) != 0) w->wrong++;
+        node_free(doc);
+    }
+    return NULL;
+}
+
+static void test_threads(void) {
+    parse_cache *c = parse_cache_create(1, 0);
+    pthread_t th[4];
+    worker_arg args[4];
+    for (int i = 0; i < 4; i++) {
+        args[i] = (worker_arg){ c, i, 0 };
+        pthread_create(&th[i], NULL, worker, &args[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(th[i], NULL);
+        CHECK(args[i].wrong == 0);
+    }
+    parse_cache_stats s = stats_of(c);
+    CHECK(s.hits + s.misses == 1200 && s.entries == 1);
+    parse_cache_free(c);
+}
+
+int main(void) {
+    test_hit_and_miss();
+    test_bypass();
+    test_eviction();
+    test_pinned_eviction();
+    test_threads();
+    if (failures) {
+        fprintf(stderr, "test_parse_cache: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("test_parse_cache: ok\n");
+    return 0;
+}